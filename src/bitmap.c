@@ -6,52 +6,115 @@
 
 #include "inodeptr.h"
 #include "bitmap_cache.h"
+#include "bitmap_scan.h"
 #include "blockptr.h"
 #include "error.h"
+#include "helpers.h"
 #include "log.h"
 #include "types.h"
 
-// alloc entry in given bitmap
-static stzfs_error_t bitmap_alloc(bitmap_cache_t* cache, int64_t* ptr) {
-    bitmap_entry_t* bitmap = (bitmap_entry_t*)cache->bitmap;
-    const size_t bitmap_length = cache->length / sizeof(bitmap_entry_t);
+#define BITS_PER_ENTRY (sizeof(bitmap_entry_t) * 8)
 
-    int64_t next_free = -1;
-    for (size_t i = cache->next; i < bitmap_length && next_free == -1; i++) {
-        bitmap_entry_t* entry = &bitmap[i];
-        if (~*entry == 0) {
-            // skip if there is no free entry available
-            continue;
+#define FULL_ENTRY (~(bitmap_entry_t)0)
+
+// true, if the bit at the given index is set
+static bool bit_is_set(const bitmap_entry_t* bitmap, int64_t index) {
+    return (bitmap[index / BITS_PER_ENTRY] >> (index % BITS_PER_ENTRY)) & 1;
+}
+
+// index of the first bit in [index, limit) that is set or clear as requested, limit if there is none
+static int64_t next_bit(const bitmap_entry_t* bitmap, int64_t index, int64_t limit, bool set) {
+    const size_t entry_limit = DIV_CEIL(limit, BITS_PER_ENTRY);
+    while (index < limit) {
+        // look at the requested bits of the current entry only
+        size_t entry = index / BITS_PER_ENTRY;
+        const bitmap_entry_t bits = (set ? bitmap[entry] : ~bitmap[entry]) & (FULL_ENTRY << (index % BITS_PER_ENTRY));
+        if (bits != 0) {
+            return MIN((int64_t)(entry * BITS_PER_ENTRY) + __builtin_ctzll(bits), limit);
         }
 
-        cache->next = i;
+        // skip entries without any requested bit
+        entry = bitmap_scan_entry(bitmap, entry + 1, entry_limit, set ? 0 : FULL_ENTRY);
+        index = entry * BITS_PER_ENTRY;
+    }
 
-        // find bit index of free entry
-        bitmap_entry_t data = *entry;
-        int offset = 0;
-        while (offset < sizeof(bitmap_entry_t) * 8 && (data & 1) != 0) {
-            data >>= 1;
-            offset++;
+    return limit;
+}
+
+// set all bits in [index, index + length), words at group boundaries are shared with the neighbouring group
+static void set_bits(bitmap_entry_t* bitmap, int64_t index, int64_t length) {
+    while (length > 0) {
+        const size_t inner = index % BITS_PER_ENTRY;
+        const size_t bits = MIN((int64_t)(BITS_PER_ENTRY - inner), length);
+        const bitmap_entry_t mask = bits == BITS_PER_ENTRY ? FULL_ENTRY : (((bitmap_entry_t)1 << bits) - 1) << inner;
+        __atomic_fetch_or(&bitmap[index / BITS_PER_ENTRY], mask, __ATOMIC_RELAXED);
+
+        index += bits;
+        length -= bits;
+    }
+}
+
+// alloc a run of up to length consecutive entries in [first, end) of given bitmap, a free run at goal always
+// wins to keep files contiguous, otherwise the first run of full length or the longest shorter one is taken
+static stzfs_error_t bitmap_alloc_range(bitmap_cache_t* cache, int64_t first, int64_t end, int64_t goal,
+                                        int64_t length, int64_t* ptr, int64_t* allocated) {
+    bitmap_entry_t* bitmap = (bitmap_entry_t*)cache->bitmap;
+    first = MAX(first, 0);
+    end = MIN(end, (int64_t)cache->count);
+
+    int64_t best_start = -1;
+    int64_t best_length = 0;
+    if (goal >= first && goal < end && !bit_is_set(bitmap, goal)) {
+        best_start = goal;
+        best_length = next_bit(bitmap, goal, MIN(end, goal + length), true) - goal;
+    }
+
+    // search the first bitmap block the summary points to unless the goal is free, runs starting in it
+    // may extend into the following blocks, the rest of the range is only searched if it has no free entry
+    const int64_t block = best_length > 0 ? -1 : bitmap_cache_find(cache, first, end, length);
+    int64_t index = MAX(first, block * (int64_t)BITMAP_CACHE_BLOCK_BITS);
+    int64_t stop = MIN(end, (block + 1) * (int64_t)BITMAP_CACHE_BLOCK_BITS);
+    while (block >= 0 && best_length < length) {
+        index = next_bit(bitmap, index, stop, false);
+        if (index >= stop) {
+            if (best_length > 0 || stop == end) break;
+            stop = end;
+            continue;
         }
 
-        // mark alloc in bitmap
-        bitmap_entry_t new_entry = 1;
-        *entry |= new_entry << offset;
-        next_free = i * sizeof(bitmap_entry_t) * 8 + offset;
+        const int64_t run = next_bit(bitmap, index, MIN(end, index + length), true) - index;
+        if (run > best_length) {
+            best_start = index;
+            best_length = run;
+        }
+        index += run;
     }
 
-    if (next_free == -1) {
+    if (best_length == 0) {
         LOG("could not allocate entry in bitmap");
+        *allocated = 0;
         return ERROR;
     }
 
-    *ptr = next_free;
+    // mark alloc in bitmap
+    set_bits(bitmap, best_start, best_length);
+
+    bitmap_cache_update(cache, best_start, best_start + best_length);
+
+    *ptr = best_start;
+    *allocated = best_length;
     return SUCCESS;
 }
 
+// alloc entry in given bitmap
+static stzfs_error_t bitmap_alloc(bitmap_cache_t* cache, int64_t* ptr) {
+    int64_t allocated;
+    return bitmap_alloc_range(cache, 0, cache->count, -1, 1, ptr, &allocated);
+}
+
 // free entry in bitmap
 static stzfs_error_t bitmap_free(bitmap_cache_t* cache, int64_t ptr) {
-    if (ptr < 0 || ptr >= cache->length * 8) {
+    if (ptr < 0 || ptr >= cache->count) {
         LOG("bitmap index out of bounds");
         return ERROR;
     }
@@ -60,25 +123,23 @@ static stzfs_error_t bitmap_free(bitmap_cache_t* cache, int64_t ptr) {
     const size_t inner_offset = ptr % (sizeof(bitmap_entry_t) * 8);
 
     bitmap_entry_t* entry = &((bitmap_entry_t*)cache->bitmap)[entry_offset];
-    *entry ^= (bitmap_entry_t)1 << inner_offset;
+    __atomic_fetch_xor(entry, (bitmap_entry_t)1 << inner_offset, __ATOMIC_RELAXED);
 
-    if (entry_offset < cache->next) {
-        cache->next = entry_offset;
-    }
+    bitmap_cache_update(cache, ptr, ptr + 1);
 
     return SUCCESS;
 }
 
 // true, if the given ptr is allocated in the given bitmap
 static bool bitmap_is_allocated(const bitmap_cache_t* cache, int64_t ptr) {
-    if (ptr < 0 || ptr >= cache->length * 8) {
+    if (ptr < 0 || ptr >= cache->count) {
         LOG("bitmap index out of bounds");
         return false;
     }
 
     const size_t entry_index = ptr / (sizeof(bitmap_entry_t) * 8);
     const size_t inner_index = ptr % (sizeof(bitmap_entry_t) * 8);
-    const bitmap_entry_t entry = ((bitmap_entry_t*)cache->bitmap)[entry_index];
+    const bitmap_entry_t entry = __atomic_load_n(&((bitmap_entry_t*)cache->bitmap)[entry_index], __ATOMIC_RELAXED);
 
     return (entry & ((bitmap_entry_t)1 << inner_index)) != 0;
 }
@@ -98,9 +159,20 @@ stzfs_error_t bitmap_alloc_block(int64_t* blockptr) {
     return bitmap_alloc(&block_bitmap_cache, blockptr);
 }
 
-// alloc new inode in inode bitmap
-stzfs_error_t bitmap_alloc_inode(int64_t* inodeptr) {
-    return bitmap_alloc(&inode_bitmap_cache, inodeptr);
+// alloc up to length consecutive blocks in [first, end) of block bitmap, preferably starting at goal
+stzfs_error_t bitmap_alloc_block_range(int64_t first, int64_t end, int64_t goal, int64_t length,
+                                       int64_t* blockptr, int64_t* allocated) {
+    if (!blockptr_is_valid(goal)) {
+        goal = -1;
+    }
+
+    return bitmap_alloc_range(&block_bitmap_cache, first, end, goal, length, blockptr, allocated);
+}
+
+// alloc new inode in [first, end) of inode bitmap
+stzfs_error_t bitmap_alloc_inode(int64_t first, int64_t end, int64_t* inodeptr) {
+    int64_t allocated;
+    return bitmap_alloc_range(&inode_bitmap_cache, first, end, -1, 1, inodeptr, &allocated);
 }
 
 // free block in block bitmap
@@ -113,6 +185,47 @@ stzfs_error_t bitmap_free_block(int64_t blockptr) {
     return bitmap_free(&block_bitmap_cache, blockptr);
 }
 
+// free a sorted list of blocks in block bitmap, every bitmap word is changed once and the summary
+// only refreshed once at the end, freed receives the number of blocks actually freed
+stzfs_error_t bitmap_free_blocks(const int64_t* blockptr_arr, size_t length, int64_t* freed) {
+    bitmap_entry_t* bitmap = (bitmap_entry_t*)block_bitmap_cache.bitmap;
+    stzfs_error_t error = SUCCESS;
+    *freed = 0;
+
+    size_t offset = 0;
+    while (offset < length) {
+        if (!blockptr_is_valid(blockptr_arr[offset]) || blockptr_arr[offset] >= block_bitmap_cache.count) {
+            LOG("bitmap index out of bounds");
+            error = ERROR;
+            offset++;
+            continue;
+        }
+
+        // collect all blocks of the same bitmap word
+        const int64_t entry = blockptr_arr[offset] / BITS_PER_ENTRY;
+        bitmap_entry_t mask = 0;
+        for (; offset < length && blockptr_arr[offset] / BITS_PER_ENTRY == entry &&
+               blockptr_arr[offset] < block_bitmap_cache.count; offset++) {
+            mask |= (bitmap_entry_t)1 << (blockptr_arr[offset] % BITS_PER_ENTRY);
+        }
+
+        if ((bitmap[entry] & mask) != mask) {
+            LOG("blockptr is not allocated");
+            error = ERROR;
+            mask &= bitmap[entry];
+        }
+        __atomic_fetch_and(&bitmap[entry], ~mask, __ATOMIC_RELAXED);
+        *freed += __builtin_popcountll(mask);
+    }
+
+    if (length > 0) {
+        bitmap_cache_update(&block_bitmap_cache, MAX(blockptr_arr[0], 0),
+                            MIN(blockptr_arr[length - 1] + 1, (int64_t)block_bitmap_cache.count));
+    }
+
+    return error;
+}
+
 // free inode in inode bitmap
 stzfs_error_t bitmap_free_inode(int64_t inodeptr) {
     if (!bitmap_is_inode_allocated(inodeptr)) {
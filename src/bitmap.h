@@ -2,6 +2,7 @@
 #define STZFS_BITMAP_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "error.h"
@@ -9,8 +10,11 @@
 bool bitmap_is_block_allocated(int64_t blockptr);
 bool bitmap_is_inode_allocated(int64_t inodeptr);
 stzfs_error_t bitmap_alloc_block(int64_t* blockptr);
-stzfs_error_t bitmap_alloc_inode(int64_t* inodeptr);
+stzfs_error_t bitmap_alloc_block_range(int64_t first, int64_t end, int64_t goal, int64_t length,
+                                       int64_t* blockptr, int64_t* allocated);
+stzfs_error_t bitmap_alloc_inode(int64_t first, int64_t end, int64_t* inodeptr);
 stzfs_error_t bitmap_free_block(int64_t blockptr);
+stzfs_error_t bitmap_free_blocks(const int64_t* blockptr_arr, size_t length, int64_t* freed);
 stzfs_error_t bitmap_free_inode(int64_t inodeptr);
 
 #endif // STZFS_BITMAP_H
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,8 +12,10 @@
 #include "types.h"
 #include "disk.h"
 
-static int create_cache(bitmap_cache_t* cache, int64_t blockptr, int64_t length);
+static int create_cache(bitmap_cache_t* cache, int64_t blockptr, int64_t length, int64_t count);
 static int dispose_cache(bitmap_cache_t* cache);
+static void summarize_block(const bitmap_cache_t* cache, size_t block, int64_t* free_out, uint32_t* largest_out);
+static void update_block(bitmap_cache_t* cache, size_t block);
 
 bitmap_cache_t block_bitmap_cache;
 bitmap_cache_t inode_bitmap_cache;
@@ -20,9 +23,9 @@ bitmap_cache_t inode_bitmap_cache;
 int bitmap_cache_init(void) {
     const super_block* sb = super_block_cache;
 
-    TRY(create_cache(&block_bitmap_cache, sb->block_bitmap, sb->block_bitmap_length),
+    TRY(create_cache(&block_bitmap_cache, sb->block_bitmap, sb->block_bitmap_length, sb->block_count),
         printf("bitmap_cache_init: could not create block bitmap cache\n"));
-    TRY(create_cache(&inode_bitmap_cache, sb->inode_bitmap, sb->inode_bitmap_length),
+    TRY(create_cache(&inode_bitmap_cache, sb->inode_bitmap, sb->inode_bitmap_length, sb->inode_count),
         printf("bitmap_cache_init: could not create inode bitmap cache\n"));
 
     return 0;
@@ -37,23 +40,207 @@ int bitmap_cache_dispose(void) {
     return 0;
 }
 
-static int create_cache(bitmap_cache_t* cache, int64_t blockptr, int64_t length) {
+static int create_cache(bitmap_cache_t* cache, int64_t blockptr, int64_t length, int64_t count) {
     cache->length = (size_t)length * STZFS_BLOCK_SIZE;
+    cache->count = MIN((size_t)count, cache->length * 8);
     cache->bitmap = mmap(NULL, cache->length, PROT_READ | PROT_WRITE, MAP_SHARED, disk_get_fd(),
                          (off_t)blockptr * STZFS_BLOCK_SIZE);
-    cache->next = 0;
 
     if (cache->bitmap == MAP_FAILED) {
         return -errno;
     }
 
+#ifdef MADV_HUGEPAGE
+    // back bitmaps with huge pages along with the rest of the mapped metadata
+    if (disk_get_backend() == DISK_BACKEND_MMAP) {
+        madvise(cache->bitmap, cache->length, MADV_HUGEPAGE);
+    }
+#endif
+
+    // summarize every bitmap block once, allocations keep the tree up to date afterwards
+    bitmap_summary_t* summary = &cache->summary;
+    summary->leaves = 1;
+    while (summary->leaves < (size_t)length) {
+        summary->leaves *= 2;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    summary->free = calloc(2 * summary->leaves, sizeof(int64_t));
+    summary->largest = calloc(2 * summary->leaves, sizeof(uint32_t));
+    if (summary->free == NULL || summary->largest == NULL) {
+        free(summary->free);
+        free(summary->largest);
+        munmap(cache->bitmap, cache->length);
+        return -ENOMEM;
+    }
+
+    for (size_t block = 0; block < (size_t)length; block++) {
+        const size_t node = summary->leaves + block;
+        summarize_block(cache, block, &summary->free[node], &summary->largest[node]);
+    }
+    for (size_t node = summary->leaves - 1; node > 0; node--) {
+        summary->free[node] = summary->free[2 * node] + summary->free[2 * node + 1];
+        summary->largest[node] = MAX(summary->largest[2 * node], summary->largest[2 * node + 1]);
+    }
+
     return 0;
 }
 
 static int dispose_cache(bitmap_cache_t* cache) {
+    free(cache->summary.free);
+    free(cache->summary.largest);
+    cache->summary.free = NULL;
+    cache->summary.largest = NULL;
+    pthread_mutex_destroy(&cache->lock);
+
     if (munmap(cache->bitmap, cache->length)) {
         return -errno;
     }
 
     return 0;
 }
+
+// count the free entries and the longest free run of a bitmap block, unusable entries count as used
+static void summarize_block(const bitmap_cache_t* cache, size_t block, int64_t* free_out, uint32_t* largest_out) {
+    const bitmap_entry_t* bitmap = (const bitmap_entry_t*)cache->bitmap + block * BITMAP_BLOCK_ENTRIES;
+    const size_t first = block * BITMAP_CACHE_BLOCK_BITS;
+    const size_t usable = cache->count > first ? MIN(cache->count - first, BITMAP_CACHE_BLOCK_BITS) : 0;
+
+    int64_t free_count = 0;
+    uint32_t run = 0;
+    uint32_t best = 0;
+    for (size_t i = 0; i < BITMAP_BLOCK_ENTRIES; i++) {
+        // free entries are clear bits, mask out the unusable tail
+        bitmap_entry_t bits = ~bitmap[i];
+        const size_t start = i * 64;
+        if (start >= usable) {
+            bits = 0;
+        } else if (usable - start < 64) {
+            bits &= ((bitmap_entry_t)1 << (usable - start)) - 1;
+        }
+
+        free_count += __builtin_popcountll(bits);
+        if (bits == ~(bitmap_entry_t)0) {
+            run += 64;
+            continue;
+        } else if (bits == 0) {
+            best = MAX(best, run);
+            run = 0;
+            continue;
+        }
+
+        // the run continues into the low bits and a new one starts at the high bits
+        run += __builtin_ctzll(~bits);
+        best = MAX(best, run);
+
+        // longest run of set bits within the entry
+        uint32_t inner = 0;
+        for (bitmap_entry_t x = bits; x != 0; x &= x << 1) {
+            inner++;
+        }
+        best = MAX(best, inner);
+
+        run = __builtin_clzll(~bits);
+    }
+
+    *free_out = free_count;
+    *largest_out = MAX(best, run);
+}
+
+// resummarize a bitmap block and its ancestors, the caller holds the summary lock
+static void update_block(bitmap_cache_t* cache, size_t block) {
+    bitmap_summary_t* summary = &cache->summary;
+    size_t node = summary->leaves + block;
+    summarize_block(cache, block, &summary->free[node], &summary->largest[node]);
+
+    for (node /= 2; node > 0; node /= 2) {
+        summary->free[node] = summary->free[2 * node] + summary->free[2 * node + 1];
+        summary->largest[node] = MAX(summary->largest[2 * node], summary->largest[2 * node + 1]);
+    }
+}
+
+// refresh the summary after entries in [from, to) changed
+void bitmap_cache_update(bitmap_cache_t* cache, int64_t from, int64_t to) {
+    if (cache->summary.free == NULL || from >= to) {
+        return;
+    }
+
+    // bitmap blocks may be shared by several groups, so summarize under the lock to see all their changes
+    pthread_mutex_lock(&cache->lock);
+    const size_t last = (size_t)(to - 1) / BITMAP_CACHE_BLOCK_BITS;
+    for (size_t block = (size_t)from / BITMAP_CACHE_BLOCK_BITS; block <= last; block++) {
+        update_block(cache, block);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// longest run of the bitmap blocks [from, to) below node, which covers the blocks [low, high)
+static uint32_t range_largest(const bitmap_summary_t* summary, size_t node, size_t low, size_t high,
+                              size_t from, size_t to) {
+    if (to <= low || high <= from) {
+        return 0;
+    } else if (from <= low && high <= to) {
+        return summary->largest[node];
+    }
+
+    const size_t middle = low + (high - low) / 2;
+    return MAX(range_largest(summary, 2 * node, low, middle, from, to),
+               range_largest(summary, 2 * node + 1, middle, high, from, to));
+}
+
+// first bitmap block of [from, to) below node holding a run of at least wanted entries, -1 if there is none
+static int64_t range_first(const bitmap_summary_t* summary, size_t node, size_t low, size_t high,
+                           size_t from, size_t to, uint32_t wanted) {
+    if (to <= low || high <= from || summary->largest[node] < wanted) {
+        return -1;
+    } else if (high - low == 1) {
+        return (int64_t)low;
+    }
+
+    const size_t middle = low + (high - low) / 2;
+    const int64_t block = range_first(summary, 2 * node, low, middle, from, to, wanted);
+    return block >= 0 ? block : range_first(summary, 2 * node + 1, middle, high, from, to, wanted);
+}
+
+// first bitmap block overlapping the entries [first, end) that holds a free run of at least length
+// entries, or the first one holding the longest run if there is none, -1 if all of them are full
+int64_t bitmap_cache_find(bitmap_cache_t* cache, int64_t first, int64_t end, int64_t length) {
+    const bitmap_summary_t* summary = &cache->summary;
+    const size_t from = (size_t)first / BITMAP_CACHE_BLOCK_BITS;
+    const size_t to = DIV_CEIL((size_t)end, BITMAP_CACHE_BLOCK_BITS);
+
+    pthread_mutex_lock(&cache->lock);
+    const uint32_t largest = range_largest(summary, 1, 0, summary->leaves, from, to);
+    const int64_t block = largest == 0 ? -1 : range_first(summary, 1, 0, summary->leaves, from, to,
+                                                          (uint32_t)MIN(length, (int64_t)largest));
+    pthread_mutex_unlock(&cache->lock);
+
+    return block;
+}
+
+// number of free entries in the bitmap
+int64_t bitmap_cache_get_free(bitmap_cache_t* cache) {
+    pthread_mutex_lock(&cache->lock);
+    const int64_t free_count = cache->summary.free[1];
+    pthread_mutex_unlock(&cache->lock);
+
+    return free_count;
+}
+
+// number of free entries in [first, end), counted with a popcount over the bitmap words
+int64_t bitmap_cache_count_free(const bitmap_cache_t* cache, int64_t first, int64_t end) {
+    const bitmap_entry_t* bitmap = (const bitmap_entry_t*)cache->bitmap;
+    const int64_t bits_per_entry = sizeof(bitmap_entry_t) * 8;
+    end = MIN(end, (int64_t)cache->count);
+
+    int64_t free_count = 0;
+    while (first < end) {
+        const int64_t inner = first % bits_per_entry;
+        const int64_t bits = MIN(bits_per_entry - inner, end - first);
+        const bitmap_entry_t mask = bits == bits_per_entry ? ~(bitmap_entry_t)0
+                                                           : (((bitmap_entry_t)1 << bits) - 1) << inner;
+        free_count += __builtin_popcountll(~bitmap[first / bits_per_entry] & mask);
+        first += bits;
+    }
+
+    return free_count;
+}
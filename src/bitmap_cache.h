@@ -1,12 +1,29 @@
 #ifndef STZFS_BITMAP_CACHE_H
 #define STZFS_BITMAP_CACHE_H
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+// entries covered by a single bitmap block
+#define BITMAP_CACHE_BLOCK_BITS (STZFS_BLOCK_SIZE * 8)
+
+// summary tree over the bitmap blocks, rebuilt at mount
+// leaves hold the numbers of one bitmap block, inner nodes the sum and max of their children
+typedef struct bitmap_summary_t {
+    size_t leaves; // power of two, leaf i is node leaves + i
+    int64_t* free; // free entries below the node
+    uint32_t* largest; // longest free run inside a single bitmap block below the node
+} bitmap_summary_t;
 
 typedef struct bitmap_cache_t {
     void* bitmap;
     size_t length;
-    size_t next;
+    size_t count; // usable entries, the tail of the last bitmap block is unused
+    bitmap_summary_t summary;
+    pthread_mutex_t lock; // guards the summary, the bitmap itself is guarded by the group locks
 } bitmap_cache_t;
 
 extern bitmap_cache_t inode_bitmap_cache;
@@ -14,5 +31,9 @@ extern bitmap_cache_t block_bitmap_cache;
 
 int bitmap_cache_init(void);
 int bitmap_cache_dispose(void);
+void bitmap_cache_update(bitmap_cache_t* cache, int64_t from, int64_t to);
+int64_t bitmap_cache_find(bitmap_cache_t* cache, int64_t first, int64_t end, int64_t length);
+int64_t bitmap_cache_get_free(bitmap_cache_t* cache);
+int64_t bitmap_cache_count_free(const bitmap_cache_t* cache, int64_t first, int64_t end);
 
 #endif // STZFS_BITMAP_CACHE_H
@@ -0,0 +1,118 @@
+#include "bitmap_scan.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_SCAN_X86 1
+#endif
+
+#include "types.h"
+
+typedef size_t (*scan_fn)(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip);
+
+static size_t scan_select(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip);
+
+static scan_fn scan = scan_select;
+static const char* scan_name = "none";
+
+// compare one entry at a time
+static size_t scan_scalar(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip) {
+    while (from < to && bitmap[from] == skip) {
+        from++;
+    }
+
+    return from;
+}
+
+#ifdef BITMAP_SCAN_X86
+// compare 4 entries per instruction, equality of all 32 bit halves implies equal entries
+static size_t scan_sse2(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip) {
+    const __m128i skip_vector = _mm_set1_epi64x((long long)skip);
+    while (from + 4 <= to) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)&bitmap[from]);
+        const __m128i b = _mm_loadu_si128((const __m128i*)&bitmap[from + 2]);
+        const __m128i equal = _mm_and_si128(_mm_cmpeq_epi32(a, skip_vector), _mm_cmpeq_epi32(b, skip_vector));
+        if (_mm_movemask_epi8(equal) != 0xffff) break;
+        from += 4;
+    }
+
+    return scan_scalar(bitmap, from, to, skip);
+}
+
+// compare 8 entries per instruction
+__attribute__((target("avx2")))
+static size_t scan_avx2(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip) {
+    const __m256i skip_vector = _mm256_set1_epi64x((long long)skip);
+    while (from + 8 <= to) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)&bitmap[from]);
+        const __m256i b = _mm256_loadu_si256((const __m256i*)&bitmap[from + 4]);
+        const __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi64(a, skip_vector),
+                                               _mm256_cmpeq_epi64(b, skip_vector));
+        if ((uint32_t)_mm256_movemask_epi8(equal) != UINT32_MAX) break;
+        from += 8;
+    }
+
+    return scan_scalar(bitmap, from, to, skip);
+}
+#endif
+
+// pick the widest implementation the cpu supports on first use
+static size_t scan_select(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip) {
+    scan_fn selected = scan_scalar;
+    scan_name = "scalar";
+#ifdef BITMAP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        selected = scan_avx2;
+        scan_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        selected = scan_sse2;
+        scan_name = "sse2";
+    }
+#endif
+    scan = selected;
+
+    return selected(bitmap, from, to, skip);
+}
+
+// find the first entry in [from, to) that differs from skip, to if there is none
+size_t bitmap_scan_entry(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip) {
+    return scan(bitmap, from, to, skip);
+}
+
+// name of the selected scan implementation for diagnostics
+const char* bitmap_scan_get_impl(void) {
+    if (scan == scan_select) {
+        const bitmap_entry_t entry = 0;
+        scan_select(&entry, 0, 1, 0);
+    }
+
+    return scan_name;
+}
+
+// force an implementation by name (eg. to compare them in tests), false if the cpu does not support it
+bool bitmap_scan_set_impl(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        scan = scan_scalar;
+        scan_name = "scalar";
+        return true;
+    }
+#ifdef BITMAP_SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        scan = scan_sse2;
+        scan_name = "sse2";
+        return true;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+        scan_name = "avx2";
+        return true;
+    }
+#endif
+
+    return false;
+}
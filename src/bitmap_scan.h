@@ -0,0 +1,13 @@
+#ifndef STZFS_BITMAP_SCAN_H
+#define STZFS_BITMAP_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "types.h"
+
+size_t bitmap_scan_entry(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip);
+const char* bitmap_scan_get_impl(void);
+bool bitmap_scan_set_impl(const char* name);
+
+#endif // STZFS_BITMAP_SCAN_H
@@ -1,15 +1,138 @@
 #include "block.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
-#include "bitmap.h"
+#include "bitmap_cache.h"
+#include "block_cache.h"
+#include "blockptr.h"
 #include "disk.h"
 #include "error.h"
+#include "group.h"
+#include "helpers.h"
 #include "log.h"
-#include "super_block_cache.h"
 #include "types.h"
 
+// free blocks promised to data that is not allocated yet (eg. delayed blocks and their mapping), only
+// allocations that draw from a reservation may take them
+static int64_t reserved_blocks = 0;
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// part of the reserved blocks the allocations of this thread draw from, see block_use_reservation
+static __thread int64_t thread_reserved = 0;
+
+// blocks freed by this thread are collected here instead of being released, see block_defer_free
+static __thread block_list_t* thread_deferred = NULL;
+
+// read or write multiple blocks and keep all physically consecutive runs in flight at once
+// reads are served from the block cache where possible, writes go through to the disk
+static stzfs_error_t block_transfer_all(bool write, const int64_t* blockptr_arr, void* blocks,
+                                        size_t length) {
+    if (length == 0) {
+        return SUCCESS;
+    }
+
+    // find blocks that need no disk access
+    bool done[length];
+    for (size_t offset = 0; offset < length; offset++) {
+        const int64_t blockptr = blockptr_arr[offset];
+        void* block = (int8_t*)blocks + offset * STZFS_BLOCK_SIZE;
+        if (!blockptr_is_valid(blockptr)) {
+            if (write) {
+                LOG("invalid blockptr given");
+                return ERROR;
+            }
+
+            // null blocks are read as zeroes, block_read rejects everything else
+            if (block_read(blockptr, block)) return ERROR;
+            done[offset] = true;
+        } else {
+            done[offset] = !write && block_cache_get(blockptr, block);
+        }
+    }
+
+    struct iovec iov[length];
+    disk_request_t requests[length];
+    size_t request_count = 0;
+
+    size_t offset = 0;
+    while (offset < length) {
+        if (done[offset]) {
+            offset++;
+            continue;
+        }
+
+        // gather physically consecutive blocks into one request
+        const int64_t blockptr = blockptr_arr[offset];
+        size_t run = 0;
+        do {
+            iov[offset + run].iov_base = (int8_t*)blocks + (offset + run) * STZFS_BLOCK_SIZE;
+            iov[offset + run].iov_len = STZFS_BLOCK_SIZE;
+            run++;
+        } while (offset + run < length && !done[offset + run] &&
+                 blockptr_arr[offset + run] == blockptr + (int64_t)run);
+
+        requests[request_count++] = (disk_request_t) {
+            .write = write,
+            .addr = (off_t)blockptr * STZFS_BLOCK_SIZE,
+            .iov = &iov[offset],
+            .iovcnt = run,
+        };
+        offset += run;
+    }
+
+    // cached copies take the new data before the disk does, a write back of an older dirty copy could
+    // otherwise land after it
+    if (write) {
+        for (offset = 0; offset < length; offset++) {
+            block_cache_update(blockptr_arr[offset], (const int8_t*)blocks + offset * STZFS_BLOCK_SIZE);
+        }
+    }
+
+    disk_submit(requests, request_count);
+    const stzfs_error_t error = disk_wait();
+    if (write) {
+        block_cache_update_done(length);
+    }
+    if (error) {
+        // the cached copies are the only ones with the new data now, a later write back retries them
+        for (offset = 0; write && offset < length; offset++) {
+            block_cache_put(blockptr_arr[offset], (const int8_t*)blocks + offset * STZFS_BLOCK_SIZE, true);
+        }
+        LOG("could not transfer %zu blocks", length);
+        return ERROR;
+    }
+
+    // keep the blocks read from disk
+    for (offset = 0; !write && offset < length; offset++) {
+        if (!done[offset]) {
+            block_cache_put(blockptr_arr[offset], (const int8_t*)blocks + offset * STZFS_BLOCK_SIZE, false);
+        }
+    }
+
+    return SUCCESS;
+}
+
+// allocate a buffer for multiple blocks that satisfies the alignment of direct io
+void* block_buffer_alloc(size_t length) {
+    void* blocks;
+    if (posix_memalign(&blocks, STZFS_BLOCK_SIZE, length * STZFS_BLOCK_SIZE)) {
+        LOG("could not allocate block buffer");
+        return NULL;
+    }
+
+    return blocks;
+}
+
+// free a buffer allocated by block_buffer_alloc
+void block_buffer_free(void* blocks) {
+    free(blocks);
+}
+
 // read block from disk
 stzfs_error_t block_read(int64_t blockptr, void* block) {
     if (blockptr == SUPER_BLOCKPTR) {
@@ -22,8 +145,9 @@ stzfs_error_t block_read(int64_t blockptr, void* block) {
 
     if (blockptr == NULL_BLOCKPTR) {
         memset(block, 0, STZFS_BLOCK_SIZE);
-    } else {
-        disk_read((off_t)blockptr * STZFS_BLOCK_SIZE, block, STZFS_BLOCK_SIZE);
+    } else if (!block_cache_get(blockptr, block)) {
+        if (disk_read((off_t)blockptr * STZFS_BLOCK_SIZE, block, STZFS_BLOCK_SIZE)) return ERROR;
+        block_cache_put(blockptr, block, false);
     }
 
     return SUCCESS;
@@ -31,12 +155,7 @@ stzfs_error_t block_read(int64_t blockptr, void* block) {
 
 // read multiple blocks from disk
 stzfs_error_t block_readall(const int64_t* blockptr_arr, void* blocks, size_t length) {
-    for (size_t i = 0; i < length; i++) {
-        block_read(blockptr_arr[i], blocks);
-        blocks += STZFS_BLOCK_SIZE;
-    }
-
-    return SUCCESS;
+    return block_transfer_all(false, blockptr_arr, blocks, length);
 }
 
 // write block to disk
@@ -52,64 +171,197 @@ stzfs_error_t block_write(int64_t blockptr, const void* block) {
         return ERROR;
     }
 
-    disk_write((off_t)blockptr * STZFS_BLOCK_SIZE, block, STZFS_BLOCK_SIZE);
+    // blocks rewritten while frees are deferred have to be on disk before the freed ones are released
+    if (thread_deferred != NULL) {
+        return block_writeall(&blockptr, block, 1);
+    }
+
+    // defer the write to the block cache, write through if it is disabled
+    if (block_cache_put(blockptr, block, true) == 0) {
+        return SUCCESS;
+    }
+
+    return disk_write((off_t)blockptr * STZFS_BLOCK_SIZE, block, STZFS_BLOCK_SIZE);
+}
+
+// write multiple blocks to disk
+stzfs_error_t block_writeall(const int64_t* blockptr_arr, const void* blocks, size_t length) {
+    return block_transfer_all(true, blockptr_arr, (void*)blocks, length);
+}
+
+// pass an access pattern hint for multiple blocks on to the disk
+stzfs_error_t block_advise(const int64_t* blockptr_arr, size_t length, disk_advice_t advice) {
+    size_t offset = 0;
+    while (offset < length) {
+        const int64_t blockptr = blockptr_arr[offset];
+        if (!blockptr_is_valid(blockptr)) {
+            offset++;
+            continue;
+        }
+
+        // hint physically consecutive blocks at once
+        size_t run = 1;
+        while (offset + run < length && blockptr_arr[offset + run] == blockptr + (int64_t)run) {
+            run++;
+        }
+
+        disk_advise((off_t)blockptr * STZFS_BLOCK_SIZE, run * STZFS_BLOCK_SIZE, advice);
+        offset += run;
+    }
+
     return SUCCESS;
 }
 
 // allocate new blockptr only
 stzfs_error_t block_allocptr(int64_t* blockptr) {
-    super_block* sb = super_block_cache;
-    stzfs_error_t error = SUCCESS;
+    int64_t allocated;
+    return block_alloc_range(NULL_BLOCKPTR, 1, blockptr, &allocated);
+}
 
-    if (sb->free_blocks == 0) {
-        LOG("no free block available");
-        error = ERROR;
+// allocate up to length physically consecutive blockptrs, preferably continuing at goal
+// the free counts live in the group descriptors, the super block is only updated when they are persisted
+// reserved blocks are left alone unless this thread draws from a reservation
+stzfs_error_t block_alloc_range(int64_t goal, int64_t length, int64_t* blockptr, int64_t* allocated) {
+    // claim the blocks before allocating them, concurrent allocations cannot take reserved ones meanwhile
+    pthread_mutex_lock(&reserve_lock);
+    length = MIN(length, bitmap_cache_get_free(&block_bitmap_cache) - reserved_blocks + thread_reserved);
+    const int64_t own = MIN(length, thread_reserved);
+    if (length > 0) {
+        reserved_blocks += length - own;
+        thread_reserved -= own;
     }
+    pthread_mutex_unlock(&reserve_lock);
 
-    if (bitmap_alloc_block(blockptr)) {
-        LOG("could not allocate blockptr");
-        error = ERROR;
+    const stzfs_error_t error = length <= 0 || group_alloc_blocks(goal, length, blockptr, allocated);
+
+    // allocated blocks use up the reservation of this thread first, the rest of the claim is released
+    if (length > 0) {
+        const int64_t used = error ? 0 : MIN(own, *allocated);
+        pthread_mutex_lock(&reserve_lock);
+        reserved_blocks -= length - own + used;
+        thread_reserved += own - used;
+        pthread_mutex_unlock(&reserve_lock);
     }
 
     if (error) {
+        LOG("no free block available");
         *blockptr = BLOCKPTR_ERROR;
-    } else {
-        // update superblock
-        sb->free_blocks--;
-        super_block_cache_sync();
+        *allocated = 0;
+        return ERROR;
     }
 
-    return error;
+    return SUCCESS;
+}
+
+// set aside count free blocks for later allocations, fails if fewer are left
+stzfs_error_t block_reserve(int64_t count) {
+    pthread_mutex_lock(&reserve_lock);
+    const bool available = bitmap_cache_get_free(&block_bitmap_cache) - reserved_blocks >= count;
+    if (available) {
+        reserved_blocks += count;
+    }
+    pthread_mutex_unlock(&reserve_lock);
+
+    return !available;
+}
+
+// give back reserved blocks that are not needed anymore
+void block_unreserve(int64_t count) {
+    pthread_mutex_lock(&reserve_lock);
+    reserved_blocks -= count;
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+// let the allocations of this thread draw from count reserved blocks until block_end_reservation
+void block_use_reservation(int64_t count) {
+    pthread_mutex_lock(&reserve_lock);
+    thread_reserved += count;
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+// give back what is left of the reservation of this thread
+void block_end_reservation(void) {
+    pthread_mutex_lock(&reserve_lock);
+    reserved_blocks -= thread_reserved;
+    thread_reserved = 0;
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+// stop drawing from the reservation of this thread without giving back what is left, the caller takes it over
+int64_t block_keep_reservation(void) {
+    pthread_mutex_lock(&reserve_lock);
+    const int64_t left = thread_reserved;
+    thread_reserved = 0;
+    pthread_mutex_unlock(&reserve_lock);
+
+    return left;
+}
+
+// free blocks that are not promised to a reservation yet
+int64_t block_get_free(void) {
+    pthread_mutex_lock(&reserve_lock);
+    const int64_t available = bitmap_cache_get_free(&block_bitmap_cache) - reserved_blocks;
+    pthread_mutex_unlock(&reserve_lock);
+
+    return MAX(available, 0);
 }
 
 // allocate and write new block in place
 stzfs_error_t block_alloc(int64_t* blockptr, const void* block) {
-    if (super_block_cache->free_blocks <= 0) {
+    if (block_allocptr(blockptr)) {
         LOG("no free blocks availabe");
         return ERROR;
     }
 
-    block_allocptr(blockptr);
     block_write(*blockptr, block);
     return SUCCESS;
 }
 
-// free blocks in bitmap
+// free blocks in bitmap, a whole batch updates every group once
 stzfs_error_t block_free(const int64_t* blockptr_arr, size_t length) {
-    super_block* sb = super_block_cache;
-    stzfs_error_t error = SUCCESS;
+    if (thread_deferred != NULL) {
+        block_list_t* list = thread_deferred;
+        if (list->count + length > list->capacity) {
+            const size_t capacity = MAX(list->count + length, list->capacity * 2);
+            int64_t* blockptrs = realloc(list->blockptrs, capacity * sizeof(int64_t));
+            if (blockptrs == NULL) {
+                LOG("could not collect freed blocks");
+                return ERROR;
+            }
+            list->blockptrs = blockptrs;
+            list->capacity = capacity;
+        }
+
+        memcpy(&list->blockptrs[list->count], blockptr_arr, length * sizeof(int64_t));
+        list->count += length;
+        return SUCCESS;
+    }
 
     for (size_t offset = 0; offset < length; offset++) {
-        sb->free_blocks--;
-        if (bitmap_free_block(blockptr_arr[offset])) {
-            LOG("could not free block in block bitmap");
-            error = ERROR;
-            break;
-        }
+        block_cache_invalidate(blockptr_arr[offset]);
+    }
+
+    if (group_free_blocks(blockptr_arr, length)) {
+        LOG("could not free blocks in their groups");
+        return ERROR;
     }
 
-    // update superblock
-    super_block_cache_sync();
+    return SUCCESS;
+}
+
+// collect the blocks this thread frees in list until block_free_deferred, blocks it writes meanwhile go
+// straight to disk, a change that drops blocks can be made durable before another one may reuse them
+void block_defer_free(block_list_t* list) {
+    *list = (block_list_t) {.blockptrs = NULL, .count = 0, .capacity = 0};
+    thread_deferred = list;
+}
+
+// stop collecting, release the collected blocks if release is set (they stay allocated otherwise)
+stzfs_error_t block_free_deferred(block_list_t* list, bool release) {
+    thread_deferred = NULL;
+    const stzfs_error_t error = release && block_free(list->blockptrs, list->count);
 
+    free(list->blockptrs);
+    *list = (block_list_t) {.blockptrs = NULL, .count = 0, .capacity = 0};
     return error;
 }
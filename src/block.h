@@ -1,16 +1,38 @@
 #ifndef STZFS_BLOCK_H
 #define STZFS_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "disk.h"
 #include "error.h"
 
+// blocks a change dropped, they are released once the change is on disk, see block_defer_free
+typedef struct block_list_t {
+    int64_t* blockptrs;
+    size_t count;
+    size_t capacity;
+} block_list_t;
+
+void* block_buffer_alloc(size_t length);
+void block_buffer_free(void* blocks);
 stzfs_error_t block_read(int64_t blockptr, void* block);
 stzfs_error_t block_readall(const int64_t* blockptr_arr, void* blocks, size_t length);
 stzfs_error_t block_write(int64_t blockptr, const void* block);
+stzfs_error_t block_writeall(const int64_t* blockptr_arr, const void* blocks, size_t length);
+stzfs_error_t block_advise(const int64_t* blockptr_arr, size_t length, disk_advice_t advice);
 stzfs_error_t block_allocptr(int64_t* blockptr);
+stzfs_error_t block_alloc_range(int64_t goal, int64_t length, int64_t* blockptr, int64_t* allocated);
 stzfs_error_t block_alloc(int64_t* blockptr, const void* block);
+stzfs_error_t block_reserve(int64_t count);
+void block_unreserve(int64_t count);
+void block_use_reservation(int64_t count);
+void block_end_reservation(void);
+int64_t block_keep_reservation(void);
+int64_t block_get_free(void);
 stzfs_error_t block_free(const int64_t* blockptr_arr, size_t length);
+void block_defer_free(block_list_t* list);
+stzfs_error_t block_free_deferred(block_list_t* list, bool release);
 
 #endif // STZFS_BLOCK_H
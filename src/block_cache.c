@@ -0,0 +1,386 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "block.h"
+#include "block_cache.h"
+#include "disk.h"
+#include "types.h"
+
+// default memory budget for cached blocks
+#define BLOCK_CACHE_DEFAULT_SIZE (32 * 1024 * 1024)
+
+// max dirty blocks written back at once when a dirty block has to be evicted
+#define BLOCK_CACHE_WRITEBACK_BATCH 64
+
+typedef struct block_cache_entry_t {
+    int64_t blockptr;
+    bool dirty;
+    struct block_cache_entry_t* hash_next;
+    struct block_cache_entry_t* prev; // lru list, most recently used first
+    struct block_cache_entry_t* next; // lru list or free list
+    void* data;
+} block_cache_entry_t;
+
+static int write_entries(block_cache_entry_t** list, size_t length);
+static block_cache_entry_t* find_entry(int64_t blockptr);
+static block_cache_entry_t* alloc_entry(int64_t blockptr);
+static void release_entry(block_cache_entry_t* entry);
+
+static size_t cache_size = BLOCK_CACHE_DEFAULT_SIZE;
+static block_cache_entry_t* entries = NULL;
+static void* data = NULL;
+static block_cache_entry_t** buckets = NULL;
+static int bucket_bits = 0;
+static block_cache_entry_t* free_list = NULL;
+static block_cache_entry_t lru = {.prev = &lru, .next = &lru};
+static block_cache_stats_t stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // guards all of the above once the cache is set up
+
+// bumped whenever the disk copy of a block changes past the cache, a block read from disk is only
+// cached if nothing changed since the miss, it could be older than data another thread wrote meanwhile
+static uint64_t generation = 0;
+static __thread uint64_t miss_generation = 0;
+static size_t updating = 0; // blocks written to disk past the cache right now, see block_cache_update
+
+// set memory budget (has to be called before init, 0 disables the cache)
+void block_cache_set_size(size_t bytes) {
+    cache_size = bytes;
+}
+
+int block_cache_init(void) {
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = cache_size / STZFS_BLOCK_SIZE;
+    if (stats.capacity == 0) {
+        return 0;
+    }
+
+    // keep hash chains short
+    bucket_bits = 1;
+    while (((size_t)1 << bucket_bits) < stats.capacity) {
+        bucket_bits++;
+    }
+
+    entries = calloc(stats.capacity, sizeof(block_cache_entry_t));
+    buckets = calloc((size_t)1 << bucket_bits, sizeof(block_cache_entry_t*));
+    data = block_buffer_alloc(stats.capacity);
+    if (entries == NULL || buckets == NULL || data == NULL) {
+        printf("block_cache_init: could not allocate %zu cache blocks\n", stats.capacity);
+        block_cache_dispose();
+        return -ENOMEM;
+    }
+
+    lru.prev = &lru;
+    lru.next = &lru;
+    free_list = NULL;
+    for (size_t i = 0; i < stats.capacity; i++) {
+        entries[i].data = (int8_t*)data + i * STZFS_BLOCK_SIZE;
+        entries[i].next = free_list;
+        free_list = &entries[i];
+    }
+
+    return 0;
+}
+
+int block_cache_dispose(void) {
+    const int err = block_cache_flush();
+
+    free(entries);
+    free(buckets);
+    block_buffer_free(data);
+    entries = NULL;
+    buckets = NULL;
+    data = NULL;
+    free_list = NULL;
+    lru.prev = &lru;
+    lru.next = &lru;
+    stats.capacity = 0;
+    stats.used = 0;
+    stats.dirty = 0;
+
+    return err;
+}
+
+// write back all dirty blocks
+int block_cache_flush(void) {
+    pthread_mutex_lock(&lock);
+    if (stats.dirty == 0) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    block_cache_entry_t** list = malloc(stats.dirty * sizeof(block_cache_entry_t*));
+    if (list == NULL) {
+        pthread_mutex_unlock(&lock);
+        return -ENOMEM;
+    }
+
+    size_t length = 0;
+    for (block_cache_entry_t* entry = lru.next; entry != &lru; entry = entry->next) {
+        if (entry->dirty) list[length++] = entry;
+    }
+
+    const int err = write_entries(list, length);
+    pthread_mutex_unlock(&lock);
+    free(list);
+    return err;
+}
+
+// copy a cached block, true on hit
+bool block_cache_get(int64_t blockptr, void* block) {
+    if (stats.capacity == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    block_cache_entry_t* entry = find_entry(blockptr);
+    if (entry == NULL) {
+        stats.misses++;
+        miss_generation = generation;
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    // move to the front of the lru list
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = &lru;
+    entry->next = lru.next;
+    lru.next->prev = entry;
+    lru.next = entry;
+
+    memcpy(block, entry->data, STZFS_BLOCK_SIZE);
+    stats.hits++;
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+// insert or replace a cached block, dirty blocks are written back later
+// clean blocks fill a previous miss of the calling thread and never replace a cached copy
+int block_cache_put(int64_t blockptr, const void* block, bool dirty) {
+    if (stats.capacity == 0) {
+        return -ENOSPC;
+    }
+
+    pthread_mutex_lock(&lock);
+    block_cache_entry_t* entry = find_entry(blockptr);
+    if (!dirty && (entry != NULL || generation != miss_generation || updating > 0)) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    if (entry == NULL) {
+        entry = alloc_entry(blockptr);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&lock);
+            return -EIO;
+        }
+    } else {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+    }
+
+    entry->prev = &lru;
+    entry->next = lru.next;
+    lru.next->prev = entry;
+    lru.next = entry;
+
+    memcpy(entry->data, block, STZFS_BLOCK_SIZE);
+    if (dirty && !entry->dirty) {
+        entry->dirty = true;
+        stats.dirty++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+// refresh a cached block before it is written to disk directly, so an older dirty copy can not be written
+// back over the new data anymore, block_cache_update_done has to follow once the write is over
+void block_cache_update(int64_t blockptr, const void* block) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    block_cache_entry_t* entry = find_entry(blockptr);
+    if (entry != NULL) {
+        memcpy(entry->data, block, STZFS_BLOCK_SIZE);
+        if (entry->dirty) {
+            entry->dirty = false;
+            stats.dirty--;
+        }
+    }
+    updating++;
+    pthread_mutex_unlock(&lock);
+}
+
+// end block_cache_update for count blocks whose direct write completed or failed
+void block_cache_update_done(size_t count) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    // misses until now may have read the disk copy from before the write
+    pthread_mutex_lock(&lock);
+    updating -= count;
+    generation++;
+    pthread_mutex_unlock(&lock);
+}
+
+// drop a cached block without writing it back (eg. after it has been freed)
+void block_cache_invalidate(int64_t blockptr) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    block_cache_entry_t* entry = find_entry(blockptr);
+    if (entry != NULL) {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        release_entry(entry);
+    }
+    generation++;
+    pthread_mutex_unlock(&lock);
+}
+
+void block_cache_get_stats(block_cache_stats_t* out) {
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+// hash bucket of a blockptr
+static block_cache_entry_t** bucket_of(int64_t blockptr) {
+    const uint64_t hash = (uint64_t)blockptr * 0x9e3779b97f4a7c15ULL;
+    return &buckets[hash >> (64 - bucket_bits)];
+}
+
+static block_cache_entry_t* find_entry(int64_t blockptr) {
+    for (block_cache_entry_t* entry = *bucket_of(blockptr); entry != NULL; entry = entry->hash_next) {
+        if (entry->blockptr == blockptr) return entry;
+    }
+
+    return NULL;
+}
+
+// remove an entry (already unlinked from the lru list) from its hash chain and free it
+static void release_entry(block_cache_entry_t* entry) {
+    block_cache_entry_t** link = bucket_of(entry->blockptr);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->dirty) {
+        entry->dirty = false;
+        stats.dirty--;
+    }
+
+    entry->next = free_list;
+    free_list = entry;
+    stats.used--;
+}
+
+// take a free entry or evict the least recently used one
+static block_cache_entry_t* alloc_entry(int64_t blockptr) {
+    if (free_list == NULL) {
+        block_cache_entry_t* victim = lru.prev;
+
+        // write back the coldest dirty blocks together with the victim
+        if (victim->dirty) {
+            block_cache_entry_t* list[BLOCK_CACHE_WRITEBACK_BATCH];
+            size_t length = 0;
+            for (block_cache_entry_t* entry = victim; entry != &lru && length < BLOCK_CACHE_WRITEBACK_BATCH;
+                 entry = entry->prev) {
+                if (entry->dirty) list[length++] = entry;
+            }
+
+            if (write_entries(list, length)) {
+                printf("block_cache: could not write back evicted block %lld\n", (long long)victim->blockptr);
+                return NULL;
+            }
+        }
+
+        victim->prev->next = victim->next;
+        victim->next->prev = victim->prev;
+        release_entry(victim);
+        stats.evictions++;
+    }
+
+    block_cache_entry_t* entry = free_list;
+    free_list = entry->next;
+
+    entry->blockptr = blockptr;
+    entry->dirty = false;
+    block_cache_entry_t** bucket = bucket_of(blockptr);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    stats.used++;
+
+    return entry;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const int64_t blockptr_a = (*(block_cache_entry_t* const*)a)->blockptr;
+    const int64_t blockptr_b = (*(block_cache_entry_t* const*)b)->blockptr;
+    return (blockptr_a > blockptr_b) - (blockptr_a < blockptr_b);
+}
+
+// write back dirty entries in disk order, physically consecutive blocks form one request
+static int write_entries(block_cache_entry_t** list, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    qsort(list, length, sizeof(block_cache_entry_t*), compare_entries);
+
+    struct iovec* iov = malloc(length * sizeof(struct iovec));
+    disk_request_t* requests = malloc(length * sizeof(disk_request_t));
+    if (iov == NULL || requests == NULL) {
+        free(iov);
+        free(requests);
+        return -ENOMEM;
+    }
+
+    size_t request_count = 0;
+    for (size_t i = 0; i < length; i++) {
+        iov[i].iov_base = list[i]->data;
+        iov[i].iov_len = STZFS_BLOCK_SIZE;
+
+        if (i > 0 && list[i]->blockptr == list[i - 1]->blockptr + 1) {
+            requests[request_count - 1].iovcnt++;
+        } else {
+            requests[request_count++] = (disk_request_t) {
+                .write = true,
+                .addr = (off_t)list[i]->blockptr * STZFS_BLOCK_SIZE,
+                .iov = &iov[i],
+                .iovcnt = 1,
+            };
+        }
+    }
+
+    disk_submit(requests, request_count);
+    const stzfs_error_t error = disk_wait();
+    free(iov);
+    free(requests);
+    if (error) {
+        return -EIO;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        list[i]->dirty = false;
+    }
+    generation++;
+    stats.dirty -= length;
+    stats.writebacks += length;
+
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef STZFS_BLOCK_CACHE_H
+#define STZFS_BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct block_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    size_t capacity; // in blocks
+    size_t used;
+    size_t dirty;
+} block_cache_stats_t;
+
+void block_cache_set_size(size_t bytes);
+int block_cache_init(void);
+int block_cache_dispose(void);
+int block_cache_flush(void);
+bool block_cache_get(int64_t blockptr, void* block);
+int block_cache_put(int64_t blockptr, const void* block, bool dirty);
+void block_cache_update(int64_t blockptr, const void* block);
+void block_cache_update_done(size_t count);
+void block_cache_invalidate(int64_t blockptr);
+void block_cache_get_stats(block_cache_stats_t* stats);
+
+#endif // STZFS_BLOCK_CACHE_H
@@ -6,6 +6,16 @@
 #include "types.h"
 #include "inode.h"
 
+// optional format features chosen at mkfs time
+#define SUPER_BLOCK_FEATURE_EXTENTS (1 << 0) // new inodes map their data with extent trees
+#define SUPER_BLOCK_FEATURE_COMPACT_DIRS (1 << 1) // directory blocks hold dir_records instead of dir_block_entries
+
+// mount state, free counts are only trusted if the file system was unmounted cleanly
+#define SUPER_BLOCK_STATE_CLEAN (1 << 0)
+
+// unlinked inodes the kernel still refers to that the super block can remember, see orphan_hold
+#define SUPER_BLOCK_HELD_ORPHANS (512)
+
 typedef struct super_block {
     blockptr_t block_count;
     blockptr_t free_blocks;
@@ -17,13 +27,40 @@ typedef struct super_block {
     blockptr_t inode_table;
     blockptr_t inode_table_length;
     inodeptr_t inode_count;
+    uint32_t features;
+    blockptr_t group_table; // 0 if the file system predates allocation groups
+    blockptr_t group_table_length;
+    blockptr_t blocks_per_group;
+    inodeptr_t inodes_per_group;
+    uint32_t group_count;
+    uint32_t state;
+    inodeptr_t orphan_head; // first unlinked inode whose blocks are still being freed, 0 if none
+    inodeptr_t held_orphans[SUPER_BLOCK_HELD_ORPHANS]; // unlinked inodes still in use, 0 for free slots
+
+    int8_t padding[STZFS_BLOCK_SIZE - sizeof(blockptr_t) * 11 - sizeof(inodeptr_t) * (4 + SUPER_BLOCK_HELD_ORPHANS) -
+                   sizeof(uint32_t) * 3];
+} STZFS_BLOCK_ALIGNED super_block;
+
+// blocks of an allocation group, one block bitmap block per group
+#define GROUP_BLOCKS (STZFS_BLOCK_SIZE * 8)
+
+// 16 bytes, free space of one allocation group
+typedef struct group_descriptor {
+    blockptr_t free_blocks;
+    inodeptr_t free_inodes;
+    uint32_t directories;
+    uint32_t reserved;
+} group_descriptor;
+
+#define GROUP_BLOCK_ENTRIES (STZFS_BLOCK_SIZE / sizeof(group_descriptor))
 
-    int8_t padding[STZFS_BLOCK_SIZE - sizeof(blockptr_t) * 8 - sizeof(inodeptr_t) * 2];
-} super_block;
+typedef struct group_block {
+    group_descriptor groups[GROUP_BLOCK_ENTRIES];
+} STZFS_BLOCK_ALIGNED group_block;
 
 typedef struct inode_block {
     inode_t inodes[INODE_BLOCK_ENTRIES];
-} inode_block;
+} STZFS_BLOCK_ALIGNED inode_block;
 
 // 256 bytes
 typedef struct dir_block_entry {
@@ -35,22 +72,62 @@ typedef struct dir_block_entry {
 
 typedef struct dir_block {
     dir_block_entry entries[DIR_BLOCK_ENTRIES];
-} dir_block;
+} STZFS_BLOCK_ALIGNED dir_block;
+
+// 8 bytes and the name, the 4 byte aligned records of a directory block cover all of it
+typedef struct dir_record {
+    inodeptr_t inode; // 0 if the record is unused
+    uint16_t length; // up to the next record
+    uint8_t name_length;
+    uint8_t type; // DIR_TYPE_*
+    filename_t name[]; // not null terminated
+} dir_record;
+
+#define DIR_RECORD_LENGTH(name_length) ((sizeof(dir_record) + (name_length) + 3) & ~(size_t)3)
+
+// file types of dir_records, fixed size entries have none
+#define DIR_TYPE_UNKNOWN (0)
+#define DIR_TYPE_REG     (1)
+#define DIR_TYPE_LNK     (2)
+#define DIR_TYPE_DIR     (3)
+
+// 8 bytes, names hashing to hash up to the hash of the next entry are found below offset
+typedef struct dir_index_entry {
+    uint32_t hash;
+    uint32_t offset; // logical block of the directory
+} dir_index_entry;
+
+#define DIR_INDEX_ENTRIES ((STZFS_BLOCK_SIZE - sizeof(uint32_t) * 2) / sizeof(dir_index_entry))
+
+// node of the hash index of an M_INDEXED directory, the root is its first block, the leaves are directory
+// blocks with unused entries (fixed size entries with an empty name)
+typedef struct dir_index_block {
+    uint32_t count;
+    uint32_t levels; // root only, levels of inner nodes between the root and the leaves
+    dir_index_entry entries[DIR_INDEX_ENTRIES];
+} STZFS_BLOCK_ALIGNED dir_index_block;
 
 #define INDIRECT_BLOCK_ENTRIES (STZFS_BLOCK_SIZE / sizeof(blockptr_t))
 
 typedef struct indirect_block {
     blockptr_t blocks[INDIRECT_BLOCK_ENTRIES];
-} indirect_block;
+} STZFS_BLOCK_ALIGNED indirect_block;
+
+#define EXTENT_BLOCK_ENTRIES ((STZFS_BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t))
+
+typedef struct extent_block {
+    extent_header_t header;
+    extent_t entries[EXTENT_BLOCK_ENTRIES];
+} STZFS_BLOCK_ALIGNED extent_block;
 
 #define BITMAP_BLOCK_ENTRIES (STZFS_BLOCK_SIZE / sizeof(bitmap_entry_t))
 
 typedef struct bitmap_block {
     bitmap_entry_t bitmap[BITMAP_BLOCK_ENTRIES];
-} bitmap_block;
+} STZFS_BLOCK_ALIGNED bitmap_block;
 
 typedef struct data_block {
     int8_t data[STZFS_BLOCK_SIZE];
-} data_block;
+} STZFS_BLOCK_ALIGNED data_block;
 
 #endif // STZFS_BLOCKS_H
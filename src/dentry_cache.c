@@ -0,0 +1,209 @@
+#include "dentry_cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+
+// default number of cached names (about 300 bytes each)
+#define DENTRY_CACHE_DEFAULT_ENTRIES 16384
+
+// entries are filled by readers holding the namespace lock shared and changed by writers holding it
+// exclusively (see inode_lock.h), so a name can not change between a directory scan and its put
+typedef struct dentry_cache_entry_t {
+    int64_t dir_inodeptr;
+    int64_t inodeptr; // INODEPTR_ERROR if the name does not exist
+    struct dentry_cache_entry_t* hash_next;
+    struct dentry_cache_entry_t* prev; // lru list, most recently used first
+    struct dentry_cache_entry_t* next; // lru list or free list
+    char name[MAX_FILENAME_LENGTH];
+} dentry_cache_entry_t;
+
+static dentry_cache_entry_t** bucket_of(int64_t dir_inodeptr, const char* name);
+static dentry_cache_entry_t* find_entry(int64_t dir_inodeptr, const char* name);
+static void release_entry(dentry_cache_entry_t* entry);
+
+static size_t cache_entries = DENTRY_CACHE_DEFAULT_ENTRIES;
+static dentry_cache_entry_t* entries = NULL;
+static dentry_cache_entry_t** buckets = NULL;
+static int bucket_bits = 0;
+static dentry_cache_entry_t* free_list = NULL;
+static dentry_cache_entry_t lru = {.prev = &lru, .next = &lru};
+static dentry_cache_stats_t stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // guards all of the above once the cache is set up
+
+// set the max number of cached names (has to be called before init, 0 disables the cache)
+void dentry_cache_set_size(size_t count) {
+    cache_entries = count;
+}
+
+int dentry_cache_init(void) {
+    dentry_cache_dispose();
+
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = cache_entries;
+    if (stats.capacity == 0) {
+        return 0;
+    }
+
+    // keep hash chains short
+    bucket_bits = 1;
+    while (((size_t)1 << bucket_bits) < stats.capacity) {
+        bucket_bits++;
+    }
+
+    entries = calloc(stats.capacity, sizeof(dentry_cache_entry_t));
+    buckets = calloc((size_t)1 << bucket_bits, sizeof(dentry_cache_entry_t*));
+    if (entries == NULL || buckets == NULL) {
+        printf("dentry_cache_init: could not allocate %zu cache entries\n", stats.capacity);
+        dentry_cache_dispose();
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < stats.capacity; i++) {
+        entries[i].next = free_list;
+        free_list = &entries[i];
+    }
+
+    return 0;
+}
+
+void dentry_cache_dispose(void) {
+    free(entries);
+    free(buckets);
+    entries = NULL;
+    buckets = NULL;
+    free_list = NULL;
+    lru.prev = &lru;
+    lru.next = &lru;
+    stats.capacity = 0;
+    stats.used = 0;
+}
+
+// look up a name, true on hit (*inodeptr is INODEPTR_ERROR if the name is known to be missing)
+bool dentry_cache_get(int64_t dir_inodeptr, const char* name, int64_t* inodeptr) {
+    if (stats.capacity == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    dentry_cache_entry_t* entry = find_entry(dir_inodeptr, name);
+    if (entry == NULL) {
+        stats.misses++;
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    // move to the front of the lru list
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = &lru;
+    entry->next = lru.next;
+    lru.next->prev = entry;
+    lru.next = entry;
+
+    *inodeptr = entry->inodeptr;
+    stats.hits++;
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+// insert or replace the inodeptr of a name, INODEPTR_ERROR for a missing one
+void dentry_cache_put(int64_t dir_inodeptr, const char* name, int64_t inodeptr) {
+    if (stats.capacity == 0 || strlen(name) >= MAX_FILENAME_LENGTH) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    dentry_cache_entry_t* entry = find_entry(dir_inodeptr, name);
+    if (entry != NULL) {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+    } else {
+        // evict the least recently used name
+        if (free_list == NULL) {
+            dentry_cache_entry_t* victim = lru.prev;
+            victim->prev->next = victim->next;
+            victim->next->prev = victim->prev;
+            release_entry(victim);
+            stats.evictions++;
+        }
+
+        entry = free_list;
+        free_list = entry->next;
+
+        entry->dir_inodeptr = dir_inodeptr;
+        strcpy(entry->name, name);
+        dentry_cache_entry_t** bucket = bucket_of(dir_inodeptr, name);
+        entry->hash_next = *bucket;
+        *bucket = entry;
+        stats.used++;
+    }
+
+    entry->inodeptr = inodeptr;
+    entry->prev = &lru;
+    entry->next = lru.next;
+    lru.next->prev = entry;
+    lru.next = entry;
+    pthread_mutex_unlock(&lock);
+}
+
+// drop a name whose directory entry changed in an unknown way
+void dentry_cache_invalidate(int64_t dir_inodeptr, const char* name) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    dentry_cache_entry_t* entry = find_entry(dir_inodeptr, name);
+    if (entry != NULL) {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        release_entry(entry);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void dentry_cache_get_stats(dentry_cache_stats_t* out) {
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+// hash bucket of a name in a directory (fnv-1a)
+static dentry_cache_entry_t** bucket_of(int64_t dir_inodeptr, const char* name) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t)dir_inodeptr;
+    for (const char* c = name; *c != 0; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return &buckets[hash >> (64 - bucket_bits)];
+}
+
+static dentry_cache_entry_t* find_entry(int64_t dir_inodeptr, const char* name) {
+    for (dentry_cache_entry_t* entry = *bucket_of(dir_inodeptr, name); entry != NULL; entry = entry->hash_next) {
+        if (entry->dir_inodeptr == dir_inodeptr && strcmp(entry->name, name) == 0) return entry;
+    }
+
+    return NULL;
+}
+
+// remove an entry (already unlinked from the lru list) from its hash chain and free it
+static void release_entry(dentry_cache_entry_t* entry) {
+    dentry_cache_entry_t** link = bucket_of(entry->dir_inodeptr, entry->name);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    entry->next = free_list;
+    free_list = entry;
+    stats.used--;
+}
@@ -0,0 +1,25 @@
+#ifndef STZFS_DENTRY_CACHE_H
+#define STZFS_DENTRY_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct dentry_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t capacity; // in entries
+    size_t used;
+} dentry_cache_stats_t;
+
+// names of directories resolved to inodeptrs, INODEPTR_ERROR caches a missing name
+void dentry_cache_set_size(size_t entries);
+int dentry_cache_init(void);
+void dentry_cache_dispose(void);
+bool dentry_cache_get(int64_t dir_inodeptr, const char* name, int64_t* inodeptr);
+void dentry_cache_put(int64_t dir_inodeptr, const char* name, int64_t inodeptr);
+void dentry_cache_invalidate(int64_t dir_inodeptr, const char* name);
+void dentry_cache_get_stats(dentry_cache_stats_t* stats);
+
+#endif // STZFS_DENTRY_CACHE_H
@@ -1,18 +1,97 @@
 #include "direntry.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "blocks.h"
+#include "dentry_cache.h"
 #include "error.h"
 #include "helpers.h"
 #include "inode.h"
 #include "log.h"
+#include "super_block_cache.h"
 #include "types.h"
 
+// linear directories get a hash index once they would grow past this many blocks
+#define DIR_INDEX_MIN_BLOCKS (4)
+
+// inner node levels below the root, enough for about two million names
+#define DIR_INDEX_MAX_LEVELS (1)
+
+// most entries a leaf can hold plus the one that splits it
+#define LEAF_MAX_ENTRIES (STZFS_BLOCK_SIZE / DIR_RECORD_LENGTH(1) + 1)
+
+// index node on the way from the root to a leaf
+typedef struct index_node_t {
+    dir_index_block block;
+    int64_t offset;
+    uint32_t position; // entry that was followed
+} index_node_t;
+
+// entry of a directory block in memory
+typedef struct entry_t {
+    int64_t inodeptr;
+    uint32_t hash; // set to sort entries into leaves
+    uint8_t type;
+    char name[MAX_FILENAME_LENGTH + 1];
+} entry_t;
+
+// entry of a directory listing, read again from its block when it is passed on
+typedef struct listed_t {
+    off_t position;
+    int64_t offset;
+    size_t at; // byte position in the block
+} listed_t;
+
+static stzfs_error_t search_entry(inode_t* inode, const char* name, dir_block* block, int64_t* offset,
+                                  size_t* position, bool* found);
+static stzfs_error_t list_blocks(inode_t* inode, int64_t first, int64_t last, off_t position,
+                                 direntry_filler_t filler, void* context, bool* stopped);
+static stzfs_error_t linear_alloc(inode_t* inode, const entry_t* entry);
+static stzfs_error_t linear_free(inode_t* inode, dir_block* block, int64_t offset, size_t position);
+static bool compact_dirs(void);
+static uint8_t record_type(stzfs_mode_t mode);
+static size_t entry_size(const entry_t* entry);
+static size_t block_end(inode_t* inode, int64_t offset);
+static void block_init(void* block);
+static bool block_entry(const void* block, size_t position, size_t* next, entry_t* entry);
+static bool block_find(const void* block, size_t end, const char* name, size_t* position);
+static bool block_insert(void* block, const entry_t* entry);
+static void block_remove(void* block, size_t position);
+static void block_set(void* block, size_t position, const entry_t* entry);
+static uint32_t name_hash(const char* name);
+static off_t name_position(const char* name);
+static stzfs_error_t index_walk(inode_t* inode, uint32_t hash, index_node_t* path, uint32_t* levels,
+                                int64_t* leaf_offset);
+static stzfs_error_t index_next(inode_t* inode, index_node_t* path, uint32_t levels, int64_t* leaf_offset,
+                                bool* more);
+static stzfs_error_t index_alloc(inode_t* inode, entry_t* entry);
+static stzfs_error_t index_add(inode_t* inode, index_node_t* path, uint32_t level, dir_index_entry added);
+static stzfs_error_t index_create(inode_t* inode, const entry_t* entry, bool* created);
+static stzfs_error_t put_block(inode_t* inode, int64_t offset, const void* block);
+static size_t split_point(const entry_t* sorted, size_t count);
+static int compare_hashes(const void* a, const void* b);
+static int compare_positions(const void* a, const void* b);
+
+// fill the first block of a new directory with its . and .. entries, the root directory has no ..
+void direntry_init(void* block, int64_t inodeptr, int64_t parent_inodeptr) {
+    block_init(block);
+
+    entry_t entry = {.inodeptr = inodeptr, .type = DIR_TYPE_DIR, .name = "."};
+    block_insert(block, &entry);
+
+    if (parent_inodeptr != 0) {
+        entry = (entry_t) {.inodeptr = parent_inodeptr, .type = DIR_TYPE_DIR, .name = ".."};
+        block_insert(block, &entry);
+    }
+}
+
 // alloc a new entry in a directory inode
-stzfs_error_t direntry_alloc(inode_t* inode, const char* name, int64_t target_inodeptr) {
+stzfs_error_t direntry_alloc(int64_t inodeptr, inode_t* inode, const char* name, int64_t target_inodeptr,
+                             stzfs_mode_t target_mode) {
     if (strlen(name) > MAX_FILENAME_LENGTH) {
         LOG("filename too long");
         return ERROR;
@@ -26,38 +105,20 @@ stzfs_error_t direntry_alloc(inode_t* inode, const char* name, int64_t target_in
         return ERROR;
     }
 
-    dir_block block;
-    dir_block_entry* entry;
+    entry_t entry = {.inodeptr = target_inodeptr, .type = record_type(target_mode)};
+    strcpy(entry.name, name);
 
-    // get next free dir block
-    const int64_t block_offset = inode->atom_count / DIR_BLOCK_ENTRIES;
-    const int next_free_entry = inode->atom_count % DIR_BLOCK_ENTRIES;
-
-    if (next_free_entry == 0) {
-        // allocate a new dir block
-        memset(&block, 0, STZFS_BLOCK_SIZE);
-    } else {
-        inode_read_data_block(inode, block_offset, &block, NULL);
+    if ((inode->mode & M_INDEXED) ? index_alloc(inode, &entry) : linear_alloc(inode, &entry)) {
+        return ERROR;
     }
 
-    // create entry
-    entry = &block.entries[next_free_entry];
-    entry->inode = target_inodeptr;
-    strcpy(entry->name, name);
     inode->atom_count++;
-
-    // write back dir block
-    if (next_free_entry == 0) {
-        inode_alloc_data_block(inode, &block);
-    } else {
-        inode_write_data_block(inode, block_offset, &block);
-    }
-
+    dentry_cache_put(inodeptr, name, target_inodeptr);
     return SUCCESS;
 }
 
 // free entry from directory
-stzfs_error_t direntry_free(inode_t* inode, const char* name) {
+stzfs_error_t direntry_free(int64_t inodeptr, inode_t* inode, const char* name) {
     if (!M_IS_DIR(inode->mode)) {
         LOG("not a directory");
         return ERROR;
@@ -70,112 +131,867 @@ stzfs_error_t direntry_free(inode_t* inode, const char* name) {
     }
 
     // search name in directory
-    bool entry_found = false;
-    size_t free_entry;
-    int64_t free_entry_offset;
-    dir_block free_entry_block;
-    for (int64_t offset = 0; offset < inode->block_count && !entry_found; offset++) {
-        inode_read_data_block(inode, offset, &free_entry_block, NULL);
-
-        // search current directory block
-        const size_t remaining_entries = inode->atom_count - offset * DIR_BLOCK_ENTRIES;
-        const size_t entries = MIN(DIR_BLOCK_ENTRIES, remaining_entries);
-        for (size_t entry = 0; entry < entries; entry++) {
-            if (strcmp((const char*)free_entry_block.entries[entry].name, name) == 0) {
-                free_entry = entry;
-                free_entry_offset = offset;
-                entry_found = true;
-                break;
+    dir_block block;
+    int64_t offset;
+    size_t position;
+    bool found;
+    if (search_entry(inode, name, &block, &offset, &position, &found)) {
+        return ERROR;
+    } else if (!found) {
+        LOG("name does not exist in directory");
+        return ERROR;
+    }
+
+    if ((inode->mode & M_INDEXED) || compact_dirs()) {
+        // blocks keep unused entries, other entries never move
+        block_remove(&block, position);
+        inode_write_data_block(inode, NULL, offset, &block);
+    } else if (linear_free(inode, &block, offset, position)) {
+        return ERROR;
+    }
+
+    inode->atom_count--;
+    dentry_cache_put(inodeptr, name, INODEPTR_ERROR);
+    return SUCCESS;
+}
+
+// replace inodeptr of name in directory
+stzfs_error_t direntry_write(int64_t inodeptr, inode_t* inode, const char* name, int64_t target_inodeptr,
+                             stzfs_mode_t target_mode) {
+    if (!M_IS_DIR(inode->mode)) {
+        LOG("not a directory");
+        return ERROR;
+    }
+
+    // search and replace name in directory
+    dir_block block;
+    int64_t offset;
+    size_t position;
+    bool found;
+    if (search_entry(inode, name, &block, &offset, &position, &found)) {
+        return ERROR;
+    } else if (!found) {
+        LOG("name does not exist in directory");
+        return ERROR;
+    }
+
+    const entry_t entry = {.inodeptr = target_inodeptr, .type = record_type(target_mode)};
+    block_set(&block, position, &entry);
+    inode_write_data_block(inode, NULL, offset, &block);
+    dentry_cache_put(inodeptr, name, target_inodeptr);
+    return SUCCESS;
+}
+
+// find name in directory inode
+stzfs_error_t direntry_find(int64_t inodeptr, inode_t* inode, const char* name, int64_t* found_inodeptr) {
+    if (!M_IS_DIR(inode->mode)) {
+        LOG("inode is not a directory");
+        *found_inodeptr = INODEPTR_ERROR;
+        return ERROR;
+    }
+
+    if (dentry_cache_get(inodeptr, name, found_inodeptr)) {
+        return SUCCESS;
+    }
+
+    dir_block block;
+    int64_t offset;
+    size_t position;
+    bool found;
+    if (search_entry(inode, name, &block, &offset, &position, &found)) {
+        *found_inodeptr = INODEPTR_ERROR;
+        return ERROR;
+    }
+
+    // missing names are cached as well, probes for them are answered from the cache from now on
+    *found_inodeptr = INODEPTR_ERROR;
+    if (found) {
+        entry_t entry;
+        size_t next;
+        block_entry(&block, position, &next, &entry);
+        *found_inodeptr = entry.inodeptr;
+    }
+    dentry_cache_put(inodeptr, name, *found_inodeptr);
+    return SUCCESS;
+}
+
+// pass the entries of a directory behind position on to filler until it asks to stop, entries are listed
+// in the order of their positions (see name_position), 0 lists all of them
+stzfs_error_t direntry_list(inode_t* inode, off_t position, direntry_filler_t filler, void* context) {
+    if (!M_IS_DIR(inode->mode)) {
+        LOG("not a directory");
+        return ERROR;
+    }
+
+    bool stopped;
+    if (!(inode->mode & M_INDEXED)) {
+        return list_blocks(inode, 0, inode->block_count, position, filler, context, &stopped);
+    }
+
+    // leaves hold ascending hash ranges, start with the one of the last listed name
+    index_node_t path[DIR_INDEX_MAX_LEVELS + 1];
+    uint32_t levels;
+    int64_t leaf_offset;
+    if (index_walk(inode, position > 0 ? (uint32_t)((position - 1) >> 30) : 0, path, &levels, &leaf_offset)) {
+        return ERROR;
+    }
+
+    for (bool more = true; more; ) {
+        if (list_blocks(inode, leaf_offset, leaf_offset + 1, position, filler, context, &stopped) ||
+            (!stopped && index_next(inode, path, levels, &leaf_offset, &more))) {
+            return ERROR;
+        } else if (stopped) {
+            break;
+        }
+    }
+
+    return SUCCESS;
+}
+
+// read the block holding the entry of a name, found is false if there is none
+static stzfs_error_t search_entry(inode_t* inode, const char* name, dir_block* block, int64_t* offset,
+                                  size_t* position, bool* found) {
+    if (inode->mode & M_INDEXED) {
+        // only the leaf of the name hash can hold it
+        index_node_t path[DIR_INDEX_MAX_LEVELS + 1];
+        uint32_t levels;
+        if (index_walk(inode, name_hash(name), path, &levels, offset) ||
+            inode_read_data_block(inode, NULL, *offset, block, NULL)) {
+            return ERROR;
+        }
+
+        *found = block_find(block, STZFS_BLOCK_SIZE, name, position);
+        return SUCCESS;
+    }
+
+    // read directory blocks and search them
+    for (*offset = 0; *offset < inode->block_count; (*offset)++) {
+        inode_read_data_block(inode, NULL, *offset, block, NULL);
+        if (block_find(block, block_end(inode, *offset), name, position)) {
+            *found = true;
+            return SUCCESS;
+        }
+    }
+
+    *found = false;
+    return SUCCESS;
+}
+
+// pass the entries of the directory blocks first to last - 1 behind position on to filler in the order of
+// their positions, stopped is set if filler asked to stop
+static stzfs_error_t list_blocks(inode_t* inode, int64_t first, int64_t last, off_t position,
+                                 direntry_filler_t filler, void* context, bool* stopped) {
+    listed_t* listed = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    dir_block block;
+    *stopped = false;
+    for (int64_t offset = first; offset < last; offset++) {
+        if (inode_read_data_block(inode, NULL, offset, &block, NULL)) {
+            free(listed);
+            return ERROR;
+        }
+
+        const size_t end = block_end(inode, offset);
+        size_t next;
+        for (size_t at = 0; at < end; at = next) {
+            entry_t entry;
+            if (!block_entry(&block, at, &next, &entry)) {
+                continue;
+            }
+
+            const off_t entry_position = name_position(entry.name);
+            if (entry_position <= position) {
+                continue;
+            }
+
+            if (count == capacity) {
+                capacity = MAX(2 * capacity, LEAF_MAX_ENTRIES);
+                listed_t* grown = realloc(listed, capacity * sizeof(listed_t));
+                if (grown == NULL) {
+                    LOG("could not allocate directory listing");
+                    free(listed);
+                    return ERROR;
+                }
+                listed = grown;
             }
+            listed[count++] = (listed_t) {.position = entry_position, .offset = offset, .at = at};
         }
     }
 
-    if (!entry_found) {
-        LOG("name does not exist in directory");
+    qsort(listed, count, sizeof(listed_t), compare_positions);
+
+    // the last block read is still at hand
+    int64_t read_offset = last - 1;
+    for (size_t i = 0; i < count && !*stopped; i++) {
+        if (listed[i].offset != read_offset) {
+            read_offset = listed[i].offset;
+            if (inode_read_data_block(inode, NULL, read_offset, &block, NULL)) {
+                free(listed);
+                return ERROR;
+            }
+        }
+
+        entry_t entry;
+        size_t next;
+        block_entry(&block, listed[i].at, &next, &entry);
+        *stopped = filler(context, entry.name, entry.inodeptr, entry.type, listed[i].position) != 0;
+    }
+
+    free(listed);
+    return SUCCESS;
+}
+
+// add an entry to a linear directory, it is indexed instead of growing past DIR_INDEX_MIN_BLOCKS
+static stzfs_error_t linear_alloc(inode_t* inode, const entry_t* entry) {
+    dir_block block;
+    if (compact_dirs()) {
+        // any block with enough free space
+        for (int64_t offset = 0; offset < inode->block_count; offset++) {
+            inode_read_data_block(inode, NULL, offset, &block, NULL);
+            if (block_insert(&block, entry)) {
+                return inode_write_data_block(inode, NULL, offset, &block);
+            }
+        }
+    } else if (inode->atom_count % DIR_BLOCK_ENTRIES != 0) {
+        // fixed size entries are kept in front, the next free one is behind the last entry
+        const int64_t offset = inode->atom_count / DIR_BLOCK_ENTRIES;
+        inode_read_data_block(inode, NULL, offset, &block, NULL);
+
+        dir_block_entry* free_entry = &block.entries[inode->atom_count % DIR_BLOCK_ENTRIES];
+        free_entry->inode = entry->inodeptr;
+        strcpy((char*)free_entry->name, entry->name);
+        return inode_write_data_block(inode, NULL, offset, &block);
+    }
+
+    if (inode->block_count >= DIR_INDEX_MIN_BLOCKS) {
+        // the directory is too large for linear scans, index it instead of adding a block
+        bool created;
+        if (index_create(inode, entry, &created)) {
+            return ERROR;
+        } else if (created) {
+            return SUCCESS;
+        }
+    }
+
+    // allocate a new dir block
+    block_init(&block);
+    block_insert(&block, entry);
+    if (inode_alloc_data_block(inode, &block)) {
+        LOG("could not allocate directory block");
         return ERROR;
     }
 
+    return SUCCESS;
+}
+
+// remove a fixed size entry of a linear directory by moving its last entry into its place
+static stzfs_error_t linear_free(inode_t* inode, dir_block* block, int64_t offset, size_t position) {
+    const size_t entry = position / sizeof(dir_block_entry);
+
     // get last entry offsets
     const size_t last_entry = (inode->atom_count - 1) % DIR_BLOCK_ENTRIES;
     const int64_t last_entry_offset = inode->block_count - 1;
 
     // copy last entry to removed entry if they are not the same
-    if (free_entry != last_entry || free_entry_offset != last_entry_offset) {
-        dir_block_entry entry;
-        if (free_entry_offset == last_entry_offset) {
-            entry = free_entry_block.entries[last_entry];
+    if (entry != last_entry || offset != last_entry_offset) {
+        if (offset == last_entry_offset) {
+            block->entries[entry] = block->entries[last_entry];
         } else {
             dir_block last_block;
-            inode_read_data_block(inode, last_entry_offset, &last_block, NULL);
-            entry = last_block.entries[last_entry];
+            inode_read_data_block(inode, NULL, last_entry_offset, &last_block, NULL);
+            block->entries[entry] = last_block.entries[last_entry];
         }
 
-        free_entry_block.entries[free_entry] = entry;
-        inode_write_data_block(inode, free_entry_offset, &free_entry_block);
+        inode_write_data_block(inode, NULL, offset, block);
     }
 
     if (last_entry == 0) {
         // the whole last block can be deleted
-        inode_free_last_data_block(inode);
+        return inode_free_last_data_block(inode);
     }
 
-    inode->atom_count--;
     return SUCCESS;
 }
 
-// replace inodeptr of name in directory
-// TODO: create a direntry search method to remove code duplication (also see direntry_free)
-stzfs_error_t direntry_write(inode_t* inode, const char* name, int64_t target_inodeptr) {
-    if (!M_IS_DIR(inode->mode)) {
-        LOG("not a directory");
-        return ERROR;
+// directory blocks hold dir_records, or fixed size dir_block_entries on older file systems
+static bool compact_dirs(void) {
+    return super_block_cache->features & SUPER_BLOCK_FEATURE_COMPACT_DIRS;
+}
+
+static uint8_t record_type(stzfs_mode_t mode) {
+    if (M_IS_DIR(mode)) {
+        return DIR_TYPE_DIR;
+    } else if (M_IS_LNK(mode)) {
+        return DIR_TYPE_LNK;
     }
 
-    // search and replace name in directory
-    for (int64_t offset = 0; offset < inode->block_count; offset++) {
-        dir_block block;
-        inode_read_data_block(inode, offset, &block, NULL);
-
-        const size_t remaining_entries = inode->atom_count - offset * DIR_BLOCK_ENTRIES;
-        const size_t entries = MIN(DIR_BLOCK_ENTRIES, remaining_entries);
-        for (size_t entry = 0; entry < entries; entry++) {
-            if (strcmp((const char*)block.entries[entry].name, name) == 0) {
-                block.entries[entry].inode = target_inodeptr;
-                inode_write_data_block(inode, offset, &block);
-                return SUCCESS;
+    return DIR_TYPE_REG;
+}
+
+// bytes an entry takes in a directory block
+static size_t entry_size(const entry_t* entry) {
+    return compact_dirs() ? DIR_RECORD_LENGTH(strlen(entry->name)) : sizeof(dir_block_entry);
+}
+
+// bytes of a directory block that may hold entries, the free fixed size entries of linear directories are
+// only cleared in new blocks
+static size_t block_end(inode_t* inode, int64_t offset) {
+    if ((inode->mode & M_INDEXED) || compact_dirs()) {
+        return STZFS_BLOCK_SIZE;
+    }
+
+    const size_t remaining_entries = inode->atom_count - offset * DIR_BLOCK_ENTRIES;
+    return MIN(DIR_BLOCK_ENTRIES, remaining_entries) * sizeof(dir_block_entry);
+}
+
+// clear a directory block, a single unused record covers a compact one
+static void block_init(void* block) {
+    memset(block, 0, STZFS_BLOCK_SIZE);
+    if (compact_dirs()) {
+        ((dir_record*)block)->length = STZFS_BLOCK_SIZE;
+    }
+}
+
+// read the entry at a byte position of a directory block, next is the position of the following one,
+// false if the entry is unused
+static bool block_entry(const void* block, size_t position, size_t* next, entry_t* entry) {
+    if (!compact_dirs()) {
+        const dir_block_entry* fixed = (const dir_block_entry*)((const uint8_t*)block + position);
+        *next = position + sizeof(dir_block_entry);
+        if (fixed->name[0] == 0) {
+            return false;
+        }
+
+        entry->inodeptr = fixed->inode;
+        entry->type = DIR_TYPE_UNKNOWN;
+        memcpy(entry->name, fixed->name, MAX_FILENAME_LENGTH);
+        entry->name[MAX_FILENAME_LENGTH] = 0;
+        return true;
+    }
+
+    const dir_record* record = (const dir_record*)((const uint8_t*)block + position);
+    if (record->length < DIR_RECORD_LENGTH(0) || record->length % 4 != 0 ||
+        position + record->length > STZFS_BLOCK_SIZE ||
+        (record->inode != 0 && DIR_RECORD_LENGTH(record->name_length) > record->length)) {
+        LOG("corrupt directory record");
+        *next = STZFS_BLOCK_SIZE;
+        return false;
+    }
+
+    *next = position + record->length;
+    if (record->inode == 0) {
+        return false;
+    }
+
+    entry->inodeptr = record->inode;
+    entry->type = record->type;
+    memcpy(entry->name, record->name, record->name_length);
+    entry->name[record->name_length] = 0;
+    return true;
+}
+
+// byte position of a name in a directory block up to end, false if it is not in there
+static bool block_find(const void* block, size_t end, const char* name, size_t* position) {
+    if (!compact_dirs()) {
+        for (*position = 0; *position < end; *position += sizeof(dir_block_entry)) {
+            const dir_block_entry* fixed = (const dir_block_entry*)((const uint8_t*)block + *position);
+            if (strcmp((const char*)fixed->name, name) == 0) {
+                return true;
             }
         }
+
+        return false;
     }
 
-    LOG("name does not exist in directory");
-    return ERROR;
+    // names are compared in place, most records differ in their name length already
+    const size_t name_length = strlen(name);
+    for (*position = 0; *position < end; ) {
+        const dir_record* record = (const dir_record*)((const uint8_t*)block + *position);
+        if (record->length < DIR_RECORD_LENGTH(0) || *position + record->length > STZFS_BLOCK_SIZE) {
+            LOG("corrupt directory record");
+            return false;
+        } else if (record->inode != 0 && record->name_length == name_length &&
+                   memcmp(record->name, name, name_length) == 0) {
+            return true;
+        }
+
+        *position += record->length;
+    }
+
+    return false;
 }
 
-// find name in directory inode
-stzfs_error_t direntry_find(inode_t* inode, const char* name, int64_t* found_inodeptr) {
-    if (!M_IS_DIR(inode->mode)) {
-        LOG("inode is not a directory");
-        *found_inodeptr = INODEPTR_ERROR;
+// put an entry into the first unused space of a directory block that fits it, false if there is none
+static bool block_insert(void* block, const entry_t* entry) {
+    if (!compact_dirs()) {
+        dir_block_entry* fixed = ((dir_block*)block)->entries;
+        for (size_t i = 0; i < DIR_BLOCK_ENTRIES; i++) {
+            if (fixed[i].name[0] == 0) {
+                fixed[i].inode = entry->inodeptr;
+                strcpy((char*)fixed[i].name, entry->name);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    const size_t name_length = strlen(entry->name);
+    const size_t needed = DIR_RECORD_LENGTH(name_length);
+    size_t next;
+    for (size_t position = 0; position < STZFS_BLOCK_SIZE; position = next) {
+        dir_record* record = (dir_record*)((uint8_t*)block + position);
+        if (record->length < DIR_RECORD_LENGTH(0) || position + record->length > STZFS_BLOCK_SIZE) {
+            LOG("corrupt directory record");
+            return false;
+        }
+        next = position + record->length;
+
+        // a used record gives away the space behind its name
+        const size_t used = record->inode != 0 ? DIR_RECORD_LENGTH(record->name_length) : 0;
+        if (record->length < used + needed) {
+            continue;
+        }
+
+        if (used > 0) {
+            dir_record* split = (dir_record*)((uint8_t*)record + used);
+            split->length = record->length - used;
+            record->length = used;
+            record = split;
+        }
+
+        record->inode = entry->inodeptr;
+        record->name_length = name_length;
+        record->type = entry->type;
+        memcpy(record->name, entry->name, name_length);
+        return true;
+    }
+
+    return false;
+}
+
+// remove the entry at a byte position of a directory block, a record is merged into the one in front of it
+static void block_remove(void* block, size_t position) {
+    if (!compact_dirs()) {
+        memset((uint8_t*)block + position, 0, sizeof(dir_block_entry));
+        return;
+    }
+
+    dir_record* record = (dir_record*)((uint8_t*)block + position);
+    if (position == 0) {
+        record->inode = 0;
+        return;
+    }
+
+    dir_record* previous = block;
+    while ((uint8_t*)previous + previous->length < (uint8_t*)record) {
+        previous = (dir_record*)((uint8_t*)previous + previous->length);
+    }
+    previous->length += record->length;
+}
+
+// point the entry at a byte position of a directory block to another inode
+static void block_set(void* block, size_t position, const entry_t* entry) {
+    if (!compact_dirs()) {
+        ((dir_block_entry*)((uint8_t*)block + position))->inode = entry->inodeptr;
+        return;
+    }
+
+    dir_record* record = (dir_record*)((uint8_t*)block + position);
+    record->inode = entry->inodeptr;
+    record->type = entry->type;
+}
+
+// hash of a name in the index (32 bit fnv-1a), part of the on disk format
+static uint32_t name_hash(const char* name) {
+    uint32_t hash = 0x811c9dc5;
+    for (const char* c = name; *c != 0; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x01000193;
+    }
+
+    return hash;
+}
+
+// position of a name in listings, its hash followed by 30 bits of a second one (djb2) for names with the
+// same hash, positions do not change while entries move between blocks
+static off_t name_position(const char* name) {
+    uint32_t second = 5381;
+    for (const char* c = name; *c != 0; c++) {
+        second = (second * 33) ^ (uint8_t)*c;
+    }
+
+    return ((off_t)name_hash(name) << 30 | (second * 0x9e3779b1) >> 2) + 1;
+}
+
+// follow the index from the root down to the leaf of a name hash, path gets the nodes on the way
+static stzfs_error_t index_walk(inode_t* inode, uint32_t hash, index_node_t* path, uint32_t* levels,
+                                int64_t* leaf_offset) {
+    int64_t offset = 0;
+    for (uint32_t level = 0; ; level++) {
+        index_node_t* node = &path[level];
+        if (inode_read_data_block(inode, NULL, offset, &node->block, NULL)) {
+            return ERROR;
+        }
+
+        if (level == 0) {
+            *levels = node->block.levels;
+        }
+        if (*levels > DIR_INDEX_MAX_LEVELS || node->block.count == 0 || node->block.count > DIR_INDEX_ENTRIES) {
+            LOG("corrupt directory index");
+            return ERROR;
+        }
+
+        // last entry whose hash is not above the searched one, the first entry starts at 0
+        uint32_t low = 0;
+        uint32_t high = node->block.count - 1;
+        while (low < high) {
+            const uint32_t middle = (low + high + 1) / 2;
+            if (node->block.entries[middle].hash <= hash) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+
+        node->offset = offset;
+        node->position = low;
+        offset = node->block.entries[low].offset;
+        if (level == *levels) {
+            *leaf_offset = offset;
+            return SUCCESS;
+        }
+    }
+}
+
+// move a path from the root on to the next leaf in hash order, more is false behind the last one
+static stzfs_error_t index_next(inode_t* inode, index_node_t* path, uint32_t levels, int64_t* leaf_offset,
+                                bool* more) {
+    uint32_t level = levels + 1;
+    do {
+        if (level == 0) {
+            *more = false;
+            return SUCCESS;
+        }
+        level--;
+    } while (path[level].position + 1 >= path[level].block.count);
+
+    path[level].position++;
+    for (; level < levels; level++) {
+        index_node_t* child = &path[level + 1];
+        child->offset = path[level].block.entries[path[level].position].offset;
+        child->position = 0;
+        if (inode_read_data_block(inode, NULL, child->offset, &child->block, NULL)) {
+            return ERROR;
+        } else if (child->block.count == 0 || child->block.count > DIR_INDEX_ENTRIES) {
+            LOG("corrupt directory index");
+            return ERROR;
+        }
+    }
+
+    *leaf_offset = path[levels].block.entries[path[levels].position].offset;
+    *more = true;
+    return SUCCESS;
+}
+
+// add an entry to the leaf of its hash, a full leaf is split in two by hash
+static stzfs_error_t index_alloc(inode_t* inode, entry_t* entry) {
+    entry->hash = name_hash(entry->name);
+    index_node_t path[DIR_INDEX_MAX_LEVELS + 1];
+    uint32_t levels;
+    int64_t leaf_offset;
+    dir_block leaf;
+    if (index_walk(inode, entry->hash, path, &levels, &leaf_offset) ||
+        inode_read_data_block(inode, NULL, leaf_offset, &leaf, NULL)) {
         return ERROR;
     }
 
-    // read directory blocks and search them
+    if (block_insert(&leaf, entry)) {
+        return inode_write_data_block(inode, NULL, leaf_offset, &leaf);
+    }
+
+    // a split adds an index entry, check for room before anything is changed
+    bool full = levels == DIR_INDEX_MAX_LEVELS;
+    for (uint32_t level = 0; level <= levels; level++) {
+        full = full && path[level].block.count == DIR_INDEX_ENTRIES;
+    }
+    if (full) {
+        LOG("directory index is full");
+        return ERROR;
+    }
+
+    entry_t* sorted = malloc(LEAF_MAX_ENTRIES * sizeof(entry_t));
+    if (sorted == NULL) {
+        LOG("could not allocate memory");
+        return ERROR;
+    }
+
+    size_t count = 0;
+    size_t next;
+    for (size_t position = 0; position < STZFS_BLOCK_SIZE && count < LEAF_MAX_ENTRIES - 1; position = next) {
+        if (block_entry(&leaf, position, &next, &sorted[count])) {
+            sorted[count].hash = name_hash(sorted[count].name);
+            count++;
+        }
+    }
+    sorted[count++] = *entry;
+    qsort(sorted, count, sizeof(entry_t), compare_hashes);
+
+    // names from the split hash on move to a new leaf, names with the same hash have to stay in one leaf
+    const size_t split = split_point(sorted, count);
+    dir_block upper;
+    block_init(&leaf);
+    block_init(&upper);
+    bool fits = split > 0;
+    for (size_t i = 0; i < count && fits; i++) {
+        fits = block_insert(i < split ? (void*)&leaf : (void*)&upper, &sorted[i]);
+    }
+
+    const uint32_t split_hash = sorted[split].hash;
+    free(sorted);
+    if (!fits) {
+        LOG("too many names with the same hash");
+        return ERROR;
+    }
+
+    const int64_t upper_offset = inode->block_count;
+    if (inode_alloc_data_block(inode, &upper)) {
+        LOG("could not allocate directory block");
+        return ERROR;
+    }
+
+    // the old leaf still holds every name, the new one must not be indexed before the names left it
+    if (inode_write_data_block(inode, NULL, leaf_offset, &leaf)) {
+        LOG("could not write split directory block");
+        inode_free_last_data_block(inode);
+        return ERROR;
+    }
+
+    return index_add(inode, path, levels, (dir_index_entry) {.hash = split_hash, .offset = upper_offset});
+}
+
+// add an entry behind the followed one of the index node at level, full nodes are split in halves and a
+// full root moves its entries one level down
+static stzfs_error_t index_add(inode_t* inode, index_node_t* path, uint32_t level, dir_index_entry added) {
+    index_node_t* node = &path[level];
+    dir_index_entry* entries = node->block.entries;
+    const uint32_t position = node->position + 1;
+
+    if (node->block.count < DIR_INDEX_ENTRIES) {
+        memmove(&entries[position + 1], &entries[position], (node->block.count - position) * sizeof(dir_index_entry));
+        entries[position] = added;
+        node->block.count++;
+        return inode_write_data_block(inode, NULL, node->offset, &node->block);
+    }
+
+    dir_index_entry all[DIR_INDEX_ENTRIES + 1];
+    memcpy(all, entries, position * sizeof(dir_index_entry));
+    all[position] = added;
+    memcpy(&all[position + 1], &entries[position], (DIR_INDEX_ENTRIES - position) * sizeof(dir_index_entry));
+
+    const uint32_t half = (DIR_INDEX_ENTRIES + 1) / 2;
+    dir_index_block lower = {.count = half};
+    dir_index_block upper = {.count = DIR_INDEX_ENTRIES + 1 - half};
+    memcpy(lower.entries, all, lower.count * sizeof(dir_index_entry));
+    memcpy(upper.entries, &all[half], upper.count * sizeof(dir_index_entry));
+
+    if (level == 0) {
+        // the root stays the first block and points to both halves
+        const int64_t lower_offset = inode->block_count;
+        if (inode_alloc_data_block(inode, &lower) || inode_alloc_data_block(inode, &upper)) {
+            LOG("could not allocate directory index block");
+            return ERROR;
+        }
+
+        node->block.levels++;
+        node->block.count = 2;
+        entries[0] = (dir_index_entry) {.hash = 0, .offset = lower_offset};
+        entries[1] = (dir_index_entry) {.hash = upper.entries[0].hash, .offset = lower_offset + 1};
+        return inode_write_data_block(inode, NULL, 0, &node->block);
+    }
+
+    const int64_t upper_offset = inode->block_count;
+    if (inode_alloc_data_block(inode, &upper)) {
+        LOG("could not allocate directory index block");
+        return ERROR;
+    }
+
+    // like a leaf split, the upper half is only linked once the lower one is on its own
+    if (inode_write_data_block(inode, NULL, node->offset, &lower)) {
+        LOG("could not write split directory index block");
+        inode_free_last_data_block(inode);
+        return ERROR;
+    }
+
+    return index_add(inode, path, level - 1, (dir_index_entry) {.hash = upper.entries[0].hash, .offset = upper_offset});
+}
+
+// turn a full linear directory into an indexed one holding the new entry as well, created is false if the
+// names can't be indexed and the directory stays linear
+static stzfs_error_t index_create(inode_t* inode, const entry_t* entry, bool* created) {
+    *created = false;
+
+    const size_t count = inode->atom_count + 1;
+    entry_t* sorted = malloc(count * sizeof(entry_t));
+    size_t* leaf_starts = malloc((count + 1) * sizeof(size_t));
+    if (sorted == NULL || leaf_starts == NULL) {
+        LOG("could not allocate memory");
+        free(sorted);
+        free(leaf_starts);
+        return ERROR;
+    }
+
+    // sort all names by hash
+    size_t read = 0;
     for (int64_t offset = 0; offset < inode->block_count; offset++) {
         dir_block block;
-        inode_read_data_block(inode, offset, &block, NULL);
-
-        const size_t remaining_entries = inode->atom_count - offset * DIR_BLOCK_ENTRIES;
-        const size_t entries = MIN(DIR_BLOCK_ENTRIES, remaining_entries);
-        for (size_t entry = 0; entry < entries; entry++) {
-            if (strcmp((const char*)block.entries[entry].name, name) == 0) {
-                // found name in directory
-                *found_inodeptr = block.entries[entry].inode;
-                return SUCCESS;
+        inode_read_data_block(inode, NULL, offset, &block, NULL);
+
+        const size_t end = block_end(inode, offset);
+        size_t next;
+        for (size_t position = 0; position < end && read < count - 1; position = next) {
+            if (block_entry(&block, position, &next, &sorted[read])) {
+                sorted[read].hash = name_hash(sorted[read].name);
+                read++;
             }
         }
     }
 
-    // file not found in directory
-    *found_inodeptr = INODEPTR_ERROR;
-    return SUCCESS;
+    if (read != count - 1) {
+        LOG("entry count of directory does not match its blocks");
+        free(sorted);
+        free(leaf_starts);
+        return ERROR;
+    }
+
+    sorted[read] = *entry;
+    sorted[read].hash = name_hash(entry->name);
+    qsort(sorted, count, sizeof(entry_t), compare_hashes);
+
+    // half full leaves leave room to grow, names with the same hash share a leaf
+    size_t leaf_count = 0;
+    for (size_t start = 0; start < count; leaf_count++) {
+        size_t end = start;
+        size_t size = 0;
+        while (end < count && (end == start || size + entry_size(&sorted[end]) <= STZFS_BLOCK_SIZE / 2)) {
+            size += entry_size(&sorted[end++]);
+        }
+        while (end < count && sorted[end].hash == sorted[end - 1].hash) {
+            size += entry_size(&sorted[end++]);
+        }
+
+        if (size > STZFS_BLOCK_SIZE) {
+            LOG("too many names with the same hash");
+            free(sorted);
+            free(leaf_starts);
+            return SUCCESS;
+        }
+
+        leaf_starts[leaf_count] = start;
+        start = end;
+    }
+    leaf_starts[leaf_count] = count;
+
+    // a second level of half full inner nodes if the root can't point to all leaves
+    const size_t inner_count = leaf_count > DIR_INDEX_ENTRIES ? DIV_CEIL(leaf_count, DIR_INDEX_ENTRIES / 2) : 0;
+    if (inner_count > DIR_INDEX_ENTRIES) {
+        LOG("too many names to index");
+        free(sorted);
+        free(leaf_starts);
+        return SUCCESS;
+    }
+
+    // the root stays the first block, followed by the inner nodes and the leaves
+    const int64_t first_leaf = 1 + inner_count;
+    dir_index_block root = {.levels = inner_count > 0};
+    if (inner_count == 0) {
+        for (size_t leaf = 0; leaf < leaf_count; leaf++) {
+            root.entries[leaf] = (dir_index_entry) {.hash = leaf == 0 ? 0 : sorted[leaf_starts[leaf]].hash,
+                                                    .offset = first_leaf + leaf};
+        }
+        root.count = leaf_count;
+    }
+
+    stzfs_error_t err = SUCCESS;
+    for (size_t inner = 0; inner < inner_count; inner++) {
+        dir_index_block node = {0};
+        const size_t first = inner * (DIR_INDEX_ENTRIES / 2);
+        for (size_t leaf = first; leaf < MIN(first + DIR_INDEX_ENTRIES / 2, leaf_count); leaf++) {
+            node.entries[node.count++] = (dir_index_entry) {.hash = leaf == 0 ? 0 : sorted[leaf_starts[leaf]].hash,
+                                                            .offset = first_leaf + leaf};
+        }
+
+        root.entries[root.count++] = (dir_index_entry) {.hash = node.entries[0].hash, .offset = 1 + inner};
+        err = err || put_block(inode, 1 + inner, &node);
+    }
+
+    for (size_t leaf = 0; leaf < leaf_count; leaf++) {
+        dir_block block;
+        block_init(&block);
+        for (size_t i = leaf_starts[leaf]; i < leaf_starts[leaf + 1]; i++) {
+            block_insert(&block, &sorted[i]);
+        }
+
+        err = err || put_block(inode, first_leaf + leaf, &block);
+    }
+
+    free(sorted);
+    free(leaf_starts);
+    if (err) {
+        LOG("could not write directory index");
+        return ERROR;
+    }
+
+    inode->mode |= M_INDEXED;
+    *created = true;
+    return put_block(inode, 0, &root);
+}
+
+// write a block of a directory or append it if it is the next one
+static stzfs_error_t put_block(inode_t* inode, int64_t offset, const void* block) {
+    if (offset < inode->block_count) {
+        return inode_write_data_block(inode, NULL, offset, block);
+    }
+
+    return inode_alloc_data_block(inode, block);
+}
+
+// first entry of the upper half when splitting entries sorted by hash in halves of about the same size,
+// names with the same hash stay together, 0 if all names share one hash
+static size_t split_point(const entry_t* sorted, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += entry_size(&sorted[i]);
+    }
+
+    size_t middle = 1;
+    for (size_t lower = entry_size(&sorted[0]); middle < count - 1 && lower < total / 2; middle++) {
+        lower += entry_size(&sorted[middle]);
+    }
+
+    size_t split = middle;
+    while (split < count && sorted[split].hash == sorted[split - 1].hash) {
+        split++;
+    }
+
+    if (split == count) {
+        split = middle;
+        while (split > 0 && sorted[split].hash == sorted[split - 1].hash) {
+            split--;
+        }
+    }
+
+    return split;
+}
+
+static int compare_hashes(const void* a, const void* b) {
+    const uint32_t hash_a = ((const entry_t*)a)->hash;
+    const uint32_t hash_b = ((const entry_t*)b)->hash;
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+static int compare_positions(const void* a, const void* b) {
+    const off_t position_a = ((const listed_t*)a)->position;
+    const off_t position_b = ((const listed_t*)b)->position;
+    return (position_a > position_b) - (position_a < position_b);
 }
@@ -2,13 +2,23 @@
 #define STZFS_DIRENTRY_H
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "error.h"
 #include "inode.h"
 
-stzfs_error_t direntry_alloc(inode_t* inode, const char* name, int64_t target_inodeptr);
-stzfs_error_t direntry_free(inode_t* inode, const char* name);
-stzfs_error_t direntry_write(inode_t* inode, const char* name, int64_t target_inodeptr);
-stzfs_error_t direntry_find(inode_t* inode, const char* name, int64_t* found_inodeptr);
+// called for each listed entry (type is a DIR_TYPE_*) with the position to continue behind it, non zero
+// stops the listing, positions are derived from the names and stay valid while the directory changes
+typedef int (*direntry_filler_t)(void* context, const char* name, int64_t inodeptr, uint8_t type, off_t next);
+
+// entries of the directory inode at inodeptr, names are looked up through the dentry cache
+void direntry_init(void* block, int64_t inodeptr, int64_t parent_inodeptr);
+stzfs_error_t direntry_alloc(int64_t inodeptr, inode_t* inode, const char* name, int64_t target_inodeptr,
+                             stzfs_mode_t target_mode);
+stzfs_error_t direntry_free(int64_t inodeptr, inode_t* inode, const char* name);
+stzfs_error_t direntry_write(int64_t inodeptr, inode_t* inode, const char* name, int64_t target_inodeptr,
+                             stzfs_mode_t target_mode);
+stzfs_error_t direntry_find(int64_t inodeptr, inode_t* inode, const char* name, int64_t* found_inodeptr);
+stzfs_error_t direntry_list(inode_t* inode, off_t position, direntry_filler_t filler, void* context);
 
 #endif // STZFS_DIRENTRY_H
@@ -1,26 +1,469 @@
+// mremap is a linux extension
+#define _GNU_SOURCE
+
 #include "disk.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define DISK_HAVE_URING 1
+#else
+#define DISK_HAVE_URING 0
+#endif
+
 #include "error.h"
 #include "log.h"
 #include "types.h"
 
-// use mmap instead of direct io
-#define DISK_USE_MMAP 0
-#if DISK_USE_MMAP
-#include <sys/mman.h>
-#include <string.h>
-
-static void* fp = NULL;
+// max io vectors per syscall (limits.h only exports it for xopen)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
 #endif
 
 // global vars
 static int fd = -1; // file descriptor
 static long long size = -1; // total virtual hard disk size
+static disk_backend_t backend = DISK_BACKEND_FD; // selected io backend
+static void* fp = NULL; // shared mapping of the whole disk file (mmap backend only)
+static size_t fp_size = 0; // length of the shared mapping
+static bool direct_io = false; // bypass the host page cache (O_DIRECT)
+
+// requests are submitted and waited for by each thread on its own
+static __thread stzfs_error_t submit_error = SUCCESS; // sticky error of submitted requests
+static __thread unsigned submit_pending = 0; // submitted requests that did not complete yet
+
+// growing the disk file replaces the mapping, transfers through it hold the map lock shared
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#if DISK_HAVE_URING
+// max requests in flight on the ring
+#define DISK_URING_ENTRIES 128
+
+// pause before waiting for completions again after the ring failed
+#define DISK_URING_RETRY_NS (1000 * 1000)
+
+// failed waits in a row before the requests the kernel never took are completed synchronously
+#define DISK_URING_MAX_RETRIES (16)
+
+// submission and completion queues shared with the kernel
+typedef struct disk_uring_t {
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned queued; // requests placed in the submission queue but not yet entered
+    unsigned inflight; // requests entered but not yet completed
+    disk_request_t requests[DISK_URING_ENTRIES]; // in flight requests by slot
+    stzfs_error_t* errors[DISK_URING_ENTRIES]; // submit error of the submitting thread by slot
+    unsigned* pending[DISK_URING_ENTRIES]; // pending count of the submitting thread by slot
+    unsigned free_slots[DISK_URING_ENTRIES];
+    unsigned free_slot_count;
+} disk_uring_t;
+
+static disk_uring_t uring = {.fd = -1};
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER; // guards the ring, any thread reaps completions
+
+// a single thread blocks for completions without the ring lock and reaps them for all, the others sleep on the
+// condition until it is done
+static pthread_cond_t uring_reaped = PTHREAD_COND_INITIALIZER;
+static bool uring_reaping = false;
+#endif
+
+// sum up the length of all io vectors
+static size_t disk_iov_length(const struct iovec* iov, int iovcnt) {
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+// map the whole disk file or grow an existing mapping to the current file size
+static stzfs_error_t disk_map(void) {
+    if (fp != NULL && fp_size == (size_t)size) {
+        return SUCCESS;
+    }
+
+    void* map;
+    if (fp == NULL) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        map = mremap(fp, fp_size, size, MREMAP_MAYMOVE);
+    }
+
+    if (map == MAP_FAILED) {
+        LOG("could not map disk file");
+        return ERROR;
+    }
+
+    fp = map;
+    fp_size = size;
+    return SUCCESS;
+}
+
+// pick up a disk file that was grown since it has been opened
+static bool disk_check_bounds(off_t addr, size_t length) {
+    // direct io can only transfer whole blocks
+    if (direct_io && (addr % STZFS_BLOCK_SIZE != 0 || length % STZFS_BLOCK_SIZE != 0)) {
+        LOG("unaligned disk access in direct io mode");
+        return false;
+    }
+
+    if (addr + length <= __atomic_load_n(&size, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+
+    pthread_mutex_lock(&grow_lock);
+    struct stat st;
+    if (addr + length > size && !fstat(fd, &st) && st.st_size > size) {
+        const long long old_size = size;
+        if (backend == DISK_BACKEND_MMAP) {
+            pthread_rwlock_wrlock(&map_lock);
+            __atomic_store_n(&size, st.st_size, __ATOMIC_RELEASE);
+            if (disk_map()) {
+                __atomic_store_n(&size, old_size, __ATOMIC_RELEASE);
+            }
+            pthread_rwlock_unlock(&map_lock);
+        } else {
+            __atomic_store_n(&size, st.st_size, __ATOMIC_RELEASE);
+        }
+    }
+    const bool in_bounds = addr + length <= size;
+    pthread_mutex_unlock(&grow_lock);
+
+    return in_bounds;
+}
+
+// true, if all io vectors satisfy the buffer alignment of direct io
+static bool disk_iov_aligned(const struct iovec* iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        if ((uintptr_t)iov[i].iov_base % STZFS_BLOCK_SIZE != 0 || iov[i].iov_len % STZFS_BLOCK_SIZE != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static stzfs_error_t disk_transfer(bool write, off_t addr, const struct iovec* iov, int iovcnt);
+
+// transfer unaligned io vectors through an aligned bounce buffer
+static stzfs_error_t disk_transfer_bounced(bool write, off_t addr, const struct iovec* iov, int iovcnt) {
+    const size_t length = disk_iov_length(iov, iovcnt);
+    void* buffer;
+    if (posix_memalign(&buffer, STZFS_BLOCK_SIZE, length)) {
+        LOG("could not allocate bounce buffer");
+        return ERROR;
+    }
+
+    // gather data to write
+    size_t offset = 0;
+    if (write) {
+        for (int i = 0; i < iovcnt; offset += iov[i].iov_len, i++) {
+            memcpy((int8_t*)buffer + offset, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+
+    const struct iovec aligned_iov = {.iov_base = buffer, .iov_len = length};
+    const stzfs_error_t error = disk_transfer(write, addr, &aligned_iov, 1);
+
+    // scatter read data
+    offset = 0;
+    if (!write && !error) {
+        for (int i = 0; i < iovcnt; offset += iov[i].iov_len, i++) {
+            memcpy(iov[i].iov_base, (int8_t*)buffer + offset, iov[i].iov_len);
+        }
+    }
+
+    free(buffer);
+    return error;
+}
+
+// transfer io vectors from or to the disk file at the given address
+static stzfs_error_t disk_transfer(bool write, off_t addr, const struct iovec* iov, int iovcnt) {
+    if (iovcnt <= 0) {
+        return SUCCESS;
+    }
+
+    if (backend == DISK_BACKEND_MMAP) {
+        pthread_rwlock_rdlock(&map_lock);
+        for (int i = 0; i < iovcnt; i++) {
+            if (write) {
+                memcpy((int8_t*)fp + addr, iov[i].iov_base, iov[i].iov_len);
+            } else {
+                memcpy(iov[i].iov_base, (int8_t*)fp + addr, iov[i].iov_len);
+            }
+            addr += iov[i].iov_len;
+        }
+        pthread_rwlock_unlock(&map_lock);
+
+        return SUCCESS;
+    }
+
+    if (direct_io && !disk_iov_aligned(iov, iovcnt)) {
+        return disk_transfer_bounced(write, addr, iov, iovcnt);
+    }
+
+    // positional io does not touch the shared file offset, so no seek is needed
+    struct iovec vec[iovcnt];
+    memcpy(vec, iov, sizeof(vec));
+
+    int index = 0;
+    while (index < iovcnt) {
+        const int count = iovcnt - index < IOV_MAX ? iovcnt - index : IOV_MAX;
+        const ssize_t done = write ? pwritev(fd, &vec[index], count, addr)
+                                   : preadv(fd, &vec[index], count, addr);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        } else if (done < 0) {
+            LOG("io error on disk file at %lld", (long long)addr);
+            return ERROR;
+        } else if (done == 0) {
+            LOG("unexpected end of disk file at %lld", (long long)addr);
+            return ERROR;
+        }
+
+        // skip completed vectors and resume short transfers inside a partial one
+        addr += done;
+        size_t remaining = done;
+        while (index < iovcnt && remaining >= vec[index].iov_len) {
+            remaining -= vec[index].iov_len;
+            index++;
+        }
+        if (remaining > 0) {
+            vec[index].iov_base = (char*)vec[index].iov_base + remaining;
+            vec[index].iov_len -= remaining;
+        }
+    }
+
+    return SUCCESS;
+}
+
+#if DISK_HAVE_URING
+// create the io_uring instance and map its queues
+static stzfs_error_t disk_uring_init(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring.fd = syscall(__NR_io_uring_setup, DISK_URING_ENTRIES, &params);
+    if (uring.fd < 0) {
+        uring.fd = -1;
+        return ERROR;
+    }
+
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.sq_ring_size = uring.sq_ring_size > uring.cq_ring_size ? uring.sq_ring_size : uring.cq_ring_size;
+        uring.cq_ring_size = 0;
+    }
+
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         uring.fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED) {
+        close(uring.fd);
+        uring.fd = -1;
+        return ERROR;
+    }
+
+    uring.cq_ring = uring.sq_ring;
+    if (uring.cq_ring_size > 0) {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    }
+
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uring.fd, IORING_OFF_SQES);
+
+    if (uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        if (uring.cq_ring != MAP_FAILED && uring.cq_ring_size > 0) munmap(uring.cq_ring, uring.cq_ring_size);
+        if (uring.sqes != MAP_FAILED) munmap(uring.sqes, uring.sqes_size);
+        munmap(uring.sq_ring, uring.sq_ring_size);
+        close(uring.fd);
+        uring.fd = -1;
+        return ERROR;
+    }
+
+    int8_t* sq = uring.sq_ring;
+    int8_t* cq = uring.cq_ring;
+    uring.sq_head = (unsigned*)(sq + params.sq_off.head);
+    uring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    uring.queued = 0;
+    uring.inflight = 0;
+    uring.free_slot_count = DISK_URING_ENTRIES;
+    for (unsigned slot = 0; slot < DISK_URING_ENTRIES; slot++) {
+        uring.free_slots[slot] = slot;
+    }
+
+    return SUCCESS;
+}
+
+// unmap the queues and close the io_uring instance
+static void disk_uring_dispose(void) {
+    if (uring.fd == -1) {
+        return;
+    }
+
+    munmap(uring.sqes, uring.sqes_size);
+    if (uring.cq_ring_size > 0) munmap(uring.cq_ring, uring.cq_ring_size);
+    munmap(uring.sq_ring, uring.sq_ring_size);
+    close(uring.fd);
+    uring.fd = -1;
+}
+
+// hand queued requests to the kernel without waiting for them
+static stzfs_error_t disk_uring_enter(void) {
+    while (true) {
+        const int submitted = syscall(__NR_io_uring_enter, uring.fd, uring.queued, 0, 0, NULL, 0);
+        if (submitted >= 0) {
+            uring.queued -= submitted;
+            uring.inflight += submitted;
+            return SUCCESS;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            LOG("could not enter io_uring");
+            return ERROR;
+        }
+    }
+}
+
+// complete a request of a slot, the submitting thread learns about it through its pending count
+static void disk_uring_complete(unsigned slot, bool failed) {
+    const disk_request_t* request = &uring.requests[slot];
+
+    // redo failed or short requests synchronously, they are idempotent
+    if (failed && disk_transfer(request->write, request->addr, request->iov, request->iovcnt)) {
+        *uring.errors[slot] = ERROR;
+    }
+
+    (*uring.pending[slot])--;
+    uring.free_slots[uring.free_slot_count++] = slot;
+}
+
+// take back the requests that were queued but never entered and complete them synchronously, the kernel
+// only consumes the submission queue while entering, so the tail can be moved back to its head
+static void disk_uring_unqueue(void) {
+    const unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    const unsigned tail = *uring.sq_tail;
+    __atomic_store_n(uring.sq_tail, head, __ATOMIC_RELEASE);
+
+    for (unsigned position = head; position != tail; position++) {
+        const unsigned index = uring.sq_array[position & *uring.sq_mask];
+        disk_uring_complete(uring.sqes[index].user_data, true);
+    }
+    uring.queued = 0;
+}
+
+// consume all available completions, the submitting threads learn about them through their pending counts
+static void disk_uring_reap(void) {
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+        const unsigned slot = cqe->user_data;
+        const disk_request_t* request = &uring.requests[slot];
+        const size_t length = disk_iov_length(request->iov, request->iovcnt);
+        disk_uring_complete(slot, cqe->res < 0 || (size_t)cqe->res != length);
+        uring.inflight--;
+        head++;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// wait for more completions, the caller holds the ring lock, it is dropped while blocking
+static stzfs_error_t disk_uring_wait(void) {
+    stzfs_error_t error = uring.queued > 0 && disk_uring_enter();
+    if (uring_reaping) {
+        pthread_cond_wait(&uring_reaped, &uring_lock);
+        return error;
+    } else if (uring.inflight == 0) {
+        // nothing could complete, the queued requests were not entered
+        return ERROR;
+    }
+
+    uring_reaping = true;
+    pthread_mutex_unlock(&uring_lock);
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    pthread_mutex_lock(&uring_lock);
+    uring_reaping = false;
+
+    if (result < 0) {
+        LOG("could not wait for io_uring completions");
+        error = ERROR;
+    }
+    disk_uring_reap();
+    pthread_cond_broadcast(&uring_reaped);
+
+    return error;
+}
+
+// place a request into the submission queue
+static stzfs_error_t disk_uring_queue(const disk_request_t* request) {
+    // wait for a free slot if the ring is full
+    while (uring.free_slot_count == 0) {
+        if (disk_uring_wait()) return ERROR;
+    }
+
+    const unsigned slot = uring.free_slots[--uring.free_slot_count];
+    uring.requests[slot] = *request;
+    uring.errors[slot] = &submit_error;
+    uring.pending[slot] = &submit_pending;
+    submit_pending++;
+
+    const unsigned tail = *uring.sq_tail;
+    const unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe* sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = request->addr;
+    sqe->addr = (uint64_t)(uintptr_t)request->iov;
+    sqe->len = request->iovcnt;
+    sqe->user_data = slot;
+
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.queued++;
+
+    return SUCCESS;
+}
+#endif
 
 // create new disk file with given size
 // TODO: this method is not really needed
@@ -28,25 +471,45 @@ stzfs_error_t disk_create_file(const char* path, off_t size) {
     const int oflag = O_CREAT | O_WRONLY;
     const mode_t mode = S_IRUSR | S_IWUSR;
 
-    fd = open(path, oflag, mode);
-    if (fd == -1) {
+    const int file = open(path, oflag, mode);
+    if (file == -1) {
         LOG("error while trying to create disk file");
         return ERROR;
     }
 
-    ftruncate(fd, size);
-    close(fd);
+    ftruncate(file, size);
+    close(file);
     return SUCCESS;
 }
 
+// select the io backend (has to be called before opening the disk file)
+void disk_set_backend(disk_backend_t new_backend) {
+    backend = new_backend;
+}
+
+// get the selected io backend
+disk_backend_t disk_get_backend(void) {
+    return backend;
+}
+
+// bypass the host page cache (has to be called before opening the disk file)
+void disk_set_direct_io(bool enabled) {
+    direct_io = enabled;
+}
+
 // open disk file
 stzfs_error_t disk_set_file(const char* path) {
     if (fd != -1) {
         LOG("closing previos vm file")
-        close(fd);
+        disk_close();
     }
 
-    const int oflag = O_RDWR;
+    if (direct_io && backend == DISK_BACKEND_MMAP) {
+        LOG("direct io can not be combined with a mapped disk");
+        return ERROR;
+    }
+
+    const int oflag = O_RDWR | (direct_io ? O_DIRECT : 0);
     fd = open(path, oflag);
     if (fd == -1) {
         LOG("error while trying to open disk file");
@@ -57,63 +520,237 @@ stzfs_error_t disk_set_file(const char* path) {
     fstat(fd, &st);
     size = st.st_size;
 
-#if DISK_USE_MMAP
-    fp = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (backend == DISK_BACKEND_MMAP && disk_map()) {
+        disk_close();
+        return ERROR;
+    }
+
+    if (backend == DISK_BACKEND_URING) {
+#if DISK_HAVE_URING
+        if (disk_uring_init()) {
 #endif
+            LOG("io_uring is not available, falling back to synchronous io");
+            backend = DISK_BACKEND_FD;
+#if DISK_HAVE_URING
+        }
+#endif
+    }
 
     return SUCCESS;
 }
 
 // write to disk file
 stzfs_error_t disk_write(off_t addr, const void* buffer, size_t length) {
-#if DISK_USE_MMAP
-    if (fp == NULL) {
-#else
+    const struct iovec iov = {.iov_base = (void*)buffer, .iov_len = length};
+    return disk_writev(addr, &iov, 1);
+}
+
+// read from disk file
+stzfs_error_t disk_read(off_t addr, void* buffer, size_t length) {
+    const struct iovec iov = {.iov_base = buffer, .iov_len = length};
+    return disk_readv(addr, &iov, 1);
+}
+
+// write io vectors to a contiguous range of the disk file
+stzfs_error_t disk_writev(off_t addr, const struct iovec* iov, int iovcnt) {
     if (fd == -1) {
-#endif
         LOG("disk file not open");
         return ERROR;
     }
 
-    if (addr + length > size) {
+    if (!disk_check_bounds(addr, disk_iov_length(iov, iovcnt))) {
         LOG("out of bounds while trying to write to disk file");
         return ERROR;
     }
 
-#if DISK_USE_MMAP
-    memcpy(fp + addr, buffer, length);
-#else
-    // seek and write to disk file
-    lseek(fd, addr, SEEK_SET);
-    write(fd, buffer, length);
+    return disk_transfer(true, addr, iov, iovcnt);
+}
+
+// read a contiguous range of the disk file into io vectors
+stzfs_error_t disk_readv(off_t addr, const struct iovec* iov, int iovcnt) {
+    if (fd == -1) {
+        LOG("disk file not open");
+        return ERROR;
+    }
+
+    if (!disk_check_bounds(addr, disk_iov_length(iov, iovcnt))) {
+        LOG("out of bounds while trying to read from disk file");
+        return ERROR;
+    }
+
+    return disk_transfer(false, addr, iov, iovcnt);
+}
+
+// submit requests that may complete asynchronously (buffers must live until disk_wait)
+stzfs_error_t disk_submit(const disk_request_t* requests, size_t count) {
+    if (fd == -1) {
+        LOG("disk file not open");
+        return ERROR;
+    }
+
+#if DISK_HAVE_URING
+    if (backend == DISK_BACKEND_URING) {
+        pthread_mutex_lock(&uring_lock);
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        const disk_request_t* request = &requests[i];
+        if (!disk_check_bounds(request->addr, disk_iov_length(request->iov, request->iovcnt))) {
+            LOG("out of bounds while trying to submit disk request");
+            submit_error = ERROR;
+            continue;
+        }
+
+#if DISK_HAVE_URING
+        if (backend == DISK_BACKEND_URING && (!direct_io || disk_iov_aligned(request->iov, request->iovcnt))) {
+            if (disk_uring_queue(request)) submit_error = ERROR;
+            continue;
+        }
+#endif
+
+        // synchronous backends complete requests right away
+        if (disk_transfer(request->write, request->addr, request->iov, request->iovcnt)) {
+            submit_error = ERROR;
+        }
+    }
+
+#if DISK_HAVE_URING
+    // start the queued batch without waiting for it
+    if (backend == DISK_BACKEND_URING) {
+        if (uring.queued > 0 && disk_uring_enter()) {
+            submit_error = ERROR;
+        }
+        pthread_mutex_unlock(&uring_lock);
+    }
+#endif
+
+    return submit_error;
+}
+
+// wait until all requests this thread submitted completed, fails if any of them failed
+stzfs_error_t disk_wait(void) {
+#if DISK_HAVE_URING
+    // any thread may reap our completions, the requests point to buffers of the caller, so they have to
+    // complete before returning even if the ring failed
+    if (backend == DISK_BACKEND_URING) {
+        const struct timespec delay = {.tv_sec = 0, .tv_nsec = DISK_URING_RETRY_NS};
+        unsigned failures = 0;
+        pthread_mutex_lock(&uring_lock);
+        while (submit_pending > 0) {
+            if (!disk_uring_wait()) {
+                failures = 0;
+            } else if (++failures >= DISK_URING_MAX_RETRIES) {
+                // the ring keeps failing, requests it never took would stay pending forever
+                LOG("io_uring keeps failing, completing queued requests synchronously");
+                submit_error = ERROR;
+                disk_uring_unqueue();
+                failures = 0;
+            } else {
+                submit_error = ERROR;
+                pthread_mutex_unlock(&uring_lock);
+                nanosleep(&delay, NULL);
+                pthread_mutex_lock(&uring_lock);
+            }
+        }
+        pthread_mutex_unlock(&uring_lock);
+    }
+#endif
+
+    const stzfs_error_t error = submit_error;
+    submit_error = SUCCESS;
+    return error;
+}
+
+// hint the expected access pattern of a disk range to the kernel
+stzfs_error_t disk_advise(off_t addr, size_t length, disk_advice_t advice) {
+    if (fd == -1 || length == 0 || !disk_check_bounds(addr, length)) {
+        return ERROR;
+    }
+
+    if (direct_io) {
+        // there is no host page cache to steer
+        return SUCCESS;
+    } else if (backend != DISK_BACKEND_MMAP) {
+        // sequential and random hints are file wide for descriptors, only prefetch ranges
+        if (advice == DISK_ADVICE_WILLNEED) {
+            return posix_fadvise(fd, addr, length, POSIX_FADV_WILLNEED) != 0;
+        }
+        return SUCCESS;
+    }
+
+    // madvise needs page aligned ranges
+    const off_t page_size = sysconf(_SC_PAGESIZE);
+    const off_t start = addr - addr % page_size;
+    length += addr - start;
+
+    int flag;
+    switch (advice) {
+        case DISK_ADVICE_SEQUENTIAL: flag = MADV_SEQUENTIAL; break;
+        case DISK_ADVICE_RANDOM:     flag = MADV_RANDOM;     break;
+        case DISK_ADVICE_WILLNEED:   flag = MADV_WILLNEED;   break;
+#ifdef MADV_HUGEPAGE
+        case DISK_ADVICE_HUGEPAGE:   flag = MADV_HUGEPAGE;   break;
 #endif
+        default:                     flag = MADV_NORMAL;     break;
+    }
 
+    // hints are best effort, eg. huge pages are not supported by every filesystem
+    pthread_rwlock_rdlock(&map_lock);
+    madvise((int8_t*)fp + start, length, flag);
+    pthread_rwlock_unlock(&map_lock);
     return SUCCESS;
 }
 
-// read from disk file
-stzfs_error_t disk_read(off_t addr, void* buffer, size_t length) {
-#if DISK_USE_MMAP
-    if (fp == NULL) {
-#else
+// flush all written data to stable storage
+stzfs_error_t disk_sync(void) {
     if (fd == -1) {
-#endif
         LOG("disk file not open");
         return ERROR;
     }
 
-    if (addr + length > size) {
-        LOG("out of bounds while trying to read from disk file");
+    pthread_rwlock_rdlock(&map_lock);
+    const bool map_error = backend == DISK_BACKEND_MMAP && msync(fp, fp_size, MS_SYNC);
+    pthread_rwlock_unlock(&map_lock);
+    if (map_error) {
+        LOG("could not sync disk file mapping");
         return ERROR;
     }
 
-#if DISK_USE_MMAP
-    memcpy(buffer, fp + addr, length);
-#else
-    // seek and read from disk file
-    lseek(fd, addr, SEEK_SET);
-    read(fd, buffer, length);
-#endif
+    if (fdatasync(fd)) {
+        LOG("could not sync disk file");
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+// flush a written range to stable storage without waiting for the rest of the disk file like disk_sync
+stzfs_error_t disk_sync_range(off_t addr, size_t length) {
+    if (fd == -1 || length == 0 || !disk_check_bounds(addr, length)) {
+        LOG("illegal range to sync");
+        return ERROR;
+    }
+
+    if (backend == DISK_BACKEND_MMAP) {
+        // msync needs page aligned ranges
+        const off_t page_size = sysconf(_SC_PAGESIZE);
+        const off_t start = addr - addr % page_size;
+        pthread_rwlock_rdlock(&map_lock);
+        const bool map_error = msync((int8_t*)fp + start, length + (addr - start), MS_SYNC) != 0;
+        pthread_rwlock_unlock(&map_lock);
+        if (map_error) {
+            LOG("could not sync disk file mapping range");
+            return ERROR;
+        }
+        return SUCCESS;
+    }
+
+    if (sync_file_range(fd, addr, length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)) {
+        LOG("could not sync disk file range");
+        return ERROR;
+    }
 
     return SUCCESS;
 }
@@ -130,8 +767,15 @@ int disk_get_fd(void) {
 
 // close disk file
 void disk_close(void) {
-#if DISK_USE_MMAP
-    munmap(fp, size);
+#if DISK_HAVE_URING
+    disk_wait();
+    disk_uring_dispose();
 #endif
+    if (fp != NULL) {
+        munmap(fp, fp_size);
+        fp = NULL;
+        fp_size = 0;
+    }
     close(fd);
+    fd = -1;
 }
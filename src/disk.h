@@ -1,16 +1,52 @@
 #ifndef STZFS_DISK_H
 #define STZFS_DISK_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "error.h"
 
+// io backend used to access the disk file
+typedef enum disk_backend_t {
+    DISK_BACKEND_FD,   // positional io on the file descriptor
+    DISK_BACKEND_MMAP, // shared mapping of the whole disk file
+    DISK_BACKEND_URING, // batched asynchronous io through io_uring
+} disk_backend_t;
+
+// access pattern hints for disk ranges
+typedef enum disk_advice_t {
+    DISK_ADVICE_NORMAL,
+    DISK_ADVICE_SEQUENTIAL,
+    DISK_ADVICE_RANDOM,
+    DISK_ADVICE_WILLNEED,
+    DISK_ADVICE_HUGEPAGE,
+} disk_advice_t;
+
+// read or write request for a contiguous disk range
+typedef struct disk_request_t {
+    bool write;
+    off_t addr;
+    const struct iovec* iov;
+    int iovcnt;
+} disk_request_t;
+
+void disk_set_backend(disk_backend_t backend);
+disk_backend_t disk_get_backend(void);
+void disk_set_direct_io(bool enabled);
 stzfs_error_t disk_create_file(const char* path, off_t size);
 stzfs_error_t disk_set_file(const char* path);
 stzfs_error_t disk_write(off_t addr, const void* buffer, size_t length);
 stzfs_error_t disk_read(off_t addr, void* buffer, size_t length);
+stzfs_error_t disk_writev(off_t addr, const struct iovec* iov, int iovcnt);
+stzfs_error_t disk_readv(off_t addr, const struct iovec* iov, int iovcnt);
+stzfs_error_t disk_submit(const disk_request_t* requests, size_t count);
+stzfs_error_t disk_wait(void);
+stzfs_error_t disk_advise(off_t addr, size_t length, disk_advice_t advice);
+stzfs_error_t disk_sync(void);
+stzfs_error_t disk_sync_range(off_t addr, size_t length);
 void disk_close(void);
 off_t disk_get_size(void);
 int disk_get_fd(void);
@@ -0,0 +1,548 @@
+#include "extent.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "block.h"
+#include "blocks.h"
+#include "error.h"
+#include "helpers.h"
+#include "inode.h"
+#include "log.h"
+#include "types.h"
+
+// blocks handed to block_free at once when unmapping a run
+#define EXTENT_FREE_BATCH (256)
+
+// blocks zeroed with one write when an unwritten extent cannot be split
+#define EXTENT_ZERO_BATCH (64)
+
+// node on the path from the root to a leaf
+typedef struct extent_node {
+    extent_block block; // unused for the root inside the inode
+    int64_t blockptr;   // NULL_BLOCKPTR for the root
+    int64_t index;      // followed entry, -1 if the target lies before the first entry
+} extent_node;
+
+// path from the root at level 0 down to a leaf
+typedef struct extent_path {
+    extent_node nodes[EXTENT_MAX_DEPTH + 1];
+    size_t depth;
+    int64_t spares[EXTENT_MAX_DEPTH + 1]; // allocated up front for the nodes an insert creates
+    size_t spare_count;
+} extent_path;
+
+static extent_header_t* node_header(inode_t* inode, extent_node* node) {
+    return node->blockptr == NULL_BLOCKPTR ? &inode->extents.header : &node->block.header;
+}
+
+static extent_t* node_entries(inode_t* inode, extent_node* node) {
+    return node->blockptr == NULL_BLOCKPTR ? inode->extents.entries : node->block.entries;
+}
+
+static size_t node_capacity(const extent_node* node) {
+    return node->blockptr == NULL_BLOCKPTR ? EXTENT_ROOT_ENTRIES : EXTENT_BLOCK_ENTRIES;
+}
+
+// write back a node, the root is written together with its inode
+static stzfs_error_t write_node(const extent_node* node) {
+    if (node->blockptr == NULL_BLOCKPTR) {
+        return SUCCESS;
+    }
+
+    return block_write(node->blockptr, &node->block);
+}
+
+// find the last entry that starts at or before the given logical block
+static int64_t search_node(const extent_t* entries, size_t count, int64_t logical) {
+    int64_t low = 0;
+    int64_t high = (int64_t)count - 1;
+    int64_t found = -1;
+    while (low <= high) {
+        const int64_t mid = (low + high) / 2;
+        if (entries[mid].logical <= logical) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+// check whether b continues a both logically and physically
+static bool is_adjacent(const extent_t* a, const extent_t* b) {
+    return a->logical + a->length == b->logical && a->physical + a->length == b->physical &&
+           a->flags == b->flags && (uint32_t)a->length + b->length <= EXTENT_MAX_LENGTH;
+}
+
+// walk from the root down to the leaf that maps the given logical block
+static stzfs_error_t load_path(inode_t* inode, int64_t logical, extent_path* path) {
+    path->spare_count = 0;
+    path->depth = inode->extents.header.depth;
+    if (path->depth > EXTENT_MAX_DEPTH) {
+        LOG("extent tree is too deep");
+        return ERROR;
+    }
+
+    for (size_t level = 0; level <= path->depth; level++) {
+        extent_node* node = &path->nodes[level];
+        if (level == 0) {
+            node->blockptr = NULL_BLOCKPTR;
+        } else {
+            extent_node* parent = &path->nodes[level - 1];
+            node->blockptr = node_entries(inode, parent)[MAX(parent->index, 0)].physical;
+            if (block_read(node->blockptr, &node->block)) {
+                LOG("could not read extent node");
+                return ERROR;
+            } else if (node->block.header.depth != path->depth - level) {
+                LOG("extent node has unexpected depth");
+                return ERROR;
+            }
+        }
+
+        const extent_header_t* header = node_header(inode, node);
+        if (level < path->depth && header->entries == 0) {
+            LOG("extent index node is empty");
+            return ERROR;
+        }
+        node->index = search_node(node_entries(inode, node), header->entries, logical);
+    }
+
+    return SUCCESS;
+}
+
+// first logical block of the subtree right of the path, INT64_MAX if there is none
+static int64_t next_key(inode_t* inode, extent_path* path) {
+    for (int64_t level = (int64_t)path->depth - 1; level >= 0; level--) {
+        extent_node* node = &path->nodes[level];
+        const int64_t index = MAX(node->index, 0) + 1;
+        if (index < node_header(inode, node)->entries) {
+            return node_entries(inode, node)[index].logical;
+        }
+    }
+
+    return INT64_MAX;
+}
+
+// free a run of consecutive physical blocks
+static stzfs_error_t free_run(int64_t physical, int64_t length) {
+    int64_t blockptr_arr[EXTENT_FREE_BATCH];
+    while (length > 0) {
+        const size_t batch = MIN(length, EXTENT_FREE_BATCH);
+        for (size_t i = 0; i < batch; i++) {
+            blockptr_arr[i] = physical + i;
+        }
+        if (block_free(blockptr_arr, batch)) return ERROR;
+
+        physical += batch;
+        length -= batch;
+    }
+
+    return SUCCESS;
+}
+
+// overwrite a run of consecutive physical blocks with zeroes
+static stzfs_error_t zero_run(int64_t physical, int64_t length) {
+    if (length <= 0) {
+        return SUCCESS;
+    }
+
+    void* zeroes = block_buffer_alloc(EXTENT_ZERO_BATCH);
+    if (zeroes == NULL) {
+        return ERROR;
+    }
+    memset(zeroes, 0, EXTENT_ZERO_BATCH * STZFS_BLOCK_SIZE);
+
+    int64_t blockptr_arr[EXTENT_ZERO_BATCH];
+    stzfs_error_t error = SUCCESS;
+    while (length > 0 && !error) {
+        const size_t batch = MIN(length, EXTENT_ZERO_BATCH);
+        for (size_t i = 0; i < batch; i++) {
+            blockptr_arr[i] = physical + i;
+        }
+        error = block_writeall(blockptr_arr, zeroes, batch);
+
+        physical += batch;
+        length -= batch;
+    }
+
+    block_buffer_free(zeroes);
+    return error;
+}
+
+// change the length and flags of the extent starting at logical in place, this never allocates
+static stzfs_error_t update_extent(inode_t* inode, int64_t logical, int64_t length, uint16_t flags) {
+    extent_path path;
+    if (load_path(inode, logical, &path)) return ERROR;
+
+    extent_node* leaf = &path.nodes[path.depth];
+    extent_t* entries = node_entries(inode, leaf);
+    if (leaf->index < 0 || entries[leaf->index].logical != logical) {
+        LOG("no extent starts at the given logical block");
+        return ERROR;
+    }
+
+    entries[leaf->index].length = length;
+    entries[leaf->index].flags = flags;
+    return write_node(leaf);
+}
+
+// release the spare nodes an insert did not use
+static void free_spares(extent_path* path) {
+    if (path->spare_count > 0 && block_free(path->spares, path->spare_count)) {
+        LOG("could not free spare extent nodes");
+    }
+    path->spare_count = 0;
+}
+
+// allocate the nodes an insert into the leaf of a path creates before anything is changed, the insert
+// then cannot run out of space halfway and leave entries unlinked
+static stzfs_error_t alloc_spares(inode_t* inode, extent_path* path) {
+    // every full node on the way up is split, a full root moves into a new node
+    size_t needed = 0;
+    for (int64_t level = (int64_t)path->depth; level >= 0; level--) {
+        extent_node* node = &path->nodes[level];
+        if (node_header(inode, node)->entries < node_capacity(node)) {
+            break;
+        } else if (level == 0 && path->depth == EXTENT_MAX_DEPTH) {
+            LOG("extent tree is full");
+            return ERROR;
+        }
+        needed++;
+    }
+
+    for (path->spare_count = 0; path->spare_count < needed; path->spare_count++) {
+        if (block_allocptr(&path->spares[path->spare_count])) {
+            LOG("could not allocate extent node");
+            free_spares(path);
+            return ERROR;
+        }
+    }
+
+    return SUCCESS;
+}
+
+// write a new tree node to one of the spares of the path
+static stzfs_error_t alloc_node(extent_path* path, extent_node* node) {
+    if (path->spare_count == 0) {
+        LOG("no spare extent node left");
+        return ERROR;
+    }
+
+    node->blockptr = path->spares[--path->spare_count];
+    return write_node(node);
+}
+
+// insert an entry into a node of the path, full nodes are split on the way up
+static stzfs_error_t insert_entry(inode_t* inode, extent_path* path, size_t level, size_t position,
+                                  const extent_t* entry) {
+    extent_node* node = &path->nodes[level];
+    extent_header_t* header = node_header(inode, node);
+    extent_t* entries = node_entries(inode, node);
+
+    if (header->entries < node_capacity(node)) {
+        memmove(&entries[position + 1], &entries[position], (header->entries - position) * sizeof(extent_t));
+        entries[position] = *entry;
+        header->entries++;
+        return write_node(node);
+    }
+
+    // a full root moves into a new node and keeps a single index entry to it
+    if (level == 0) {
+        if (header->depth == EXTENT_MAX_DEPTH) {
+            LOG("extent tree is full");
+            return ERROR;
+        }
+
+        extent_node child;
+        memset(&child.block, 0, STZFS_BLOCK_SIZE);
+        child.block.header = *header;
+        memcpy(child.block.entries, entries, header->entries * sizeof(extent_t));
+
+        memmove(&child.block.entries[position + 1], &child.block.entries[position],
+                (header->entries - position) * sizeof(extent_t));
+        child.block.entries[position] = *entry;
+        child.block.header.entries++;
+        if (alloc_node(path, &child)) return ERROR;
+
+        header->depth++;
+        header->entries = 1;
+        entries[0] = (extent_t) {.logical = child.block.entries[0].logical, .physical = child.blockptr};
+        return SUCCESS;
+    }
+
+    // split the node in halves and put the entry into the matching one
+    const size_t half = header->entries / 2;
+    extent_node right;
+    memset(&right.block, 0, STZFS_BLOCK_SIZE);
+    right.block.header = (extent_header_t) {.entries = header->entries - half, .depth = header->depth};
+    memcpy(right.block.entries, &entries[half], right.block.header.entries * sizeof(extent_t));
+    header->entries = half;
+
+    extent_header_t* target_header = header;
+    extent_t* target_entries = entries;
+    if (position > half) {
+        target_header = &right.block.header;
+        target_entries = right.block.entries;
+        position -= half;
+    }
+    memmove(&target_entries[position + 1], &target_entries[position],
+            (target_header->entries - position) * sizeof(extent_t));
+    target_entries[position] = *entry;
+    target_header->entries++;
+
+    if (alloc_node(path, &right) || write_node(node)) return ERROR;
+
+    // link the new node into the parent right after the split one
+    const extent_t index = {.logical = right.block.entries[0].logical, .physical = right.blockptr};
+    return insert_entry(inode, path, level - 1, MAX(path->nodes[level - 1].index, 0) + 1, &index);
+}
+
+// free an empty node and drop its entry from the parent
+static stzfs_error_t remove_node(inode_t* inode, extent_path* path, size_t level) {
+    extent_node* node = &path->nodes[level];
+    if (block_free(&node->blockptr, 1)) return ERROR;
+
+    extent_node* parent = &path->nodes[level - 1];
+    extent_header_t* header = node_header(inode, parent);
+    extent_t* entries = node_entries(inode, parent);
+    const int64_t index = MAX(parent->index, 0);
+    memmove(&entries[index], &entries[index + 1], (header->entries - index - 1) * sizeof(extent_t));
+    header->entries--;
+
+    if (header->entries == 0) {
+        if (level - 1 > 0) {
+            return remove_node(inode, path, level - 1);
+        }
+
+        // the emptied root is a leaf again
+        header->depth = 0;
+    }
+
+    return write_node(parent);
+}
+
+// pull the only child of the root back into the inode while it fits
+static stzfs_error_t collapse_root(inode_t* inode) {
+    extent_root_t* root = &inode->extents;
+    while (root->header.depth > 0 && root->header.entries == 1) {
+        int64_t blockptr = root->entries[0].physical;
+        extent_block block;
+        if (block_read(blockptr, &block)) return ERROR;
+        if (block.header.entries > EXTENT_ROOT_ENTRIES) break;
+
+        root->header = block.header;
+        memcpy(root->entries, block.entries, block.header.entries * sizeof(extent_t));
+        if (block_free(&blockptr, 1)) return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+// start an empty extent tree in the block pointer area of an inode
+void extent_init(inode_t* inode) {
+    memset(&inode->extents, 0, sizeof(extent_root_t));
+}
+
+// find the extent mapping a logical block, holes are reported with a null physical blockptr and
+// a length that reaches up to the next mapped block
+stzfs_error_t extent_find(inode_t* inode, int64_t logical, extent_t* extent_out) {
+    extent_path path;
+    if (load_path(inode, logical, &path)) return ERROR;
+
+    extent_node* leaf = &path.nodes[path.depth];
+    const extent_t* entries = node_entries(inode, leaf);
+    const int64_t count = node_header(inode, leaf)->entries;
+    const int64_t index = leaf->index;
+    if (index >= 0 && logical < entries[index].logical + entries[index].length) {
+        *extent_out = entries[index];
+        return SUCCESS;
+    }
+
+    const int64_t next = index + 1 < count ? entries[index + 1].logical : next_key(inode, &path);
+    *extent_out = (extent_t) {
+        .logical = logical,
+        .physical = NULL_BLOCKPTR,
+        .length = MIN(next - logical, EXTENT_MAX_LENGTH),
+    };
+    return SUCCESS;
+}
+
+// map a run of logical blocks that is not mapped yet, adjacent extents are merged
+stzfs_error_t extent_insert(inode_t* inode, const extent_t* extent) {
+    if (extent->length == 0) {
+        return SUCCESS;
+    }
+
+    extent_path path;
+    if (load_path(inode, extent->logical, &path)) return ERROR;
+
+    extent_node* leaf = &path.nodes[path.depth];
+    extent_header_t* header = node_header(inode, leaf);
+    extent_t* entries = node_entries(inode, leaf);
+    const int64_t left = leaf->index;
+    const int64_t right = left + 1;
+
+    if ((left >= 0 && entries[left].logical + entries[left].length > extent->logical) ||
+        (right < header->entries && extent->logical + extent->length > entries[right].logical)) {
+        LOG("logical blocks are already mapped");
+        return ERROR;
+    }
+
+    // grow the left neighbour and close the gap to the right one if possible
+    if (left >= 0 && is_adjacent(&entries[left], extent)) {
+        entries[left].length += extent->length;
+        if (right < header->entries && is_adjacent(&entries[left], &entries[right])) {
+            entries[left].length += entries[right].length;
+            memmove(&entries[right], &entries[right + 1], (header->entries - right - 1) * sizeof(extent_t));
+            header->entries--;
+        }
+        return write_node(leaf);
+    }
+
+    // grow the right neighbour downwards
+    if (right < header->entries && is_adjacent(extent, &entries[right])) {
+        entries[right].logical = extent->logical;
+        entries[right].physical = extent->physical;
+        entries[right].length += extent->length;
+        return write_node(leaf);
+    }
+
+    if (alloc_spares(inode, &path)) return ERROR;
+    const stzfs_error_t error = insert_entry(inode, &path, path.depth, right, extent);
+    free_spares(&path);
+    return error;
+}
+
+// unmap the logical blocks in [start, end) and free their physical blocks if release is set
+static stzfs_error_t unmap_range(inode_t* inode, int64_t start, int64_t end, bool release) {
+    while (start < end) {
+        extent_path path;
+        if (load_path(inode, start, &path)) return ERROR;
+
+        extent_node* leaf = &path.nodes[path.depth];
+        extent_header_t* header = node_header(inode, leaf);
+        extent_t* entries = node_entries(inode, leaf);
+        const int64_t next = next_key(inode, &path);
+
+        // first extent reaching into the range
+        int64_t i = leaf->index;
+        if (i < 0 || entries[i].logical + entries[i].length <= start) {
+            i++;
+        }
+
+        while (i < header->entries && entries[i].logical < end) {
+            extent_t* extent = &entries[i];
+            const int64_t extent_end = extent->logical + extent->length;
+            const int64_t from = MAX(start, extent->logical);
+            const int64_t to = MIN(end, extent_end);
+            if (release && free_run(extent->physical + (from - extent->logical), to - from)) return ERROR;
+
+            if (from > extent->logical && to < extent_end) {
+                // the range lies inside of a single extent, its tail becomes a new extent
+                const extent_t tail = {
+                    .logical = to,
+                    .physical = extent->physical + (to - extent->logical),
+                    .length = extent_end - to,
+                    .flags = extent->flags,
+                };
+                extent->length = from - extent->logical;
+                if (write_node(leaf)) return ERROR;
+                return extent_insert(inode, &tail);
+            } else if (from > extent->logical) {
+                extent->length = from - extent->logical;
+                i++;
+            } else if (to < extent_end) {
+                extent->physical += to - extent->logical;
+                extent->length = extent_end - to;
+                extent->logical = to;
+                i++;
+            } else {
+                memmove(extent, extent + 1, (header->entries - i - 1) * sizeof(extent_t));
+                header->entries--;
+            }
+        }
+
+        const bool leaf_done = i >= header->entries;
+        if (header->entries == 0 && path.depth > 0) {
+            if (remove_node(inode, &path, path.depth)) return ERROR;
+        } else if (write_node(leaf)) {
+            return ERROR;
+        }
+
+        // continue in the next leaf if the range reaches into it
+        if (!leaf_done || next >= end) {
+            break;
+        }
+        start = next;
+    }
+
+    return collapse_root(inode);
+}
+
+// unmap the logical blocks in [start, end) and free their physical blocks
+stzfs_error_t extent_remove(inode_t* inode, int64_t start, int64_t end) {
+    return unmap_range(inode, start, end, true);
+}
+
+// turn the unwritten blocks in [start, end) into written ones, an extent is split into an unwritten head,
+// the written range and an unwritten tail, if there is no space for the split the rest of the extent is
+// zeroed and the whole extent marked written instead, writing preallocated blocks never fails for lack of space
+stzfs_error_t extent_mark_written(inode_t* inode, int64_t start, int64_t end) {
+    while (start < end) {
+        extent_t extent;
+        if (extent_find(inode, start, &extent)) return ERROR;
+
+        const int64_t extent_end = extent.logical + extent.length;
+        const int64_t to = MIN(end, extent_end);
+        if (extent.physical == NULL_BLOCKPTR || !(extent.flags & EXTENT_UNWRITTEN)) {
+            start = to;
+            continue;
+        }
+
+        const uint16_t written = extent.flags & ~EXTENT_UNWRITTEN;
+        const extent_t middle = {
+            .logical = start,
+            .physical = extent.physical + (start - extent.logical),
+            .length = to - start,
+            .flags = written,
+        };
+
+        // the extent keeps its head or becomes the written range, only the new entries may need a node
+        if (start > extent.logical) {
+            if (update_extent(inode, extent.logical, start - extent.logical, extent.flags)) return ERROR;
+            if (extent_insert(inode, &middle)) {
+                if (update_extent(inode, extent.logical, extent.length, extent.flags) ||
+                    zero_run(extent.physical, start - extent.logical) ||
+                    zero_run(middle.physical + middle.length, extent_end - to) ||
+                    update_extent(inode, extent.logical, extent.length, written)) {
+                    return ERROR;
+                }
+                start = extent_end;
+                continue;
+            }
+        } else if (update_extent(inode, start, to - start, written)) {
+            return ERROR;
+        }
+
+        if (to < extent_end) {
+            const extent_t tail = {
+                .logical = to,
+                .physical = middle.physical + middle.length,
+                .length = extent_end - to,
+                .flags = extent.flags,
+            };
+            if (extent_insert(inode, &tail) &&
+                (zero_run(tail.physical, tail.length) || update_extent(inode, start, extent_end - start, written))) {
+                return ERROR;
+            }
+        }
+        start = to;
+    }
+
+    return SUCCESS;
+}
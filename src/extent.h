@@ -0,0 +1,51 @@
+#ifndef STZFS_EXTENT_H
+#define STZFS_EXTENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "types.h"
+
+// longest run a single extent can map
+#define EXTENT_MAX_LENGTH (UINT16_MAX)
+
+// deepest extent tree below the root in the inode
+#define EXTENT_MAX_DEPTH (4)
+
+// extent flags
+#define EXTENT_UNWRITTEN (1 << 0) // preallocated blocks that read as zeroes until they are written
+
+// 12 bytes, maps length logical blocks to consecutive physical blocks
+// index nodes store the child node in physical and leave length unused
+typedef struct extent_t {
+    blockptr_t logical;
+    blockptr_t physical;
+    uint16_t length;
+    uint16_t flags;
+} extent_t;
+
+// 4 bytes
+typedef struct extent_header_t {
+    uint16_t entries;
+    uint16_t depth; // 0 if the entries are extents, index entries otherwise
+} extent_header_t;
+
+#define EXTENT_ROOT_ENTRIES (4)
+
+// 52 bytes, fits into the block pointer area of an inode
+typedef struct extent_root_t {
+    extent_header_t header;
+    extent_t entries[EXTENT_ROOT_ENTRIES];
+} extent_root_t;
+
+// inode_t is only declared here as inode.h embeds the extent root
+struct inode_t;
+
+void extent_init(struct inode_t* inode);
+stzfs_error_t extent_find(struct inode_t* inode, int64_t logical, extent_t* extent_out);
+stzfs_error_t extent_insert(struct inode_t* inode, const extent_t* extent);
+stzfs_error_t extent_remove(struct inode_t* inode, int64_t start, int64_t end);
+stzfs_error_t extent_mark_written(struct inode_t* inode, int64_t start, int64_t end);
+
+#endif // STZFS_EXTENT_H
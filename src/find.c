@@ -20,9 +20,10 @@ int find_file_inode(const char* file_path, int64_t* inodeptr, inode_t* inode,
                     int64_t* parent_inodeptr, inode_t* parent_inode, char* last_name) {
     const super_block* sb = super_block_cache;
 
-    // start at root inode
+    // start at root inode, no inode is locked on the way, so open files are read from the inode table, the
+    // caller re-reads the last one once it is locked
     *inodeptr = 1;
-    inode_read(*inodeptr, inode);
+    inode_read_table(*inodeptr, inode);
 
     if (strcmp(file_path, "/") == 0 ) {
         if (parent_inodeptr) *parent_inodeptr = 0;
@@ -34,7 +35,8 @@ int find_file_inode(const char* file_path, int64_t* inodeptr, inode_t* inode,
     bool not_existing = false;
     char full_name[2048];
     strcpy(full_name, file_path);
-    char* name = strtok(full_name, "/");
+    char* save;
+    char* name = strtok_r(full_name, "/", &save);
     do {
         // printf("Searching for %s\n", name);
 
@@ -53,18 +55,18 @@ int find_file_inode(const char* file_path, int64_t* inodeptr, inode_t* inode,
             if (last_name) strcpy(last_name, name);
 
             int64_t found_inodeptr;
-            direntry_find(inode, name, &found_inodeptr);
+            direntry_find(*inodeptr, inode, name, &found_inodeptr);
 
             if (inodeptr_is_valid(found_inodeptr)) {
                 // go to the next level of path
                 *inodeptr = found_inodeptr;
-                inode_read(*inodeptr, inode);
+                inode_read_table(*inodeptr, inode);
             } else {
                 // if this is the last level a new file is allowed
                 not_existing = true;
             }
         }
-    } while((name = strtok(NULL, "/")) != NULL);
+    } while((name = strtok_r(NULL, "/", &save)) != NULL);
 
     if (not_existing) {
         *inodeptr = 0;
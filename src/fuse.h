@@ -1,3 +1,4 @@
 // convenience fuse include header
 #define FUSE_USE_VERSION 36
 #include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
@@ -1,12 +1,94 @@
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "block_cache.h"
+#include "dentry_cache.h"
+#include "inode_cache.h"
 #include "disk.h"
 #include "fuse.h"
 #include "stzfs.h"
 
+// stzfs specific mount options
+typedef struct stzfs_options {
+    int mmap;
+    int uring;
+    int odirect;
+    int paths;
+    unsigned long cache_size;
+    unsigned long dentry_cache;
+    unsigned long inode_cache;
+} stzfs_options;
+
+static const struct fuse_opt stzfs_opts[] = {
+    {"mmap", offsetof(stzfs_options, mmap), 1},
+    {"uring", offsetof(stzfs_options, uring), 1},
+    {"odirect", offsetof(stzfs_options, odirect), 1},
+    {"paths", offsetof(stzfs_options, paths), 1},
+    {"cache_size=%lu", offsetof(stzfs_options, cache_size), 0},
+    {"dentry_cache=%lu", offsetof(stzfs_options, dentry_cache), 0},
+    {"inode_cache=%lu", offsetof(stzfs_options, inode_cache), 0},
+    FUSE_OPT_END
+};
+
 void print_usage(void) {
     printf("usage: stzfs <disk> <mountpoint> [options]\n");
+    printf("\n");
+    printf("stzfs options:\n");
+    printf("    -o mmap    access the disk through a shared mapping\n");
+    printf("    -o uring   batch block io asynchronously through io_uring\n");
+    printf("    -o odirect bypass the host page cache (not with mmap)\n");
+    printf("    -o cache_size=N  block cache budget in MiB (0 disables it)\n");
+    printf("    -o dentry_cache=N  directory entries to cache (0 disables it)\n");
+    printf("    -o inode_cache=N  inodes to cache (0 writes them through)\n");
+    printf("    -o paths   serve path based requests instead of inode numbers\n");
+}
+
+// mount with the low level frontend, files are named by their inodeptr
+static int mount_lowlevel(struct fuse_args* args) {
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(args, &opts) != 0) {
+        return 1;
+    } else if (opts.show_help) {
+        print_usage();
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        return 0;
+    } else if (opts.mountpoint == NULL) {
+        print_usage();
+        return 1;
+    }
+
+    int ret = 1;
+    struct fuse_session* session = fuse_session_new(args, &stzfs_ll_ops, sizeof(stzfs_ll_ops), NULL);
+    if (session == NULL) {
+        printf("could not create fuse session\n");
+    } else if (fuse_set_signal_handlers(session) != 0) {
+        printf("could not set signal handlers\n");
+        fuse_session_destroy(session);
+    } else if (fuse_session_mount(session, opts.mountpoint) != 0) {
+        printf("could not mount %s\n", opts.mountpoint);
+        fuse_remove_signal_handlers(session);
+        fuse_session_destroy(session);
+    } else {
+        fuse_daemonize(opts.foreground);
+
+        if (opts.singlethread) {
+            ret = fuse_session_loop(session) != 0;
+        } else {
+            struct fuse_loop_config config = {.clone_fd = opts.clone_fd, .max_idle_threads = opts.max_idle_threads};
+            ret = fuse_session_loop_mt(session, &config) != 0;
+        }
+
+        fuse_session_unmount(session);
+        fuse_remove_signal_handlers(session);
+        fuse_session_destroy(session);
+    }
+
+    free(opts.mountpoint);
+    return ret;
 }
 
 int main(int argc, char** argv) {
@@ -23,13 +105,47 @@ int main(int argc, char** argv) {
         argv_new[i - 1] = argv[i];
     }
 
+    // parse stzfs options and pass the rest on to fuse
+    stzfs_options options = {.cache_size = ULONG_MAX, .dentry_cache = ULONG_MAX, .inode_cache = ULONG_MAX};
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv_new);
+    if (fuse_opt_parse(&args, &options, stzfs_opts, NULL) == -1) {
+        print_usage();
+        return 1;
+    }
+
+    if (options.mmap && options.uring) {
+        printf("the mmap and uring options are mutually exclusive\n");
+        return 1;
+    } else if (options.mmap) {
+        disk_set_backend(DISK_BACKEND_MMAP);
+    } else if (options.uring) {
+        disk_set_backend(DISK_BACKEND_URING);
+    }
+
+    if (options.odirect && options.mmap) {
+        printf("the odirect and mmap options are mutually exclusive\n");
+        return 1;
+    }
+    disk_set_direct_io(options.odirect);
+
+    if (options.cache_size != ULONG_MAX) {
+        block_cache_set_size((size_t)options.cache_size * 1024 * 1024);
+    }
+
+    if (options.dentry_cache != ULONG_MAX) {
+        dentry_cache_set_size(options.dentry_cache);
+    }
+
+    if (options.inode_cache != ULONG_MAX) {
+        inode_cache_set_size(options.inode_cache);
+    }
+
     // run fuse
     printf("mounting %s at %s\n", disk, argv[2]);
-    disk_set_file(disk);
-    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv_new);
-    fuse_opt_parse(&args, NULL, NULL, NULL);
-    fuse_opt_add_arg(&args, "-s");
-    int ret = fuse_main(args.argc, args.argv, &stzfs_ops, NULL);
+    if (disk_set_file(disk)) {
+        return 1;
+    }
+    int ret = options.paths ? fuse_main(args.argc, args.argv, &stzfs_ops, NULL) : mount_lowlevel(&args);
 
     // cleanup fuse
     fuse_opt_free_args(&args);
@@ -0,0 +1,236 @@
+#include "group.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "blockptr.h"
+#include "error.h"
+#include "group_cache.h"
+#include "helpers.h"
+#include "inodeptr.h"
+#include "log.h"
+#include "types.h"
+
+// group the given blockptr belongs to
+int64_t group_of_block(int64_t blockptr) {
+    return blockptr / group_cache.blocks_per_group;
+}
+
+// group the given inodeptr belongs to
+int64_t group_of_inode(int64_t inodeptr) {
+    return inodeptr / group_cache.inodes_per_group;
+}
+
+// first block of the group holding the given inode, keeps new data close to its inode
+int64_t group_block_goal(int64_t inodeptr) {
+    if (!inodeptr_is_valid(inodeptr)) {
+        return NULL_BLOCKPTR;
+    }
+
+    const int64_t group = MIN(group_of_inode(inodeptr), (int64_t)group_cache.count - 1);
+    return group * group_cache.blocks_per_group;
+}
+
+// alloc up to length consecutive blocks inside a single group
+static stzfs_error_t alloc_blocks_in(size_t group, int64_t goal, int64_t length, int64_t* blockptr,
+                                     int64_t* allocated) {
+    group_descriptor* descriptor = &group_cache.groups[group];
+    const int64_t first = (int64_t)group * group_cache.blocks_per_group;
+    stzfs_error_t error = ERROR;
+
+    pthread_mutex_lock(&group_cache.locks[group]);
+    if (descriptor->free_blocks > 0) {
+        error = bitmap_alloc_block_range(first, first + group_cache.blocks_per_group, goal,
+                                         MIN(length, (int64_t)descriptor->free_blocks), blockptr, allocated);
+        if (!error) {
+            descriptor->free_blocks -= *allocated;
+        }
+    }
+    pthread_mutex_unlock(&group_cache.locks[group]);
+
+    return error;
+}
+
+// alloc an inode inside a single group
+static stzfs_error_t alloc_inode_in(size_t group, bool directory, int64_t* inodeptr) {
+    group_descriptor* descriptor = &group_cache.groups[group];
+    const int64_t first = (int64_t)group * group_cache.inodes_per_group;
+    stzfs_error_t error = ERROR;
+
+    pthread_mutex_lock(&group_cache.locks[group]);
+    if (descriptor->free_inodes > 0) {
+        error = bitmap_alloc_inode(first, first + group_cache.inodes_per_group, inodeptr);
+        if (!error) {
+            descriptor->free_inodes--;
+            descriptor->directories += directory;
+        }
+    }
+    pthread_mutex_unlock(&group_cache.locks[group]);
+
+    return error;
+}
+
+// copy a group descriptor for placement decisions
+static group_descriptor read_group(size_t group) {
+    pthread_mutex_lock(&group_cache.locks[group]);
+    const group_descriptor descriptor = group_cache.groups[group];
+    pthread_mutex_unlock(&group_cache.locks[group]);
+
+    return descriptor;
+}
+
+// spread directories over the groups with at least average free inodes, preferring the fewest directories
+static size_t find_directory_group(void) {
+    int64_t total_free = 0;
+    for (size_t group = 0; group < group_cache.count; group++) {
+        total_free += read_group(group).free_inodes;
+    }
+    const int64_t average_free = total_free / (int64_t)group_cache.count;
+
+    size_t best = 0;
+    int64_t best_directories = INT64_MAX;
+    for (size_t group = 0; group < group_cache.count; group++) {
+        const group_descriptor descriptor = read_group(group);
+        if (descriptor.free_inodes > 0 && descriptor.free_inodes >= average_free &&
+            descriptor.directories < best_directories) {
+            best = group;
+            best_directories = descriptor.directories;
+        }
+    }
+
+    return best;
+}
+
+// alloc up to length consecutive blocks, preferably at goal, otherwise in the group of goal or the following ones
+stzfs_error_t group_alloc_blocks(int64_t goal, int64_t length, int64_t* blockptr, int64_t* allocated) {
+    const size_t start = blockptr_is_valid(goal) ? MIN((size_t)group_of_block(goal), group_cache.count - 1) : 0;
+
+    for (size_t i = 0; i < group_cache.count; i++) {
+        const size_t group = (start + i) % group_cache.count;
+        if (!alloc_blocks_in(group, group == start ? goal : NULL_BLOCKPTR, length, blockptr, allocated)) {
+            group_cache_sync_lazily();
+            return SUCCESS;
+        }
+    }
+
+    LOG("no group has a free block");
+    *blockptr = BLOCKPTR_ERROR;
+    *allocated = 0;
+    return ERROR;
+}
+
+// alloc an inode, files stay in the group of their parent while directories are spread out
+stzfs_error_t group_alloc_inode(int64_t parent_inodeptr, bool directory, int64_t* inodeptr) {
+    size_t start = 0;
+    if (directory && group_cache.count > 1) {
+        start = find_directory_group();
+    } else if (inodeptr_is_valid(parent_inodeptr)) {
+        start = MIN((size_t)group_of_inode(parent_inodeptr), group_cache.count - 1);
+    }
+
+    for (size_t i = 0; i < group_cache.count; i++) {
+        if (!alloc_inode_in((start + i) % group_cache.count, directory, inodeptr)) {
+            group_cache_sync_lazily();
+            return SUCCESS;
+        }
+    }
+
+    LOG("no group has a free inode");
+    *inodeptr = INODEPTR_ERROR;
+    return ERROR;
+}
+
+// free a block in its group
+stzfs_error_t group_free_block(int64_t blockptr) {
+    const size_t group = (size_t)group_of_block(blockptr);
+    if (!blockptr_is_valid(blockptr) || group >= group_cache.count) {
+        LOG("invalid blockptr given");
+        return ERROR;
+    }
+
+    pthread_mutex_lock(&group_cache.locks[group]);
+    const stzfs_error_t error = bitmap_free_block(blockptr);
+    if (!error) {
+        group_cache.groups[group].free_blocks++;
+    }
+    pthread_mutex_unlock(&group_cache.locks[group]);
+
+    group_cache_sync_lazily();
+    return error;
+}
+
+// order blockptrs for batched frees
+static int compare_blockptrs(const void* a, const void* b) {
+    const int64_t blockptr_a = *(const int64_t*)a;
+    const int64_t blockptr_b = *(const int64_t*)b;
+    return (blockptr_a > blockptr_b) - (blockptr_a < blockptr_b);
+}
+
+// free a batch of blocks, the bitmap and the count of every group are updated once per group
+stzfs_error_t group_free_blocks(const int64_t* blockptr_arr, size_t length) {
+    if (length == 0) {
+        return SUCCESS;
+    }
+
+    int64_t sorted[length];
+    memcpy(sorted, blockptr_arr, length * sizeof(int64_t));
+    qsort(sorted, length, sizeof(int64_t), compare_blockptrs);
+
+    stzfs_error_t error = SUCCESS;
+    size_t offset = 0;
+    while (offset < length) {
+        const size_t group = (size_t)group_of_block(sorted[offset]);
+        if (!blockptr_is_valid(sorted[offset]) || group >= group_cache.count) {
+            LOG("invalid blockptr given");
+            error = ERROR;
+            offset++;
+            continue;
+        }
+
+        size_t end = offset + 1;
+        while (end < length && (size_t)group_of_block(sorted[end]) == group) {
+            end++;
+        }
+
+        int64_t freed;
+        pthread_mutex_lock(&group_cache.locks[group]);
+        if (bitmap_free_blocks(&sorted[offset], end - offset, &freed)) {
+            error = ERROR;
+        }
+        group_cache.groups[group].free_blocks += freed;
+        pthread_mutex_unlock(&group_cache.locks[group]);
+
+        offset = end;
+    }
+
+    group_cache_sync_lazily();
+    return error;
+}
+
+// free an inode in its group
+stzfs_error_t group_free_inode(int64_t inodeptr, bool directory) {
+    const size_t group = (size_t)group_of_inode(inodeptr);
+    if (!inodeptr_is_valid(inodeptr) || group >= group_cache.count) {
+        LOG("invalid inodeptr given");
+        return ERROR;
+    }
+
+    pthread_mutex_lock(&group_cache.locks[group]);
+    const stzfs_error_t error = bitmap_free_inode(inodeptr);
+    if (!error) {
+        group_descriptor* descriptor = &group_cache.groups[group];
+        descriptor->free_inodes++;
+        if (directory && descriptor->directories > 0) {
+            descriptor->directories--;
+        }
+    }
+    pthread_mutex_unlock(&group_cache.locks[group]);
+
+    group_cache_sync_lazily();
+    return error;
+}
@@ -0,0 +1,19 @@
+#ifndef STZFS_GROUP_H
+#define STZFS_GROUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+
+int64_t group_of_block(int64_t blockptr);
+int64_t group_of_inode(int64_t inodeptr);
+int64_t group_block_goal(int64_t inodeptr);
+stzfs_error_t group_alloc_blocks(int64_t goal, int64_t length, int64_t* blockptr, int64_t* allocated);
+stzfs_error_t group_alloc_inode(int64_t parent_inodeptr, bool directory, int64_t* inodeptr);
+stzfs_error_t group_free_block(int64_t blockptr);
+stzfs_error_t group_free_blocks(const int64_t* blockptr_arr, size_t length);
+stzfs_error_t group_free_inode(int64_t inodeptr, bool directory);
+
+#endif // STZFS_GROUP_H
@@ -0,0 +1,171 @@
+#include "group_cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "bitmap_cache.h"
+#include "blocks.h"
+#include "helpers.h"
+#include "super_block_cache.h"
+#include "types.h"
+#include "disk.h"
+
+static int create_legacy_group(void);
+static void rebuild_counts(void);
+
+// seconds between persisting the free counts while mounted
+#define GROUP_CACHE_SYNC_INTERVAL (5)
+
+static int64_t last_sync;
+
+group_cache_t group_cache;
+
+int group_cache_init(void) {
+    super_block* sb = super_block_cache;
+
+    if (sb->group_table == 0) {
+        TRY(create_legacy_group(),
+            printf("group_cache_init: could not create legacy group\n"));
+    } else {
+        group_cache.count = sb->group_count;
+        group_cache.length = (size_t)sb->group_table_length * STZFS_BLOCK_SIZE;
+        group_cache.blocks_per_group = sb->blocks_per_group;
+        group_cache.inodes_per_group = sb->inodes_per_group;
+        group_cache.groups = mmap(NULL, group_cache.length, PROT_READ | PROT_WRITE, MAP_SHARED, disk_get_fd(),
+                                  (off_t)sb->group_table * STZFS_BLOCK_SIZE);
+        if (group_cache.groups == MAP_FAILED) {
+            printf("group_cache_init: could not map group table\n");
+            return -errno;
+        }
+    }
+
+    group_cache.locks = malloc(group_cache.count * sizeof(pthread_mutex_t));
+    if (group_cache.locks == NULL) {
+        printf("group_cache_init: could not create group locks\n");
+        return -ENOMEM;
+    }
+    for (size_t group = 0; group < group_cache.count; group++) {
+        pthread_mutex_init(&group_cache.locks[group], NULL);
+    }
+
+    // counts may be off after a crash, the bitmaps are always right
+    if (!(sb->state & SUPER_BLOCK_STATE_CLEAN)) {
+        printf("group_cache_init: file system was not unmounted cleanly, rebuilding free counts\n");
+        rebuild_counts();
+    }
+
+    // mark mounted, a crash from now on leaves the file system unclean
+    sb->state &= ~SUPER_BLOCK_STATE_CLEAN;
+    TRY(group_cache_sync(),
+        printf("group_cache_init: could not mark file system as mounted\n"));
+
+    return 0;
+}
+
+int group_cache_dispose(void) {
+    TRY(group_cache_sync(),
+        printf("group_cache_dispose: could not persist free counts\n"));
+    super_block_cache->state |= SUPER_BLOCK_STATE_CLEAN;
+    TRY(super_block_cache_sync(),
+        printf("group_cache_dispose: could not mark file system as clean\n"));
+
+    for (size_t group = 0; group < group_cache.count; group++) {
+        pthread_mutex_destroy(&group_cache.locks[group]);
+    }
+    free(group_cache.locks);
+    group_cache.locks = NULL;
+
+    if (group_cache.length == 0) {
+        free(group_cache.groups);
+    } else if (munmap(group_cache.groups, group_cache.length)) {
+        printf("group_cache_dispose: could not unmap group table\n");
+        return -errno;
+    }
+    group_cache.groups = NULL;
+
+    return 0;
+}
+
+// write the free counts of all groups and their sums in the super block to disk
+int group_cache_sync(void) {
+    super_block* sb = super_block_cache;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    __atomic_store_n(&last_sync, (int64_t)now.tv_sec, __ATOMIC_RELAXED);
+
+    // concurrent syncs must not store older sums last
+    super_block_cache_lock();
+    int64_t free_blocks = 0;
+    int64_t free_inodes = 0;
+    for (size_t group = 0; group < group_cache.count; group++) {
+        pthread_mutex_lock(&group_cache.locks[group]);
+        free_blocks += group_cache.groups[group].free_blocks;
+        free_inodes += group_cache.groups[group].free_inodes;
+        pthread_mutex_unlock(&group_cache.locks[group]);
+    }
+    sb->free_blocks = free_blocks;
+    sb->free_inodes = free_inodes;
+    super_block_cache_unlock();
+
+    if (group_cache.length > 0 && msync(group_cache.groups, group_cache.length, MS_SYNC)) {
+        printf("group_cache_sync: could not sync group table to disk\n");
+        return -errno;
+    }
+
+    return super_block_cache_sync();
+}
+
+// persist the free counts if the last time was long enough ago, only one caller does the work
+int group_cache_sync_lazily(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    int64_t last = __atomic_load_n(&last_sync, __ATOMIC_RELAXED);
+    if (now.tv_sec - last < GROUP_CACHE_SYNC_INTERVAL ||
+        !__atomic_compare_exchange_n(&last_sync, &last, (int64_t)now.tv_sec, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    return group_cache_sync();
+}
+
+// recount the free entries of every group with a popcount over its part of the bitmaps
+static void rebuild_counts(void) {
+    for (size_t group = 0; group < group_cache.count; group++) {
+        const int64_t first_block = (int64_t)group * group_cache.blocks_per_group;
+        const int64_t first_inode = (int64_t)group * group_cache.inodes_per_group;
+
+        pthread_mutex_lock(&group_cache.locks[group]);
+        group_cache.groups[group].free_blocks =
+            bitmap_cache_count_free(&block_bitmap_cache, first_block, first_block + group_cache.blocks_per_group);
+        group_cache.groups[group].free_inodes =
+            bitmap_cache_count_free(&inode_bitmap_cache, first_inode, first_inode + group_cache.inodes_per_group);
+        pthread_mutex_unlock(&group_cache.locks[group]);
+    }
+}
+
+// file systems without a group table are treated as one group spanning the whole disk
+static int create_legacy_group(void) {
+    const super_block* sb = super_block_cache;
+
+    group_cache.groups = calloc(1, sizeof(group_descriptor));
+    if (group_cache.groups == NULL) {
+        return -ENOMEM;
+    }
+
+    group_cache.count = 1;
+    group_cache.length = 0;
+    group_cache.blocks_per_group = sb->block_count;
+    group_cache.inodes_per_group = sb->inode_count;
+    group_cache.groups[0].free_blocks = sb->free_blocks;
+    group_cache.groups[0].free_inodes = sb->free_inodes;
+
+    return 0;
+}
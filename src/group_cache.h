@@ -0,0 +1,26 @@
+#ifndef STZFS_GROUP_CACHE_H
+#define STZFS_GROUP_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+typedef struct group_cache_t {
+    group_descriptor* groups;
+    pthread_mutex_t* locks; // one per group, guards its descriptor and its part of the bitmaps
+    size_t count;
+    size_t length; // mapped bytes of the group table, 0 if the single legacy group lives in memory only
+    int64_t blocks_per_group;
+    int64_t inodes_per_group;
+} group_cache_t;
+
+extern group_cache_t group_cache;
+
+int group_cache_init(void);
+int group_cache_dispose(void);
+int group_cache_sync(void);
+int group_cache_sync_lazily(void);
+
+#endif // STZFS_GROUP_CACHE_H
@@ -0,0 +1,400 @@
+#include "handle.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "blocks.h"
+#include "error.h"
+#include "helpers.h"
+#include "inode.h"
+#include "inode_cache.h"
+#include "log.h"
+#include "types.h"
+
+#define HANDLE_BUCKET_BITS (8)
+#define HANDLE_BUCKETS (1 << HANDLE_BUCKET_BITS)
+
+// blocks staged per write when delayed blocks are allocated
+#define HANDLE_FLUSH_BLOCKS (256)
+
+static handle_t* buckets[HANDLE_BUCKETS];
+static pthread_mutex_t buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// find the delayed block bucket of a file block offset
+static handle_block_t** delayed_bucket_of(const handle_t* handle, int64_t offset) {
+    return (handle_block_t**)&handle->delayed[(uint64_t)offset % HANDLE_DELAYED_BUCKETS];
+}
+
+// find the delayed block at a file block offset, NULL if there is none
+static handle_block_t* find_delayed_block(const handle_t* handle, int64_t offset) {
+    if (handle->delayed_count == 0) {
+        return NULL;
+    }
+
+    for (handle_block_t* block = *delayed_bucket_of(handle, offset); block != NULL; block = block->next) {
+        if (block->offset == offset) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+// free blocks a new delayed block sets aside, the first block of a run also reserves the worst case metadata
+// mapping the run takes, runs are cut where an indirect block ends
+static int64_t delayed_block_reservation(const handle_t* handle, int64_t offset) {
+    const bool starts_run = offset % INDIRECT_BLOCK_ENTRIES == 0 || find_delayed_block(handle, offset - 1) == NULL;
+    return 1 + (starts_run ? HANDLE_RUN_METADATA_BLOCKS : 0);
+}
+
+// release a delayed block and its reservation
+static void free_delayed_block(handle_t* handle, handle_block_t* block) {
+    block_unreserve(block->reserved);
+    block_buffer_free(block->data);
+    free(block);
+    handle->delayed_count--;
+}
+
+// drop a single delayed block
+static void drop_delayed_block(handle_t* handle, handle_block_t* block) {
+    handle_block_t** link = delayed_bucket_of(handle, block->offset);
+    while (*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+    free_delayed_block(handle, block);
+}
+
+// drop all delayed blocks at or after the given file block offset
+static void drop_delayed_blocks(handle_t* handle, int64_t offset) {
+    for (size_t bucket = 0; bucket < HANDLE_DELAYED_BUCKETS; bucket++) {
+        handle_block_t** link = &handle->delayed[bucket];
+        while (*link != NULL) {
+            handle_block_t* block = *link;
+            if (block->offset >= offset) {
+                *link = block->next;
+                free_delayed_block(handle, block);
+            } else {
+                link = &block->next;
+            }
+        }
+    }
+}
+
+// order delayed blocks by file offset
+static int compare_delayed_blocks(const void* a, const void* b) {
+    const int64_t offset_a = (*(handle_block_t* const*)a)->offset;
+    const int64_t offset_b = (*(handle_block_t* const*)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// find the hash bucket of an inodeptr
+static handle_t** bucket_of(int64_t inodeptr) {
+    return &buckets[((uint64_t)inodeptr * 0x9e3779b97f4a7c15ull) >> (64 - HANDLE_BUCKET_BITS)];
+}
+
+// remove a handle from its bucket
+static void unlink_handle(handle_t* handle) {
+    pthread_mutex_lock(&buckets_lock);
+    for (handle_t** link = bucket_of(handle->inodeptr); *link != NULL; link = &(*link)->next) {
+        if (*link == handle) {
+            *link = handle->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&buckets_lock);
+    handle->next = NULL;
+}
+
+// open a file or share the handle of an already open instance, the caller holds the inode lock exclusively
+handle_t* handle_open(int64_t inodeptr) {
+    handle_t* handle = handle_find(inodeptr);
+    if (handle != NULL) {
+        handle->open_count++;
+        return handle;
+    }
+
+    // the embedded indirect blocks have to be block aligned
+    if (posix_memalign((void**)&handle, STZFS_BLOCK_SIZE, sizeof(handle_t))) {
+        LOG("could not allocate file handle");
+        return NULL;
+    }
+
+    if (inode_read_table(inodeptr, &handle->inode)) {
+        LOG("could not read inode of file handle");
+        free(handle);
+        return NULL;
+    }
+
+    // the inode stays cached while it is open, flushing the handle only updates the cache
+    inode_cache_ref(inodeptr, &handle->inode);
+
+    inode_map_init(&handle->map, inodeptr);
+    pthread_mutex_init(&handle->read_lock, NULL);
+    handle->read_end = -1;
+    handle->inodeptr = inodeptr;
+    handle->open_count = 1;
+    handle->dirty = false;
+    handle->detached = false;
+    memset(handle->delayed, 0, sizeof(handle->delayed));
+    handle->delayed_count = 0;
+
+    pthread_mutex_lock(&buckets_lock);
+    handle_t** bucket = bucket_of(inodeptr);
+    handle->next = *bucket;
+    *bucket = handle;
+    pthread_mutex_unlock(&buckets_lock);
+
+    return handle;
+}
+
+// drop one open instance and write back the inode once the last one is gone
+stzfs_error_t handle_close(handle_t* handle) {
+    stzfs_error_t error = handle_flush(handle);
+
+    if (--handle->open_count > 0) {
+        return error;
+    }
+
+    if (handle->delayed_count > 0) {
+        LOG("dropping %zu delayed blocks that could not be written", handle->delayed_count);
+    }
+
+    if (!handle->detached) {
+        unlink_handle(handle);
+        inode_cache_unref(handle->inodeptr);
+    }
+    drop_delayed_blocks(handle, 0);
+    pthread_mutex_destroy(&handle->read_lock);
+    free(handle);
+
+    return error;
+}
+
+// allocate and write the delayed blocks and write back the inode of a handle if it was changed
+stzfs_error_t handle_flush(handle_t* handle) {
+    if (handle_flush_data(handle)) {
+        return ERROR;
+    }
+
+    if (!handle->dirty || handle->detached) {
+        return SUCCESS;
+    }
+
+    if (inode_write_table(handle->inodeptr, &handle->inode)) {
+        LOG("could not write back inode of file handle");
+        return ERROR;
+    }
+
+    handle->dirty = false;
+    return SUCCESS;
+}
+
+// allocate the delayed blocks of a handle in as few physically consecutive runs as possible and write them
+stzfs_error_t handle_flush_data(handle_t* handle) {
+    if (handle->delayed_count == 0) {
+        return SUCCESS;
+    }
+
+    // collect the delayed blocks in file order
+    handle_block_t** blocks = malloc(handle->delayed_count * sizeof(handle_block_t*));
+    void* staging = block_buffer_alloc(HANDLE_FLUSH_BLOCKS);
+    if (blocks == NULL || staging == NULL) {
+        LOG("could not allocate flush buffers");
+        free(blocks);
+        block_buffer_free(staging);
+        return ERROR;
+    }
+
+    size_t count = 0;
+    for (size_t bucket = 0; bucket < HANDLE_DELAYED_BUCKETS; bucket++) {
+        for (handle_block_t* block = handle->delayed[bucket]; block != NULL; block = block->next) {
+            blocks[count++] = block;
+        }
+    }
+    qsort(blocks, count, sizeof(handle_block_t*), compare_delayed_blocks);
+
+    // write consecutive file blocks together, this allocates each run at once
+    stzfs_error_t error = SUCCESS;
+    for (size_t start = 0; start < count && !handle->detached;) {
+        size_t length = 1;
+        while (start + length < count && length < HANDLE_FLUSH_BLOCKS &&
+               blocks[start + length]->offset == blocks[start]->offset + (int64_t)length) {
+            length++;
+        }
+
+        // the blocks and their mapping are allocated from the reservations of the delayed blocks, what a
+        // run does not use is kept for the following ones until all are written
+        int64_t reserved = 0;
+        for (size_t i = 0; i < length; i++) {
+            memcpy((char*)staging + i * STZFS_BLOCK_SIZE, blocks[start + i]->data, STZFS_BLOCK_SIZE);
+            reserved += blocks[start + i]->reserved;
+        }
+        block_use_reservation(reserved);
+        if (inode_write_data_blocks(&handle->inode, &handle->map, staging, length, blocks[start]->offset)) {
+            // the run stays delayed, it keeps what is left of the reservation for a retry
+            LOG("could not write delayed blocks of file handle");
+            for (size_t i = 1; i < length; i++) {
+                blocks[start + i]->reserved = 0;
+            }
+            blocks[start]->reserved = block_keep_reservation();
+            error = ERROR;
+            break;
+        }
+
+        // written blocks are not delayed anymore, their reservations went into the allocation
+        for (size_t i = 0; i < length; i++) {
+            blocks[start + i]->reserved = 0;
+            drop_delayed_block(handle, blocks[start + i]);
+        }
+        handle->dirty = true;
+        start += length;
+    }
+
+    block_end_reservation();
+    free(blocks);
+    block_buffer_free(staging);
+
+    return error;
+}
+
+// delayed block at the given file block offset, NULL if there is none
+void* handle_find_block(const handle_t* handle, int64_t offset) {
+    const handle_block_t* block = find_delayed_block(handle, offset);
+    return block != NULL ? block->data : NULL;
+}
+
+// get the delayed block at the given file block offset, a new one starts zeroed like the hole it replaces
+// returns NULL if the disk could not hold all delayed blocks or memory is exhausted
+void* handle_delay_block(handle_t* handle, int64_t offset) {
+    void* data = handle_find_block(handle, offset);
+    if (data != NULL) {
+        return data;
+    }
+
+    // bound the memory held by a single handle
+    if (handle->delayed_count >= HANDLE_DELAYED_MAX_BLOCKS && handle_flush_data(handle)) {
+        return NULL;
+    }
+
+    // every delayed block must find a free block later on, mapping the held back runs hands back the
+    // metadata reserved for them that they did not need
+    int64_t reserved = delayed_block_reservation(handle, offset);
+    if (block_reserve(reserved)) {
+        if (handle_flush_data(handle)) {
+            return NULL;
+        }
+
+        reserved = delayed_block_reservation(handle, offset);
+        if (block_reserve(reserved)) {
+            LOG("no free block left to reserve");
+            return NULL;
+        }
+    }
+
+    handle_block_t* block = malloc(sizeof(handle_block_t));
+    data = block_buffer_alloc(1);
+    if (block == NULL || data == NULL) {
+        LOG("could not allocate delayed block");
+        free(block);
+        block_buffer_free(data);
+        block_unreserve(reserved);
+        return NULL;
+    }
+    memset(data, 0, STZFS_BLOCK_SIZE);
+
+    // the following run is joined and mapped together with this one from now on
+    handle_block_t* next = find_delayed_block(handle, offset + 1);
+    if (next != NULL && (offset + 1) % INDIRECT_BLOCK_ENTRIES != 0 && next->reserved > 1) {
+        block_unreserve(next->reserved - 1);
+        next->reserved = 1;
+    }
+
+    handle_block_t** bucket = delayed_bucket_of(handle, offset);
+    block->offset = offset;
+    block->data = data;
+    block->reserved = reserved;
+    block->next = *bucket;
+    *bucket = block;
+    handle->delayed_count++;
+
+    return data;
+}
+
+// forget delayed data past the new end of a file
+void handle_truncate(handle_t* handle, int64_t atom_count) {
+    drop_delayed_blocks(handle, DIV_CEIL(atom_count, STZFS_BLOCK_SIZE));
+
+    // a later extension has to read zeroes after the end
+    const size_t inner = atom_count % STZFS_BLOCK_SIZE;
+    char* data = handle_find_block(handle, atom_count / STZFS_BLOCK_SIZE);
+    if (data != NULL && inner > 0) {
+        memset(&data[inner], 0, STZFS_BLOCK_SIZE - inner);
+    }
+}
+
+// write back the inodes of all open files and stop serving them from their handles
+stzfs_error_t handle_dispose(void) {
+    stzfs_error_t error = SUCCESS;
+    for (size_t bucket = 0; bucket < HANDLE_BUCKETS; bucket++) {
+        while (buckets[bucket] != NULL) {
+            handle_t* handle = buckets[bucket];
+            if (handle_flush(handle)) error = ERROR;
+            handle_detach(handle->inodeptr);
+        }
+    }
+
+    return error;
+}
+
+// find the handle of an open file, it stays valid while the inode lock of the file is held
+handle_t* handle_find(int64_t inodeptr) {
+    pthread_mutex_lock(&buckets_lock);
+    handle_t* handle = *bucket_of(inodeptr);
+    while (handle != NULL && handle->inodeptr != inodeptr) {
+        handle = handle->next;
+    }
+    pthread_mutex_unlock(&buckets_lock);
+
+    return handle;
+}
+
+// copy the inode of an open file, false if the file is not open, the caller holds its inode lock (shared is
+// enough), writers change the inode of a handle while holding it exclusively, readers touch its atime under
+// the read lock
+bool handle_read_inode(int64_t inodeptr, inode_t* inode) {
+    pthread_mutex_lock(&buckets_lock);
+    handle_t* handle = *bucket_of(inodeptr);
+    while (handle != NULL && handle->inodeptr != inodeptr) {
+        handle = handle->next;
+    }
+    if (handle != NULL) {
+        pthread_mutex_lock(&handle->read_lock);
+        *inode = handle->inode;
+        pthread_mutex_unlock(&handle->read_lock);
+    }
+    pthread_mutex_unlock(&buckets_lock);
+
+    return handle != NULL;
+}
+
+// stop serving a freed inode from its handle, the handle itself lives until it is closed
+void handle_detach(int64_t inodeptr) {
+    handle_t* handle = handle_find(inodeptr);
+    if (handle == NULL) {
+        return;
+    }
+
+    unlink_handle(handle);
+    inode_cache_unref(inodeptr);
+    handle->detached = true;
+    handle->dirty = false;
+
+    // data of a freed file never needs a physical block
+    drop_delayed_blocks(handle, 0);
+}
@@ -0,0 +1,57 @@
+#ifndef STZFS_HANDLE_H
+#define STZFS_HANDLE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "inode.h"
+
+// buckets of the delayed blocks of a handle
+#define HANDLE_DELAYED_BUCKETS (64)
+
+// delayed blocks a handle holds before they are allocated and written without waiting for a flush
+#define HANDLE_DELAYED_MAX_BLOCKS (4096)
+
+// worst case metadata allocated when a run of delayed blocks is mapped, an extent insert splits every
+// level and the root or a new triple, double and single indirect block
+#define HANDLE_RUN_METADATA_BLOCKS (EXTENT_MAX_DEPTH + 1)
+
+// file data written to a hole, a physical block is only assigned when the handle is flushed
+typedef struct handle_block_t {
+    int64_t offset;
+    void* data;
+    int64_t reserved; // free blocks set aside for the block and the mapping of its run
+    struct handle_block_t* next;
+} handle_block_t;
+
+// state shared by all open instances of a file, guarded by the inode lock of the file
+typedef struct handle_t {
+    inode_map_t map;
+    inode_t inode;
+    pthread_mutex_t read_lock; // map, atime and read_end, readers only hold the inode lock shared
+    int64_t read_end; // byte offset the last read ended at, -1 before the first one
+    int64_t inodeptr;
+    size_t open_count;
+    bool dirty;    // inode differs from the inode table
+    bool detached; // inode was freed while the file was open
+    handle_block_t* delayed[HANDLE_DELAYED_BUCKETS];
+    size_t delayed_count;
+    struct handle_t* next;
+} handle_t;
+
+handle_t* handle_open(int64_t inodeptr);
+stzfs_error_t handle_close(handle_t* handle);
+stzfs_error_t handle_flush(handle_t* handle);
+stzfs_error_t handle_flush_data(handle_t* handle);
+void* handle_find_block(const handle_t* handle, int64_t offset);
+void* handle_delay_block(handle_t* handle, int64_t offset);
+void handle_truncate(handle_t* handle, int64_t atom_count);
+stzfs_error_t handle_dispose(void);
+handle_t* handle_find(int64_t inodeptr);
+bool handle_read_inode(int64_t inodeptr, inode_t* inode);
+void handle_detach(int64_t inodeptr);
+
+#endif // STZFS_HANDLE_H
@@ -7,6 +7,7 @@
 #include "find.h"
 #include "helpers.h"
 #include "inode.h"
+#include "inode_lock.h"
 
 // check if file exists
 int file_exists(const char* path) {
@@ -51,36 +52,54 @@ int unlink_file_or_dir(const char* path, int allow_dir) {
     int err = find_file_inode2(path, &f, &parent, name);
     if (err) return err;
 
-    if (f.inodeptr == 0) {
+    return unlink_file_or_dir_at(&parent, name, &f, allow_dir);
+}
+
+// unlink the entry name of a directory, which links to f (f->inodeptr is 0 if there is none)
+int unlink_file_or_dir_at(file* parent, const char* name, file* f, int allow_dir) {
+    if (f->inodeptr == 0) {
         printf("unlink_file_or_dir: no such file or directory\n");
         return -ENOENT;
-    } else if (M_IS_DIR(f.inode.mode) && !allow_dir) {
+    }
+
+    // the file may still be open, re-read it once it is locked
+    inode_lock_exclusive(f->inodeptr);
+    inode_read(f->inodeptr, &f->inode);
+
+    if (M_IS_DIR(f->inode.mode) && !allow_dir) {
         printf("unlink_file_or_dir: is a directory\n");
+        inode_unlock(f->inodeptr);
         return -EISDIR;
-    } else if (M_IS_DIR(f.inode.mode) && f.inode.atom_count > 2) {
+    } else if (!M_IS_DIR(f->inode.mode) && allow_dir) {
+        printf("unlink_file_or_dir: not a directory\n");
+        inode_unlock(f->inodeptr);
+        return -ENOTDIR;
+    } else if (M_IS_DIR(f->inode.mode) && f->inode.atom_count > 2) {
         printf("unlink_file_or_dir: directory is not empty\n");
+        inode_unlock(f->inodeptr);
         return -ENOTEMPTY;
     }
 
     // update timestamps
-    touch_atime(&f.inode);
-    touch_ctime(&f.inode);
-    touch_mtime_and_ctime(&parent.inode);
+    touch_atime(&f->inode);
+    touch_ctime(&f->inode);
+    touch_mtime_and_ctime(&parent->inode);
 
-    if (M_IS_DIR(f.inode.mode)) {
-        parent.inode.link_count--;
+    if (M_IS_DIR(f->inode.mode)) {
+        parent->inode.link_count--;
     }
 
-    direntry_free(&parent.inode, name);
-    inode_write(parent.inodeptr, &parent.inode);
+    direntry_free(parent->inodeptr, &parent->inode, name);
+    inode_write(parent->inodeptr, &parent->inode);
 
-    f.inode.link_count--;
-    if (f.inode.link_count == 0) {
-        inode_free(f.inodeptr, &f.inode);
+    f->inode.link_count--;
+    if (f->inode.link_count == 0) {
+        inode_free(f->inodeptr, &f->inode);
     } else {
-        inode_write(f.inodeptr, &f.inode);
+        inode_write(f->inodeptr, &f->inode);
     }
 
+    inode_unlock(f->inodeptr);
     return 0;
 }
 
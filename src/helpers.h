@@ -18,6 +18,7 @@ void touch_ctime(inode_t* inode);
 // misc helpers
 void memcpy_min(void* dest, const void* src, size_t mult, size_t a, size_t b);
 int unlink_file_or_dir(const char* path, int allow_dir);
+int unlink_file_or_dir_at(file* parent, const char* name, file* f, int allow_dir);
 stzfs_mode_t mode_posix_to_stzfs(mode_t mode);
 mode_t mode_stzfs_to_posix(stzfs_mode_t stzfs_mode);
 
@@ -1,62 +1,78 @@
 #include "inode.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "bitmap.h"
 #include "block.h"
 #include "blockptr.h"
+#include "dentry_cache.h"
+#include "disk.h"
 #include "error.h"
+#include "extent.h"
 #include "find.h"
+#include "group.h"
+#include "handle.h"
+#include "helpers.h"
+#include "inode_cache.h"
 #include "inodeptr.h"
 #include "log.h"
+#include "lookup.h"
+#include "orphan.h"
 #include "super_block_cache.h"
 
-// allocate new inodeptr only
-stzfs_error_t inode_allocptr(int64_t* inodeptr) {
-    super_block* sb = super_block_cache;
-    stzfs_error_t error = SUCCESS;
+// data blocks a single range operation looks up at once
+#define INODE_RANGE_BLOCKS (1024)
 
-    if (sb->free_inodes == 0) {
-        LOG("no free inode available");
-        *inodeptr = INODEPTR_ERROR;
-        return ERROR;
-    }
+// blocks zeroed per write when preallocating without extents
+#define INODE_ZERO_BLOCKS (256)
 
-    bitmap_alloc_inode(inodeptr);
+// blocks freed at once when truncating
+#define INODE_FREE_BATCH (256)
 
-    // update superblock
-    sb->free_inodes--;
-    super_block_cache_sync();
+// locks of inode table blocks, inodes sharing a table block are read and written back together
+#define INODE_TABLE_LOCKS (64)
 
-    return SUCCESS;
-}
+static pthread_mutex_t table_locks[INODE_TABLE_LOCKS] = {
+    [0 ... INODE_TABLE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
-// allocate and write a new inode in place
-stzfs_error_t inode_alloc(int64_t* inodeptr, const inode_t* inode) {
-    const super_block* sb = super_block_cache;
+static int64_t find_goal(inode_t* inode, inode_map_t* map, int64_t offset);
+static void forget_blockptrs(inode_map_t* map, int64_t offset, int64_t length);
+static void expand_runs(const inode_run_t* run_arr, size_t run_count, int64_t* blockptr_arr, bool unwritten_as_holes);
+
+// reset the block map of a new inode to the format the file system was created with
+void inode_init_blocks(inode_t* inode) {
+    memset(inode->data_direct, 0, sizeof(inode_t) - offsetof(inode_t, data_direct));
+    inode->block_count = 0;
+    inode->mode &= ~M_EXTENTS;
+
+    if (super_block_cache->features & SUPER_BLOCK_FEATURE_EXTENTS) {
+        inode->mode |= M_EXTENTS;
+        extent_init(inode);
+    }
+}
 
-    if (sb->free_inodes == 0) {
+// allocate new inodeptr only, placed by the group of its parent directory
+stzfs_error_t inode_allocptr(int64_t parent_inodeptr, bool directory, int64_t* inodeptr) {
+    if (group_alloc_inode(parent_inodeptr, directory, inodeptr)) {
         LOG("no free inode available");
-        *inodeptr = INODEPTR_ERROR;
         return ERROR;
     }
 
-    // get next free inode
-    inode_allocptr(inodeptr);
-
-    // get inode table block
-    const int64_t inode_table_offset = *inodeptr / INODE_BLOCK_ENTRIES;
-    const int64_t inode_table_blockptr = sb->inode_table + inode_table_offset;
-    inode_block inode_table_block;
-    block_read(inode_table_blockptr, &inode_table_block);
+    return SUCCESS;
+}
 
-    // place inode into table and write table block
-    inode_table_block.inodes[*inodeptr % INODE_BLOCK_ENTRIES] = *inode;
-    block_write(inode_table_blockptr, &inode_table_block);
+// allocate and write a new inode in place
+stzfs_error_t inode_alloc(int64_t parent_inodeptr, int64_t* inodeptr, const inode_t* inode) {
+    // get next free inode
+    if (inode_allocptr(parent_inodeptr, M_IS_DIR(inode->mode), inodeptr)) return ERROR;
 
-    return SUCCESS;
+    // written back with the other inodes of its table block
+    return inode_write_table(*inodeptr, inode);
 }
 
 // append blockptr to inode block list
@@ -71,6 +87,16 @@ stzfs_error_t inode_append_data_blockptr(inode_t* inode, int64_t blockptr) {
         return ERROR;
     }
 
+    // holes are not mapped at all in an extent tree
+    if (inode->mode & M_EXTENTS) {
+        if (blockptr != NULL_BLOCKPTR) {
+            const extent_t extent = {.logical = inode->block_count, .physical = blockptr, .length = 1};
+            if (extent_insert(inode, &extent)) return ERROR;
+        }
+        inode->block_count++;
+        return SUCCESS;
+    }
+
     // level struct for indirection convenience
     typedef struct level {
         blockptr_t* blockptr;
@@ -166,13 +192,13 @@ stzfs_error_t inode_alloc_data_block(inode_t* inode, const void* block) {
         return ERROR;
     }
 
-    if (super_block_cache->free_blocks <= 0) {
-        LOG("no free block available");
+    // continue right after the current last block, this keeps growing directories contiguous
+    int64_t blockptr, allocated;
+    if (block_alloc_range(find_goal(inode, NULL, inode->block_count), 1, &blockptr, &allocated)) {
         return ERROR;
     }
 
-    int64_t blockptr;
-    block_alloc(&blockptr, block);
+    block_write(blockptr, block);
     inode_append_data_blockptr(inode, blockptr);
     return SUCCESS;
 }
@@ -187,6 +213,11 @@ stzfs_error_t inode_append_null_blocks(inode_t* inode, int64_t block_count) {
         return ERROR;
     }
 
+    if (inode->mode & M_EXTENTS) {
+        inode->block_count = block_count;
+        return SUCCESS;
+    }
+
     for (int64_t i = inode->block_count; i < block_count; i++) {
         inode_append_data_blockptr(inode, NULL_BLOCKPTR);
     }
@@ -209,17 +240,90 @@ stzfs_error_t inode_free(int64_t inodeptr, inode_t* inode) {
         return ERROR;
     }
 
-    // dealloc inode first
-    bitmap_free_inode(inodeptr);
+    // the kernel may still refer to the inodeptr, it must not be reused before it was forgotten
+    // it is remembered on disk meanwhile, so the next mount frees it if this one is not unmounted cleanly
+    if (lookup_defer_free(inodeptr)) {
+        if (orphan_hold(inodeptr)) {
+            LOG("could not remember held orphan");
+        }
+        return inode_write(inodeptr, inode);
+    }
 
-    // free allocated data blocks in bitmap
-    inode_truncate(inode, 0);
+    // detach first, open handles must not shadow a reused inodeptr
+    handle_detach(inodeptr);
 
-    return SUCCESS;
+    // an empty directory only resolves . and .., names it lacked are missing in a reused one as well
+    if (M_IS_DIR(inode->mode)) {
+        dentry_cache_invalidate(inodeptr, ".");
+        dentry_cache_invalidate(inodeptr, "..");
+    }
+
+    return orphan_add(inodeptr, inode);
+}
+
+// blocks collected before they are freed at once
+typedef struct free_batch_t {
+    int64_t blockptrs[INODE_FREE_BATCH];
+    size_t count;
+} free_batch_t;
+
+// free the collected blocks
+static stzfs_error_t flush_free_batch(free_batch_t* batch) {
+    const stzfs_error_t error = block_free(batch->blockptrs, batch->count);
+    batch->count = 0;
+    return error;
+}
+
+// collect a block to be freed, holes are skipped
+static stzfs_error_t add_free_batch(free_batch_t* batch, int64_t blockptr) {
+    if (blockptr == NULL_BLOCKPTR) {
+        return SUCCESS;
+    }
+
+    batch->blockptrs[batch->count++] = blockptr;
+    return batch->count == INODE_FREE_BATCH ? flush_free_batch(batch) : SUCCESS;
+}
+
+// free the data blocks in [offset, end) below an indirect block whose entries map span blocks from base on,
+// the indirect block is freed as well if nothing is left in front of offset, freed_out tells if it was
+static stzfs_error_t truncate_indirect(int64_t blockptr, int64_t span, int64_t base, int64_t offset, int64_t end,
+                                       free_batch_t* batch, bool* freed_out) {
+    *freed_out = offset <= base;
+    if (blockptr == NULL_BLOCKPTR) {
+        return SUCCESS;
+    }
+
+    indirect_block block;
+    if (block_read(blockptr, &block)) {
+        LOG("could not read indirect block");
+        return ERROR;
+    }
+
+    // every entry reaching past offset loses its data, whole subtrees in one go
+    const int64_t last = MIN(DIV_CEIL(end - base, span), INDIRECT_BLOCK_ENTRIES);
+    for (int64_t index = (offset - base) / span; index < last; index++) {
+        const int64_t entry_base = base + index * span;
+        bool freed = true;
+        if (span == 1) {
+            if (add_free_batch(batch, block.blocks[index])) return ERROR;
+        } else if (truncate_indirect(block.blocks[index], span / INDIRECT_BLOCK_ENTRIES, entry_base,
+                                     MAX(offset, entry_base), MIN(end, entry_base + span), batch, &freed)) {
+            return ERROR;
+        }
+
+        if (freed) {
+            block.blocks[index] = NULL_BLOCKPTR;
+        }
+    }
+
+    if (*freed_out) {
+        return add_free_batch(batch, blockptr);
+    }
+    return block_write(blockptr, &block);
 }
 
-// free inode data blocks until its block count reaches the given offset
-// FIXME: implement proper algorithm (merge with free_last_inode_data_block)
+// free inode data blocks until its block count reaches the given offset, the block map is walked once
+// and the blocks are freed in batches
 stzfs_error_t inode_truncate(inode_t* inode, int64_t offset) {
     if (offset < 0) {
         LOG("negative offsets are illegal");
@@ -229,11 +333,47 @@ stzfs_error_t inode_truncate(inode_t* inode, int64_t offset) {
         return ERROR;
     }
 
-    for (int64_t block_count = inode->block_count; block_count > offset; block_count--) {
-        inode_free_last_data_block(inode);
+    // drop whole runs at once
+    if (inode->mode & M_EXTENTS) {
+        if (extent_remove(inode, offset, inode->block_count)) return ERROR;
+        inode->block_count = offset;
+        return SUCCESS;
     }
 
-    return SUCCESS;
+    const int64_t end = inode->block_count;
+    free_batch_t batch = {.count = 0};
+    for (int64_t i = offset; i < MIN(end, INODE_DIRECT_BLOCKS); i++) {
+        if (add_free_batch(&batch, inode->data_direct[i])) return ERROR;
+        inode->data_direct[i] = NULL_BLOCKPTR;
+    }
+
+    // every indirection level is a subtree with entries of growing span
+    const struct {
+        blockptr_t* blockptr;
+        int64_t first;
+        int64_t span;
+    } levels[] = {
+        {&inode->data_single_indirect, INODE_SINGLE_INDIRECT_OFFSET, 1},
+        {&inode->data_double_indirect, INODE_DOUBLE_INDIRECT_OFFSET, INODE_SINGLE_INDIRECT_BLOCKS},
+        {&inode->data_triple_indirect, INODE_TRIPLE_INDIRECT_OFFSET, INODE_DOUBLE_INDIRECT_BLOCKS},
+    };
+    for (size_t level = 0; level < 3; level++) {
+        const int64_t last = MIN(end, levels[level].first + levels[level].span * INDIRECT_BLOCK_ENTRIES);
+        if (MAX(offset, levels[level].first) >= last) {
+            continue;
+        }
+
+        bool freed;
+        if (truncate_indirect(*levels[level].blockptr, levels[level].span, levels[level].first,
+                              MAX(offset, levels[level].first), last, &batch, &freed)) {
+            return ERROR;
+        } else if (freed) {
+            *levels[level].blockptr = NULL_BLOCKPTR;
+        }
+    }
+
+    inode->block_count = offset;
+    return flush_free_batch(&batch);
 }
 
 // free the last data block of an inode
@@ -243,77 +383,26 @@ stzfs_error_t inode_free_last_data_block(inode_t* inode) {
         return ERROR;
     }
 
-    // level struct for convenience
-    typedef struct level {
-        int64_t blockptr;
-        indirect_block block;
-    } level;
-
-    inode->block_count--;
-    int64_t offset = inode->block_count;
-    int64_t absolute_blockptr = 0;
-    if (offset < INODE_DIRECT_BLOCKS) {
-        absolute_blockptr = inode->data_direct[offset];
-
-        // FIXME: just for debugging
-        inode->data_direct[offset] = 0;
-    } else if ((offset -= INODE_DIRECT_BLOCKS) < INODE_SINGLE_INDIRECT_BLOCKS) {
-        level level1 = {.blockptr = inode->data_single_indirect};
-        block_read(level1.blockptr, &level1.block);
-        absolute_blockptr = level1.block.blocks[offset];
-
-        if (offset == 0) {
-            block_free(&level1.blockptr, 1);
-
-            // FIXME: just for debugging
-            inode->data_single_indirect = 0;
-        }
-    } else if ((offset -= INODE_SINGLE_INDIRECT_BLOCKS) < INODE_DOUBLE_INDIRECT_BLOCKS) {
-        level level1 = {.blockptr = inode->data_double_indirect};
-        block_read(level1.blockptr, &level1.block);
-
-        level level2 = {.blockptr = level1.block.blocks[offset / INODE_SINGLE_INDIRECT_BLOCKS]};
-        block_read(level2.blockptr, &level2.block);
-        absolute_blockptr = level2.block.blocks[offset % INODE_SINGLE_INDIRECT_BLOCKS];
-
-        if (offset == 0) {
-            block_free(&level1.blockptr, 1);
-
-            // FIXME: just for debugging
-            inode->data_double_indirect = 0;
-        }
-        if (offset % INODE_SINGLE_INDIRECT_BLOCKS == 0) block_free(&level2.blockptr, 1);
-    } else if ((offset -= INODE_DOUBLE_INDIRECT_BLOCKS) < INODE_TRIPLE_INDIRECT_BLOCKS) {
-        level level1 = {.blockptr = inode->data_triple_indirect};
-        block_read(level1.blockptr, &level1.block);
-
-        level level2 = {.blockptr = level1.block.blocks[offset / INODE_DOUBLE_INDIRECT_BLOCKS]};
-        block_read(level2.blockptr, &level2.block);
-
-        level level3 = {.blockptr = level2.block.blocks[offset % INODE_DOUBLE_INDIRECT_BLOCKS]};
-        block_read(level3.blockptr, &level3.block);
-        absolute_blockptr = level3.block.blocks[offset % INODE_SINGLE_INDIRECT_BLOCKS];
-
-        if (offset == 0) {
-            block_free(&level1.blockptr, 1);
+    return inode_truncate(inode, inode->block_count - 1);
+}
 
-            // FIXME: just for debugging
-            inode->data_triple_indirect = 0;
-        }
-        if (offset % INODE_DOUBLE_INDIRECT_BLOCKS == 0) block_free(&level2.blockptr, 1);
-        if (offset % INODE_SINGLE_INDIRECT_BLOCKS == 0) block_free(&level3.blockptr, 1);
-    } else {
-        // this block should not be reached ever
-        LOG("relative data offset out of bounds");
+// read inode, open files are served from their handle, which needs the inode lock (shared is enough)
+// lookups without it read the inode table with inode_read_table
+stzfs_error_t inode_read(int64_t inodeptr, inode_t* inode) {
+    if (!inodeptr_is_valid(inodeptr)) {
+        LOG("invalid inodeptr given");
         return ERROR;
     }
 
-    if (absolute_blockptr) block_free(&absolute_blockptr, 1);
-    return SUCCESS;
+    if (handle_read_inode(inodeptr, inode)) {
+        return SUCCESS;
+    }
+
+    return inode_read_table(inodeptr, inode);
 }
 
-// read inode from disk
-stzfs_error_t inode_read(int64_t inodeptr, inode_t* inode) {
+// read inode from the inode table, through the inode cache
+stzfs_error_t inode_read_table(int64_t inodeptr, inode_t* inode) {
     if (!inodeptr_is_valid(inodeptr)) {
         LOG("invalid inodeptr given");
         return ERROR;
@@ -322,29 +411,84 @@ stzfs_error_t inode_read(int64_t inodeptr, inode_t* inode) {
         return ERROR;
     }
 
+    if (inode_cache_get(inodeptr, inode)) {
+        return SUCCESS;
+    }
+
     const super_block* sb = super_block_cache;
 
     // get inode table block
     const int64_t inode_table_block_offset = inodeptr / (STZFS_BLOCK_SIZE / sizeof(inode_t));
     const int64_t inode_table_blockptr = sb->inode_table + inode_table_block_offset;
+    pthread_mutex_t* lock = &table_locks[inode_table_block_offset % INODE_TABLE_LOCKS];
     inode_block inode_table_block;
+    pthread_mutex_lock(lock);
     block_read(inode_table_blockptr, &inode_table_block);
 
-    // read inode from inode table block
+    // read inode from inode table block, it is cached before the table block can change
     *inode = inode_table_block.inodes[inodeptr % (STZFS_BLOCK_SIZE / sizeof(inode_t))];
+    inode_cache_fill(inodeptr, inode);
+    pthread_mutex_unlock(lock);
+
+    return SUCCESS;
+}
+
+// read a few inodes through the inode cache, missing inodes sharing a table block are read with one block read
+stzfs_error_t inode_read_table_batch(const int64_t* inodeptrs, size_t count, inode_t* inodes) {
+    for (size_t i = 0; i < count; i++) {
+        if (!inodeptr_is_valid(inodeptrs[i]) || !bitmap_is_inode_allocated(inodeptrs[i])) {
+            LOG("invalid or unallocated inodeptr given");
+            return ERROR;
+        }
+    }
+
+    bool cached[count];
+    for (size_t i = 0; i < count; i++) {
+        cached[i] = inode_cache_get(inodeptrs[i], &inodes[i]);
+    }
+
+    const super_block* sb = super_block_cache;
+    for (size_t i = 0; i < count; i++) {
+        // skip table blocks that were read for an earlier inode already
+        const int64_t table_block_offset = inodeptrs[i] / INODE_BLOCK_ENTRIES;
+        bool read = cached[i];
+        for (size_t j = 0; j < i && !read; j++) {
+            read = !cached[j] && inodeptrs[j] / INODE_BLOCK_ENTRIES == table_block_offset;
+        }
+        if (read) {
+            continue;
+        }
+
+        pthread_mutex_t* lock = &table_locks[table_block_offset % INODE_TABLE_LOCKS];
+        inode_block table_block;
+        pthread_mutex_lock(lock);
+        block_read(sb->inode_table + table_block_offset, &table_block);
+        for (size_t j = i; j < count; j++) {
+            if (!cached[j] && inodeptrs[j] / INODE_BLOCK_ENTRIES == table_block_offset) {
+                inodes[j] = table_block.inodes[inodeptrs[j] % INODE_BLOCK_ENTRIES];
+                inode_cache_fill(inodeptrs[j], &inodes[j]);
+            }
+        }
+        pthread_mutex_unlock(lock);
+    }
 
     return SUCCESS;
 }
 
 // read inode data block with relative offset
-stzfs_error_t inode_read_data_block(inode_t* inode, int64_t offset, void* block, int64_t* blockptr_out) {
+stzfs_error_t inode_read_data_block(inode_t* inode, inode_map_t* map, int64_t offset, void* block,
+                                    int64_t* blockptr_out) {
     if (offset < 0 || offset >= inode->block_count) {
         LOG("inode data block offset out of range");
         return ERROR;
     }
 
     int64_t blockptr;
-    inode_find_data_blockptr(inode, offset, ALLOC_SPARSE_NO, &blockptr);
+    if (map != NULL) {
+        inode_map_find_data_blockptr(inode, map, offset, ALLOC_SPARSE_NO, &blockptr);
+    } else {
+        inode_find_data_blockptr(inode, offset, ALLOC_SPARSE_NO, &blockptr);
+    }
     block_read(blockptr, block);
 
     if (blockptr_out != NULL) {
@@ -354,20 +498,42 @@ stzfs_error_t inode_read_data_block(inode_t* inode, int64_t offset, void* block,
 }
 
 // read data blocks of an inode and store them to a buffer
-stzfs_error_t inode_read_data_blocks(inode_t* inode, void* block_arr, size_t length, int64_t offset) {
+stzfs_error_t inode_read_data_blocks(inode_t* inode, inode_map_t* map, void* block_arr, size_t length,
+                                     int64_t offset) {
     if (offset < 0 || (offset + length) > inode->block_count) {
         LOG("inode data block offset out of range");
         return ERROR;
     }
 
     int64_t blockptr_arr[length];
-    inode_find_data_blockptrs(inode, offset, blockptr_arr, length);
-    block_readall(blockptr_arr, block_arr, length);
-    return SUCCESS;
+    inode_find_data_blockptrs(inode, map, offset, blockptr_arr, length);
+    return block_readall(blockptr_arr, block_arr, length);
 }
 
-// write inode to disk
+// write inode, open files only update their handle until it is flushed
 stzfs_error_t inode_write(int64_t inodeptr, const inode_t* inode) {
+    if (!inodeptr_is_valid(inodeptr)) {
+        LOG("illegal inodeptr given");
+        return ERROR;
+    }
+
+    handle_t* handle = handle_find(inodeptr);
+    if (handle != NULL) {
+        // the block map may have been changed behind the back of the handle
+        if (inode != &handle->inode) {
+            handle->inode = *inode;
+            inode_map_reset(&handle->map);
+        }
+        handle->dirty = true;
+        return SUCCESS;
+    }
+
+    return inode_write_table(inodeptr, inode);
+}
+
+// write inode to the inode table, the inode cache holds it back until inode_flush_table if it has room and
+// the block cache holds the table block back after that, use inode_write_table_sync where the order on disk matters
+stzfs_error_t inode_write_table(int64_t inodeptr, const inode_t* inode) {
     if (!inodeptr_is_valid(inodeptr)) {
         LOG("illegal inodeptr given");
         return ERROR;
@@ -376,30 +542,154 @@ stzfs_error_t inode_write(int64_t inodeptr, const inode_t* inode) {
         return ERROR;
     }
 
+    if (inode_cache_put(inodeptr, inode)) {
+        return SUCCESS;
+    }
+
     const super_block* sb = super_block_cache;
 
     int64_t table_block_offset = inodeptr / INODE_BLOCK_ENTRIES;
 
     // place inode in table and write back table block
     int64_t table_blockptr = sb->inode_table + table_block_offset;
+    pthread_mutex_t* lock = &table_locks[table_block_offset % INODE_TABLE_LOCKS];
     inode_block table_block;
+    pthread_mutex_lock(lock);
     block_read(table_blockptr, &table_block);
     table_block.inodes[inodeptr % INODE_BLOCK_ENTRIES] = *inode;
     block_write(table_blockptr, &table_block);
+    inode_cache_update(inodeptr, inode);
+    pthread_mutex_unlock(lock);
+
+    return SUCCESS;
+}
+
+// write inode to the inode table and wait until it is on disk, for inodes that on-disk pointers are persisted
+// to right after (eg. the orphan list), the other dirty inodes of its table block go along
+stzfs_error_t inode_write_table_sync(int64_t inodeptr, const inode_t* inode) {
+    if (!inodeptr_is_valid(inodeptr)) {
+        LOG("illegal inodeptr given");
+        return ERROR;
+    } else if (!bitmap_is_inode_allocated(inodeptr)) {
+        LOG("inodeptr is not allocated");
+        return ERROR;
+    }
+
+    const super_block* sb = super_block_cache;
+
+    // bypass the block cache, it would hold the table block back as well
+    const int64_t table_block_offset = inodeptr / INODE_BLOCK_ENTRIES;
+    const int64_t table_blockptr = sb->inode_table + table_block_offset;
+    pthread_mutex_t* lock = &table_locks[table_block_offset % INODE_TABLE_LOCKS];
+    inode_block table_block;
+    pthread_mutex_lock(lock);
+    stzfs_error_t error = block_read(table_blockptr, &table_block);
+    if (!error) {
+        inode_cache_collect(table_block_offset, &table_block);
+        table_block.inodes[inodeptr % INODE_BLOCK_ENTRIES] = *inode;
+        error = block_writeall(&table_blockptr, &table_block, 1);
+    }
+    if (!error) {
+        inode_cache_written(table_block_offset, &table_block);
+        inode_cache_update(inodeptr, inode);
+    }
+    pthread_mutex_unlock(lock);
+
+    // only this block has to reach the disk, a full sync would wait for every dirty page of the image
+    if (error || disk_sync_range((off_t)table_blockptr * STZFS_BLOCK_SIZE, STZFS_BLOCK_SIZE)) {
+        LOG("could not write inode table block through to disk");
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+// write back the dirty inodes of the inode cache, all dirty inodes of a table block with one block write
+stzfs_error_t inode_flush_table(void) {
+    const super_block* sb = super_block_cache;
+
+    // inodes changed meanwhile are left to the next flush
+    inode_cache_stats_t stats;
+    inode_cache_get_stats(&stats);
+    int64_t table_block_offset;
+    for (size_t rounds = stats.dirty; rounds > 0 && inode_cache_next_dirty(&table_block_offset); rounds--) {
+        const int64_t table_blockptr = sb->inode_table + table_block_offset;
+        pthread_mutex_t* lock = &table_locks[table_block_offset % INODE_TABLE_LOCKS];
+        inode_block table_block;
+        pthread_mutex_lock(lock);
+        stzfs_error_t error = block_read(table_blockptr, &table_block);
+        if (!error && inode_cache_collect(table_block_offset, &table_block) > 0) {
+            error = block_write(table_blockptr, &table_block);
+            if (!error) {
+                inode_cache_written(table_block_offset, &table_block);
+            }
+        }
+        pthread_mutex_unlock(lock);
+
+        if (error) {
+            LOG("could not write back inode table block");
+            return ERROR;
+        }
+    }
 
     return SUCCESS;
 }
 
 // read inode data block with relative offset
-stzfs_error_t inode_write_data_block(inode_t* inode, int64_t offset, const void* block) {
+stzfs_error_t inode_write_data_block(inode_t* inode, inode_map_t* map, int64_t offset, const void* block) {
     if (offset < 0 || offset > inode->block_count) {
         LOG("inode data block offset out of bounds");
         return ERROR;
     }
 
+    // a failed lookup leaves an invalid blockptr that block_write rejects
     int64_t blockptr;
-    inode_find_data_blockptr(inode, offset, ALLOC_SPARSE_YES, &blockptr);
-    block_write(blockptr, block);
+    if (map != NULL) {
+        inode_map_find_data_blockptr(inode, map, offset, ALLOC_SPARSE_YES, &blockptr);
+    } else {
+        inode_find_data_blockptr(inode, offset, ALLOC_SPARSE_YES, &blockptr);
+    }
+    return block_write(blockptr, block);
+}
+
+// write consecutive inode data blocks starting at the given relative offset
+stzfs_error_t inode_write_data_blocks(inode_t* inode, inode_map_t* map, const void* block_arr, size_t length,
+                                      int64_t offset) {
+    if (offset < 0 || (offset + length) > inode->block_count) {
+        LOG("inode data block offset out of range");
+        return ERROR;
+    }
+
+    inode_map_t local_map;
+    if (map == NULL) {
+        inode_map_init(&local_map, 0);
+        map = &local_map;
+    }
+
+    // fill holes with as few physically consecutive runs as possible first
+    inode_run_t run_arr[length];
+    size_t run_count;
+    if (inode_alloc_data_range(inode, map, offset, length) ||
+        inode_find_data_runs(inode, map, offset, length, run_arr, &run_count)) {
+        return ERROR;
+    }
+
+    int64_t blockptr_arr[length];
+    expand_runs(run_arr, run_count, blockptr_arr, false);
+    if (block_writeall(blockptr_arr, block_arr, length)) {
+        return ERROR;
+    }
+
+    // preallocated blocks only become visible once their data is on disk
+    for (size_t run = 0; run < run_count; run++) {
+        if (run_arr[run].unwritten) {
+            forget_blockptrs(map, offset, run_arr[run].length);
+            map->extent.length = 0;
+            if (extent_mark_written(inode, offset, offset + run_arr[run].length)) return ERROR;
+        }
+        offset += run_arr[run].length;
+    }
+
     return SUCCESS;
 }
 
@@ -412,7 +702,7 @@ stzfs_error_t inode_write_or_alloc_data_block(inode_t* inode, int64_t offset, co
     }
 
     if (offset < inode->block_count) {
-        inode_write_data_block(inode, offset, block);
+        inode_write_data_block(inode, NULL, offset, block);
     } else {
         inode_alloc_data_block(inode, block);
     }
@@ -420,90 +710,608 @@ stzfs_error_t inode_write_or_alloc_data_block(inode_t* inode, int64_t offset, co
     return SUCCESS;
 }
 
+// set up an empty inode map for the given owner
+void inode_map_init(inode_map_t* map, int64_t inodeptr) {
+    map->inodeptr = inodeptr;
+    inode_map_reset(map);
+}
+
+// forget all cached translations of a block map, its owner is kept
+void inode_map_reset(inode_map_t* map) {
+    for (size_t level = 0; level < 3; level++) {
+        map->level_blockptrs[level] = BLOCKPTR_ERROR;
+    }
+    map->extent.length = 0;
+    for (size_t slot = 0; slot < INODE_MAP_SLOTS; slot++) {
+        map->offsets[slot] = -1;
+    }
+    map->block_count = -1;
+}
+
 // translate relative inode data block offset to absolute blockptr
 stzfs_error_t inode_find_data_blockptr(inode_t* inode, int64_t offset, alloc_sparse_t alloc_sparse,
                                        int64_t* blockptr_out) {
-    if (offset > inode->block_count) {
-        LOG("relative data block offset out of bounds");
+    inode_map_t map;
+    inode_map_init(&map, 0);
+    return inode_map_find_data_blockptr(inode, &map, offset, alloc_sparse, blockptr_out);
+}
+
+// translate relative data block offset of an extent mapped inode to absolute blockptr
+static stzfs_error_t find_extent_blockptr(inode_t* inode, inode_map_t* map, int64_t offset,
+                                          alloc_sparse_t alloc_sparse, int64_t* blockptr_out) {
+    extent_t* extent = &map->extent;
+    if (extent->length == 0 || offset < extent->logical || offset >= extent->logical + extent->length) {
+        if (extent_find(inode, offset, extent)) {
+            extent->length = 0;
+            *blockptr_out = BLOCKPTR_ERROR;
+            return ERROR;
+        }
+    }
+
+    if (extent->physical != NULL_BLOCKPTR && !(extent->flags & EXTENT_UNWRITTEN)) {
+        *blockptr_out = extent->physical + (offset - extent->logical);
+        return SUCCESS;
+    } else if (!alloc_sparse) {
+        // preallocated blocks read as zeroes until they are written
+        *blockptr_out = NULL_BLOCKPTR;
+        return SUCCESS;
+    } else if (extent->physical != NULL_BLOCKPTR) {
+        // the block is about to be written, the cached extent is outdated afterwards
+        const int64_t blockptr = extent->physical + (offset - extent->logical);
+        extent->length = 0;
+        if (extent_mark_written(inode, offset, offset + 1)) {
+            *blockptr_out = BLOCKPTR_ERROR;
+            return ERROR;
+        }
+
+        *blockptr_out = blockptr;
+        return SUCCESS;
+    }
+
+    // fill the hole, the cached extent is outdated afterwards
+    int64_t new_blockptr, allocated;
+    if (block_alloc_range(find_goal(inode, map, offset), 1, &new_blockptr, &allocated)) {
         *blockptr_out = BLOCKPTR_ERROR;
         return ERROR;
-    } else if (offset >= INODE_MAX_BLOCKS) {
-        LOG("relative data block offset out of absolute bounds");
+    }
+
+    extent->length = 0;
+    const extent_t new_extent = {.logical = offset, .physical = new_blockptr, .length = 1};
+    if (extent_insert(inode, &new_extent)) {
         *blockptr_out = BLOCKPTR_ERROR;
         return ERROR;
     }
 
-    typedef struct level {
-        int64_t blockptr;
-        indirect_block block;
-    } level;
+    *blockptr_out = new_blockptr;
+    return SUCCESS;
+}
 
-    level level1, level2, level3;
-    level* last_level = NULL;
+// drop the map if the block count of the inode changed since it was filled
+static void check_map(inode_t* inode, inode_map_t* map) {
+    // appending or truncating rewrites the indirect blocks behind the back of the map
+    if (map->block_count != inode->block_count) {
+        inode_map_reset(map);
+        map->block_count = inode->block_count;
+    }
+}
 
-    blockptr_t* absolute_blockptr;
-    if (offset < INODE_DIRECT_BLOCKS) {
-        absolute_blockptr = &inode->data_direct[offset];
-    } else if ((offset -= INODE_DIRECT_BLOCKS) < INODE_SINGLE_INDIRECT_BLOCKS) {
-        level1.blockptr = inode->data_single_indirect;
-        block_read(level1.blockptr, &level1.block);
-        absolute_blockptr = &level1.block.blocks[offset];
+// walk down the indirect blocks to the entry of a relative data block offset and only read the
+// levels the map does not hold yet, span_out receives the entries left in the same pointer array
+static blockptr_t* walk_indirect_blocks(inode_t* inode, inode_map_t* map, int64_t offset, size_t* depth_out,
+                                        size_t* span_out) {
+    // find indirection depth and the entry index on every level
+    size_t depth;
+    int64_t blockptr;
+    size_t index[3];
+    int64_t relative_offset = offset;
+    if (relative_offset < INODE_DIRECT_BLOCKS) {
+        depth = 0;
+    } else if ((relative_offset -= INODE_DIRECT_BLOCKS) < INODE_SINGLE_INDIRECT_BLOCKS) {
+        depth = 1;
+        blockptr = inode->data_single_indirect;
+        index[0] = relative_offset;
+    } else if ((relative_offset -= INODE_SINGLE_INDIRECT_BLOCKS) < INODE_DOUBLE_INDIRECT_BLOCKS) {
+        depth = 2;
+        blockptr = inode->data_double_indirect;
+        index[0] = relative_offset / INODE_SINGLE_INDIRECT_BLOCKS;
+        index[1] = relative_offset % INDIRECT_BLOCK_ENTRIES;
+    } else if ((relative_offset -= INODE_DOUBLE_INDIRECT_BLOCKS) < INODE_TRIPLE_INDIRECT_BLOCKS) {
+        depth = 3;
+        blockptr = inode->data_triple_indirect;
+        index[0] = relative_offset / INODE_DOUBLE_INDIRECT_BLOCKS;
+        index[1] = (relative_offset % INODE_DOUBLE_INDIRECT_BLOCKS) / INODE_SINGLE_INDIRECT_BLOCKS;
+        index[2] = relative_offset % INDIRECT_BLOCK_ENTRIES;
+    } else {
+        LOG("relative block offset out of bounds");
+        return NULL;
+    }
 
-        if (alloc_sparse) last_level = &level1;
-    } else if ((offset -= INODE_SINGLE_INDIRECT_BLOCKS) < INODE_DOUBLE_INDIRECT_BLOCKS) {
-        level1.blockptr = inode->data_double_indirect;
-        block_read(level1.blockptr, &level1.block);
+    *depth_out = depth;
+    if (depth == 0) {
+        *span_out = INODE_DIRECT_BLOCKS - offset;
+        return &inode->data_direct[offset];
+    }
 
-        level2.blockptr = level1.block.blocks[offset / INODE_SINGLE_INDIRECT_BLOCKS];
-        block_read(level2.blockptr, &level2.block);
-        absolute_blockptr = &level2.block.blocks[offset % INDIRECT_BLOCK_ENTRIES];
+    for (size_t level = 0; level < depth; level++) {
+        if (map->level_blockptrs[level] != blockptr) {
+            if (block_read(blockptr, map->levels[level])) {
+                LOG("could not read indirect block");
+                map->level_blockptrs[level] = BLOCKPTR_ERROR;
+                return NULL;
+            }
+            map->level_blockptrs[level] = blockptr;
+        }
+        blockptr = map->levels[level][index[level]];
+    }
 
-        if (alloc_sparse) last_level = &level2;
-    } else if ((offset -= INODE_DOUBLE_INDIRECT_BLOCKS) < INODE_TRIPLE_INDIRECT_BLOCKS) {
-        level1.blockptr = inode->data_triple_indirect;
-        block_read(level1.blockptr, &level1.block);
+    *span_out = INDIRECT_BLOCK_ENTRIES - index[depth - 1];
+    return &map->levels[depth - 1][index[depth - 1]];
+}
+
+// translate relative inode data block offset to absolute blockptr and reuse what the map knows
+stzfs_error_t inode_map_find_data_blockptr(inode_t* inode, inode_map_t* map, int64_t offset,
+                                           alloc_sparse_t alloc_sparse, int64_t* blockptr_out) {
+    if (offset > inode->block_count) {
+        LOG("relative data block offset out of bounds");
+        *blockptr_out = BLOCKPTR_ERROR;
+        return ERROR;
+    } else if (offset >= INODE_MAX_BLOCKS) {
+        LOG("relative data block offset out of absolute bounds");
+        *blockptr_out = BLOCKPTR_ERROR;
+        return ERROR;
+    }
 
-        level2.blockptr = level1.block.blocks[offset / INODE_DOUBLE_INDIRECT_BLOCKS];
-        block_read(level2.blockptr, &level2.block);
+    check_map(inode, map);
 
-        level3.blockptr = level2.block.blocks[(offset % INODE_DOUBLE_INDIRECT_BLOCKS) / INODE_SINGLE_INDIRECT_BLOCKS];
-        block_read(level3.blockptr, &level3.block);
-        absolute_blockptr = &level3.block.blocks[offset % INDIRECT_BLOCK_ENTRIES];
+    const size_t slot = offset % INODE_MAP_SLOTS;
+    if (map->offsets[slot] == offset && (!alloc_sparse || map->blockptrs[slot] != NULL_BLOCKPTR)) {
+        *blockptr_out = map->blockptrs[slot];
+        return SUCCESS;
+    }
 
-        if (alloc_sparse) last_level = &level3;
-    } else {
-        LOG("relative block offset out of bounds");
+    if (inode->mode & M_EXTENTS) {
+        if (find_extent_blockptr(inode, map, offset, alloc_sparse, blockptr_out)) return ERROR;
+        map->offsets[slot] = offset;
+        map->blockptrs[slot] = *blockptr_out;
+        return SUCCESS;
+    }
+
+    size_t depth, span;
+    blockptr_t* absolute_blockptr = walk_indirect_blocks(inode, map, offset, &depth, &span);
+    if (absolute_blockptr == NULL) {
         *blockptr_out = BLOCKPTR_ERROR;
         return ERROR;
     }
 
     if (alloc_sparse && *absolute_blockptr == NULL_BLOCKPTR) {
-        int64_t new_blockptr;
-        block_allocptr(&new_blockptr);
+        // looking up the goal may replace the cached indirect blocks
+        const int64_t goal = find_goal(inode, map, offset);
+        absolute_blockptr = walk_indirect_blocks(inode, map, offset, &depth, &span);
+
+        int64_t new_blockptr, allocated;
+        if (absolute_blockptr == NULL || block_alloc_range(goal, 1, &new_blockptr, &allocated)) {
+            *blockptr_out = BLOCKPTR_ERROR;
+            return ERROR;
+        }
         *absolute_blockptr = new_blockptr;
 
-        if (last_level != NULL) {
-            block_write(last_level->blockptr, &last_level->block);
+        if (depth > 0) {
+            block_write(map->level_blockptrs[depth - 1], map->levels[depth - 1]);
         }
     }
 
+    map->offsets[slot] = offset;
+    map->blockptrs[slot] = *absolute_blockptr;
+
     *blockptr_out = *absolute_blockptr;
     return SUCCESS;
 }
 
-// find inode blockptrs and store them in the given buffer
-stzfs_error_t inode_find_data_blockptrs(inode_t* inode, int64_t offset, int64_t* blockptr_arr,
-                                        size_t length) {
-    if (offset + length > inode->block_count) {
+// physical block right after the data block before offset, allocating it keeps the file contiguous
+static int64_t find_goal(inode_t* inode, inode_map_t* map, int64_t offset) {
+    // without a previous block start in the group of the inode if it is known
+    const int64_t fallback = map != NULL ? group_block_goal(map->inodeptr) : NULL_BLOCKPTR;
+
+    int64_t blockptr;
+    if (offset <= 0 || offset > inode->block_count) {
+        return fallback;
+    } else if (map != NULL) {
+        if (inode_map_find_data_blockptr(inode, map, offset - 1, ALLOC_SPARSE_NO, &blockptr)) return fallback;
+    } else if (inode_find_data_blockptr(inode, offset - 1, ALLOC_SPARSE_NO, &blockptr)) {
+        return fallback;
+    }
+
+    return blockptr_is_valid(blockptr) ? blockptr + 1 : fallback;
+}
+
+// drop the cached blockptrs of a range of data blocks
+static void forget_blockptrs(inode_map_t* map, int64_t offset, int64_t length) {
+    for (int64_t i = offset; i < offset + MIN(length, INODE_MAP_SLOTS); i++) {
+        if (map->offsets[i % INODE_MAP_SLOTS] >= offset && map->offsets[i % INODE_MAP_SLOTS] < offset + length) {
+            map->offsets[i % INODE_MAP_SLOTS] = -1;
+        }
+    }
+}
+
+// point a range of unmapped data blocks to consecutive physical blocks, extents of preallocated
+// blocks are marked unwritten
+static stzfs_error_t map_data_blocks(inode_t* inode, inode_map_t* map, int64_t offset, int64_t blockptr,
+                                     int64_t length, bool unwritten) {
+    forget_blockptrs(map, offset, length);
+
+    if (inode->mode & M_EXTENTS) {
+        map->extent.length = 0;
+        while (length > 0) {
+            const extent_t extent = {
+                .logical = offset,
+                .physical = blockptr,
+                .length = MIN(length, EXTENT_MAX_LENGTH),
+                .flags = unwritten ? EXTENT_UNWRITTEN : 0,
+            };
+            if (extent_insert(inode, &extent)) return ERROR;
+
+            offset += extent.length;
+            blockptr += extent.length;
+            length -= extent.length;
+        }
+        return SUCCESS;
+    }
+
+    while (length > 0) {
+        size_t depth, span;
+        blockptr_t* entries = walk_indirect_blocks(inode, map, offset, &depth, &span);
+        if (entries == NULL) return ERROR;
+
+        span = MIN(span, (size_t)length);
+        for (size_t i = 0; i < span; i++) {
+            entries[i] = blockptr + i;
+        }
+        if (depth > 0 && block_write(map->level_blockptrs[depth - 1], map->levels[depth - 1])) return ERROR;
+
+        offset += span;
+        blockptr += span;
+        length -= span;
+    }
+
+    return SUCCESS;
+}
+
+// overwrite consecutive physical blocks with zeroes
+static stzfs_error_t zero_blocks(int64_t blockptr, int64_t length) {
+    void* zeroes = block_buffer_alloc(MIN(length, INODE_ZERO_BLOCKS));
+    if (zeroes == NULL) {
+        return ERROR;
+    }
+    memset(zeroes, 0, MIN(length, INODE_ZERO_BLOCKS) * STZFS_BLOCK_SIZE);
+
+    stzfs_error_t error = SUCCESS;
+    while (length > 0 && !error) {
+        const int64_t count = MIN(length, INODE_ZERO_BLOCKS);
+        int64_t blockptr_arr[count];
+        for (int64_t i = 0; i < count; i++) {
+            blockptr_arr[i] = blockptr + i;
+        }
+
+        error = block_writeall(blockptr_arr, zeroes, count);
+        blockptr += count;
+        length -= count;
+    }
+
+    block_buffer_free(zeroes);
+    return error;
+}
+
+// back all holes in a range of data blocks with new blocks, every hole is filled with as few
+// physically consecutive runs as possible that continue the blocks in front of it
+// preallocated blocks are mapped unwritten, without extents they have to be zeroed instead
+static stzfs_error_t alloc_data_range(inode_t* inode, inode_map_t* map, int64_t offset, size_t length,
+                                      bool prealloc) {
+    if (length == 0) {
+        return SUCCESS;
+    }
+
+    inode_map_t local_map;
+    if (map == NULL) {
+        inode_map_init(&local_map, 0);
+        map = &local_map;
+    }
+
+    inode_run_t run_arr[length];
+    size_t run_count;
+    if (inode_find_data_runs(inode, map, offset, length, run_arr, &run_count)) return ERROR;
+
+    int64_t goal = find_goal(inode, map, offset);
+    for (size_t run = 0; run < run_count; run++) {
+        int64_t remaining = run_arr[run].length;
+        if (run_arr[run].blockptr != NULL_BLOCKPTR) {
+            goal = run_arr[run].blockptr + remaining;
+            offset += remaining;
+            continue;
+        }
+
+        while (remaining > 0) {
+            int64_t blockptr, allocated;
+            if (block_alloc_range(goal, remaining, &blockptr, &allocated)) {
+                return ERROR;
+            }
+
+            const bool unwritten = prealloc && (inode->mode & M_EXTENTS);
+            if ((prealloc && !unwritten && zero_blocks(blockptr, allocated)) ||
+                map_data_blocks(inode, map, offset, blockptr, allocated, unwritten)) {
+                return ERROR;
+            }
+
+            goal = blockptr + allocated;
+            offset += allocated;
+            remaining -= allocated;
+        }
+    }
+
+    return SUCCESS;
+}
+
+// back all holes in a range of data blocks with new blocks that are written right away
+stzfs_error_t inode_alloc_data_range(inode_t* inode, inode_map_t* map, int64_t offset, size_t length) {
+    return alloc_data_range(inode, map, offset, length, false);
+}
+
+// back all holes in a range of data blocks with new blocks that read as zeroes until they are written
+stzfs_error_t inode_prealloc_data_range(inode_t* inode, inode_map_t* map, int64_t offset, int64_t length) {
+    while (length > 0) {
+        const int64_t count = MIN(length, INODE_RANGE_BLOCKS);
+        if (alloc_data_range(inode, map, offset, count, true)) return ERROR;
+
+        offset += count;
+        length -= count;
+    }
+
+    return SUCCESS;
+}
+
+// turn a range of data blocks into a hole and free the blocks backing it, the block count is kept
+stzfs_error_t inode_unmap_data_range(inode_t* inode, inode_map_t* map, int64_t offset, int64_t length) {
+    if (offset < 0 || offset + length > inode->block_count) {
+        LOG("inode data block offset out of range");
+        return ERROR;
+    }
+
+    inode_map_t local_map;
+    if (map == NULL) {
+        inode_map_init(&local_map, 0);
+        map = &local_map;
+    }
+    check_map(inode, map);
+    forget_blockptrs(map, offset, length);
+
+    if (inode->mode & M_EXTENTS) {
+        map->extent.length = 0;
+        return extent_remove(inode, offset, offset + length);
+    }
+
+    while (length > 0) {
+        size_t depth, span;
+        blockptr_t* entries = walk_indirect_blocks(inode, map, offset, &depth, &span);
+        if (entries == NULL) return ERROR;
+
+        // clear the entries before their blocks can be reused
+        span = MIN(span, (size_t)length);
+        int64_t blockptr_arr[span];
+        size_t count = 0;
+        for (size_t i = 0; i < span; i++) {
+            if (entries[i] != NULL_BLOCKPTR) {
+                blockptr_arr[count++] = entries[i];
+                entries[i] = NULL_BLOCKPTR;
+            }
+        }
+        if (count > 0 && depth > 0 && block_write(map->level_blockptrs[depth - 1], map->levels[depth - 1])) {
+            return ERROR;
+        }
+        if (block_free(blockptr_arr, count)) return ERROR;
+
+        offset += span;
+        length -= span;
+    }
+
+    return SUCCESS;
+}
+
+// first data block, or hole if hole is set, in [offset, end) of an indirect subtree, end if there is none
+// every entry of the given block maps span blocks starting at base, null subtrees are skipped at once
+static stzfs_error_t seek_indirect(int64_t blockptr, int64_t span, int64_t base, int64_t offset, int64_t end,
+                                   bool hole, int64_t* offset_out) {
+    if (blockptr == NULL_BLOCKPTR) {
+        *offset_out = hole ? offset : end;
+        return SUCCESS;
+    }
+
+    indirect_block block;
+    if (block_read(blockptr, &block)) {
+        LOG("could not read indirect block");
+        return ERROR;
+    }
+
+    for (int64_t index = (offset - base) / span; index < INDIRECT_BLOCK_ENTRIES; index++) {
+        const int64_t first = MAX(offset, base + index * span);
+        const int64_t last = MIN(end, base + (index + 1) * span);
+        if (first >= end) {
+            break;
+        }
+
+        if (span == 1) {
+            if ((block.blocks[index] == NULL_BLOCKPTR) == hole) {
+                *offset_out = first;
+                return SUCCESS;
+            }
+            continue;
+        }
+
+        if (seek_indirect(block.blocks[index], span / INDIRECT_BLOCK_ENTRIES, base + index * span, first, last, hole,
+                          offset_out)) {
+            return ERROR;
+        } else if (*offset_out < last) {
+            return SUCCESS;
+        }
+    }
+
+    *offset_out = end;
+    return SUCCESS;
+}
+
+// find the first data block, or hole if hole is set, at or after the given offset without looking
+// at a single data block, preallocated blocks count as data, the block count is returned if there is none
+stzfs_error_t inode_seek(inode_t* inode, int64_t offset, bool hole, int64_t* offset_out) {
+    const int64_t end = inode->block_count;
+    *offset_out = end;
+    if (offset < 0) {
+        LOG("negative offsets are illegal");
+        return ERROR;
+    }
+
+    if (inode->mode & M_EXTENTS) {
+        while (offset < end) {
+            extent_t extent;
+            if (extent_find(inode, offset, &extent)) return ERROR;
+
+            if ((extent.physical == NULL_BLOCKPTR) == hole) {
+                *offset_out = offset;
+                return SUCCESS;
+            }
+            offset = extent.logical + extent.length;
+        }
+        return SUCCESS;
+    }
+
+    for (; offset < MIN(end, INODE_DIRECT_BLOCKS); offset++) {
+        if ((inode->data_direct[offset] == NULL_BLOCKPTR) == hole) {
+            *offset_out = offset;
+            return SUCCESS;
+        }
+    }
+
+    // every indirection level is a subtree with entries of growing span
+    const struct {
+        int64_t blockptr;
+        int64_t first;
+        int64_t span;
+    } levels[] = {
+        {inode->data_single_indirect, INODE_SINGLE_INDIRECT_OFFSET, 1},
+        {inode->data_double_indirect, INODE_DOUBLE_INDIRECT_OFFSET, INODE_SINGLE_INDIRECT_BLOCKS},
+        {inode->data_triple_indirect, INODE_TRIPLE_INDIRECT_OFFSET, INODE_DOUBLE_INDIRECT_BLOCKS},
+    };
+    for (size_t level = 0; level < 3 && offset < end; level++) {
+        const int64_t last = MIN(end, levels[level].first + levels[level].span * INDIRECT_BLOCK_ENTRIES);
+        if (offset >= last) {
+            continue;
+        }
+
+        if (seek_indirect(levels[level].blockptr, levels[level].span, levels[level].first,
+                          MAX(offset, levels[level].first), last, hole, offset_out)) {
+            return ERROR;
+        } else if (*offset_out < last) {
+            return SUCCESS;
+        }
+        offset = last;
+    }
+
+    *offset_out = end;
+    return SUCCESS;
+}
+
+// append blocks to the last run if they continue it, start a new run otherwise
+static void add_run(inode_run_t* run_arr, size_t* run_count, int64_t blockptr, int64_t length, bool unwritten) {
+    if (*run_count > 0) {
+        inode_run_t* last = &run_arr[*run_count - 1];
+        const bool both_holes = last->blockptr == NULL_BLOCKPTR && blockptr == NULL_BLOCKPTR;
+        const bool consecutive = last->blockptr != NULL_BLOCKPTR && blockptr == last->blockptr + last->length &&
+                                 last->unwritten == unwritten;
+        if (both_holes || consecutive) {
+            last->length += length;
+            return;
+        }
+    }
+
+    run_arr[(*run_count)++] = (inode_run_t) {.blockptr = blockptr, .length = length, .unwritten = unwritten};
+}
+
+// write the blockptrs of runs to a buffer, unwritten blocks may be reported as holes
+static void expand_runs(const inode_run_t* run_arr, size_t run_count, int64_t* blockptr_arr, bool unwritten_as_holes) {
+    size_t i = 0;
+    for (size_t run = 0; run < run_count; run++) {
+        const int64_t blockptr = unwritten_as_holes && run_arr[run].unwritten ? NULL_BLOCKPTR : run_arr[run].blockptr;
+        for (int64_t block = 0; block < run_arr[run].length; block++) {
+            blockptr_arr[i++] = blockptr == NULL_BLOCKPTR ? NULL_BLOCKPTR : blockptr + block;
+        }
+    }
+}
+
+// find the physically consecutive runs backing a range of inode data blocks, every indirect block
+// or extent is looked up once per range, holes are returned as runs of null blockptrs and
+// preallocated blocks as unwritten runs, run_arr has to hold up to length runs
+stzfs_error_t inode_find_data_runs(inode_t* inode, inode_map_t* map, int64_t offset, size_t length,
+                                   inode_run_t* run_arr, size_t* run_count) {
+    *run_count = 0;
+    if (offset < 0 || offset + length > inode->block_count) {
         LOG("relative data block offset out of range");
+        return ERROR;
+    }
+
+    inode_map_t local_map;
+    if (map == NULL) {
+        inode_map_init(&local_map, 0);
+        map = &local_map;
+    }
+    check_map(inode, map);
+
+    const int64_t end = offset + length;
+    while (offset < end) {
+        if (inode->mode & M_EXTENTS) {
+            extent_t* extent = &map->extent;
+            if (extent->length == 0 || offset < extent->logical || offset >= extent->logical + extent->length) {
+                if (extent_find(inode, offset, extent)) {
+                    extent->length = 0;
+                    return ERROR;
+                }
+            }
+
+            const int64_t span = MIN(extent->logical + extent->length - offset, end - offset);
+            const int64_t blockptr = extent->physical == NULL_BLOCKPTR ?
+                                     NULL_BLOCKPTR : extent->physical + (offset - extent->logical);
+            add_run(run_arr, run_count, blockptr, span,
+                    extent->physical != NULL_BLOCKPTR && (extent->flags & EXTENT_UNWRITTEN));
+            offset += span;
+            continue;
+        }
+
+        size_t depth, span;
+        const blockptr_t* entries = walk_indirect_blocks(inode, map, offset, &depth, &span);
+        if (entries == NULL) return ERROR;
+
+        span = MIN(span, (size_t)(end - offset));
+        for (size_t i = 0; i < span; i++) {
+            add_run(run_arr, run_count, entries[i], 1, false);
+        }
+        offset += span;
+    }
+
+    return SUCCESS;
+}
+
+// find inode blockptrs and store them in the given buffer, unwritten blocks read as holes
+stzfs_error_t inode_find_data_blockptrs(inode_t* inode, inode_map_t* map, int64_t offset,
+                                        int64_t* blockptr_arr, size_t length) {
+    if (length == 0) {
+        return SUCCESS;
+    }
+
+    inode_run_t run_arr[length];
+    size_t run_count;
+    if (inode_find_data_runs(inode, map, offset, length, run_arr, &run_count)) {
         for (size_t i = 0; i < length; i++) {
             blockptr_arr[i] = BLOCKPTR_ERROR;
         }
         return ERROR;
     }
 
-    for (size_t i = 0; i < length; i++) {
-        inode_find_data_blockptr(inode, i + offset, ALLOC_SPARSE_NO, &blockptr_arr[i]);
-    }
+    expand_runs(run_arr, run_count, blockptr_arr, true);
     return SUCCESS;
 }
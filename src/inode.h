@@ -6,6 +6,7 @@
 #include <time.h>
 
 #include "error.h"
+#include "extent.h"
 #include "types.h"
 
 // blocks each direction/indirection level can hold
@@ -30,12 +31,17 @@ typedef struct inode_t {
     struct timespec atime;
     struct timespec mtime;
     struct timespec ctime;
-    uint64_t atom_count;
+    uint64_t atom_count; // next orphan once the inode is on the orphan list
     uint32_t block_count;
-    blockptr_t data_direct[INODE_DIRECT_BLOCKS];
-    blockptr_t data_single_indirect;
-    blockptr_t data_double_indirect;
-    blockptr_t data_triple_indirect;
+    union {
+        struct {
+            blockptr_t data_direct[INODE_DIRECT_BLOCKS];
+            blockptr_t data_single_indirect;
+            blockptr_t data_double_indirect;
+            blockptr_t data_triple_indirect;
+        };
+        extent_root_t extents; // M_EXTENTS
+    };
 } inode_t;
 
 #define INODE_SIZE (sizeof(inode_t))
@@ -47,13 +53,36 @@ typedef struct file {
     inode_t inode;
 } file;
 
+// data blockptrs an inode map remembers
+#define INODE_MAP_SLOTS (64)
+
+// block map cache of an inode, keeps the indirect blocks or the extent of the last lookup and
+// recently resolved data blockptrs, it is dropped when the block count of the inode changes
+typedef struct inode_map_t {
+    blockptr_t levels[3][STZFS_BLOCK_SIZE / sizeof(blockptr_t)] STZFS_BLOCK_ALIGNED;
+    int64_t level_blockptrs[3];
+    extent_t extent; // M_EXTENTS, mapped or hole, empty if length is 0
+    int64_t offsets[INODE_MAP_SLOTS];
+    int64_t blockptrs[INODE_MAP_SLOTS];
+    int64_t block_count;
+    int64_t inodeptr; // owner, 0 if unknown, new data is placed in its group
+} inode_map_t;
+
+// physically consecutive data blocks of an inode, blockptr is NULL_BLOCKPTR for holes
+typedef struct inode_run_t {
+    int64_t blockptr;
+    int64_t length;
+    bool unwritten; // preallocated, reads as zeroes
+} inode_run_t;
+
 // sparse alloc enum helper
 typedef bool alloc_sparse_t;
 enum { ALLOC_SPARSE_NO = false, ALLOC_SPARSE_YES = true };
 
 // functions
-stzfs_error_t inode_allocptr(int64_t* inodeptr);
-stzfs_error_t inode_alloc(int64_t* inodeptr, const inode_t* inode);
+void inode_init_blocks(inode_t* inode);
+stzfs_error_t inode_allocptr(int64_t parent_inodeptr, bool directory, int64_t* inodeptr);
+stzfs_error_t inode_alloc(int64_t parent_inodeptr, int64_t* inodeptr, const inode_t* inode);
 stzfs_error_t inode_append_data_blockptr(inode_t* inode, int64_t blockptr);
 stzfs_error_t inode_alloc_data_block(inode_t* inode, const void* block);
 stzfs_error_t inode_append_null_blocks(inode_t* inode, int64_t block_count);
@@ -61,12 +90,26 @@ stzfs_error_t inode_free(int64_t inodeptr, inode_t* inode);
 stzfs_error_t inode_truncate(inode_t* inode, int64_t offset);
 stzfs_error_t inode_free_last_data_block(inode_t* inode);
 stzfs_error_t inode_read(int64_t inodeptr, inode_t* inode);
-stzfs_error_t inode_read_data_block(inode_t* inode, int64_t offset, void* block, int64_t* blockptr_out);
-stzfs_error_t inode_read_data_blocks(inode_t* inode, void* block_arr, size_t length, int64_t offset);
+stzfs_error_t inode_read_table(int64_t inodeptr, inode_t* inode);
+stzfs_error_t inode_read_table_batch(const int64_t* inodeptrs, size_t count, inode_t* inodes);
+stzfs_error_t inode_read_data_block(inode_t* inode, inode_map_t* map, int64_t offset, void* block, int64_t* blockptr_out);
+stzfs_error_t inode_read_data_blocks(inode_t* inode, inode_map_t* map, void* block_arr, size_t length, int64_t offset);
 stzfs_error_t inode_write(int64_t inodeptr, const inode_t* inode);
-stzfs_error_t inode_write_data_block(inode_t* inode, int64_t offset, const void* block);
+stzfs_error_t inode_write_table(int64_t inodeptr, const inode_t* inode);
+stzfs_error_t inode_write_table_sync(int64_t inodeptr, const inode_t* inode);
+stzfs_error_t inode_flush_table(void);
+stzfs_error_t inode_write_data_block(inode_t* inode, inode_map_t* map, int64_t offset, const void* block);
+stzfs_error_t inode_write_data_blocks(inode_t* inode, inode_map_t* map, const void* block_arr, size_t length, int64_t offset);
 stzfs_error_t inode_write_or_alloc_data_block(inode_t* inode, int64_t offset, const void* block);
+void inode_map_init(inode_map_t* map, int64_t inodeptr);
+void inode_map_reset(inode_map_t* map);
 stzfs_error_t inode_find_data_blockptr(inode_t* inode, int64_t offset, alloc_sparse_t alloc_sparse, int64_t* blockptr_out);
-stzfs_error_t inode_find_data_blockptrs(inode_t* inode, int64_t offset, int64_t* blockptr_arr, size_t length);
+stzfs_error_t inode_map_find_data_blockptr(inode_t* inode, inode_map_t* map, int64_t offset, alloc_sparse_t alloc_sparse, int64_t* blockptr_out);
+stzfs_error_t inode_alloc_data_range(inode_t* inode, inode_map_t* map, int64_t offset, size_t length);
+stzfs_error_t inode_prealloc_data_range(inode_t* inode, inode_map_t* map, int64_t offset, int64_t length);
+stzfs_error_t inode_unmap_data_range(inode_t* inode, inode_map_t* map, int64_t offset, int64_t length);
+stzfs_error_t inode_seek(inode_t* inode, int64_t offset, bool hole, int64_t* offset_out);
+stzfs_error_t inode_find_data_runs(inode_t* inode, inode_map_t* map, int64_t offset, size_t length, inode_run_t* run_arr, size_t* run_count);
+stzfs_error_t inode_find_data_blockptrs(inode_t* inode, inode_map_t* map, int64_t offset, int64_t* blockptr_arr, size_t length);
 
 #endif // STZFS_INODE_H
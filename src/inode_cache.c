@@ -0,0 +1,448 @@
+#include "inode_cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block_cache.h"
+#include "types.h"
+
+// default number of cached inodes (about 180 bytes each)
+#define INODE_CACHE_DEFAULT_ENTRIES 16384
+
+typedef struct inode_cache_entry_t {
+    int64_t inodeptr;
+    inode_t inode;
+    uint32_t refs; // referenced entries are never evicted
+    bool dirty;
+    struct inode_cache_entry_t* hash_next;
+    struct inode_cache_entry_t* prev; // lru list, most recently used first
+    struct inode_cache_entry_t* next; // lru list or free list
+    struct inode_cache_entry_t* dirty_prev; // dirty list, first dirtied first
+    struct inode_cache_entry_t* dirty_next;
+} inode_cache_entry_t;
+
+static inode_cache_entry_t** bucket_of(int64_t inodeptr);
+static inode_cache_entry_t* find_entry(int64_t inodeptr);
+static inode_cache_entry_t* alloc_entry(int64_t inodeptr);
+static void release_entry(inode_cache_entry_t* entry);
+static void touch_entry(inode_cache_entry_t* entry);
+static void set_dirty(inode_cache_entry_t* entry, bool dirty);
+static void* writeback_loop(void* arg);
+
+static size_t cache_entries = INODE_CACHE_DEFAULT_ENTRIES;
+static inode_cache_entry_t* entries = NULL;
+static inode_cache_entry_t** buckets = NULL;
+static int bucket_bits = 0;
+static inode_cache_entry_t* free_list = NULL;
+static inode_cache_entry_t lru = {.prev = &lru, .next = &lru};
+static inode_cache_entry_t dirty_list = {.dirty_prev = &dirty_list, .dirty_next = &dirty_list};
+static inode_cache_stats_t stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // guards all of the above once the cache is set up
+
+// writeback thread, woken early once half of the cache is dirty
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writeback_thread;
+static bool writeback_running = false;
+static bool writeback_stop = false;
+static bool writeback_wanted = false;
+
+// set the max number of cached inodes (has to be called before init, 0 disables the cache)
+void inode_cache_set_size(size_t count) {
+    cache_entries = count;
+}
+
+int inode_cache_init(void) {
+    inode_cache_dispose();
+
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = cache_entries;
+    if (stats.capacity == 0) {
+        return 0;
+    }
+
+    // keep hash chains short
+    bucket_bits = 1;
+    while (((size_t)1 << bucket_bits) < stats.capacity) {
+        bucket_bits++;
+    }
+
+    entries = calloc(stats.capacity, sizeof(inode_cache_entry_t));
+    buckets = calloc((size_t)1 << bucket_bits, sizeof(inode_cache_entry_t*));
+    if (entries == NULL || buckets == NULL) {
+        printf("inode_cache_init: could not allocate %zu cache entries\n", stats.capacity);
+        inode_cache_dispose();
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < stats.capacity; i++) {
+        entries[i].next = free_list;
+        free_list = &entries[i];
+    }
+
+    return 0;
+}
+
+// stop the writeback thread and write back all dirty inodes
+void inode_cache_dispose(void) {
+    if (writeback_running) {
+        pthread_mutex_lock(&writeback_lock);
+        writeback_stop = true;
+        pthread_cond_broadcast(&writeback_cond);
+        pthread_mutex_unlock(&writeback_lock);
+
+        if (pthread_join(writeback_thread, NULL)) {
+            printf("inode_cache_dispose: could not join writeback thread\n");
+        }
+        writeback_running = false;
+    }
+
+    if (stats.dirty > 0 && inode_flush_table()) {
+        printf("inode_cache_dispose: could not write back dirty inodes\n");
+    }
+
+    free(entries);
+    free(buckets);
+    entries = NULL;
+    buckets = NULL;
+    free_list = NULL;
+    lru.prev = &lru;
+    lru.next = &lru;
+    dirty_list.dirty_prev = &dirty_list;
+    dirty_list.dirty_next = &dirty_list;
+    stats.capacity = 0;
+    stats.used = 0;
+    stats.dirty = 0;
+}
+
+// write back dirty inodes and blocks every INODE_CACHE_WRITEBACK_INTERVAL seconds from now on
+int inode_cache_start_writeback(void) {
+    writeback_stop = false;
+    writeback_wanted = false;
+
+    const int err = pthread_create(&writeback_thread, NULL, writeback_loop, NULL);
+    if (err) {
+        printf("inode_cache_start_writeback: could not start writeback thread\n");
+        return -err;
+    }
+
+    writeback_running = true;
+    return 0;
+}
+
+// copy a cached inode, true on hit
+bool inode_cache_get(int64_t inodeptr, inode_t* inode) {
+    if (stats.capacity == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    inode_cache_entry_t* entry = find_entry(inodeptr);
+    if (entry == NULL) {
+        stats.misses++;
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    touch_entry(entry);
+    *inode = entry->inode;
+    stats.hits++;
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+// cache an inode read from the table, the caller holds the lock of its table block, a cached copy is never
+// replaced as it may be newer
+void inode_cache_fill(int64_t inodeptr, const inode_t* inode) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    inode_cache_entry_t* entry = find_entry(inodeptr);
+    if (entry == NULL) {
+        entry = alloc_entry(inodeptr);
+        if (entry != NULL) {
+            entry->inode = *inode;
+            touch_entry(entry);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// store a changed inode to be written back later, false if there is no room and it has to be written through
+bool inode_cache_put(int64_t inodeptr, const inode_t* inode) {
+    if (stats.capacity == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    inode_cache_entry_t* entry = find_entry(inodeptr);
+    if (entry == NULL) {
+        entry = alloc_entry(inodeptr);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+    }
+
+    entry->inode = *inode;
+    touch_entry(entry);
+    set_dirty(entry, true);
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+// refresh a cached inode after it has been written to the table directly
+void inode_cache_update(int64_t inodeptr, const inode_t* inode) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    inode_cache_entry_t* entry = find_entry(inodeptr);
+    if (entry != NULL) {
+        entry->inode = *inode;
+        set_dirty(entry, false);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// drop a freed inode without writing it back
+void inode_cache_invalidate(int64_t inodeptr) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    inode_cache_entry_t* entry = find_entry(inodeptr);
+    if (entry != NULL) {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        release_entry(entry);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// keep an inode cached until it is unreferenced (eg. while it is open), the caller holds its inode lock
+void inode_cache_ref(int64_t inodeptr, const inode_t* inode) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    inode_cache_entry_t* entry = find_entry(inodeptr);
+    if (entry == NULL) {
+        entry = alloc_entry(inodeptr);
+        if (entry != NULL) {
+            entry->inode = *inode;
+        }
+    }
+
+    if (entry != NULL) {
+        entry->refs++;
+        touch_entry(entry);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void inode_cache_unref(int64_t inodeptr) {
+    if (stats.capacity == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    inode_cache_entry_t* entry = find_entry(inodeptr);
+    if (entry != NULL && entry->refs > 0) {
+        entry->refs--;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// inode table block of the inode that has been dirty the longest, false if none is dirty
+bool inode_cache_next_dirty(int64_t* table_block_offset) {
+    pthread_mutex_lock(&lock);
+    const bool dirty = dirty_list.dirty_next != &dirty_list;
+    if (dirty) {
+        *table_block_offset = dirty_list.dirty_next->inodeptr / INODE_BLOCK_ENTRIES;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return dirty;
+}
+
+// copy the dirty inodes of an inode table block into it, the caller holds the lock of the table block and
+// writes it, then marks them clean with inode_cache_written, returns the number of inodes copied
+size_t inode_cache_collect(int64_t table_block_offset, inode_block* block) {
+    size_t count = 0;
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; stats.dirty > 0 && i < INODE_BLOCK_ENTRIES; i++) {
+        const inode_cache_entry_t* entry = find_entry(table_block_offset * INODE_BLOCK_ENTRIES + i);
+        if (entry != NULL && entry->dirty) {
+            block->inodes[i] = entry->inode;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+// mark the dirty inodes of an inode table block clean once it reached the disk, inodes changed since they
+// were collected stay dirty
+void inode_cache_written(int64_t table_block_offset, const inode_block* block) {
+    size_t count = 0;
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; stats.dirty > 0 && i < INODE_BLOCK_ENTRIES; i++) {
+        inode_cache_entry_t* entry = find_entry(table_block_offset * INODE_BLOCK_ENTRIES + i);
+        if (entry != NULL && entry->dirty && !memcmp(&entry->inode, &block->inodes[i], sizeof(inode_t))) {
+            set_dirty(entry, false);
+            count++;
+        }
+    }
+
+    if (count > 0) {
+        stats.writebacks++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void inode_cache_get_stats(inode_cache_stats_t* out) {
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+// hash bucket of an inodeptr
+static inode_cache_entry_t** bucket_of(int64_t inodeptr) {
+    const uint64_t hash = (uint64_t)inodeptr * 0x9e3779b97f4a7c15ULL;
+    return &buckets[hash >> (64 - bucket_bits)];
+}
+
+static inode_cache_entry_t* find_entry(int64_t inodeptr) {
+    for (inode_cache_entry_t* entry = *bucket_of(inodeptr); entry != NULL; entry = entry->hash_next) {
+        if (entry->inodeptr == inodeptr) return entry;
+    }
+
+    return NULL;
+}
+
+// take a free entry or evict the least recently used clean and unreferenced one, NULL if there is none
+static inode_cache_entry_t* alloc_entry(int64_t inodeptr) {
+    if (free_list == NULL) {
+        inode_cache_entry_t* victim = lru.prev;
+        while (victim != &lru && (victim->dirty || victim->refs > 0)) {
+            victim = victim->prev;
+        }
+        if (victim == &lru) {
+            return NULL;
+        }
+
+        victim->prev->next = victim->next;
+        victim->next->prev = victim->prev;
+        release_entry(victim);
+        stats.evictions++;
+    }
+
+    inode_cache_entry_t* entry = free_list;
+    free_list = entry->next;
+
+    // new entries are linked into the lru list by touch_entry
+    entry->inodeptr = inodeptr;
+    entry->refs = 0;
+    entry->dirty = false;
+    entry->prev = entry;
+    entry->next = entry;
+    inode_cache_entry_t** bucket = bucket_of(inodeptr);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    stats.used++;
+
+    return entry;
+}
+
+// remove an entry (already unlinked from the lru list) from its hash chain and free it
+static void release_entry(inode_cache_entry_t* entry) {
+    inode_cache_entry_t** link = bucket_of(entry->inodeptr);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    set_dirty(entry, false);
+    entry->next = free_list;
+    free_list = entry;
+    stats.used--;
+}
+
+// move an entry to the front of the lru list
+static void touch_entry(inode_cache_entry_t* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = &lru;
+    entry->next = lru.next;
+    lru.next->prev = entry;
+    lru.next = entry;
+}
+
+static void set_dirty(inode_cache_entry_t* entry, bool dirty) {
+    if (entry->dirty == dirty) {
+        return;
+    }
+
+    entry->dirty = dirty;
+    if (!dirty) {
+        entry->dirty_prev->dirty_next = entry->dirty_next;
+        entry->dirty_next->dirty_prev = entry->dirty_prev;
+        stats.dirty--;
+        return;
+    }
+
+    entry->dirty_prev = dirty_list.dirty_prev;
+    entry->dirty_next = &dirty_list;
+    dirty_list.dirty_prev->dirty_next = entry;
+    dirty_list.dirty_prev = entry;
+    stats.dirty++;
+
+    // do not wait for the interval once half of the cache is dirty
+    if (stats.dirty == stats.capacity / 2) {
+        pthread_mutex_lock(&writeback_lock);
+        writeback_wanted = true;
+        pthread_cond_signal(&writeback_cond);
+        pthread_mutex_unlock(&writeback_lock);
+    }
+}
+
+static void* writeback_loop(void* arg) {
+    pthread_mutex_lock(&writeback_lock);
+    while (!writeback_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += INODE_CACHE_WRITEBACK_INTERVAL;
+        while (!writeback_stop && !writeback_wanted &&
+               pthread_cond_timedwait(&writeback_cond, &writeback_lock, &deadline) == 0) {
+        }
+        if (writeback_stop) {
+            break;
+        }
+        writeback_wanted = false;
+
+        // the cache is written back without the thread lock, changing inodes may wake it meanwhile
+        pthread_mutex_unlock(&writeback_lock);
+        // the table blocks would only reach the block cache, flush it as well to bound what a crash loses
+        if (inode_flush_table() || block_cache_flush()) {
+            printf("inode_cache: could not write back dirty inodes\n");
+        }
+        pthread_mutex_lock(&writeback_lock);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+
+    return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef STZFS_INODE_CACHE_H
+#define STZFS_INODE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+#include "inode.h"
+
+// seconds between two write backs of the dirty inodes (and dirty blocks) to disk by the writeback thread
+#define INODE_CACHE_WRITEBACK_INTERVAL (5)
+
+typedef struct inode_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks; // inode table blocks written
+    size_t capacity; // in inodes
+    size_t used;
+    size_t dirty;
+} inode_cache_stats_t;
+
+// inodes of the inode table by inodeptr, dirty ones are written back by inode_flush_table (see inode.c),
+// referenced ones are never evicted
+void inode_cache_set_size(size_t inodes);
+int inode_cache_init(void);
+void inode_cache_dispose(void);
+int inode_cache_start_writeback(void);
+bool inode_cache_get(int64_t inodeptr, inode_t* inode);
+void inode_cache_fill(int64_t inodeptr, const inode_t* inode);
+bool inode_cache_put(int64_t inodeptr, const inode_t* inode);
+void inode_cache_update(int64_t inodeptr, const inode_t* inode);
+void inode_cache_invalidate(int64_t inodeptr);
+void inode_cache_ref(int64_t inodeptr, const inode_t* inode);
+void inode_cache_unref(int64_t inodeptr);
+bool inode_cache_next_dirty(int64_t* table_block_offset);
+size_t inode_cache_collect(int64_t table_block_offset, inode_block* block);
+void inode_cache_written(int64_t table_block_offset, const inode_block* block);
+void inode_cache_get_stats(inode_cache_stats_t* stats);
+
+#endif // STZFS_INODE_CACHE_H
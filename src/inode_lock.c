@@ -0,0 +1,42 @@
+#include "inode_lock.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+static pthread_rwlock_t stripes[INODE_LOCK_STRIPES] = {
+    [0 ... INODE_LOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+// stripe of an inodeptr, neighbouring inodes get different stripes
+static size_t stripe_of(int64_t inodeptr) {
+    return (uint64_t)inodeptr % INODE_LOCK_STRIPES;
+}
+
+void inode_lock_shared(int64_t inodeptr) {
+    pthread_rwlock_rdlock(&stripes[stripe_of(inodeptr)]);
+}
+
+void inode_lock_exclusive(int64_t inodeptr) {
+    pthread_rwlock_wrlock(&stripes[stripe_of(inodeptr)]);
+}
+
+void inode_unlock(int64_t inodeptr) {
+    pthread_rwlock_unlock(&stripes[stripe_of(inodeptr)]);
+}
+
+// lock two inodes exclusively in stripe order, an inodeptr of 0 is skipped
+void inode_lock_pair(int64_t a, int64_t b) {
+    if (a == 0 || (b != 0 && stripe_of(b) < stripe_of(a))) {
+        const int64_t swap = a;
+        a = b;
+        b = swap;
+    }
+
+    if (a != 0) inode_lock_exclusive(a);
+    if (b != 0 && stripe_of(b) != stripe_of(a)) inode_lock_exclusive(b);
+}
+
+void inode_unlock_pair(int64_t a, int64_t b) {
+    if (a != 0) inode_unlock(a);
+    if (b != 0 && (a == 0 || stripe_of(b) != stripe_of(a))) inode_unlock(b);
+}
@@ -0,0 +1,26 @@
+#ifndef STZFS_INODE_LOCK_H
+#define STZFS_INODE_LOCK_H
+
+#include <stdint.h>
+
+// reader/writer locks of inodes, inodes hashing to the same stripe share a lock
+#define INODE_LOCK_STRIPES (1024)
+
+// lock ordering, a lock is only taken while holding locks of earlier levels:
+//   1. namespace lock (stzfs.c), shared by path lookups, exclusive while directories are changed
+//   2. inode locks, shared to read an inode and its data, exclusive to change them
+//      operations that need two of them (rename, link) take them with inode_lock_pair, which
+//      orders the stripes, and only while holding the namespace lock exclusively
+//   3. orphan lock, then the super block lock
+//   4. block reservation lock or one group lock
+//   5. leaf locks: bitmap summaries, handle table, handle read state, inode table blocks,
+//      inode cache, block cache, disk
+// directories are never opened as files, so the exclusive namespace lock is enough to change them
+
+void inode_lock_shared(int64_t inodeptr);
+void inode_lock_exclusive(int64_t inodeptr);
+void inode_unlock(int64_t inodeptr);
+void inode_lock_pair(int64_t a, int64_t b);
+void inode_unlock_pair(int64_t a, int64_t b);
+
+#endif // STZFS_INODE_LOCK_H
@@ -0,0 +1,35 @@
+#ifndef STZFS_IOCTL_H
+#define STZFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// entries a single extent report can hold, larger files are reported piece by piece
+#define STZFS_REPORT_EXTENTS (32)
+
+// extent report entry flags
+#define STZFS_EXTENT_LAST (1 << 0) // no data follows this extent
+#define STZFS_EXTENT_UNWRITTEN (1 << 1) // preallocated, reads as zeroes
+
+// 32 bytes, physically consecutive data of a file, all values are in bytes
+typedef struct stzfs_extent_entry_t {
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+    uint32_t flags;
+    uint32_t reserved;
+} stzfs_extent_entry_t;
+
+// fiemap style report of the data in [start, start + length) of a file, holes are skipped
+typedef struct stzfs_extent_report_t {
+    uint64_t start;
+    uint64_t length;
+    uint32_t count; // entries filled in
+    uint32_t reserved;
+    stzfs_extent_entry_t entries[STZFS_REPORT_EXTENTS];
+} stzfs_extent_report_t;
+
+// ioctl commands
+#define STZFS_IOC_REPORT_EXTENTS _IOWR('S', 1, stzfs_extent_report_t)
+
+#endif // STZFS_IOCTL_H
@@ -0,0 +1,121 @@
+#include "lookup.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "inode.h"
+#include "inode_lock.h"
+#include "log.h"
+
+#define LOOKUP_BUCKET_BITS (12)
+#define LOOKUP_BUCKETS (1 << LOOKUP_BUCKET_BITS)
+
+// kernel references to an inode
+typedef struct lookup_t {
+    int64_t inodeptr;
+    uint64_t count;
+    bool unlinked; // last link is gone, the inode is freed once the kernel forgot it
+    struct lookup_t* next;
+} lookup_t;
+
+static lookup_t* buckets[LOOKUP_BUCKETS];
+static pthread_mutex_t buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// find the hash bucket of an inodeptr
+static lookup_t** bucket_of(int64_t inodeptr) {
+    return &buckets[((uint64_t)inodeptr * 0x9e3779b97f4a7c15ull) >> (64 - LOOKUP_BUCKET_BITS)];
+}
+
+// find the link pointing to the entry of an inodeptr, the link holds NULL if there is none
+static lookup_t** find_link(int64_t inodeptr) {
+    lookup_t** link = bucket_of(inodeptr);
+    while (*link != NULL && (*link)->inodeptr != inodeptr) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// the kernel got the inode in a reply, called while the inode can not be unlinked concurrently
+void lookup_ref(int64_t inodeptr) {
+    pthread_mutex_lock(&buckets_lock);
+    lookup_t** link = find_link(inodeptr);
+    if (*link == NULL) {
+        lookup_t* entry = calloc(1, sizeof(lookup_t));
+        if (entry == NULL) {
+            // the inode is freed right away if it is unlinked, like without the low level frontend
+            LOG("could not allocate lookup entry");
+            pthread_mutex_unlock(&buckets_lock);
+            return;
+        }
+        entry->inodeptr = inodeptr;
+        *link = entry;
+    }
+    (*link)->count++;
+    pthread_mutex_unlock(&buckets_lock);
+}
+
+// drop kernel references, true if the inode was unlinked and has to be freed by the caller now
+bool lookup_forget(int64_t inodeptr, uint64_t count) {
+    pthread_mutex_lock(&buckets_lock);
+    lookup_t** link = find_link(inodeptr);
+    lookup_t* entry = *link;
+    if (entry == NULL) {
+        pthread_mutex_unlock(&buckets_lock);
+        return false;
+    }
+
+    entry->count -= count < entry->count ? count : entry->count;
+    if (entry->count > 0) {
+        pthread_mutex_unlock(&buckets_lock);
+        return false;
+    }
+
+    *link = entry->next;
+    pthread_mutex_unlock(&buckets_lock);
+
+    const bool unlinked = entry->unlinked;
+    free(entry);
+    return unlinked;
+}
+
+// true if the kernel still refers to an inode that lost its last link, freeing it is left to lookup_forget
+// the caller keeps it on the held orphan list meanwhile (see orphan_hold)
+bool lookup_defer_free(int64_t inodeptr) {
+    pthread_mutex_lock(&buckets_lock);
+    lookup_t* entry = *find_link(inodeptr);
+    if (entry != NULL) {
+        entry->unlinked = true;
+    }
+    pthread_mutex_unlock(&buckets_lock);
+
+    return entry != NULL;
+}
+
+// forget all references, unlinked inodes are freed (the kernel does not forget everything on unmount)
+stzfs_error_t lookup_dispose(void) {
+    stzfs_error_t error = SUCCESS;
+
+    for (size_t bucket = 0; bucket < LOOKUP_BUCKETS; bucket++) {
+        while (buckets[bucket] != NULL) {
+            lookup_t* entry = buckets[bucket];
+            buckets[bucket] = entry->next;
+
+            if (entry->unlinked) {
+                inode_t inode;
+                inode_lock_exclusive(entry->inodeptr);
+                if (inode_read(entry->inodeptr, &inode) || inode_free(entry->inodeptr, &inode)) {
+                    LOG("could not free unlinked inode");
+                    error = ERROR;
+                }
+                inode_unlock(entry->inodeptr);
+            }
+            free(entry);
+        }
+    }
+
+    return error;
+}
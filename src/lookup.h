@@ -0,0 +1,16 @@
+#ifndef STZFS_LOOKUP_H
+#define STZFS_LOOKUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "error.h"
+
+// inodes the kernel knows through the low level frontend (the nlookup counts of fuse), an unlinked
+// inode keeps its inodeptr until the kernel forgot it
+void lookup_ref(int64_t inodeptr);
+bool lookup_forget(int64_t inodeptr, uint64_t count);
+bool lookup_defer_free(int64_t inodeptr);
+stzfs_error_t lookup_dispose(void);
+
+#endif // STZFS_LOOKUP_H
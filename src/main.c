@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include "blocks.h"
 #include "fuse.h"
 #include "stzfs.h"
 #include "types.h"
@@ -25,7 +26,7 @@ int main() {
     off_t size = disk_set_file(DISK_FILE_PATH);
 
     // create and init filesystem
-    stzfs_makefs(inodes);
+    stzfs_makefs(inodes, SUPER_BLOCK_FEATURE_COMPACT_DIRS);
 
     // create some files
     struct fuse_file_info file_info;
@@ -90,5 +91,8 @@ int main() {
     stzfs_rmdir("/home/user/foo");
     stzfs_readdir("/home/user", NULL, printf_filler, 0, NULL, 0);
 
+    // write back cached blocks and close the disk
+    stzfs_destroy();
+
     return 0;
 }
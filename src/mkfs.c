@@ -1,27 +1,51 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "blocks.h"
 #include "stzfs.h"
 #include "disk.h"
 
+static void print_usage(void) {
+    printf("usage: mkfs.stzfs [-e] [-f] <device> [bytes_per_inode]\n");
+    printf("    -e    map file data with extents instead of indirect blocks\n");
+    printf("    -f    store fixed size directory entries instead of variable length records\n");
+}
+
 int main(int argc, char** argv) {
-    if (argc < 2 || argc > 3) {
-        printf("usage: mkfs.stzfs <device> [bytes_per_inode]\n");
+    uint32_t features = SUPER_BLOCK_FEATURE_COMPACT_DIRS;
+    int opt;
+    while ((opt = getopt(argc, argv, "ef")) != -1) {
+        if (opt == 'e') {
+            features |= SUPER_BLOCK_FEATURE_EXTENTS;
+        } else if (opt == 'f') {
+            features &= ~SUPER_BLOCK_FEATURE_COMPACT_DIRS;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    const int args = argc - optind;
+    if (args < 1 || args > 2) {
+        print_usage();
         return 1;
     }
 
-    if (disk_set_file(argv[1])) {
+    if (disk_set_file(argv[optind])) {
         return 1;
     }
 
     long int bytes_per_inode = 16384;
-    if (argc == 3) {
-        bytes_per_inode = strtol(argv[2], NULL, 10);
+    if (args == 2) {
+        bytes_per_inode = strtol(argv[optind + 1], NULL, 10);
     }
 
     const off_t size = disk_get_size();
-    stzfs_makefs(size / bytes_per_inode);
+    stzfs_makefs(size / bytes_per_inode, features);
+    stzfs_destroy();
 
     return 0;
 }
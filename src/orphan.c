@@ -0,0 +1,276 @@
+#include "orphan.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "block.h"
+#include "group.h"
+#include "helpers.h"
+#include "inode_cache.h"
+#include "log.h"
+#include "super_block_cache.h"
+
+static void* reclaim_loop(void* arg);
+static stzfs_error_t reclaim_step(int64_t step_blocks);
+static stzfs_error_t free_now(int64_t inodeptr, inode_t* inode);
+static int set_head(int64_t inodeptr);
+static bool is_held(int64_t inodeptr);
+static stzfs_error_t link_orphan(int64_t inodeptr, inode_t* inode);
+
+// orphan list and reclaimer state
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaim_thread;
+static bool reclaim_running = false;
+static bool reclaim_stop = false;
+
+// finish the deletions an earlier mount left behind
+int orphan_init(void) {
+    // nothing refers to held inodes anymore, they are freed like the others
+    for (size_t slot = 0; slot < SUPER_BLOCK_HELD_ORPHANS; slot++) {
+        const int64_t inodeptr = super_block_cache->held_orphans[slot];
+        inode_t inode;
+        if (inodeptr != 0 && (inode_read_table(inodeptr, &inode) || link_orphan(inodeptr, &inode))) {
+            printf("orphan_init: could not queue held orphan %lld\n", (long long)inodeptr);
+            return -EIO;
+        }
+    }
+
+    if (super_block_cache->orphan_head != 0) {
+        printf("orphan_init: finishing interrupted deletions\n");
+    }
+
+    while (super_block_cache->orphan_head != 0) {
+        if (reclaim_step(ORPHAN_INIT_STEP_BLOCKS)) {
+            printf("orphan_init: could not free orphan %i\n", super_block_cache->orphan_head);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+// free large unlinked files in the background from now on
+int orphan_start_reclaimer(void) {
+    reclaim_stop = false;
+
+    const int err = pthread_create(&reclaim_thread, NULL, reclaim_loop, NULL);
+    if (err) {
+        printf("orphan_start_reclaimer: could not start reclaimer thread\n");
+        return -err;
+    }
+
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_running = true;
+    pthread_mutex_unlock(&reclaim_lock);
+    return 0;
+}
+
+// stop the reclaimer, orphans left on the list are freed on the next mount
+int orphan_dispose(void) {
+    if (!reclaim_running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&reclaim_lock);
+    reclaim_stop = true;
+    pthread_cond_broadcast(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+
+    const int err = pthread_join(reclaim_thread, NULL);
+    reclaim_running = false;
+    if (err) {
+        printf("orphan_dispose: could not join reclaimer thread\n");
+        return -err;
+    }
+
+    return 0;
+}
+
+// remember an unlinked inode the kernel still refers to until orphan_add, it is freed by the next mount if
+// the file system is not unmounted cleanly before
+stzfs_error_t orphan_hold(int64_t inodeptr) {
+    super_block* sb = super_block_cache;
+
+    super_block_cache_lock();
+    int64_t free_slot = -1;
+    for (size_t slot = 0; slot < SUPER_BLOCK_HELD_ORPHANS; slot++) {
+        if (sb->held_orphans[slot] == inodeptr) {
+            super_block_cache_unlock();
+            return SUCCESS;
+        } else if (sb->held_orphans[slot] == 0 && free_slot < 0) {
+            free_slot = slot;
+        }
+    }
+
+    if (free_slot < 0) {
+        super_block_cache_unlock();
+        LOG("no free slot for held orphans");
+        return ERROR;
+    }
+
+    sb->held_orphans[free_slot] = inodeptr;
+    const int err = super_block_cache_sync();
+    super_block_cache_unlock();
+
+    return err ? ERROR : SUCCESS;
+}
+
+// release an unlinked inode, large files are queued and freed by the reclaimer, held inodes always go
+// through the orphan list, they leave their slot and enter the list with one super block write
+stzfs_error_t orphan_add(int64_t inodeptr, inode_t* inode) {
+    const bool held = is_held(inodeptr);
+    if (!held && (M_IS_DIR(inode->mode) || inode->block_count < ORPHAN_MIN_BLOCKS)) {
+        return free_now(inodeptr, inode);
+    }
+
+    pthread_mutex_lock(&reclaim_lock);
+    const bool reclaiming = reclaim_running && !reclaim_stop;
+    if (!held && !reclaiming) {
+        pthread_mutex_unlock(&reclaim_lock);
+        return free_now(inodeptr, inode);
+    }
+
+    stzfs_error_t error = link_orphan(inodeptr, inode);
+
+    // nobody else would free it before the next mount
+    while (!error && !reclaiming && super_block_cache->orphan_head == inodeptr) {
+        error = reclaim_step(ORPHAN_INIT_STEP_BLOCKS);
+    }
+
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+    return error;
+}
+
+// put an inode in front of the orphan list
+static stzfs_error_t link_orphan(int64_t inodeptr, inode_t* inode) {
+    // the inode stays allocated until all of its blocks are gone
+    // the link has to be on disk before the list head points at the inode
+    inode->atom_count = super_block_cache->orphan_head;
+    if (inode_write_table_sync(inodeptr, inode)) {
+        LOG("could not write orphan inode");
+        return ERROR;
+    } else if (set_head(inodeptr)) {
+        LOG("could not persist orphan list");
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+// point the orphan list at a new first inode and persist it, a held inode leaves its slot at the same time
+static int set_head(int64_t inodeptr) {
+    super_block* sb = super_block_cache;
+
+    super_block_cache_lock();
+    sb->orphan_head = inodeptr;
+    for (size_t slot = 0; slot < SUPER_BLOCK_HELD_ORPHANS; slot++) {
+        if (sb->held_orphans[slot] == inodeptr) {
+            sb->held_orphans[slot] = 0;
+        }
+    }
+    const int err = super_block_cache_sync();
+    super_block_cache_unlock();
+
+    return err;
+}
+
+// true if the inode waits in a held orphan slot
+static bool is_held(int64_t inodeptr) {
+    const super_block* sb = super_block_cache;
+    bool held = false;
+
+    super_block_cache_lock();
+    for (size_t slot = 0; slot < SUPER_BLOCK_HELD_ORPHANS && !held; slot++) {
+        held = sb->held_orphans[slot] == inodeptr;
+    }
+    super_block_cache_unlock();
+
+    return held;
+}
+
+static stzfs_error_t free_now(int64_t inodeptr, inode_t* inode) {
+    inode_cache_invalidate(inodeptr);
+    group_free_inode(inodeptr, M_IS_DIR(inode->mode));
+
+    // free allocated data blocks in bitmap
+    return inode_truncate(inode, 0);
+}
+
+static void* reclaim_loop(void* arg) {
+    const struct timespec delay = {.tv_sec = 0, .tv_nsec = ORPHAN_STEP_DELAY_NS};
+
+    pthread_mutex_lock(&reclaim_lock);
+    while (!reclaim_stop) {
+        if (super_block_cache->orphan_head == 0) {
+            pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+            continue;
+        }
+
+        if (reclaim_step(ORPHAN_STEP_BLOCKS)) {
+            printf("reclaim_loop: could not free orphan %i, leaving it for the next mount\n",
+                   super_block_cache->orphan_head);
+            reclaim_stop = true;
+            pthread_mutex_unlock(&reclaim_lock);
+            return NULL;
+        }
+
+        // pause between steps, this bounds the disk bandwidth taken from file system operations
+        pthread_mutex_unlock(&reclaim_lock);
+        nanosleep(&delay, NULL);
+        pthread_mutex_lock(&reclaim_lock);
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+
+    return NULL;
+}
+
+// free up to step_blocks trailing blocks of the first orphan, unlink it once it is empty
+static stzfs_error_t reclaim_step(int64_t step_blocks) {
+    super_block* sb = super_block_cache;
+    const int64_t inodeptr = sb->orphan_head;
+
+    inode_t inode;
+    if (inode_read_table(inodeptr, &inode)) {
+        LOG("could not read orphan inode");
+        return ERROR;
+    }
+
+    // the cut blocks are released only once the shortened inode is on disk, a crash in between must not
+    // leave them referenced by the inode on disk, the next mount would free them again after they may
+    // have been reused
+    block_list_t freed;
+    block_defer_free(&freed);
+    if (inode_truncate(&inode, MAX((int64_t)inode.block_count - step_blocks, 0))) {
+        LOG("could not truncate orphan inode");
+        block_free_deferred(&freed, false);
+        return ERROR;
+    }
+
+    if (inode_write_table_sync(inodeptr, &inode)) {
+        LOG("could not persist truncated orphan inode");
+        block_free_deferred(&freed, false);
+        return ERROR;
+    }
+
+    if (block_free_deferred(&freed, true)) {
+        LOG("could not free truncated orphan blocks");
+        return ERROR;
+    }
+
+    if (inode.block_count > 0) {
+        return SUCCESS;
+    }
+
+    // the inode is only reused after it left the list
+    if (set_head((inodeptr_t)inode.atom_count)) {
+        LOG("could not persist orphan list");
+        return ERROR;
+    }
+
+    inode_cache_invalidate(inodeptr);
+    return group_free_inode(inodeptr, M_IS_DIR(inode.mode));
+}
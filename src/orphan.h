@@ -0,0 +1,25 @@
+#ifndef STZFS_ORPHAN_H
+#define STZFS_ORPHAN_H
+
+#include <stdint.h>
+
+#include "error.h"
+#include "inode.h"
+
+// files with at least this many blocks are freed in the background once the reclaimer runs
+#define ORPHAN_MIN_BLOCKS (256)
+
+// blocks the reclaimer frees at once and the pause after every step, this limits it to 1 GiB/s
+#define ORPHAN_STEP_BLOCKS (4096)
+#define ORPHAN_STEP_DELAY_NS (16 * 1000 * 1000)
+
+// blocks freed at once when finishing the deletions of an earlier mount
+#define ORPHAN_INIT_STEP_BLOCKS (256 * 1024)
+
+int orphan_init(void);
+int orphan_start_reclaimer(void);
+int orphan_dispose(void);
+stzfs_error_t orphan_hold(int64_t inodeptr);
+stzfs_error_t orphan_add(int64_t inodeptr, inode_t* inode);
+
+#endif // STZFS_ORPHAN_H
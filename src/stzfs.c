@@ -1,6 +1,9 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,13 +11,26 @@
 #include <unistd.h>
 
 #include "direntry.h"
+#include "bitmap.h"
 #include "bitmap_cache.h"
 #include "block.h"
+#include "block_cache.h"
+#include "blockptr.h"
 #include "blocks.h"
+#include "dentry_cache.h"
 #include "find.h"
 #include "fuse.h"
+#include "group.h"
+#include "group_cache.h"
+#include "handle.h"
 #include "helpers.h"
 #include "inode.h"
+#include "inode_cache.h"
+#include "inode_lock.h"
+#include "inodeptr.h"
+#include "ioctl.h"
+#include "lookup.h"
+#include "orphan.h"
 #include "stzfs.h"
 #include "super_block_cache.h"
 #include "disk.h"
@@ -33,6 +49,15 @@
 #define STZFS_DEBUG(...)
 #endif
 
+// max blocks to prefetch ahead of a sequential reader
+#define STZFS_READAHEAD_BLOCKS 256
+
+// directory entries whose inodes are read together when listing with attributes
+#define STZFS_READDIR_BATCH 64
+
+// held shared while paths are resolved, exclusively while directories are changed (see inode_lock.h)
+static pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 // fuse operations
 struct fuse_operations stzfs_ops = {
     .init = stzfs_fuse_init,
@@ -48,26 +73,386 @@ struct fuse_operations stzfs_ops = {
     .rmdir = stzfs_rmdir,
     .readdir = stzfs_readdir,
     .statfs = stzfs_statfs,
+    .flush = stzfs_flush,
+    .release = stzfs_release,
+    .fsync = stzfs_fsync,
     .chown = stzfs_chown,
     .chmod = stzfs_chmod,
     .truncate = stzfs_truncate,
+    .fallocate = stzfs_fallocate,
+    .lseek = stzfs_lseek,
+    .ioctl = stzfs_ioctl,
     .utimens = stzfs_utimens,
     .link = stzfs_link,
     .symlink = stzfs_symlink,
     .readlink = stzfs_readlink
 };
 
+// get the handle of an open file
+static handle_t* stzfs_handle(const struct fuse_file_info* file_info) {
+    return (handle_t*)(uintptr_t)file_info->fh;
+}
+
+// pass the access pattern of a read on to the disk backend, the caller holds the read lock of the handle
+// reads of a file continue each other no matter which thread serves them
+static void stzfs_advise_read(handle_t* handle, off_t offset, size_t length) {
+    const inode_t* inode = &handle->inode;
+    const bool sequential = offset == handle->read_end;
+    handle->read_end = offset + length;
+
+    // only a mapped disk profits from hints as it does not read through the fd
+    if (disk_get_backend() != DISK_BACKEND_MMAP) {
+        return;
+    }
+
+    // blocks of the current read followed by the expected next read
+    const int64_t first = offset / STZFS_BLOCK_SIZE;
+    const int64_t end = MIN(DIV_CEIL(offset + length, STZFS_BLOCK_SIZE), inode->block_count);
+    const int64_t current = MIN(end - first, STZFS_READAHEAD_BLOCKS);
+    const int64_t ahead = sequential ? MIN(current, inode->block_count - end) : 0;
+    if (current <= 0) {
+        return;
+    }
+
+    int64_t blockptr_arr[current + ahead];
+    inode_find_data_blockptrs(&handle->inode, &handle->map, first, blockptr_arr, current + ahead);
+
+    if (sequential) {
+        block_advise(blockptr_arr, current, DISK_ADVICE_SEQUENTIAL);
+        block_advise(&blockptr_arr[current], ahead, DISK_ADVICE_WILLNEED);
+    } else {
+        block_advise(blockptr_arr, current, DISK_ADVICE_RANDOM);
+    }
+}
+
+// resolve a path, or take the open file of fi, and lock its inode, a path keeps the namespace lock
+// held shared until stzfs_unlock_file
+static int stzfs_lock_file(const char* path, const struct fuse_file_info* fi, bool exclusive, file* f) {
+    if (fi != NULL && fi->fh != 0) {
+        f->inodeptr = stzfs_handle(fi)->inodeptr;
+    } else {
+        pthread_rwlock_rdlock(&namespace_lock);
+        const int err = find_file_inode2(path, f, NULL, NULL);
+        if (err || f->inodeptr == 0) {
+            pthread_rwlock_unlock(&namespace_lock);
+            return err ? err : -ENOENT;
+        }
+    }
+
+    if (exclusive) {
+        inode_lock_exclusive(f->inodeptr);
+    } else {
+        inode_lock_shared(f->inodeptr);
+    }
+
+    // an open file may have been changed until the lock was taken
+    inode_read(f->inodeptr, &f->inode);
+    return 0;
+}
+
+// release the locks of stzfs_lock_file
+static void stzfs_unlock_file(const struct fuse_file_info* fi, const file* f) {
+    inode_unlock(f->inodeptr);
+    if (fi == NULL || fi->fh == 0) {
+        pthread_rwlock_unlock(&namespace_lock);
+    }
+}
+
+// lock an inode given by its number like stzfs_lock_file, there is no path to walk
+static int stzfs_lock_inode(int64_t inodeptr, const struct fuse_file_info* fi, bool exclusive, file* f) {
+    if (fi != NULL && fi->fh != 0) {
+        return stzfs_lock_file(NULL, fi, exclusive, f);
+    }
+
+    pthread_rwlock_rdlock(&namespace_lock);
+    if (!bitmap_is_inode_allocated(inodeptr)) {
+        pthread_rwlock_unlock(&namespace_lock);
+        return -ENOENT;
+    }
+
+    f->inodeptr = inodeptr;
+    if (exclusive) {
+        inode_lock_exclusive(inodeptr);
+    } else {
+        inode_lock_shared(inodeptr);
+    }
+
+    inode_read(inodeptr, &f->inode);
+    return 0;
+}
+
+// read a directory given by its number, the namespace lock has to be held
+static int stzfs_read_dir(int64_t inodeptr, file* dir) {
+    if (!bitmap_is_inode_allocated(inodeptr)) {
+        return -ENOENT;
+    }
+
+    dir->inodeptr = inodeptr;
+    inode_read_table(inodeptr, &dir->inode);
+    return M_IS_DIR(dir->inode.mode) ? 0 : -ENOTDIR;
+}
+
+// find an entry of a directory, f->inodeptr is 0 if there is none, the entry is not locked, so an open file
+// is read from the inode table and has to be re-read once it is locked
+static int stzfs_find_entry(file* dir, const char* name, file* f) {
+    if (strlen(name) >= MAX_FILENAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+
+    int64_t inodeptr;
+    direntry_find(dir->inodeptr, &dir->inode, name, &inodeptr);
+    if (!inodeptr_is_valid(inodeptr)) {
+        f->inodeptr = 0;
+        memset(&f->inode, 0, sizeof(inode_t));
+        return 0;
+    }
+
+    f->inodeptr = inodeptr;
+    inode_read_table(inodeptr, &f->inode);
+    return 0;
+}
+
+// fill the attributes of a locked file
+static void stzfs_fill_stat(const file* f, struct stat* st) {
+    memset(st, 0, sizeof(struct stat));
+    if (M_IS_DIR(f->inode.mode)) {
+        st->st_size = (off_t)f->inode.block_count * STZFS_BLOCK_SIZE;
+    } else {
+        st->st_size = f->inode.atom_count;
+    }
+
+    st->st_ino = f->inodeptr;
+    st->st_mode = mode_stzfs_to_posix(f->inode.mode);
+    st->st_nlink = f->inode.link_count;
+#if STZFS_MOUNT_AS_USER
+    if (f->inodeptr == ROOT_INODEPTR) {
+        st->st_uid = getuid();
+        st->st_gid = getgid();
+    } else {
+#endif
+    st->st_uid = f->inode.uid;
+    st->st_gid = f->inode.gid;
+#if STZFS_MOUNT_AS_USER
+    }
+#endif
+    st->st_atim = f->inode.atime;
+    st->st_mtim = f->inode.mtime;
+    st->st_ctim = f->inode.ctime;
+    st->st_blksize = STZFS_BLOCK_SIZE;
+    st->st_blocks = f->inode.block_count * (STZFS_BLOCK_SIZE / 512);
+}
+
+// read a single file block, preferring data the handle holds back
+static void stzfs_read_block(handle_t* handle, int64_t offset, data_block* block) {
+    const void* delayed = handle_find_block(handle, offset);
+    if (delayed != NULL) {
+        memcpy(block, delayed, STZFS_BLOCK_SIZE);
+        return;
+    }
+
+    // readers share the block map of the handle
+    int64_t blockptr;
+    pthread_mutex_lock(&handle->read_lock);
+    inode_map_find_data_blockptr(&handle->inode, &handle->map, offset, ALLOC_SPARSE_NO, &blockptr);
+    pthread_mutex_unlock(&handle->read_lock);
+    block_read(blockptr, block);
+}
+
+// copy length bytes to inner of a single file block, zeroes if data is NULL
+// holes are not allocated but held back by the handle until it is flushed, preallocated blocks are
+// written in place, their space is already taken
+static int stzfs_write_block(handle_t* handle, int64_t offset, size_t inner, const char* data, size_t length) {
+    char* delayed = handle_find_block(handle, offset);
+    if (delayed == NULL) {
+        inode_run_t run;
+        size_t run_count;
+        if (inode_find_data_runs(&handle->inode, &handle->map, offset, 1, &run, &run_count)) {
+            printf("stzfs_write_block: could not map data block\n");
+            return -EIO;
+        }
+
+        if (run.blockptr == NULL_BLOCKPTR && (delayed = handle_delay_block(handle, offset)) == NULL) {
+            printf("stzfs_write_block: could not delay data block\n");
+            return -ENOSPC;
+        }
+    }
+
+    data_block block;
+    char* target = delayed;
+    if (target == NULL) {
+        inode_read_data_block(&handle->inode, &handle->map, offset, &block, NULL);
+        target = (char*)block.data;
+    }
+
+    if (data != NULL) {
+        memcpy(&target[inner], data, length);
+    } else {
+        memset(&target[inner], 0, length);
+    }
+
+    if (delayed == NULL && inode_write_data_block(&handle->inode, &handle->map, offset, &block)) {
+        printf("stzfs_write_block: could not write data block\n");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+// zero a byte range inside of a single file block, holes and unwritten blocks already read as zeroes
+static int stzfs_zero_block_range(handle_t* handle, off_t from, off_t to) {
+    const int64_t offset = from / STZFS_BLOCK_SIZE;
+    if (from >= to || offset >= handle->inode.block_count) {
+        return 0;
+    }
+
+    int64_t blockptr;
+    if (inode_map_find_data_blockptr(&handle->inode, &handle->map, offset, ALLOC_SPARSE_NO, &blockptr)) {
+        printf("stzfs_zero_block_range: could not map data block\n");
+        return -EIO;
+    }
+
+    if (!blockptr_is_valid(blockptr)) {
+        return 0;
+    }
+    return stzfs_write_block(handle, offset, from % STZFS_BLOCK_SIZE, NULL, to - from);
+}
+
+// get the handle of an open file and lock it exclusively, a file without an open instance gets one
+// until stzfs_put_handle
+static int stzfs_get_handle(const char* path, const struct fuse_file_info* fi, handle_t** handle_out) {
+    if (fi != NULL && fi->fh != 0) {
+        *handle_out = stzfs_handle(fi);
+        inode_lock_exclusive((*handle_out)->inodeptr);
+        return 0;
+    } else if (path == NULL) {
+        // the low level frontend only passes open files
+        printf("stzfs_get_handle: no open file given\n");
+        return -EBADF;
+    }
+
+    file f;
+    int err = stzfs_lock_file(path, NULL, true, &f);
+    if (err) {
+        printf("stzfs_get_handle: no such file\n");
+        return err;
+    }
+
+    if (M_IS_DIR(f.inode.mode)) {
+        printf("stzfs_get_handle: is a directory\n");
+        err = -EISDIR;
+    } else if ((*handle_out = handle_open(f.inodeptr)) == NULL) {
+        printf("stzfs_get_handle: could not open file handle\n");
+        err = -ENOMEM;
+    }
+
+    if (err) stzfs_unlock_file(NULL, &f);
+    return err;
+}
+
+// release a handle from stzfs_get_handle and pass the error of the operation on
+static int stzfs_put_handle(const struct fuse_file_info* fi, handle_t* handle, int err) {
+    const file f = {.inodeptr = handle->inodeptr};
+    if ((fi == NULL || fi->fh == 0) && handle_close(handle) && !err) {
+        printf("stzfs_put_handle: could not write back inode\n");
+        err = -EIO;
+    }
+
+    stzfs_unlock_file(fi, &f);
+    return err;
+}
+
+// preallocate, punch or zero the bytes in [offset, end) of an open file
+static int stzfs_fallocate_range(handle_t* handle, int mode, off_t offset, off_t end) {
+    inode_t* inode = &handle->inode;
+
+    // held back blocks have to be mapped before the range is changed below them
+    if (handle_flush_data(handle)) {
+        printf("stzfs_fallocate: could not flush delayed blocks\n");
+        return -EIO;
+    }
+
+    // the previous last block may hold stale bytes past the end of the file that would become visible
+    const off_t tail = inode->atom_count;
+    if (!(mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) && end > tail && tail % STZFS_BLOCK_SIZE > 0) {
+        const int err = stzfs_zero_block_range(handle, tail, (tail / STZFS_BLOCK_SIZE + 1) * STZFS_BLOCK_SIZE);
+        if (err) return err;
+    }
+
+    // punching never extends a file
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        end = MIN(end, (off_t)inode->block_count * STZFS_BLOCK_SIZE);
+        if (offset >= end) {
+            return 0;
+        }
+    }
+
+    // partially covered blocks at the edges keep the bytes outside of the range
+    const int64_t first = offset / STZFS_BLOCK_SIZE;
+    const int64_t last = DIV_CEIL(end, STZFS_BLOCK_SIZE);
+    const int64_t full_first = DIV_CEIL(offset, STZFS_BLOCK_SIZE);
+    const int64_t full_end = MIN(end / STZFS_BLOCK_SIZE, (int64_t)inode->block_count);
+
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        int err = stzfs_zero_block_range(handle, offset, MIN(end, (off_t)full_first * STZFS_BLOCK_SIZE));
+        if (!err && end / STZFS_BLOCK_SIZE >= full_first) {
+            err = stzfs_zero_block_range(handle, MAX(offset, end / STZFS_BLOCK_SIZE * STZFS_BLOCK_SIZE), end);
+        }
+        if (err) return err;
+
+        if (full_first < full_end && inode_unmap_data_range(inode, &handle->map, full_first, full_end - full_first)) {
+            printf("stzfs_fallocate: could not unmap data blocks\n");
+            return -EIO;
+        }
+    }
+
+    // zeroed ranges stay allocated just like preallocated ones
+    if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+        if (last > inode->block_count) {
+            inode_append_null_blocks(inode, last);
+        }
+
+        if (inode_prealloc_data_range(inode, &handle->map, first, last - first)) {
+            printf("stzfs_fallocate: could not preallocate data blocks\n");
+            handle->dirty = true;
+            return -ENOSPC;
+        }
+
+        if (!(mode & FALLOC_FL_KEEP_SIZE) && end > (off_t)inode->atom_count) {
+            inode->atom_count = end;
+        }
+    }
+
+    // the inode is written back when the file is flushed
+    touch_mtime_and_ctime(inode);
+    handle->dirty = true;
+
+    return 0;
+}
+
 // init filesystem
-int64_t stzfs_makefs(int64_t inode_count) {
+int64_t stzfs_makefs(int64_t inode_count, uint32_t features) {
     const int64_t blocks = disk_get_size() / STZFS_BLOCK_SIZE;
     printf("stzfs_makefs: creating file system with %i blocks and %i inodes\n", blocks, inode_count);
+    if (features & SUPER_BLOCK_FEATURE_EXTENTS) {
+        printf("stzfs_makefs: mapping file data with extents\n");
+    }
+    if (features & SUPER_BLOCK_FEATURE_COMPACT_DIRS) {
+        printf("stzfs_makefs: storing directory entries as variable length records\n");
+    }
+
+    // split blocks and inodes into groups, keeping the inodes of a group on whole bitmap entries
+    const int64_t group_count = DIV_CEIL(blocks, GROUP_BLOCKS);
+    const int64_t bitmap_entry_bits = sizeof(bitmap_entry_t) * 8;
+    const int64_t inodes_per_group = DIV_CEIL(DIV_CEIL(inode_count, group_count), bitmap_entry_bits) * bitmap_entry_bits;
 
-    // calculate bitmap and inode table lengths
+    // calculate group table, bitmap and inode table lengths
+    int64_t group_table_length = DIV_CEIL(group_count, GROUP_BLOCK_ENTRIES);
     int64_t block_bitmap_length = DIV_CEIL(blocks, STZFS_BLOCK_SIZE * 8);
     int64_t inode_table_length = DIV_CEIL(inode_count, STZFS_BLOCK_SIZE / sizeof(inode_t));
     int64_t inode_bitmap_length = DIV_CEIL(inode_count, STZFS_BLOCK_SIZE * 8);
 
-    const int64_t initial_block_count = 1 + block_bitmap_length + inode_bitmap_length + inode_table_length;
+    const int64_t initial_block_count = 1 + group_table_length + block_bitmap_length + inode_bitmap_length +
+                                        inode_table_length;
 
     // create superblock
     super_block sb;
@@ -75,13 +460,20 @@ int64_t stzfs_makefs(int64_t inode_count) {
     sb.block_count = blocks;
     sb.free_blocks = blocks - initial_block_count;
     sb.free_inodes = inode_count - 2;
-    sb.block_bitmap = 1;
+    sb.group_table = 1;
+    sb.group_table_length = group_table_length;
+    sb.block_bitmap = sb.group_table + group_table_length;
     sb.block_bitmap_length = block_bitmap_length;
-    sb.inode_bitmap = 1 + block_bitmap_length;
+    sb.inode_bitmap = sb.block_bitmap + block_bitmap_length;
     sb.inode_bitmap_length = inode_bitmap_length;
-    sb.inode_table = 1 + block_bitmap_length + inode_bitmap_length;
+    sb.inode_table = sb.inode_bitmap + inode_bitmap_length;
     sb.inode_table_length = inode_table_length;
     sb.inode_count = inode_count;
+    sb.features = features;
+    sb.blocks_per_group = GROUP_BLOCKS;
+    sb.inodes_per_group = inodes_per_group;
+    sb.group_count = group_count;
+    sb.state = SUPER_BLOCK_STATE_CLEAN;
 
     // initialize all bitmaps and inode table with zeroes
     data_block initial_block;
@@ -117,6 +509,27 @@ int64_t stzfs_makefs(int64_t inode_count) {
     first_inode_bitmap_block.bitmap[0] = 1;
     block_write(sb.inode_bitmap, &first_inode_bitmap_block);
 
+    // write group table, the initial blocks and the reserved inode 0 are taken from the first groups
+    group_block gb;
+    for (int64_t group = 0; group < group_count; group++) {
+        if (group % GROUP_BLOCK_ENTRIES == 0) {
+            memset(&gb, 0, STZFS_BLOCK_SIZE);
+        }
+
+        const int64_t first_block = group * GROUP_BLOCKS;
+        const int64_t end_block = MIN(blocks, first_block + GROUP_BLOCKS);
+        const int64_t first_inode = MIN(inode_count, group * inodes_per_group);
+        const int64_t end_inode = MIN(inode_count, first_inode + inodes_per_group);
+
+        group_descriptor* descriptor = &gb.groups[group % GROUP_BLOCK_ENTRIES];
+        descriptor->free_blocks = end_block - MAX(first_block, MIN(end_block, initial_block_count));
+        descriptor->free_inodes = end_inode - first_inode - (group == 0);
+
+        if (group % GROUP_BLOCK_ENTRIES == GROUP_BLOCK_ENTRIES - 1 || group == group_count - 1) {
+            block_write(sb.group_table + group / GROUP_BLOCK_ENTRIES, &gb);
+        }
+    }
+
     // write superblock (can't use write_block here because of security limitations)
     disk_write(0, &sb, STZFS_BLOCK_SIZE);
 
@@ -125,8 +538,7 @@ int64_t stzfs_makefs(int64_t inode_count) {
 
     // write root directory block
     dir_block root_dir_block;
-    memset(&root_dir_block, 0, STZFS_BLOCK_SIZE);
-    root_dir_block.entries[0] = (dir_block_entry) {.name = ".", .inode = 1};
+    direntry_init(&root_dir_block, ROOT_INODEPTR, 0);
     int64_t root_dir_block_ptr;
     block_alloc(&root_dir_block_ptr, &root_dir_block);
     printf("stzfs_makefs: wrote root dir block at %i\n", root_dir_block_ptr);
@@ -144,14 +556,18 @@ int64_t stzfs_makefs(int64_t inode_count) {
     root_inode.ctime = now;
     root_inode.link_count = 1;
     root_inode.atom_count = 1;
-    root_inode.block_count = 1;
-    root_inode.data_direct[0] = root_dir_block_ptr;
+    inode_init_blocks(&root_inode);
+    inode_append_data_blockptr(&root_inode, root_dir_block_ptr);
 
     // write root inode
     int64_t root_inode_ptr;
-    inode_alloc(&root_inode_ptr, &root_inode);
+    inode_alloc(0, &root_inode_ptr, &root_inode);
     printf("stzfs_makefs: wrote root inode with id %i\n", root_inode_ptr);
 
+    inode_flush_table();
+    block_cache_flush();
+    group_cache_sync();
+
     return blocks;
 }
 
@@ -162,6 +578,10 @@ void* stzfs_fuse_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
 
     stzfs_init();
 
+    // unlinked large files are freed and dirty inodes written back in the background from now on
+    orphan_start_reclaimer();
+    inode_cache_start_writeback();
+
     return NULL;
 }
 
@@ -169,6 +589,18 @@ void* stzfs_fuse_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
 void stzfs_init(void) {
     super_block_cache_init();
     bitmap_cache_init();
+    group_cache_init();
+    block_cache_init();
+    inode_cache_init();
+    dentry_cache_init();
+    orphan_init();
+
+    // back the hot metadata area with huge pages if the disk is mapped
+    if (disk_get_backend() == DISK_BACKEND_MMAP) {
+        const super_block* sb = super_block_cache;
+        const int64_t metadata_blocks = sb->inode_table + sb->inode_table_length;
+        disk_advise(0, (size_t)metadata_blocks * STZFS_BLOCK_SIZE, DISK_ADVICE_HUGEPAGE);
+    }
 }
 
 // clean up filesystem from fuse
@@ -178,6 +610,39 @@ void stzfs_fuse_destroy(void* private_data) {
 
 // low level filesystem cleanup (has to be called manually if fuse is not used)
 void stzfs_destroy(void) {
+    orphan_dispose();
+    lookup_dispose();
+    handle_dispose();
+    inode_cache_dispose();
+    block_cache_dispose();
+
+#if ENABLE_DEBUG
+    inode_cache_stats_t inode_stats;
+    inode_cache_get_stats(&inode_stats);
+    STZFS_DEBUG("inode cache hits=%llu misses=%llu evictions=%llu writebacks=%llu",
+                (unsigned long long)inode_stats.hits, (unsigned long long)inode_stats.misses,
+                (unsigned long long)inode_stats.evictions, (unsigned long long)inode_stats.writebacks);
+#endif
+
+#if ENABLE_DEBUG
+    block_cache_stats_t stats;
+    block_cache_get_stats(&stats);
+    STZFS_DEBUG("block cache hits=%llu misses=%llu evictions=%llu writebacks=%llu",
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.evictions, (unsigned long long)stats.writebacks);
+#endif
+
+#if ENABLE_DEBUG
+    dentry_cache_stats_t dentry_stats;
+    dentry_cache_get_stats(&dentry_stats);
+    STZFS_DEBUG("dentry cache hits=%llu misses=%llu evictions=%llu",
+                (unsigned long long)dentry_stats.hits, (unsigned long long)dentry_stats.misses,
+                (unsigned long long)dentry_stats.evictions);
+#endif
+    dentry_cache_dispose();
+
+    disk_sync();
+    group_cache_dispose();
     bitmap_cache_dispose();
     super_block_cache_dispose();
     disk_close();
@@ -187,41 +652,13 @@ void stzfs_destroy(void) {
 int stzfs_getattr(const char* path, struct stat* st, struct fuse_file_info* file_info) {
     STZFS_DEBUG("path=%s", path);
 
-    // TODO: reuse inode
-    if (!file_exists(path)) {
-        // spams stdout
-        // printf("stzfs_getattr: no such file\n");
-        return -ENOENT;
-    }
-
+    // no message for missing files, it spams stdout
     file f;
-    int err = find_file_inode2(path, &f, NULL, NULL);
+    int err = stzfs_lock_file(path, file_info, false, &f);
     if (err) return err;
 
-    if (M_IS_DIR(f.inode.mode)) {
-        st->st_size = f.inode.atom_count * sizeof(dir_block_entry);
-    } else {
-        st->st_size = f.inode.atom_count;
-    }
-
-    st->st_ino = f.inodeptr;
-    st->st_mode = mode_stzfs_to_posix(f.inode.mode);
-    st->st_nlink = f.inode.link_count;
-#if STZFS_MOUNT_AS_USER
-    if (strcmp(path, "/") == 0) {
-        st->st_uid = getuid();
-        st->st_gid = getgid();
-    } else {
-#endif
-    st->st_uid = f.inode.uid;
-    st->st_gid = f.inode.gid;
-#if STZFS_MOUNT_AS_USER
-    }
-#endif
-    st->st_atim = f.inode.atime;
-    st->st_mtim = f.inode.mtime;
-    st->st_ctim = f.inode.ctime;
-
+    stzfs_fill_stat(&f, st);
+    stzfs_unlock_file(file_info, &f);
     return 0;
 }
 
@@ -229,62 +666,95 @@ int stzfs_getattr(const char* path, struct stat* st, struct fuse_file_info* file
 int stzfs_open(const char* file_path, struct fuse_file_info* file_info) {
     STZFS_DEBUG("path=%s", file_path);
 
-    int64_t inodeptr, parent_inodeptr;
-    inode_t inode, parent_inode;
-    int err = find_file_inode(file_path, &inodeptr, &inode, &parent_inodeptr, &parent_inode, NULL);
-    if (err) return err;
-
-    if (inodeptr == 0) {
+    file f;
+    int err = stzfs_lock_file(file_path, NULL, true, &f);
+    if (err) {
         printf("stzfs_open: no such file\n");
-        return -ENOENT;
-    } else if (M_IS_DIR(inode.mode)) {
-        printf("stzfs_open: is a directory\n");
-        return -EISDIR;
+        return err;
     }
 
     // open exsiting file
-    file_info->fh = inodeptr;
+    handle_t* handle = NULL;
+    if (M_IS_DIR(f.inode.mode)) {
+        printf("stzfs_open: is a directory\n");
+        err = -EISDIR;
+    } else if ((handle = handle_open(f.inodeptr)) == NULL) {
+        printf("stzfs_open: could not open file handle\n");
+        err = -ENOMEM;
+    } else {
+        file_info->fh = (uintptr_t)handle;
 
-    // update timestamps
-    touch_atime(&inode);
-    inode_write(inodeptr, &inode);
+        // update timestamps
+        touch_atime(&handle->inode);
+        handle->dirty = true;
+    }
 
-    return 0;
+    stzfs_unlock_file(NULL, &f);
+    return err;
 }
 
-// read from a file
-int stzfs_read(const char* file_path, char* buffer, size_t length, off_t offset,
-               struct fuse_file_info* file_info) {
-    STZFS_DEBUG("path=%s, length=%zu, offset=%lld", file_path, length, offset);
+// write back the inode of an open file
+int stzfs_flush(const char* path, struct fuse_file_info* file_info) {
+    STZFS_DEBUG("path=%s", path);
 
-    if (length == 0)  {
-        printf("stzfs_read: zero length read\n");
-        return 0;
+    handle_t* handle = stzfs_handle(file_info);
+    inode_lock_exclusive(handle->inodeptr);
+    const stzfs_error_t error = handle_flush(handle);
+    inode_unlock(handle->inodeptr);
+
+    if (error) {
+        printf("stzfs_flush: could not write back inode\n");
+        return -EIO;
     }
 
-    if (file_info->fh == 0) {
-        printf("stzfs_read: invald file handle (inode)\n");
-        return -EFAULT;
+    return 0;
+}
+
+// close an open file
+int stzfs_release(const char* path, struct fuse_file_info* file_info) {
+    STZFS_DEBUG("path=%s", path);
+
+    // the handle is gone after the last instance was closed
+    handle_t* handle = stzfs_handle(file_info);
+    const int64_t inodeptr = handle->inodeptr;
+    inode_lock_exclusive(inodeptr);
+    const stzfs_error_t error = handle_close(handle);
+    inode_unlock(inodeptr);
+
+    if (error) {
+        printf("stzfs_release: could not write back inode\n");
+        return -EIO;
     }
 
-    int64_t inodeptr = file_info->fh;
-    inode_t inode;
-    inode_read(inodeptr, &inode);
+    return 0;
+}
+
+// read from an open file, readers of the same file hold its inode lock shared
+static int stzfs_read_handle(handle_t* handle, char* buffer, size_t length, off_t offset) {
+    inode_t* inode = &handle->inode;
 
     // check file bounds
-    if (M_IS_DIR(inode.mode)) {
+    if (M_IS_DIR(inode->mode)) {
         printf("stzfs_read: is a directory\n");
         return -EISDIR;
     }
 
     // end of file reached
-    if (offset >= inode.atom_count) {
+    if (offset >= inode->atom_count) {
         return 0;
     }
 
-    // update timestamps
-    touch_atime(&inode);
-    inode_write(inodeptr, &inode);
+    // never read past the end of file
+    if (length > inode->atom_count - offset) {
+        length = inode->atom_count - offset;
+    }
+
+    // update timestamps, the inode is written back when the file is flushed
+    pthread_mutex_lock(&handle->read_lock);
+    touch_atime(inode);
+    handle->dirty = true;
+    stzfs_advise_read(handle, offset, length);
+    pthread_mutex_unlock(&handle->read_lock);
 
     size_t read_bytes = 0;
     int64_t blockptr = offset / STZFS_BLOCK_SIZE;
@@ -293,7 +763,7 @@ int stzfs_read(const char* file_path, char* buffer, size_t length, off_t offset,
     const size_t initial_byte_offset = offset % STZFS_BLOCK_SIZE;
     if (initial_byte_offset > 0) {
         data_block block;
-        inode_read_data_block(&inode, blockptr, &block, NULL);
+        stzfs_read_block(handle, blockptr, &block);
 
         // keep block boundaries
         read_bytes = STZFS_BLOCK_SIZE - initial_byte_offset;
@@ -305,17 +775,31 @@ int stzfs_read(const char* file_path, char* buffer, size_t length, off_t offset,
         blockptr++;
     }
 
-    // read full blocks
-    for (; (length - read_bytes) >= STZFS_BLOCK_SIZE; blockptr++) {
-        inode_read_data_block(&inode, blockptr, &buffer[read_bytes], NULL);
-        read_bytes += STZFS_BLOCK_SIZE;
+    // read full blocks with as few requests as possible
+    const size_t full_blocks = (length - read_bytes) / STZFS_BLOCK_SIZE;
+    if (full_blocks > 0) {
+        int64_t blockptr_arr[full_blocks];
+        pthread_mutex_lock(&handle->read_lock);
+        inode_find_data_blockptrs(inode, &handle->map, blockptr, blockptr_arr, full_blocks);
+        pthread_mutex_unlock(&handle->read_lock);
+        block_readall(blockptr_arr, &buffer[read_bytes], full_blocks);
+
+        // data written to holes is still held back by the handle
+        for (size_t i = 0; handle->delayed_count > 0 && i < full_blocks; i++) {
+            const void* delayed = handle_find_block(handle, blockptr + i);
+            if (delayed != NULL) {
+                memcpy(&buffer[read_bytes + i * STZFS_BLOCK_SIZE], delayed, STZFS_BLOCK_SIZE);
+            }
+        }
+        read_bytes += full_blocks * STZFS_BLOCK_SIZE;
+        blockptr += full_blocks;
     }
 
     // read last partial block
     const size_t diff = length - read_bytes;
     if (diff > 0) {
         data_block block;
-        inode_read_data_block(&inode, blockptr, &block, NULL);
+        stzfs_read_block(handle, blockptr, &block);
         memcpy(&buffer[read_bytes], &block, diff);
         read_bytes += diff;
     }
@@ -323,27 +807,46 @@ int stzfs_read(const char* file_path, char* buffer, size_t length, off_t offset,
     return read_bytes;
 }
 
-// write to a file
-int stzfs_write(const char* file_path, const char* buffer, size_t length, off_t offset,
-                struct fuse_file_info* file_info) {
-    STZFS_DEBUG("p=%s, l=%zu, o=%lld", file_path, length, offset);
+// read from a file
+int stzfs_read(const char* file_path, char* buffer, size_t length, off_t offset,
+               struct fuse_file_info* file_info) {
+    STZFS_DEBUG("path=%s, length=%zu, offset=%lld", file_path, length, offset);
 
     if (length == 0)  {
-        printf("stzfs_write: zero length write\n");
+        printf("stzfs_read: zero length read\n");
         return 0;
     }
 
     if (file_info->fh == 0) {
-        printf("stzfs_write: invald file handle (inode)\n");
+        printf("stzfs_read: invald file handle\n");
         return -EFAULT;
     }
 
-    int64_t inodeptr = file_info->fh;
-    inode_t inode;
-    inode_read(inodeptr, &inode);
+    handle_t* handle = stzfs_handle(file_info);
+    inode_lock_shared(handle->inodeptr);
+    const int result = stzfs_read_handle(handle, buffer, length, offset);
+    inode_unlock(handle->inodeptr);
+
+    return result;
+}
+
+// end a write that failed part way, the bytes written up to then are reported like a short write
+static int stzfs_end_write(handle_t* handle, off_t offset, size_t written_bytes, int err) {
+    if (written_bytes == 0) {
+        return err;
+    }
+
+    handle->inode.atom_count = MAX(handle->inode.atom_count, offset + (off_t)written_bytes);
+    handle->dirty = true;
+    return written_bytes;
+}
+
+// write to an open file, its inode lock is held exclusively
+static int stzfs_write_handle(handle_t* handle, const char* buffer, size_t length, off_t offset) {
+    inode_t* inode = &handle->inode;
 
     // check file size limits
-    const off_t new_atom_count = MAX(offset + length, inode.atom_count);
+    const off_t new_atom_count = MAX(offset + length, inode->atom_count);
     const int64_t new_block_count = DIV_CEIL(new_atom_count, STZFS_BLOCK_SIZE);
     if (new_block_count > INODE_MAX_BLOCKS) {
         printf("stzfs_write: max file size exceeded\n");
@@ -351,22 +854,21 @@ int stzfs_write(const char* file_path, const char* buffer, size_t length, off_t
     }
 
     // allocate null blocks to the new end of the file
-    if (new_block_count > inode.block_count) {
-        inode_append_null_blocks(&inode, new_block_count);
+    if (new_block_count > inode->block_count) {
+        inode_append_null_blocks(inode, new_block_count);
     }
 
     // fill previous last block with zeroes
-    const size_t last_block_inner_offset = inode.atom_count % STZFS_BLOCK_SIZE;
-    if (offset > inode.atom_count && last_block_inner_offset > 0) {
-        data_block block;
-        inode_read_data_block(&inode, inode.block_count - 1, &block, NULL);
-        memset(&block.data[last_block_inner_offset], 0, STZFS_BLOCK_SIZE - last_block_inner_offset);
-        inode_write_data_block(&inode, inode.block_count - 1, &block);
+    const size_t last_block_inner_offset = inode->atom_count % STZFS_BLOCK_SIZE;
+    if (offset > inode->atom_count && last_block_inner_offset > 0) {
+        const int err = stzfs_write_block(handle, inode->atom_count / STZFS_BLOCK_SIZE, last_block_inner_offset,
+                                          NULL, STZFS_BLOCK_SIZE - last_block_inner_offset);
+        if (err) return err;
     }
 
     // update timestamps
-    touch_atime(&inode);
-    touch_mtime_and_ctime(&inode);
+    touch_atime(inode);
+    touch_mtime_and_ctime(inode);
 
     size_t written_bytes = 0;
 
@@ -374,225 +876,324 @@ int stzfs_write(const char* file_path, const char* buffer, size_t length, off_t
     const size_t initial_byte_offset = offset % STZFS_BLOCK_SIZE;
     int64_t blockptr = offset / STZFS_BLOCK_SIZE;
     if (initial_byte_offset > 0) {
-        data_block block;
-        inode_read_data_block(&inode, blockptr, &block, NULL);
-
         // keep block boundaries
         written_bytes = STZFS_BLOCK_SIZE - initial_byte_offset;
         if (written_bytes > length) {
             written_bytes = length;
         }
 
-        memcpy(&block.data[initial_byte_offset], buffer, written_bytes);
-        inode_write_data_block(&inode, blockptr, &block);
+        const int err = stzfs_write_block(handle, blockptr, initial_byte_offset, buffer, written_bytes);
+        if (err) return err;
         blockptr++;
     }
 
-    // write aligned full blocks
-    for (; (length - written_bytes) >= STZFS_BLOCK_SIZE; blockptr++) {
-        inode_write_data_block(&inode, blockptr, &buffer[written_bytes]);
-        written_bytes += STZFS_BLOCK_SIZE;
+    // write aligned full blocks, mapped runs with as few requests as possible and holes into delayed blocks
+    const size_t full_blocks = (length - written_bytes) / STZFS_BLOCK_SIZE;
+    if (full_blocks > 0) {
+        inode_run_t run_arr[full_blocks];
+        size_t run_count;
+        if (inode_find_data_runs(inode, &handle->map, blockptr, full_blocks, run_arr, &run_count)) {
+            printf("stzfs_write: could not map data blocks\n");
+            return -EIO;
+        }
+
+        for (size_t run = 0; run < run_count; run++) {
+            if (blockptr_is_valid(run_arr[run].blockptr)) {
+                if (inode_write_data_blocks(inode, &handle->map, &buffer[written_bytes], run_arr[run].length,
+                                            blockptr)) {
+                    printf("stzfs_write: could not write data blocks\n");
+                    return stzfs_end_write(handle, offset, written_bytes, -EIO);
+                }
+            } else {
+                for (int64_t i = 0; i < run_arr[run].length; i++) {
+                    void* delayed = handle_delay_block(handle, blockptr + i);
+                    if (delayed == NULL) {
+                        printf("stzfs_write: could not delay data block\n");
+                        return stzfs_end_write(handle, offset, written_bytes + i * STZFS_BLOCK_SIZE, -ENOSPC);
+                    }
+                    memcpy(delayed, &buffer[written_bytes + i * STZFS_BLOCK_SIZE], STZFS_BLOCK_SIZE);
+                }
+            }
+
+            written_bytes += run_arr[run].length * STZFS_BLOCK_SIZE;
+            blockptr += run_arr[run].length;
+        }
     }
 
     // write final partial block
     const size_t diff = length - written_bytes;
     if (diff > 0) {
-        data_block block;
-        inode_read_data_block(&inode, blockptr, &block, NULL);
-
-        memcpy(&block, &buffer[written_bytes], diff);
-        inode_write_data_block(&inode, blockptr, &block);
+        const int err = stzfs_write_block(handle, blockptr, 0, &buffer[written_bytes], diff);
+        if (err) return stzfs_end_write(handle, offset, written_bytes, err);
         written_bytes += diff;
     }
 
-    inode.atom_count = new_atom_count;
-    inode_write(inodeptr, &inode);
+    // the inode is written back when the file is flushed
+    inode->atom_count = new_atom_count;
+    handle->dirty = true;
 
     return written_bytes;
 }
 
-// create new file and open it
-int stzfs_create(const char* file_path, mode_t mode, struct fuse_file_info* file_info) {
-    STZFS_DEBUG("path=%s", file_path);
+// write to a file
+int stzfs_write(const char* file_path, const char* buffer, size_t length, off_t offset,
+                struct fuse_file_info* file_info) {
+    STZFS_DEBUG("p=%s, l=%zu, o=%lld", file_path, length, offset);
 
-    int64_t inodeptr, parent_inodeptr;
-    inode_t inode, parent_inode;
-    char last_name[2048];
-    int err = find_file_inode(file_path, &inodeptr, &inode, &parent_inodeptr, &parent_inode, last_name);
-    if (err) return err;
+    if (length == 0)  {
+        printf("stzfs_write: zero length write\n");
+        return 0;
+    }
 
-    if (inodeptr != 0) {
-        printf("stzfs_create: file is already existing\n");
-        return -EEXIST;
+    if (file_info->fh == 0) {
+        printf("stzfs_write: invald file handle\n");
+        return -EFAULT;
     }
 
-    // update timestamps
-    touch_mtime_and_ctime(&parent_inode);
+    handle_t* handle = stzfs_handle(file_info);
+    inode_lock_exclusive(handle->inodeptr);
+    const int result = stzfs_write_handle(handle, buffer, length, offset);
+    inode_unlock(handle->inodeptr);
 
-    struct fuse_context* context = fuse_get_context();
+    return result;
+}
+
+// create a new file in a locked directory
+static int stzfs_create_at(file* parent, const char* name, mode_t mode, uid_t uid, gid_t gid, file* f) {
+    int err = stzfs_find_entry(parent, name, f);
+    if (err) return err;
+
+    if (f->inodeptr != 0) {
+        printf("stzfs_create: file is already existing\n");
+        return -EEXIST;
+    }
+
+    // update timestamps
+    touch_mtime_and_ctime(&parent->inode);
 
     // create new file
     struct timespec now;
     clock_gettime(CLOCK_REALTIME, &now);
-    inode.mode = mode_posix_to_stzfs(mode);
-    inode.uid = context->uid;
-    inode.gid = context->gid;
-    inode.atime = now;
-    inode.mtime = now;
-    inode.ctime = now;
-    inode.link_count = 1;
-
-    inode_alloc(&inodeptr, &inode);
-    direntry_alloc(&parent_inode, last_name, inodeptr);
-    inode_write(parent_inodeptr, &parent_inode);
-
-    file_info->fh = inodeptr;
+    f->inode.mode = mode_posix_to_stzfs(mode);
+    inode_init_blocks(&f->inode);
+    f->inode.uid = uid;
+    f->inode.gid = gid;
+    f->inode.atime = now;
+    f->inode.mtime = now;
+    f->inode.ctime = now;
+    f->inode.link_count = 1;
+
+    if (inode_alloc(parent->inodeptr, &f->inodeptr, &f->inode)) {
+        printf("stzfs_create: could not allocate inode\n");
+        return -ENOSPC;
+    }
+    direntry_alloc(parent->inodeptr, &parent->inode, name, f->inodeptr, f->inode.mode);
+    inode_write(parent->inodeptr, &parent->inode);
+
     return 0;
 }
 
-// rename a file
-int stzfs_rename(const char* src_path, const char* dst_path, unsigned int flags) {
-    STZFS_DEBUG("src_path=%s, dst_path=%s", src_path, dst_path);
+// open a file that was just created
+static int stzfs_open_created(const file* f, struct fuse_file_info* file_info) {
+    inode_lock_exclusive(f->inodeptr);
+    handle_t* handle = handle_open(f->inodeptr);
+    inode_unlock(f->inodeptr);
+    if (handle == NULL) {
+        printf("stzfs_create: could not open file handle\n");
+        return -ENOMEM;
+    }
+    file_info->fh = (uintptr_t)handle;
+    return 0;
+}
+
+// create new file and open it
+static int stzfs_create_locked(const char* file_path, mode_t mode, struct fuse_file_info* file_info) {
+    char name[2048];
+    file f, parent;
+    int err = find_file_inode2(file_path, &f, &parent, name);
+    if (err) return err;
+
+    if (f.inodeptr != 0) {
+        printf("stzfs_create: file is already existing\n");
+        return -EEXIST;
+    }
+
+    struct fuse_context* context = fuse_get_context();
+    err = stzfs_create_at(&parent, name, mode, context->uid, context->gid, &f);
+    if (err) return err;
+
+    return stzfs_open_created(&f, file_info);
+}
+
+int stzfs_create(const char* file_path, mode_t mode, struct fuse_file_info* file_info) {
+    STZFS_DEBUG("path=%s", file_path);
 
-    // TODO: improve me (use inodes and ptrs)
-    int src_exists = file_exists(src_path);
-    int dst_exists = file_exists(dst_path);
+    pthread_rwlock_wrlock(&namespace_lock);
+    const int err = stzfs_create_locked(file_path, mode, file_info);
+    pthread_rwlock_unlock(&namespace_lock);
 
-    if (src_exists == 0) {
+    return err;
+}
+
+// rename the entry src_name of a locked directory, which links to src (dst->inodeptr is 0 if dst_name is free)
+static int stzfs_rename_at(file* src_parent, const char* src_name, file* src, file* dst_parent,
+                           const char* dst_name, file* dst, unsigned int flags) {
+    const bool dst_exists = dst->inodeptr != 0;
+
+    if (flags & ~RENAME_NOREPLACE) {
+        printf("stzfs_rename: unsupported flags\n");
+        return -EINVAL;
+    } else if (src->inodeptr == 0) {
         printf("stzfs_rename: src file does not exist\n");
         return -ENOENT;
     } else if (dst_exists && (flags & RENAME_NOREPLACE)) {
         printf("stzfs_rename: dest file exists but RENAME_NOREPLACE is set\n");
         return -EEXIST;
+    } else if (dst->inodeptr == src->inodeptr) {
+        // both names link to the same file already
+        return 0;
     }
 
-    // find src file nodes
-    char src_last_name[MAX_FILENAME_LENGTH];
-    file src, src_parent;
-    int err = find_file_inode(src_path, &src.inodeptr, &src.inode, &src_parent.inodeptr,
-                              &src_parent.inode, src_last_name);
-    if (err) return err;
-
-    // find dest file nodes
-    char dst_last_name[MAX_FILENAME_LENGTH];
-    file dst, dst_parent;
-    err = find_file_inode(dst_path, &dst.inodeptr, &dst.inode, &dst_parent.inodeptr,
-                          &dst_parent.inode, dst_last_name);
-    if (err) return err;
+    // open files may be written concurrently, re-read them once they are locked
+    inode_lock_pair(src->inodeptr, dst->inodeptr);
+    inode_read(src->inodeptr, &src->inode);
+    if (dst_exists) {
+        inode_read(dst->inodeptr, &dst->inode);
+    }
 
     // update timestamps
-    touch_atime(&src.inode);
-    touch_ctime(&src.inode);
+    touch_atime(&src->inode);
+    touch_ctime(&src->inode);
 
     if (dst_exists) {
-        touch_atime(&dst.inode);
-        touch_ctime(&dst.inode);
+        touch_atime(&dst->inode);
+        touch_ctime(&dst->inode);
     }
 
-    touch_mtime_and_ctime(&src_parent.inode);
+    touch_mtime_and_ctime(&src_parent->inode);
 
-    if (src_parent.inodeptr != dst_parent.inodeptr) {
-        touch_mtime_and_ctime(&dst_parent.inode);
+    if (src_parent->inodeptr != dst_parent->inodeptr) {
+        touch_mtime_and_ctime(&dst_parent->inode);
     }
 
     // TODO: update parent dir pointer if src is a dir
     // TODO: check inode bounds
     // replace dst with src
-    src.inode.link_count++;
-    touch_ctime(&src.inode);
-    inode_write(src.inodeptr, &src.inode);
+    src->inode.link_count++;
+    touch_ctime(&src->inode);
+    inode_write(src->inodeptr, &src->inode);
 
     if (dst_exists) {
-        direntry_write(&dst_parent.inode, dst_last_name, src.inodeptr);
-        dst.inode.link_count--;
-        if (dst.inode.link_count <= 0) {
-            inode_free(dst.inodeptr, &dst.inode);
+        direntry_write(dst_parent->inodeptr, &dst_parent->inode, dst_name, src->inodeptr, src->inode.mode);
+        dst->inode.link_count--;
+        if (dst->inode.link_count <= 0) {
+            inode_free(dst->inodeptr, &dst->inode);
         } else {
-            inode_write(dst.inodeptr, &dst.inode);
+            inode_write(dst->inodeptr, &dst->inode);
         }
     } else {
-        direntry_alloc(&dst_parent.inode, dst_last_name, src.inodeptr);
-        inode_write(dst_parent.inodeptr, &dst_parent.inode);
+        direntry_alloc(dst_parent->inodeptr, &dst_parent->inode, dst_name, src->inodeptr, src->inode.mode);
+        inode_write(dst_parent->inodeptr, &dst_parent->inode);
     }
 
     // rewrite double dot inodeptr
-    if (M_IS_DIR(src.inode.mode) && src_parent.inodeptr != dst_parent.inodeptr) {
-        dst_parent.inode.link_count++;
-        inode_write(dst_parent.inodeptr, &dst_parent.inode);
+    if (M_IS_DIR(src->inode.mode) && src_parent->inodeptr != dst_parent->inodeptr) {
+        dst_parent->inode.link_count++;
+        inode_write(dst_parent->inodeptr, &dst_parent->inode);
 
-        direntry_write(&src.inode, "..", dst_parent.inodeptr);
+        direntry_write(src->inodeptr, &src->inode, "..", dst_parent->inodeptr, dst_parent->inode.mode);
 
-        src_parent.inode.link_count--;
-        inode_write(src_parent.inodeptr, &src_parent.inode);
+        src_parent->inode.link_count--;
+        inode_write(src_parent->inodeptr, &src_parent->inode);
     }
 
-    if (src_parent.inodeptr == dst_parent.inodeptr) {
-        src_parent.inode = dst_parent.inode;
+    if (src_parent->inodeptr == dst_parent->inodeptr) {
+        src_parent->inode = dst_parent->inode;
     }
 
     // unlink src from parent directory
-    direntry_free(&src_parent.inode, src_last_name);
-    inode_write(src_parent.inodeptr, &src_parent.inode);
+    direntry_free(src_parent->inodeptr, &src_parent->inode, src_name);
+    inode_write(src_parent->inodeptr, &src_parent->inode);
+
+    src->inode.link_count--;
+    inode_write(src->inodeptr, &src->inode);
 
-    src.inode.link_count--;
-    inode_write(src.inodeptr, &src.inode);
+    inode_unlock_pair(src->inodeptr, dst->inodeptr);
+    return 0;
 }
 
-// unlink a file
-int stzfs_unlink(const char* path) {
-    STZFS_DEBUG("path=%s", path);
+// rename a file
+static int stzfs_rename_locked(const char* src_path, const char* dst_path, unsigned int flags) {
+    char src_name[MAX_FILENAME_LENGTH];
+    file src, src_parent;
+    int err = find_file_inode2(src_path, &src, &src_parent, src_name);
+    if (err) return err;
+
+    char dst_name[MAX_FILENAME_LENGTH];
+    file dst, dst_parent;
+    err = find_file_inode2(dst_path, &dst, &dst_parent, dst_name);
+    if (err) return err;
 
-    return unlink_file_or_dir(path, 0);
+    return stzfs_rename_at(&src_parent, src_name, &src, &dst_parent, dst_name, &dst, flags);
 }
 
-// create a new directory
-int stzfs_mkdir(const char* path, mode_t mode) {
+int stzfs_rename(const char* src_path, const char* dst_path, unsigned int flags) {
+    STZFS_DEBUG("src_path=%s, dst_path=%s", src_path, dst_path);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    const int err = stzfs_rename_locked(src_path, dst_path, flags);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// unlink a file
+int stzfs_unlink(const char* path) {
     STZFS_DEBUG("path=%s", path);
 
-    char name[MAX_FILENAME_LENGTH];
-    file dir, parent;
+    pthread_rwlock_wrlock(&namespace_lock);
+    const int err = unlink_file_or_dir(path, 0);
+    pthread_rwlock_unlock(&namespace_lock);
 
+    return err;
+}
+
+// create a new directory in a locked directory
+static int stzfs_mkdir_at(file* parent, const char* name, mode_t mode, uid_t uid, gid_t gid, file* dir) {
     {
-        const int err = find_file_inode2(path, &dir, &parent, name);
-        if (err) {
-            printf("stzfs_mkdir: could not find parent directory inode\n");
-            return err;
-        }
+        const int err = stzfs_find_entry(parent, name, dir);
+        if (err) return err;
     }
 
-    if (parent.inodeptr == 0) {
-        printf("stzfs_mkdir: parent not existing\n");
-        return -ENOENT;
-    } else if (dir.inodeptr != 0) {
+    if (dir->inodeptr != 0) {
         printf("stzfs_mkdir: file or directory exists\n");
         return -EEXIST;
     }
 
-    const super_block* sb = super_block_cache;
-    if (sb->free_blocks == 0) {
+    if (bitmap_cache_get_free(&block_bitmap_cache) == 0) {
         printf("stzfs_mkdir: no free block available\n");
         return -ENOSPC;
-    } else if (sb->free_inodes == 0) {
+    } else if (bitmap_cache_get_free(&inode_bitmap_cache) == 0) {
         printf("stzfs_mkdir: no free inode available\n");
         return -ENOSPC;
     }
 
     // update timestamps
-    touch_mtime_and_ctime(&parent.inode);
+    touch_mtime_and_ctime(&parent->inode);
 
     // allocate new inode
     {
-        const int err = inode_allocptr(&dir.inodeptr);
+        const int err = inode_allocptr(parent->inodeptr, true, &dir->inodeptr);
         if (err) {
             printf("stzfs_mkdir: could not allocate directory inode\n");
             return err;
         }
     }
 
-    // allocate new block
-    int64_t blockptr;
+    // allocate new block in the group of the new directory
+    int64_t blockptr, allocated;
     {
-        const int err = block_allocptr(&blockptr);
+        const int err = block_alloc_range(group_block_goal(dir->inodeptr), 1, &blockptr, &allocated);
         if (err) {
             printf("stzfs_mkdir: could not allocate directory block\n");
             return err;
@@ -601,92 +1202,275 @@ int stzfs_mkdir(const char* path, mode_t mode) {
 
     // allocate and write directory block
     dir_block block;
-    memset(&block, 0, STZFS_BLOCK_SIZE);
-    block.entries[0] = (dir_block_entry) {.name = ".", .inode=dir.inodeptr};
-    block.entries[1] = (dir_block_entry) {.name = "..", .inode=parent.inodeptr};
+    direntry_init(&block, dir->inodeptr, parent->inodeptr);
     block_write(blockptr, &block);
 
     // TODO: check inode bounds
     // increase parent inode link counter
-    parent.inode.link_count++;
-    inode_write(parent.inodeptr, &parent.inode);
-
-    struct fuse_context* context = fuse_get_context();
+    parent->inode.link_count++;
+    inode_write(parent->inodeptr, &parent->inode);
 
     // create and write inode
     struct timespec now;
     clock_gettime(CLOCK_REALTIME, &now);
-    dir.inode.mode = mode_posix_to_stzfs(mode | S_IFDIR);
-    dir.inode.uid = context->uid;
-    dir.inode.gid = context->gid;
-    dir.inode.link_count = 2;
-    dir.inode.atom_count = 2;
-    dir.inode.block_count = 1;
-    dir.inode.atime = now;
-    dir.inode.mtime = now;
-    dir.inode.ctime = now;
-    dir.inode.data_direct[0] = blockptr;
-    inode_write(dir.inodeptr, &dir.inode);
+    dir->inode.mode = mode_posix_to_stzfs(mode | S_IFDIR);
+    dir->inode.uid = uid;
+    dir->inode.gid = gid;
+    dir->inode.link_count = 2;
+    dir->inode.atom_count = 2;
+    dir->inode.atime = now;
+    dir->inode.mtime = now;
+    dir->inode.ctime = now;
+    inode_init_blocks(&dir->inode);
+    inode_append_data_blockptr(&dir->inode, blockptr);
+    inode_write(dir->inodeptr, &dir->inode);
 
     // allocate entry in parent dir
-    direntry_alloc(&parent.inode, name, dir.inodeptr);
-    inode_write(parent.inodeptr, &parent.inode);
+    direntry_alloc(parent->inodeptr, &parent->inode, name, dir->inodeptr, dir->inode.mode);
+    inode_write(parent->inodeptr, &parent->inode);
 
     return 0;
 }
 
+// create a new directory
+static int stzfs_mkdir_locked(const char* path, mode_t mode) {
+    char name[MAX_FILENAME_LENGTH];
+    file dir, parent;
+
+    {
+        const int err = find_file_inode2(path, &dir, &parent, name);
+        if (err) {
+            printf("stzfs_mkdir: could not find parent directory inode\n");
+            return err;
+        }
+    }
+
+    if (parent.inodeptr == 0) {
+        printf("stzfs_mkdir: parent not existing\n");
+        return -ENOENT;
+    } else if (dir.inodeptr != 0) {
+        printf("stzfs_mkdir: file or directory exists\n");
+        return -EEXIST;
+    }
+
+    struct fuse_context* context = fuse_get_context();
+    return stzfs_mkdir_at(&parent, name, mode, context->uid, context->gid, &dir);
+}
+
+int stzfs_mkdir(const char* path, mode_t mode) {
+    STZFS_DEBUG("path=%s", path);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    const int err = stzfs_mkdir_locked(path, mode);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
 // remove an empty directory
 int stzfs_rmdir(const char* path) {
     STZFS_DEBUG("path=%s", path);
 
     // TODO: check root directory? fuse relative or absolute path?
-    return unlink_file_or_dir(path, 1);
+    pthread_rwlock_wrlock(&namespace_lock);
+    const int err = unlink_file_or_dir(path, 1);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
 }
 
-// read the contents of a directory
-int stzfs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset,
-                  struct fuse_file_info* file_info, enum fuse_readdir_flags flags) {
-    STZFS_DEBUG("path=%s, offset=%lld", path, offset);
+// passes directory entries on, the positions of the entries behind the virtual .. of the root directory are
+// shifted
+typedef struct stzfs_shift_context {
+    direntry_filler_t filler;
+    void* context;
+    off_t shift;
+} stzfs_shift_context;
+
+static int stzfs_fill_shifted(void* context, const char* name, int64_t inodeptr, uint8_t type, off_t next) {
+    const stzfs_shift_context* shift = context;
+    return shift->filler(shift->context, name, inodeptr, type, next + shift->shift);
+}
 
-    if (!file_exists(path)) {
-        printf("stzfs_readdir: no such directory\n");
-        return -ENOENT;
+// list the entries of a directory behind offset, the namespace lock has to be held
+static int stzfs_list_dir(const file* dir, off_t offset, direntry_filler_t filler, void* context) {
+    // the root directory has no .. entry on disk, it is shown in front of the others
+    stzfs_shift_context shift = {.filler = filler, .context = context, .shift = 0};
+#if STZFS_SHOW_DOUBLE_DOTS_IN_ROOT_DIR
+    if (dir->inodeptr == ROOT_INODEPTR) {
+        if (offset == 0 && filler(context, "..", ROOT_INODEPTR, DIR_TYPE_DIR, 1)) {
+            return 0;
+        }
+        shift.shift = 1;
     }
+#endif
 
-    file dir;
-    find_file_inode2(path, &dir, NULL, NULL);
+    inode_t inode = dir->inode;
+    if (direntry_list(&inode, MAX(offset - shift.shift, 0), stzfs_fill_shifted, &shift)) {
+        printf("stzfs_readdir: can't read directory block\n");
+        return -EFAULT;
+    }
+
+    return 0;
+}
 
-    if (!M_IS_DIR(dir.inode.mode)) {
+// passes directory entries on with their posix file types
+typedef struct stzfs_type_context {
+    stzfs_filler_t filler;
+    void* context;
+} stzfs_type_context;
+
+static int stzfs_fill_type(void* context, const char* name, int64_t inodeptr, uint8_t type, off_t next) {
+    const stzfs_type_context* fill = context;
+
+    struct stat st = {.st_ino = inodeptr};
+    if (type == DIR_TYPE_REG) {
+        st.st_mode = S_IFREG;
+    } else if (type == DIR_TYPE_LNK) {
+        st.st_mode = S_IFLNK;
+    } else if (type == DIR_TYPE_DIR) {
+        st.st_mode = S_IFDIR;
+    }
+
+    return fill->filler(fill->context, name, &st, next);
+}
+
+// entries collected to read their inodes together
+typedef struct stzfs_readdir_batch {
+    size_t count;
+    int64_t inodeptrs[STZFS_READDIR_BATCH];
+    inode_t inodes[STZFS_READDIR_BATCH];
+    off_t nexts[STZFS_READDIR_BATCH];
+    char names[STZFS_READDIR_BATCH][MAX_FILENAME_LENGTH + 1];
+} stzfs_readdir_batch;
+
+static int stzfs_collect_entry(void* context, const char* name, int64_t inodeptr, uint8_t type, off_t next) {
+    stzfs_readdir_batch* batch = context;
+    batch->inodeptrs[batch->count] = inodeptr;
+    batch->nexts[batch->count] = next;
+    strcpy(batch->names[batch->count], name);
+    return ++batch->count == STZFS_READDIR_BATCH;
+}
+
+// pass the entries of a directory with all of their attributes, the inodes of a batch of entries are read
+// with one read per inode table block
+static int stzfs_list_dir_plus(const file* dir, off_t offset, stzfs_filler_t filler, void* context) {
+    stzfs_readdir_batch* batch = malloc(sizeof(stzfs_readdir_batch));
+    if (batch == NULL) {
+        return -ENOMEM;
+    }
+
+    int err = 0;
+    bool full = false;
+    do {
+        batch->count = 0;
+        err = stzfs_list_dir(dir, offset, stzfs_collect_entry, batch);
+        if (!err && inode_read_table_batch(batch->inodeptrs, batch->count, batch->inodes)) {
+            printf("stzfs_readdir: can't read inodes of directory entries\n");
+            err = -EFAULT;
+        }
+
+        for (size_t i = 0; !err && !full && i < batch->count; i++) {
+            // open files are newer in their handles, which change under the inode lock
+            file f = {.inodeptr = batch->inodeptrs[i], .inode = batch->inodes[i]};
+            inode_lock_shared(f.inodeptr);
+            handle_read_inode(f.inodeptr, &f.inode);
+            inode_unlock(f.inodeptr);
+
+            struct stat st;
+            stzfs_fill_stat(&f, &st);
+            full = filler(context, batch->names[i], &st, batch->nexts[i]) != 0;
+        }
+
+        if (batch->count > 0) {
+            offset = batch->nexts[batch->count - 1];
+        }
+    } while (!err && !full && batch->count == STZFS_READDIR_BATCH);
+
+    free(batch);
+    return err;
+}
+
+// pass the entries of a locked directory behind offset on to filler until it is full, the inode lock of the
+// directory is dropped once its access time is updated, the namespace lock is left to the caller
+static int stzfs_readdir_at(file* dir, off_t offset, bool plus, stzfs_filler_t filler, void* context) {
+    if (!M_IS_DIR(dir->inode.mode)) {
         printf("stzfs_readdir: not a directory\n");
+        inode_unlock(dir->inodeptr);
         return -ENOTDIR;
     }
 
     // update timestamps
-    touch_atime(&dir.inode);
-    inode_write(dir.inodeptr, &dir.inode);
+    touch_atime(&dir->inode);
+    inode_write(dir->inodeptr, &dir->inode);
 
-#if STZFS_SHOW_DOUBLE_DOTS_IN_ROOT_DIR
-    if (strcmp(path, "/") == 0) {
-        filler(buffer, "..", NULL, 0, 0);
+    // directories only change under the exclusive namespace lock, the entries need no inode lock and the
+    // inodes of entries can be locked while they are read
+    inode_unlock(dir->inodeptr);
+
+    if (plus) {
+        return stzfs_list_dir_plus(dir, offset, filler, context);
     }
-#endif
 
-    for (int64_t offset = 0; offset < dir.inode.block_count; offset++) {
-        dir_block block;
-        int64_t blockptr;
-        inode_read_data_block(&dir.inode, offset, &block, &blockptr);
-        if (blockptr == 0) {
-            printf("stzfs_readdir: can't read directory block\n");
-            return -EFAULT;
-        }
+    stzfs_type_context fill = {.filler = filler, .context = context};
+    return stzfs_list_dir(dir, offset, stzfs_fill_type, &fill);
+}
+
+// fuse directory buffer of the path frontend
+typedef struct stzfs_fill_dir_context {
+    void* buffer;
+    fuse_fill_dir_t filler;
+    enum fuse_fill_dir_flags flags;
+} stzfs_fill_dir_context;
+
+static int stzfs_fill_dir(void* context, const char* name, const struct stat* st, off_t next) {
+    const stzfs_fill_dir_context* fill = context;
+    return fill->filler(fill->buffer, name, st, next, fill->flags);
+}
+
+// read the contents of a directory from offset on until the buffer is full
+int stzfs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset,
+                  struct fuse_file_info* file_info, enum fuse_readdir_flags flags) {
+    STZFS_DEBUG("path=%s, offset=%lld", path, offset);
+
+    // exclusive, concurrent readers would race on the access time
+    file dir;
+    int err = stzfs_lock_file(path, NULL, true, &dir);
+    if (err) {
+        printf("stzfs_readdir: no such directory\n");
+        return err;
+    }
 
-        const size_t remaining_entries = dir.inode.atom_count - offset * DIR_BLOCK_ENTRIES;
-        const size_t entries = MIN(DIR_BLOCK_ENTRIES, remaining_entries);
-        for (size_t entry = 0; entry < entries; entry++) {
-            filler(buffer, (const char*)block.entries[entry].name, NULL, 0, 0);
+    const bool plus = flags & FUSE_READDIR_PLUS;
+    stzfs_fill_dir_context context = {.buffer = buffer, .filler = filler, .flags = plus ? FUSE_FILL_DIR_PLUS : 0};
+    err = stzfs_readdir_at(&dir, offset, plus, stzfs_fill_dir, &context);
+
+    pthread_rwlock_unlock(&namespace_lock);
+    return err;
+}
+
+// flush written file data to the disk
+int stzfs_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+    STZFS_DEBUG("path=%s, datasync=%i", path, datasync);
+
+    // held back data gets its blocks first
+    if (fi != NULL && fi->fh != 0) {
+        handle_t* handle = stzfs_handle(fi);
+        inode_lock_exclusive(handle->inodeptr);
+        const stzfs_error_t error = handle_flush(handle);
+        inode_unlock(handle->inodeptr);
+
+        if (error) {
+            printf("stzfs_fsync: could not flush file handle\n");
+            return -EIO;
         }
     }
 
+    if (inode_flush_table() || block_cache_flush() || disk_sync()) {
+        printf("stzfs_fsync: could not sync disk\n");
+        return -EIO;
+    }
+
     return 0;
 }
 
@@ -699,66 +1483,107 @@ int stzfs_statfs(const char* path, struct statvfs* stat) {
     stat->f_bsize = STZFS_BLOCK_SIZE;
     stat->f_frsize = STZFS_BLOCK_SIZE;
     stat->f_blocks = sb->block_count;
-    stat->f_bfree = sb->free_blocks;
-    stat->f_bavail = sb->free_blocks;
+    // blocks reserved for delayed writes are as good as used
+    stat->f_bfree = block_get_free();
+    stat->f_bavail = stat->f_bfree;
     stat->f_files = sb->inode_count;
-    stat->f_ffree = sb->free_inodes;
+    stat->f_ffree = bitmap_cache_get_free(&inode_bitmap_cache);
     stat->f_namemax = MAX_FILENAME_LENGTH;
 
     return 0;
 }
 
+// change the owner of a locked file, -1 keeps an id
+static void stzfs_chown_file(file* f, uid_t uid, gid_t gid) {
+    // update timestamps
+    touch_atime(&f->inode);
+    touch_ctime(&f->inode);
+
+    if (uid != (uid_t)-1) f->inode.uid = uid;
+    if (gid != (gid_t)-1) f->inode.gid = gid;
+    inode_write(f->inodeptr, &f->inode);
+}
+
 // change file owner
 int stzfs_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi) {
     STZFS_DEBUG("path=%s, uid=%u, gid=%u", path, uid, gid);
 
     file f;
-    if (fi == NULL) {
-        find_file_inode2(path, &f, NULL, NULL);
-    } else {
-        f.inodeptr = fi->fh;
-        inode_read(f.inodeptr, &f.inode);
-    }
-
-    if (f.inodeptr == 0) {
+    const int err = stzfs_lock_file(path, fi, true, &f);
+    if (err) {
         printf("stzfs_chown: no such file\n");
-        return -ENOENT;
+        return err;
     }
 
-    // update timestamps
-    touch_atime(&f.inode);
-    touch_ctime(&f.inode);
-
-    f.inode.uid = uid;
-    f.inode.gid = gid;
-    inode_write(f.inodeptr, &f.inode);
+    stzfs_chown_file(&f, uid, gid);
 
+    stzfs_unlock_file(fi, &f);
     return 0;
 }
 
+// change the permissions of a locked file
+static void stzfs_chmod_file(file* f, mode_t mode) {
+    // update timestamps
+    touch_atime(&f->inode);
+    touch_ctime(&f->inode);
+
+    // keep the format flags of the inode
+    f->inode.mode = mode_posix_to_stzfs(mode) | (f->inode.mode & M_FLAGS_MASK);
+    inode_write(f->inodeptr, &f->inode);
+}
+
 // change file permissions
 int stzfs_chmod(const char* path, mode_t mode, struct fuse_file_info* fi) {
     STZFS_DEBUG("path=%s", path);
 
     file f;
-    if (fi == NULL) {
-        find_file_inode2(path, &f, NULL, NULL);
-    } else {
-        f.inodeptr = fi->fh;
-        inode_read(f.inodeptr, &f.inode);
+    const int err = stzfs_lock_file(path, fi, true, &f);
+    if (err) {
+        printf("stzfs_chmod: no such file\n");
+        return err;
     }
 
-    if (f.inodeptr == 0) {
-        printf("stzfs_chmod: no such file\n");
-        return -ENOENT;
+    stzfs_chmod_file(&f, mode);
+
+    stzfs_unlock_file(fi, &f);
+    return 0;
+}
+
+// truncate a locked file
+static int stzfs_truncate_file(file* f, off_t offset) {
+    if ((off_t)DIV_CEIL(offset, STZFS_BLOCK_SIZE) > BLOCKPTR_MAX) {
+        printf("stzfs_truncate: sparse file block count would exceed maximum inode block count\n");
+        return -EFBIG;
+    } else if (M_IS_DIR(f->inode.mode)) {
+        printf("stzfs_truncate: is a directory\n");
+        return -EISDIR;
     }
 
-    // update timestamps
-    touch_atime(&f.inode);
-    touch_ctime(&f.inode);
+    const int64_t new_block_count = DIV_CEIL(offset, STZFS_BLOCK_SIZE);
+
+    // data held back for the cut off part of an open file must not be allocated anymore
+    handle_t* handle = handle_find(f->inodeptr);
+    if (handle != NULL) {
+        handle_truncate(handle, offset);
+    }
+
+    // blocks preallocated past the end of the file are dropped as well
+    if (new_block_count > f->inode.block_count) {
+        inode_append_null_blocks(&f->inode, new_block_count);
+    } else if (new_block_count < f->inode.block_count) {
+        inode_truncate(&f->inode, new_block_count);
+    }
+    if (offset < f->inode.atom_count) {
+        touch_mtime_and_ctime(&f->inode);
+    }
+
+    if (f->inode.block_count != new_block_count) {
+        printf("stzfs_truncate: invalid block count after truncate\n");
+    }
 
-    f.inode.mode = mode_posix_to_stzfs(mode);
-    inode_write(f.inodeptr, &f.inode);
+    f->inode.atom_count = offset;
+    touch_atime(&f->inode);
+    inode_write(f->inodeptr, &f->inode);
 
     return 0;
 }
@@ -768,182 +1593,632 @@ int stzfs_truncate(const char* path, off_t offset, struct fuse_file_info* fi) {
     STZFS_DEBUG("path=%s, offset=%lld", path, offset);
 
     file f;
-    if (fi == NULL) {
-        find_file_inode2(path, &f, NULL, NULL);
-    } else {
-        f.inodeptr = fi->fh;
-        inode_read(f.inodeptr, &f.inode);
-    }
-
-    if (f.inodeptr == 0) {
+    int err = stzfs_lock_file(path, fi, true, &f);
+    if (err) {
         printf("stzfs_truncate: no such file\n");
-        return -ENOENT;
+        return err;
     }
 
-    if ((off_t)DIV_CEIL(offset, STZFS_BLOCK_SIZE) > BLOCKPTR_MAX) {
-        printf("stzfs_truncate: sparse file block count would exceed maximum inode block count\n");
+    err = stzfs_truncate_file(&f, offset);
+
+    stzfs_unlock_file(fi, &f);
+    return err;
+}
+
+// preallocate blocks, punch holes or zero ranges of a file
+int stzfs_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+    STZFS_DEBUG("path=%s, mode=%i, offset=%lld, length=%lld", path, mode, offset, length);
+
+    const int supported = FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE;
+    if ((mode & ~supported) || ((mode & FALLOC_FL_PUNCH_HOLE) && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))) {
+        printf("stzfs_fallocate: unsupported mode\n");
+        return -EOPNOTSUPP;
+    } else if (offset < 0 || length <= 0) {
+        printf("stzfs_fallocate: invalid range\n");
+        return -EINVAL;
+    } else if (!(mode & FALLOC_FL_PUNCH_HOLE) &&
+               (length > INT64_MAX - offset || DIV_CEIL(offset + length, STZFS_BLOCK_SIZE) > INODE_MAX_BLOCKS)) {
+        printf("stzfs_fallocate: max file size exceeded\n");
         return -EFBIG;
     }
 
-    const int64_t new_block_count = DIV_CEIL(offset, STZFS_BLOCK_SIZE);
+    handle_t* handle;
+    int err = stzfs_get_handle(path, fi, &handle);
+    if (err) return err;
+
+    // a punched range past the largest file ends with it
+    const off_t end = length > INT64_MAX - offset ? INT64_MAX : offset + length;
+    err = stzfs_fallocate_range(handle, mode, offset, end);
+    return stzfs_put_handle(fi, handle, err);
+}
 
-    if (offset > f.inode.atom_count) {
-        inode_append_null_blocks(&f.inode, new_block_count);
-    } else if (offset < f.inode.atom_count) {
-        if (new_block_count < f.inode.block_count) {
-            inode_truncate(&f.inode, new_block_count);
+// find the next data or hole of a file, preallocated blocks count as data
+off_t stzfs_lseek(const char* path, off_t offset, int whence, struct fuse_file_info* fi) {
+    STZFS_DEBUG("path=%s, offset=%lld, whence=%i", path, offset, whence);
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        printf("stzfs_lseek: unsupported whence\n");
+        return -EINVAL;
+    } else if (offset < 0) {
+        printf("stzfs_lseek: negative offset\n");
+        return -ENXIO;
+    }
+
+    handle_t* handle;
+    int err = stzfs_get_handle(path, fi, &handle);
+    if (err) return err;
+
+    // data held back by the handle has to be mapped to be found
+    const inode_t* inode = &handle->inode;
+    int64_t block = 0;
+    if (offset >= (off_t)inode->atom_count) {
+        err = -ENXIO;
+    } else if (handle_flush_data(handle) ||
+               inode_seek(&handle->inode, offset / STZFS_BLOCK_SIZE, whence == SEEK_HOLE, &block)) {
+        printf("stzfs_lseek: could not walk block map\n");
+        err = -EIO;
+    }
+
+    // the end of the file is an implicit hole
+    off_t result = MAX(offset, (off_t)block * STZFS_BLOCK_SIZE);
+    if (!err && result >= (off_t)inode->atom_count) {
+        if (whence == SEEK_DATA) {
+            err = -ENXIO;
+        } else {
+            result = inode->atom_count;
         }
-        touch_mtime_and_ctime(&f.inode);
     }
 
-    if (f.inode.block_count != new_block_count) {
-        printf("stzfs_truncate: invalid block count after truncate\n");
+    err = stzfs_put_handle(fi, handle, err);
+    return err ? err : result;
+}
+
+// report the physically consecutive data of a file in a byte range, holes are skipped
+static int stzfs_report_extents(handle_t* handle, stzfs_extent_report_t* report) {
+    inode_t* inode = &handle->inode;
+    report->count = 0;
+
+    if (handle_flush_data(handle)) {
+        printf("stzfs_report_extents: could not flush delayed blocks\n");
+        return -EIO;
     }
 
-    f.inode.atom_count = offset;
-    touch_atime(&f.inode);
-    inode_write(f.inodeptr, &f.inode);
+    const uint64_t end_atom = report->length > UINT64_MAX - report->start ? UINT64_MAX : report->start + report->length;
+    const int64_t end = MIN(DIV_CEIL(end_atom, STZFS_BLOCK_SIZE), (uint64_t)inode->block_count);
+    int64_t offset = MIN(report->start / STZFS_BLOCK_SIZE, (uint64_t)end);
+
+    stzfs_extent_entry_t* last = NULL;
+    while (offset < end) {
+        int64_t data, hole;
+        if (inode_seek(inode, offset, false, &data) || inode_seek(inode, data, true, &hole)) {
+            printf("stzfs_report_extents: could not walk block map\n");
+            return -EIO;
+        } else if (data >= end) {
+            break;
+        }
+
+        // translate the data in bounded pieces, runs continuing the last entry extend it
+        offset = data;
+        const int64_t stop = MIN(hole, end);
+        while (offset < stop) {
+            const size_t length = MIN(stop - offset, STZFS_READAHEAD_BLOCKS);
+            inode_run_t run_arr[length];
+            size_t run_count;
+            if (inode_find_data_runs(inode, &handle->map, offset, length, run_arr, &run_count)) {
+                printf("stzfs_report_extents: could not map data blocks\n");
+                return -EIO;
+            }
+
+            for (size_t run = 0; run < run_count; run++) {
+                const uint32_t flags = run_arr[run].unwritten ? STZFS_EXTENT_UNWRITTEN : 0;
+                const uint64_t logical = (uint64_t)offset * STZFS_BLOCK_SIZE;
+                const uint64_t physical = (uint64_t)run_arr[run].blockptr * STZFS_BLOCK_SIZE;
+                const uint64_t bytes = (uint64_t)run_arr[run].length * STZFS_BLOCK_SIZE;
+                offset += run_arr[run].length;
+
+                if (last != NULL && last->flags == flags && last->logical + last->length == logical &&
+                    last->physical + last->length == physical) {
+                    last->length += bytes;
+                    continue;
+                } else if (report->count == STZFS_REPORT_EXTENTS) {
+                    // the caller continues after the last entry
+                    return 0;
+                }
+
+                last = &report->entries[report->count++];
+                *last = (stzfs_extent_entry_t) {.logical = logical, .physical = physical, .length = bytes, .flags = flags};
+            }
+        }
+    }
+
+    // spare the caller another report if no data follows
+    int64_t next = inode->block_count;
+    if (last != NULL && inode_seek(inode, (last->logical + last->length) / STZFS_BLOCK_SIZE, false, &next)) {
+        printf("stzfs_report_extents: could not walk block map\n");
+        return -EIO;
+    } else if (last != NULL && next >= inode->block_count) {
+        last->flags |= STZFS_EXTENT_LAST;
+    }
 
     return 0;
 }
 
+// handle file system specific ioctls
+int stzfs_ioctl(const char* path, unsigned int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags,
+                void* data) {
+    STZFS_DEBUG("path=%s, cmd=%u", path, cmd);
+
+    if (cmd != STZFS_IOC_REPORT_EXTENTS) {
+        return -ENOTTY;
+    }
+
+    handle_t* handle;
+    int err = stzfs_get_handle(path, fi, &handle);
+    if (err) return err;
+
+    err = stzfs_report_extents(handle, data);
+    return stzfs_put_handle(fi, handle, err);
+}
+
+// change the access and modification times of a locked file
+static void stzfs_utimens_file(file* f, const struct timespec tv[2]) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct timespec* times[2] = {&f->inode.atime, &f->inode.mtime};
+    for (int i = 0; i < 2; i++) {
+        if (tv[i].tv_nsec == UTIME_NOW) {
+            *times[i] = now;
+        } else if (tv[i].tv_nsec != UTIME_OMIT) {
+            *times[i] = tv[i];
+        }
+    }
+
+    touch_ctime(&f->inode);
+    inode_write(f->inodeptr, &f->inode);
+}
+
 // change access and modification times of a file
 int stzfs_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
     STZFS_DEBUG("path=%s", path);
 
     file f;
-    if (fi == NULL) {
-        find_file_inode2(path, &f, NULL, NULL);
-    } else {
-        f.inodeptr = fi->fh;
-        inode_read(f.inodeptr, &f.inode);
-    }
-
-    if (f.inodeptr == 0) {
+    const int err = stzfs_lock_file(path, fi, true, &f);
+    if (err) {
         printf("stzfs_utimens: no such file\n");
-        return -ENOENT;
+        return err;
     }
 
-    f.inode.atime = tv[0];
-    f.inode.mtime = tv[1];
-    touch_ctime(&f.inode);
-    inode_write(f.inodeptr, &f.inode);
+    stzfs_utimens_file(&f, tv);
 
+    stzfs_unlock_file(fi, &f);
     return 0;
 }
 
-// create a hard link to a file
-// TODO: improve me
-int stzfs_link(const char* src, const char* dest) {
-    STZFS_DEBUG("src=%s, dest=%s", src, dest);
-
-    if (!file_exists(src)) {
-        printf("stzfs_link: no such file\n");
-        return -ENOENT;
-    }
+// link a file into a locked directory
+static int stzfs_link_at(file* src, file* parent, const char* name) {
+    file existing;
+    int err = stzfs_find_entry(parent, name, &existing);
+    if (err) return err;
 
-    if (file_exists(dest)) {
+    if (existing.inodeptr != 0) {
         printf("stzfs_link: dest already existing\n");
         return -EEXIST;
     }
 
+    // the source may be an open file
+    inode_lock_exclusive(src->inodeptr);
+    inode_read(src->inodeptr, &src->inode);
+
+    // update timestamps
+    touch_atime(&src->inode);
+    touch_ctime(&src->inode);
+    touch_mtime_and_ctime(&parent->inode);
+
+    src->inode.link_count++;
+    inode_write(src->inodeptr, &src->inode);
+    inode_unlock(src->inodeptr);
+
+    direntry_alloc(parent->inodeptr, &parent->inode, name, src->inodeptr, src->inode.mode);
+    inode_write(parent->inodeptr, &parent->inode);
+
+    return 0;
+}
+
+// create a hard link to a file
+static int stzfs_link_locked(const char* src, const char* dest) {
     file src_file;
-    find_file_inode2(src, &src_file, NULL, NULL);
+    int err = find_file_inode2(src, &src_file, NULL, NULL);
+    if (err || src_file.inodeptr == 0) {
+        printf("stzfs_link: no such file\n");
+        return err ? err : -ENOENT;
+    }
 
     file dest_file, dest_parent;
     char dest_last_name[MAX_FILENAME_LENGTH];
-    find_file_inode2(dest, &dest_file, &dest_parent, dest_last_name);
+    err = find_file_inode2(dest, &dest_file, &dest_parent, dest_last_name);
+    if (err) return err;
 
-    // update timestamps
-    touch_atime(&src_file.inode);
-    touch_ctime(&src_file.inode);
-    touch_mtime_and_ctime(&dest_parent.inode);
+    return stzfs_link_at(&src_file, &dest_parent, dest_last_name);
+}
 
-    src_file.inode.link_count++;
-    inode_write(src_file.inodeptr, &src_file.inode);
+int stzfs_link(const char* src, const char* dest) {
+    STZFS_DEBUG("src=%s, dest=%s", src, dest);
 
-    direntry_alloc(&dest_parent.inode, dest_last_name, src_file.inodeptr);
-    inode_write(dest_parent.inodeptr, &dest_parent.inode);
+    pthread_rwlock_wrlock(&namespace_lock);
+    const int err = stzfs_link_locked(src, dest);
+    pthread_rwlock_unlock(&namespace_lock);
 
-    return 0;
+    return err;
 }
 
-// create symbolic link
-int stzfs_symlink(const char* target, const char* link_name) {
-    STZFS_DEBUG("target=%s, link_name=%s", target, link_name);
+// create a symbolic link in a locked directory
+static int stzfs_symlink_at(const char* target, file* parent, const char* name, uid_t uid, gid_t gid,
+                            file* symlink) {
+    int err = stzfs_find_entry(parent, name, symlink);
+    if (err) return err;
 
-    if (file_exists(link_name)) {
+    if (symlink->inodeptr != 0) {
         printf("stzfs_symlink: link name already existing\n");
         return -EEXIST;
     }
 
-    file symlink, symlink_parent;
-    char symlink_last_name[MAX_FILENAME_LENGTH];
-    find_file_inode2(link_name, &symlink, &symlink_parent, symlink_last_name);
-
     // update timestamps
-    touch_mtime_and_ctime(&symlink_parent.inode);
+    touch_mtime_and_ctime(&parent->inode);
 
     // create new file
-    struct fuse_context* context = fuse_get_context();
     struct timespec now;
     clock_gettime(CLOCK_REALTIME, &now);
 
-    symlink.inode.mode = M_LNK;
-    symlink.inode.uid = context->uid;
-    symlink.inode.gid = context->gid;
-    symlink.inode.atime = now;
-    symlink.inode.mtime = now;
-    symlink.inode.ctime = now;
-    symlink.inode.link_count = 1;
+    symlink->inode.mode = M_LNK;
+    inode_init_blocks(&symlink->inode);
+    symlink->inode.uid = uid;
+    symlink->inode.gid = gid;
+    symlink->inode.atime = now;
+    symlink->inode.mtime = now;
+    symlink->inode.ctime = now;
+    symlink->inode.link_count = 1;
 
-    inode_alloc(&symlink.inodeptr, &symlink.inode);
-    direntry_alloc(&symlink_parent.inode, symlink_last_name, symlink.inodeptr);
-    inode_write(symlink_parent.inodeptr, &symlink_parent.inode);
+    inode_alloc(parent->inodeptr, &symlink->inodeptr, &symlink->inode);
+    direntry_alloc(parent->inodeptr, &parent->inode, name, symlink->inodeptr, symlink->inode.mode);
+    inode_write(parent->inodeptr, &parent->inode);
 
     // write target to symbolic link data blocks
     const size_t target_length = strlen(target);
     const size_t buffer_length = DIV_CEIL(sizeof(char) * target_length, STZFS_BLOCK_SIZE) * STZFS_BLOCK_SIZE;
-    void* buffer = malloc(buffer_length);
+    void* buffer = block_buffer_alloc(buffer_length / STZFS_BLOCK_SIZE);
     memcpy(buffer, target, target_length);
     memset(buffer + target_length, 0, buffer_length - target_length);
 
     for (size_t offset = 0; offset < buffer_length; offset += STZFS_BLOCK_SIZE) {
-        inode_alloc_data_block(&symlink.inode, buffer + offset);
+        inode_alloc_data_block(&symlink->inode, buffer + offset);
     }
-    symlink.inode.atom_count = target_length;
-    inode_write(symlink.inodeptr, &symlink.inode);
-    free(buffer);
+    symlink->inode.atom_count = target_length;
+    inode_write(symlink->inodeptr, &symlink->inode);
+    block_buffer_free(buffer);
 
     return 0;
 }
 
-// read symbolic link target
-int stzfs_readlink(const char* path, char* buffer, size_t length) {
-    STZFS_DEBUG("path=%s", path);
+// create symbolic link
+static int stzfs_symlink_locked(const char* target, const char* link_name) {
+    file symlink, symlink_parent;
+    char symlink_last_name[MAX_FILENAME_LENGTH];
+    int err = find_file_inode2(link_name, &symlink, &symlink_parent, symlink_last_name);
+    if (err) return err;
 
-    if (!file_exists(path)) {
-        printf("stzfs_readlink: no such file\n");
-        return -ENOENT;
+    if (symlink.inodeptr != 0) {
+        printf("stzfs_symlink: link name already existing\n");
+        return -EEXIST;
     }
 
-    file symlink;
-    find_file_inode2(path, &symlink, NULL, NULL);
+    struct fuse_context* context = fuse_get_context();
+    return stzfs_symlink_at(target, &symlink_parent, symlink_last_name, context->uid, context->gid, &symlink);
+}
 
-    if (!M_IS_LNK(symlink.inode.mode)) {
+int stzfs_symlink(const char* target, const char* link_name) {
+    STZFS_DEBUG("target=%s, link_name=%s", target, link_name);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    const int err = stzfs_symlink_locked(target, link_name);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// read the target of a locked symbolic link
+static int stzfs_readlink_file(file* symlink, char* buffer, size_t length) {
+    if (!M_IS_LNK(symlink->inode.mode)) {
         printf("stzfs_readlink: not a symbolic link\n");
         return -EINVAL;
     }
 
-    touch_atime(&symlink.inode);
-    inode_write(symlink.inodeptr, &symlink.inode);
+    touch_atime(&symlink->inode);
+    inode_write(symlink->inodeptr, &symlink->inode);
 
-    data_block data_blocks[symlink.inode.block_count];
-    inode_read_data_blocks(&symlink.inode, data_blocks, symlink.inode.block_count, 0);
+    data_block data_blocks[symlink->inode.block_count];
+    inode_read_data_blocks(&symlink->inode, NULL, data_blocks, symlink->inode.block_count, 0);
 
-    const size_t data_length = MIN(length - 1, symlink.inode.atom_count);
+    const size_t data_length = MIN(length - 1, symlink->inode.atom_count);
     memcpy(buffer, data_blocks, data_length);
     buffer[data_length] = 0;
 
     return 0;
 }
+
+// read symbolic link target
+int stzfs_readlink(const char* path, char* buffer, size_t length) {
+    STZFS_DEBUG("path=%s", path);
+
+    file symlink;
+    int err = stzfs_lock_file(path, NULL, true, &symlink);
+    if (err) {
+        printf("stzfs_readlink: no such file\n");
+        return err;
+    }
+
+    err = stzfs_readlink_file(&symlink, buffer, length);
+
+    stzfs_unlock_file(NULL, &symlink);
+    return err;
+}
+
+// look up the entry name of a directory, the kernel holds a reference to the inode from now on
+int stzfs_lookup_inode(int64_t parent_inodeptr, const char* name, struct stat* st) {
+    STZFS_DEBUG("parent=%lld, name=%s", parent_inodeptr, name);
+
+    // the namespace can not change until the reference was taken
+    pthread_rwlock_rdlock(&namespace_lock);
+    file parent, f;
+    int err = stzfs_read_dir(parent_inodeptr, &parent);
+    if (!err) {
+        err = stzfs_find_entry(&parent, name, &f);
+    }
+
+    if (!err && f.inodeptr == 0) {
+        err = -ENOENT;
+    } else if (!err) {
+        inode_lock_shared(f.inodeptr);
+        inode_read(f.inodeptr, &f.inode);
+        stzfs_fill_stat(&f, st);
+        inode_unlock(f.inodeptr);
+        lookup_ref(f.inodeptr);
+    }
+
+    pthread_rwlock_unlock(&namespace_lock);
+    return err;
+}
+
+// drop kernel references, an unlinked inode is freed with the last one
+void stzfs_forget_inode(int64_t inodeptr, uint64_t count) {
+    STZFS_DEBUG("inodeptr=%lld, count=%llu", inodeptr, count);
+
+    if (!lookup_forget(inodeptr, count)) {
+        return;
+    }
+
+    inode_t inode;
+    inode_lock_exclusive(inodeptr);
+    if (inode_read(inodeptr, &inode) || inode_free(inodeptr, &inode)) {
+        printf("stzfs_forget_inode: could not free unlinked inode\n");
+    }
+    inode_unlock(inodeptr);
+}
+
+// get the stats of an inode
+int stzfs_getattr_inode(int64_t inodeptr, struct stat* st, struct fuse_file_info* fi) {
+    STZFS_DEBUG("inodeptr=%lld", inodeptr);
+
+    file f;
+    int err = stzfs_lock_inode(inodeptr, fi, false, &f);
+    if (err) return err;
+
+    stzfs_fill_stat(&f, st);
+    stzfs_unlock_file(fi, &f);
+    return 0;
+}
+
+// change the attributes of an inode named by to_set (FUSE_SET_ATTR_*) and get its new stats
+int stzfs_setattr_inode(int64_t inodeptr, const struct stat* attr, int to_set, struct stat* st,
+                        struct fuse_file_info* fi) {
+    STZFS_DEBUG("inodeptr=%lld, to_set=%i", inodeptr, to_set);
+
+    file f;
+    int err = stzfs_lock_inode(inodeptr, fi, true, &f);
+    if (err) {
+        printf("stzfs_setattr: no such file\n");
+        return err;
+    }
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        stzfs_chmod_file(&f, attr->st_mode);
+    }
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        stzfs_chown_file(&f, (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1,
+                         (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1);
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        err = stzfs_truncate_file(&f, attr->st_size);
+    }
+    if (!err && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        const struct timespec tv[2] = {
+            {.tv_nsec = !(to_set & FUSE_SET_ATTR_ATIME) ? UTIME_OMIT :
+                        (to_set & FUSE_SET_ATTR_ATIME_NOW) ? UTIME_NOW : attr->st_atim.tv_nsec,
+             .tv_sec = attr->st_atim.tv_sec},
+            {.tv_nsec = !(to_set & FUSE_SET_ATTR_MTIME) ? UTIME_OMIT :
+                        (to_set & FUSE_SET_ATTR_MTIME_NOW) ? UTIME_NOW : attr->st_mtim.tv_nsec,
+             .tv_sec = attr->st_mtim.tv_sec}
+        };
+        stzfs_utimens_file(&f, tv);
+    }
+
+    if (!err) {
+        stzfs_fill_stat(&f, st);
+    }
+    stzfs_unlock_file(fi, &f);
+    return err;
+}
+
+// open an existing inode
+int stzfs_open_inode(int64_t inodeptr, struct fuse_file_info* fi) {
+    STZFS_DEBUG("inodeptr=%lld", inodeptr);
+
+    file f;
+    int err = stzfs_lock_inode(inodeptr, NULL, true, &f);
+    if (err) {
+        printf("stzfs_open: no such file\n");
+        return err;
+    }
+
+    handle_t* handle = NULL;
+    if (M_IS_DIR(f.inode.mode)) {
+        printf("stzfs_open: is a directory\n");
+        err = -EISDIR;
+    } else if ((handle = handle_open(f.inodeptr)) == NULL) {
+        printf("stzfs_open: could not open file handle\n");
+        err = -ENOMEM;
+    } else {
+        fi->fh = (uintptr_t)handle;
+
+        // update timestamps
+        touch_atime(&handle->inode);
+        handle->dirty = true;
+    }
+
+    stzfs_unlock_file(NULL, &f);
+    return err;
+}
+
+// get the stats of a new inode and hand it to the kernel, the namespace lock is held
+static void stzfs_ref_new_inode(const file* f, struct stat* st) {
+    inode_lock_shared(f->inodeptr);
+    file created = {.inodeptr = f->inodeptr};
+    inode_read(f->inodeptr, &created.inode);
+    stzfs_fill_stat(&created, st);
+    inode_unlock(f->inodeptr);
+    lookup_ref(f->inodeptr);
+}
+
+// create a new file in a directory and open it
+int stzfs_create_inode(int64_t parent_inodeptr, const char* name, mode_t mode, uid_t uid, gid_t gid,
+                       struct stat* st, struct fuse_file_info* fi) {
+    STZFS_DEBUG("parent=%lld, name=%s", parent_inodeptr, name);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    file parent, f;
+    int err = stzfs_read_dir(parent_inodeptr, &parent);
+    if (!err) err = stzfs_create_at(&parent, name, mode, uid, gid, &f);
+    if (!err) err = stzfs_open_created(&f, fi);
+    if (!err) stzfs_ref_new_inode(&f, st);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// create a new directory in a directory
+int stzfs_mkdir_inode(int64_t parent_inodeptr, const char* name, mode_t mode, uid_t uid, gid_t gid,
+                      struct stat* st) {
+    STZFS_DEBUG("parent=%lld, name=%s", parent_inodeptr, name);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    file parent, dir;
+    int err = stzfs_read_dir(parent_inodeptr, &parent);
+    if (!err) err = stzfs_mkdir_at(&parent, name, mode, uid, gid, &dir);
+    if (!err) stzfs_ref_new_inode(&dir, st);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// create a symbolic link in a directory
+int stzfs_symlink_inode(const char* target, int64_t parent_inodeptr, const char* name, uid_t uid, gid_t gid,
+                        struct stat* st) {
+    STZFS_DEBUG("target=%s, parent=%lld, name=%s", target, parent_inodeptr, name);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    file parent, symlink;
+    int err = stzfs_read_dir(parent_inodeptr, &parent);
+    if (!err) err = stzfs_symlink_at(target, &parent, name, uid, gid, &symlink);
+    if (!err) stzfs_ref_new_inode(&symlink, st);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// link an inode into a directory
+int stzfs_link_inode(int64_t inodeptr, int64_t parent_inodeptr, const char* name, struct stat* st) {
+    STZFS_DEBUG("inodeptr=%lld, parent=%lld, name=%s", inodeptr, parent_inodeptr, name);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    file parent, f = {.inodeptr = inodeptr};
+    int err = stzfs_read_dir(parent_inodeptr, &parent);
+    if (!err && !bitmap_is_inode_allocated(inodeptr)) err = -ENOENT;
+    if (!err) err = stzfs_link_at(&f, &parent, name);
+    if (!err) stzfs_ref_new_inode(&f, st);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// unlink a file or an empty directory from a directory
+int stzfs_unlink_inode(int64_t parent_inodeptr, const char* name, bool dir) {
+    STZFS_DEBUG("parent=%lld, name=%s", parent_inodeptr, name);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    file parent, f;
+    int err = stzfs_read_dir(parent_inodeptr, &parent);
+    if (!err) err = stzfs_find_entry(&parent, name, &f);
+    if (!err) err = unlink_file_or_dir_at(&parent, name, &f, dir);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// move the entry src_name of a directory to dst_name of another one
+int stzfs_rename_inode(int64_t src_parent_inodeptr, const char* src_name, int64_t dst_parent_inodeptr,
+                       const char* dst_name, unsigned int flags) {
+    STZFS_DEBUG("src_parent=%lld, src_name=%s, dst_parent=%lld, dst_name=%s", src_parent_inodeptr, src_name,
+                dst_parent_inodeptr, dst_name);
+
+    pthread_rwlock_wrlock(&namespace_lock);
+    file src_parent, src, dst_parent, dst;
+    int err = stzfs_read_dir(src_parent_inodeptr, &src_parent);
+    if (!err) err = stzfs_read_dir(dst_parent_inodeptr, &dst_parent);
+    if (!err) err = stzfs_find_entry(&src_parent, src_name, &src);
+    if (!err) err = stzfs_find_entry(&dst_parent, dst_name, &dst);
+    if (!err) err = stzfs_rename_at(&src_parent, src_name, &src, &dst_parent, dst_name, &dst, flags);
+    pthread_rwlock_unlock(&namespace_lock);
+
+    return err;
+}
+
+// read the target of a symbolic link
+int stzfs_readlink_inode(int64_t inodeptr, char* buffer, size_t length) {
+    STZFS_DEBUG("inodeptr=%lld", inodeptr);
+
+    file symlink;
+    int err = stzfs_lock_inode(inodeptr, NULL, true, &symlink);
+    if (err) return err;
+
+    err = stzfs_readlink_file(&symlink, buffer, length);
+
+    stzfs_unlock_file(NULL, &symlink);
+    return err;
+}
+
+// pass the entries of a directory from offset on to filler until it returns non zero, with plus the stats
+// of the entries are complete and filler is called under the namespace lock, so the entries stay valid
+// until it returns
+int stzfs_readdir_inode(int64_t inodeptr, off_t offset, bool plus, stzfs_filler_t filler, void* context) {
+    STZFS_DEBUG("inodeptr=%lld, offset=%lld, plus=%i", inodeptr, offset, plus);
+
+    // exclusive, concurrent readers would race on the access time
+    file dir;
+    int err = stzfs_lock_inode(inodeptr, NULL, true, &dir);
+    if (err) return err;
+
+    err = stzfs_readdir_at(&dir, offset, plus, filler, context);
+
+    pthread_rwlock_unlock(&namespace_lock);
+    return err;
+}
@@ -1,7 +1,9 @@
 #ifndef STZFS_STZFS_H
 #define STZFS_STZFS_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -10,7 +12,7 @@
 #include "fuse.h"
 #include "types.h"
 
-int64_t stzfs_makefs(int64_t inode_count);
+int64_t stzfs_makefs(int64_t inode_count, uint32_t features);
 
 void* stzfs_fuse_init(struct fuse_conn_info* conn, struct fuse_config* cfg);
 void stzfs_init(void);
@@ -18,6 +20,8 @@ void stzfs_fuse_destroy(void* private_data);
 void stzfs_destroy(void);
 
 int stzfs_open(const char* file_path, struct fuse_file_info* file_info);
+int stzfs_flush(const char* path, struct fuse_file_info* file_info);
+int stzfs_release(const char* path, struct fuse_file_info* file_info);
 
 int stzfs_read(const char* file_path, char* buffer, size_t length, off_t offset,
                struct fuse_file_info* file_info);
@@ -29,6 +33,10 @@ int stzfs_rename(const char* src, const char* dst, unsigned int flags);
 int stzfs_link(const char* src, const char* dest);
 int stzfs_unlink(const char* path);
 int stzfs_truncate(const char* path, off_t offset, struct fuse_file_info* fi);
+int stzfs_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi);
+off_t stzfs_lseek(const char* path, off_t offset, int whence, struct fuse_file_info* fi);
+int stzfs_ioctl(const char* path, unsigned int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags,
+                void* data);
 int stzfs_symlink(const char* target, const char* link_name);
 int stzfs_readlink(const char* path, char* buffer, size_t length);
 
@@ -37,6 +45,7 @@ int stzfs_rmdir(const char* path);
 int stzfs_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset,
                   struct fuse_file_info* file_info, enum fuse_readdir_flags flags);
 
+int stzfs_fsync(const char* path, int datasync, struct fuse_file_info* fi);
 int stzfs_statfs(const char* path, struct statvfs* stat);
 
 int stzfs_getattr(const char* path, struct stat* st, struct fuse_file_info* file_info);
@@ -46,4 +55,33 @@ int stzfs_utimens(const char* path, const struct timespec tv[2], struct fuse_fil
 
 extern struct fuse_operations stzfs_ops;
 
+// receives a directory entry, its stats and the offset to continue after it, non zero stops the listing,
+// without plus the stats hold st_ino and the file type (S_IFMT bits, 0 if unknown) only
+typedef int (*stzfs_filler_t)(void* context, const char* name, const struct stat* st, off_t next);
+
+// operations on inodes named by their inodeptr, used by the low level frontend without any path walks,
+// operations returning the stats of an entry hand a reference to the kernel that stzfs_forget_inode drops
+int stzfs_lookup_inode(int64_t parent_inodeptr, const char* name, struct stat* st);
+void stzfs_forget_inode(int64_t inodeptr, uint64_t count);
+int stzfs_getattr_inode(int64_t inodeptr, struct stat* st, struct fuse_file_info* fi);
+int stzfs_setattr_inode(int64_t inodeptr, const struct stat* attr, int to_set, struct stat* st,
+                        struct fuse_file_info* fi);
+int stzfs_open_inode(int64_t inodeptr, struct fuse_file_info* fi);
+
+int stzfs_create_inode(int64_t parent_inodeptr, const char* name, mode_t mode, uid_t uid, gid_t gid,
+                       struct stat* st, struct fuse_file_info* fi);
+int stzfs_mkdir_inode(int64_t parent_inodeptr, const char* name, mode_t mode, uid_t uid, gid_t gid,
+                      struct stat* st);
+int stzfs_symlink_inode(const char* target, int64_t parent_inodeptr, const char* name, uid_t uid, gid_t gid,
+                        struct stat* st);
+int stzfs_link_inode(int64_t inodeptr, int64_t parent_inodeptr, const char* name, struct stat* st);
+int stzfs_unlink_inode(int64_t parent_inodeptr, const char* name, bool dir);
+int stzfs_rename_inode(int64_t src_parent_inodeptr, const char* src_name, int64_t dst_parent_inodeptr,
+                       const char* dst_name, unsigned int flags);
+int stzfs_readlink_inode(int64_t inodeptr, char* buffer, size_t length);
+int stzfs_readdir_inode(int64_t inodeptr, off_t offset, bool plus, stzfs_filler_t filler, void* context);
+
+// low level fuse operations (see stzfs_ll.c)
+extern struct fuse_lowlevel_ops stzfs_ll_ops;
+
 #endif // STZFS_STZFS_H
@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fuse.h"
+#include "inode_cache.h"
+#include "ioctl.h"
+#include "lookup.h"
+#include "orphan.h"
+#include "stzfs.h"
+#include "types.h"
+
+// seconds the kernel may cache attributes and entries, like the defaults of the path frontend
+#define STZFS_LL_TIMEOUT 1.0
+
+// the fuse ino of a file is its inodeptr, the root ids of both are 1
+_Static_assert(FUSE_ROOT_ID == ROOT_INODEPTR, "fuse root id has to be the root inodeptr");
+
+// reply buffer of a directory listing
+typedef struct stzfs_ll_dir_buffer {
+    fuse_req_t req;
+    char* data;
+    size_t size;
+    size_t used;
+    int64_t* refs; // entries of a readdirplus reply the kernel holds references to
+    size_t ref_count;
+    size_t ref_capacity;
+} stzfs_ll_dir_buffer;
+
+// answer a request for an entry, the reference is dropped again if the kernel did not take it
+static void stzfs_ll_reply_entry(fuse_req_t req, int err, const struct stat* st) {
+    if (err) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+
+    const struct fuse_entry_param entry = {.ino = st->st_ino, .attr = *st, .attr_timeout = STZFS_LL_TIMEOUT,
+                                           .entry_timeout = STZFS_LL_TIMEOUT};
+    if (fuse_reply_entry(req, &entry) != 0) {
+        stzfs_forget_inode(st->st_ino, 1);
+    }
+}
+
+static void stzfs_ll_init(void* userdata, struct fuse_conn_info* conn) {
+    stzfs_init();
+
+    // unlinked large files are freed and dirty inodes written back in the background from now on
+    orphan_start_reclaimer();
+    inode_cache_start_writeback();
+}
+
+static void stzfs_ll_destroy(void* userdata) {
+    stzfs_destroy();
+}
+
+static void stzfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    struct stat st;
+    const int err = stzfs_lookup_inode(parent, name, &st);
+
+    // missing names are cached by the kernel as well
+    if (err == -ENOENT) {
+        const struct fuse_entry_param negative = {.ino = 0, .entry_timeout = STZFS_LL_TIMEOUT};
+        fuse_reply_entry(req, &negative);
+        return;
+    }
+
+    stzfs_ll_reply_entry(req, err, &st);
+}
+
+static void stzfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    stzfs_forget_inode(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void stzfs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+    for (size_t i = 0; i < count; i++) {
+        stzfs_forget_inode(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void stzfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    struct stat st;
+    const int err = stzfs_getattr_inode(ino, &st, fi);
+    if (err) {
+        fuse_reply_err(req, -err);
+    } else {
+        fuse_reply_attr(req, &st, STZFS_LL_TIMEOUT);
+    }
+}
+
+static void stzfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+                             struct fuse_file_info* fi) {
+    struct stat st;
+    const int err = stzfs_setattr_inode(ino, attr, to_set, &st, fi);
+    if (err) {
+        fuse_reply_err(req, -err);
+    } else {
+        fuse_reply_attr(req, &st, STZFS_LL_TIMEOUT);
+    }
+}
+
+static void stzfs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    char target[PATH_MAX];
+    const int err = stzfs_readlink_inode(ino, target, sizeof(target));
+    if (err) {
+        fuse_reply_err(req, -err);
+    } else {
+        fuse_reply_readlink(req, target);
+    }
+}
+
+static void stzfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+    const struct fuse_ctx* ctx = fuse_req_ctx(req);
+    struct stat st;
+    const int err = stzfs_mkdir_inode(parent, name, mode, ctx->uid, ctx->gid, &st);
+    stzfs_ll_reply_entry(req, err, &st);
+}
+
+static void stzfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    fuse_reply_err(req, -stzfs_unlink_inode(parent, name, false));
+}
+
+static void stzfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    fuse_reply_err(req, -stzfs_unlink_inode(parent, name, true));
+}
+
+static void stzfs_ll_symlink(fuse_req_t req, const char* target, fuse_ino_t parent, const char* name) {
+    const struct fuse_ctx* ctx = fuse_req_ctx(req);
+    struct stat st;
+    const int err = stzfs_symlink_inode(target, parent, name, ctx->uid, ctx->gid, &st);
+    stzfs_ll_reply_entry(req, err, &st);
+}
+
+static void stzfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t new_parent,
+                            const char* new_name, unsigned int flags) {
+    fuse_reply_err(req, -stzfs_rename_inode(parent, name, new_parent, new_name, flags));
+}
+
+static void stzfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t new_parent, const char* new_name) {
+    struct stat st;
+    const int err = stzfs_link_inode(ino, new_parent, new_name, &st);
+    stzfs_ll_reply_entry(req, err, &st);
+}
+
+static void stzfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    const int err = stzfs_open_inode(ino, fi);
+    if (err) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+
+    fi->keep_cache = 1;
+    if (fuse_reply_open(req, fi) != 0) {
+        stzfs_release(NULL, fi);
+    }
+}
+
+static void stzfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+                            struct fuse_file_info* fi) {
+    const struct fuse_ctx* ctx = fuse_req_ctx(req);
+    struct stat st;
+    const int err = stzfs_create_inode(parent, name, mode, ctx->uid, ctx->gid, &st, fi);
+    if (err) {
+        fuse_reply_err(req, -err);
+        return;
+    }
+
+    fi->keep_cache = 1;
+    const struct fuse_entry_param entry = {.ino = st.st_ino, .attr = st, .attr_timeout = STZFS_LL_TIMEOUT,
+                                           .entry_timeout = STZFS_LL_TIMEOUT};
+    if (fuse_reply_create(req, &entry, fi) != 0) {
+        stzfs_release(NULL, fi);
+        stzfs_forget_inode(st.st_ino, 1);
+    }
+}
+
+static void stzfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+    char* buffer = malloc(size);
+    if (buffer == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    const int result = stzfs_read(NULL, buffer, size, offset, fi);
+    if (result < 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_buf(req, buffer, result);
+    }
+    free(buffer);
+}
+
+static void stzfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char* buffer, size_t size, off_t offset,
+                           struct fuse_file_info* fi) {
+    const int result = stzfs_write(NULL, buffer, size, offset, fi);
+    if (result < 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_write(req, result);
+    }
+}
+
+static void stzfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    fuse_reply_err(req, -stzfs_flush(NULL, fi));
+}
+
+static void stzfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    fuse_reply_err(req, -stzfs_release(NULL, fi));
+}
+
+static void stzfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+    fuse_reply_err(req, -stzfs_fsync(NULL, datasync, fi));
+}
+
+// add an entry to the reply buffer, non zero once it is full
+static int stzfs_ll_fill_dir(void* context, const char* name, const struct stat* st, off_t next) {
+    stzfs_ll_dir_buffer* dir = context;
+
+    // the entry carries the file type, the inode is not read
+    const size_t length = fuse_add_direntry(dir->req, &dir->data[dir->used], dir->size - dir->used, name, st,
+                                            next);
+    if (length > dir->size - dir->used) {
+        return 1;
+    }
+
+    dir->used += length;
+    return 0;
+}
+
+// add an entry with its attributes to the reply buffer, the kernel holds a reference to every entry but
+// . and .. from now on
+static int stzfs_ll_fill_dir_plus(void* context, const char* name, const struct stat* st, off_t next) {
+    stzfs_ll_dir_buffer* dir = context;
+
+    const bool dots = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+    if (!dots && dir->ref_count == dir->ref_capacity) {
+        const size_t capacity = dir->ref_capacity == 0 ? 64 : 2 * dir->ref_capacity;
+        int64_t* refs = realloc(dir->refs, capacity * sizeof(int64_t));
+        if (refs == NULL) {
+            return 1;
+        }
+        dir->refs = refs;
+        dir->ref_capacity = capacity;
+    }
+
+    const struct fuse_entry_param entry = {.ino = st->st_ino, .attr = *st, .attr_timeout = STZFS_LL_TIMEOUT,
+                                           .entry_timeout = STZFS_LL_TIMEOUT};
+    const size_t length = fuse_add_direntry_plus(dir->req, &dir->data[dir->used], dir->size - dir->used, name,
+                                                 &entry, next);
+    if (length > dir->size - dir->used) {
+        return 1;
+    }
+
+    // the entry can not be unlinked before the reference is taken, fillers run under the namespace lock
+    dir->used += length;
+    if (!dots) {
+        lookup_ref(st->st_ino);
+        dir->refs[dir->ref_count++] = st->st_ino;
+    }
+    return 0;
+}
+
+static void stzfs_ll_list(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, bool plus) {
+    stzfs_ll_dir_buffer dir = {.req = req, .data = malloc(size), .size = size, .used = 0};
+    if (dir.data == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    const int err = stzfs_readdir_inode(ino, offset, plus, plus ? stzfs_ll_fill_dir_plus : stzfs_ll_fill_dir,
+                                        &dir);
+    if (err) {
+        fuse_reply_err(req, -err);
+    } else if (fuse_reply_buf(req, dir.data, dir.used) != 0) {
+        // entries the kernel never saw
+        for (size_t i = 0; i < dir.ref_count; i++) {
+            stzfs_forget_inode(dir.refs[i], 1);
+        }
+    }
+    free(dir.refs);
+    free(dir.data);
+}
+
+static void stzfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                             struct fuse_file_info* fi) {
+    stzfs_ll_list(req, ino, size, offset, false);
+}
+
+static void stzfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                 struct fuse_file_info* fi) {
+    stzfs_ll_list(req, ino, size, offset, true);
+}
+
+static void stzfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs st;
+    memset(&st, 0, sizeof(st));
+    stzfs_statfs(NULL, &st);
+    fuse_reply_statfs(req, &st);
+}
+
+static void stzfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd, void* arg, struct fuse_file_info* fi,
+                           unsigned flags, const void* in_buf, size_t in_bufsz, size_t out_bufsz) {
+    if (cmd != STZFS_IOC_REPORT_EXTENTS) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    } else if ((flags & FUSE_IOCTL_DIR) || fi == NULL || fi->fh == 0) {
+        // directories are not opened by this frontend, there is no path to fall back to either
+        fuse_reply_err(req, EISDIR);
+        return;
+    } else if (in_bufsz < sizeof(stzfs_extent_report_t) || out_bufsz < sizeof(stzfs_extent_report_t)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    // the kernel copied the argument in and copies the reply back out
+    stzfs_extent_report_t report;
+    memcpy(&report, in_buf, sizeof(report));
+    const int err = stzfs_ioctl(NULL, cmd, arg, fi, flags, &report);
+    if (err) {
+        fuse_reply_err(req, -err);
+    } else {
+        fuse_reply_ioctl(req, 0, &report, sizeof(report));
+    }
+}
+
+static void stzfs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                               struct fuse_file_info* fi) {
+    fuse_reply_err(req, -stzfs_fallocate(NULL, mode, offset, length, fi));
+}
+
+static void stzfs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t offset, int whence, struct fuse_file_info* fi) {
+    const off_t result = stzfs_lseek(NULL, offset, whence, fi);
+    if (result < 0) {
+        fuse_reply_err(req, -result);
+    } else {
+        fuse_reply_lseek(req, result);
+    }
+}
+
+// low level fuse operations
+struct fuse_lowlevel_ops stzfs_ll_ops = {
+    .init = stzfs_ll_init,
+    .destroy = stzfs_ll_destroy,
+    .lookup = stzfs_ll_lookup,
+    .forget = stzfs_ll_forget,
+    .forget_multi = stzfs_ll_forget_multi,
+    .getattr = stzfs_ll_getattr,
+    .setattr = stzfs_ll_setattr,
+    .readlink = stzfs_ll_readlink,
+    .mkdir = stzfs_ll_mkdir,
+    .unlink = stzfs_ll_unlink,
+    .rmdir = stzfs_ll_rmdir,
+    .symlink = stzfs_ll_symlink,
+    .rename = stzfs_ll_rename,
+    .link = stzfs_ll_link,
+    .open = stzfs_ll_open,
+    .create = stzfs_ll_create,
+    .read = stzfs_ll_read,
+    .write = stzfs_ll_write,
+    .flush = stzfs_ll_flush,
+    .release = stzfs_ll_release,
+    .fsync = stzfs_ll_fsync,
+    .readdir = stzfs_ll_readdir,
+    .readdirplus = stzfs_ll_readdirplus,
+    .statfs = stzfs_ll_statfs,
+    .ioctl = stzfs_ll_ioctl,
+    .fallocate = stzfs_ll_fallocate,
+    .lseek = stzfs_ll_lseek
+};
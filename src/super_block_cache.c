@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/mman.h>
 
@@ -8,6 +9,9 @@
 
 super_block* super_block_cache = NULL;
 
+// serializes changes of super block fields made by different modules while mounted
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
 int super_block_cache_init(void) {
     super_block_cache = mmap(NULL, STZFS_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
                              disk_get_fd(), SUPER_BLOCKPTR * STZFS_BLOCK_SIZE);
@@ -36,3 +40,11 @@ int super_block_cache_sync(void) {
 
     return 0;
 }
+
+void super_block_cache_lock(void) {
+    pthread_mutex_lock(&lock);
+}
+
+void super_block_cache_unlock(void) {
+    pthread_mutex_unlock(&lock);
+}
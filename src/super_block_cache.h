@@ -8,5 +8,7 @@ extern super_block* super_block_cache;
 int super_block_cache_init(void);
 int super_block_cache_dispose(void);
 int super_block_cache_sync(void);
+void super_block_cache_lock(void);
+void super_block_cache_unlock(void);
 
 #endif // STZFS_SUPER_BLOCK_CACHE_H
@@ -7,6 +7,7 @@
 #define EOF (-1)
 #define STZFS_BLOCK_SIZE_BITS (12) // 4 KiB
 #define STZFS_BLOCK_SIZE (1 << STZFS_BLOCK_SIZE_BITS)
+#define STZFS_BLOCK_ALIGNED __attribute__((aligned(STZFS_BLOCK_SIZE))) // direct io capable
 #define MAX_FILENAME_LENGTH (256 - sizeof(inodeptr_t)) // 251 characters
 
 // file modes
@@ -23,6 +24,11 @@
 #define M_SETGID (0b0000000000100000) // set gid
 #define M_STICKY (0b0000000000010000) // sticky
 
+// bits between permissions and file type hold per inode format flags
+#define M_FLAGS_MASK           (0b1100)
+#define M_EXTENTS (0b0000000000000100) // data is mapped by an extent tree
+#define M_INDEXED (0b0000000000001000) // directory names are found through a hash index
+
 // last 2 bits decide over file type
 #define M_TYPE_MASK            (0b11)
 #define M_REG    (0b0000000000000000) // regular file
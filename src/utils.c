@@ -82,6 +82,16 @@ void utils_print_superblock(const char* arg) {
     printf("\tinode_table = %i\n", sb->inode_table);
     printf("\tinode_table_length = %i\n", sb->inode_table_length);
     printf("\tinode_count = %i\n", sb->inode_count);
+    printf("\tgroup_table = %i\n", sb->group_table);
+    printf("\tgroup_table_length = %i\n", sb->group_table_length);
+    printf("\tblocks_per_group = %i\n", sb->blocks_per_group);
+    printf("\tinodes_per_group = %i\n", sb->inodes_per_group);
+    printf("\tgroup_count = %i\n", sb->group_count);
+    printf("\tstate = %s\n", sb->state & SUPER_BLOCK_STATE_CLEAN ? "clean" : "not clean");
+    printf("\torphan_head = %i\n", sb->orphan_head);
+    for (size_t slot = 0; slot < SUPER_BLOCK_HELD_ORPHANS; slot++) {
+        if (sb->held_orphans[slot] != 0) printf("\theld_orphans[%zu] = %i\n", slot, sb->held_orphans[slot]);
+    }
     printf("}\n");
 }
 
@@ -160,23 +170,36 @@ void utils_print_inode(const char* arg) {
     printf("\tatom_count = %lu\n", inode_data->atom_count);
     printf("\tblock_count = %i\n", inode_data->block_count);
 
-    printf("\tdata_direct = [");
-    for (int i = 0; i < INODE_DIRECT_BLOCKS; i++) {
-        const int64_t blockptr = inode_data->data_direct[i];
-        if (blockptr == NULL_BLOCKPTR) {
-            printf("NULL");
-        } else {
-            printf("%u", blockptr);
+    if (inode_data->mode & M_EXTENTS) {
+        const extent_root_t* root = &inode_data->extents;
+        printf("\textents (depth %u) = [", root->header.depth);
+        for (int i = 0; i < root->header.entries; i++) {
+            const extent_t* extent = &root->entries[i];
+            printf("%u+%u -> %u", extent->logical, extent->length, extent->physical);
+            if (i < root->header.entries - 1) {
+                printf(", ");
+            }
         }
-        if (i < INODE_DIRECT_BLOCKS - 1) {
-            printf(", ");
+        printf("]\n");
+    } else {
+        printf("\tdata_direct = [");
+        for (int i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+            const int64_t blockptr = inode_data->data_direct[i];
+            if (blockptr == NULL_BLOCKPTR) {
+                printf("NULL");
+            } else {
+                printf("%u", blockptr);
+            }
+            if (i < INODE_DIRECT_BLOCKS - 1) {
+                printf(", ");
+            }
         }
-    }
-    printf("]\n");
+        printf("]\n");
 
-    printf("\tdata_single_indirect = %i\n", inode_data->data_single_indirect);
-    printf("\tdata_double_indirect = %i\n", inode_data->data_double_indirect);
-    printf("\tdata_triple_indirect = %i\n", inode_data->data_triple_indirect);
+        printf("\tdata_single_indirect = %i\n", inode_data->data_single_indirect);
+        printf("\tdata_double_indirect = %i\n", inode_data->data_double_indirect);
+        printf("\tdata_triple_indirect = %i\n", inode_data->data_triple_indirect);
+    }
     printf("}\n");
 }
 
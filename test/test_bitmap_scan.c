@@ -0,0 +1,79 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../src/bitmap_scan.h"
+
+#define TEST_ENTRIES (256)
+#define TEST_ROUNDS (20000)
+
+void test_scalar_scan(void** state);
+void test_sse2_scan(void** state);
+void test_avx2_scan(void** state);
+
+static void assert_scan_agrees(const char* impl);
+static size_t reference_scan(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip);
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_scalar_scan),
+        cmocka_unit_test(test_sse2_scan),
+        cmocka_unit_test(test_avx2_scan),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+void test_scalar_scan(void** state) {
+    assert_scan_agrees("scalar");
+}
+
+void test_sse2_scan(void** state) {
+    assert_scan_agrees("sse2");
+}
+
+void test_avx2_scan(void** state) {
+    assert_scan_agrees("avx2");
+}
+
+// scan random ranges of random bitmaps that mostly consist of the skipped entry
+static void assert_scan_agrees(const char* impl) {
+    if (!bitmap_scan_set_impl(impl)) {
+        skip();
+    }
+    assert_string_equal(bitmap_scan_get_impl(), impl);
+
+    srand(1);
+    bitmap_entry_t bitmap[TEST_ENTRIES];
+    for (int round = 0; round < TEST_ROUNDS; round++) {
+        const bitmap_entry_t skip_entry = (round % 2) ? UINT64_MAX : 0;
+        for (size_t i = 0; i < TEST_ENTRIES; i++) {
+            bitmap[i] = skip_entry;
+        }
+
+        // a few differing entries, some of them only in the upper or the lower 32 bits
+        const int differing = rand() % 4;
+        for (int i = 0; i < differing; i++) {
+            const size_t index = (size_t)rand() % TEST_ENTRIES;
+            const int bit = (i == 0) ? 32 + rand() % 32 : rand() % 64;
+            bitmap[index] = skip_entry ^ ((bitmap_entry_t)1 << bit);
+        }
+
+        const size_t from = (size_t)rand() % TEST_ENTRIES;
+        const size_t to = from + (size_t)rand() % (TEST_ENTRIES - from + 1);
+        assert_int_equal(bitmap_scan_entry(bitmap, from, to, skip_entry),
+                         reference_scan(bitmap, from, to, skip_entry));
+    }
+}
+
+static size_t reference_scan(const bitmap_entry_t* bitmap, size_t from, size_t to, bitmap_entry_t skip) {
+    for (size_t i = from; i < to; i++) {
+        if (bitmap[i] != skip) return i;
+    }
+
+    return to;
+}
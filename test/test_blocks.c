@@ -8,11 +8,13 @@
 
 void test_STZFS_BLOCK_SIZEs(void** state);
 void test_block_entry_sizes(void** state);
+void test_block_alignment(void** state);
 
 int main() {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_STZFS_BLOCK_SIZEs),
-        cmocka_unit_test(test_block_entry_sizes)
+        cmocka_unit_test(test_block_entry_sizes),
+        cmocka_unit_test(test_block_alignment)
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -22,12 +24,32 @@ void test_STZFS_BLOCK_SIZEs(void** state) {
    assert_int_equal(sizeof(super_block), STZFS_BLOCK_SIZE);
    assert_int_equal(sizeof(inode_block), STZFS_BLOCK_SIZE);
    assert_int_equal(sizeof(dir_block), STZFS_BLOCK_SIZE);
+   assert_int_equal(sizeof(dir_index_block), STZFS_BLOCK_SIZE);
    assert_int_equal(sizeof(indirect_block), STZFS_BLOCK_SIZE);
+   assert_int_equal(sizeof(extent_block), STZFS_BLOCK_SIZE);
    assert_int_equal(sizeof(bitmap_block), STZFS_BLOCK_SIZE);
+   assert_int_equal(sizeof(group_block), STZFS_BLOCK_SIZE);
    assert_int_equal(sizeof(data_block), STZFS_BLOCK_SIZE);
 }
 
 void test_block_entry_sizes(void** state) {
     assert_int_equal(sizeof(inode_t), 128);
     assert_int_equal(sizeof(dir_block_entry), 256);
+    assert_int_equal(sizeof(dir_record), 8);
+    assert_int_equal(sizeof(dir_index_entry), 8);
+    assert_int_equal(sizeof(extent_t), 12);
+    assert_int_equal(sizeof(group_descriptor), 16);
+    assert_true(sizeof(extent_root_t) <= sizeof(blockptr_t) * (INODE_DIRECT_BLOCKS + 3));
+}
+
+void test_block_alignment(void** state) {
+    assert_int_equal(__alignof__(super_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(inode_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(dir_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(dir_index_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(indirect_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(extent_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(bitmap_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(group_block), STZFS_BLOCK_SIZE);
+    assert_int_equal(__alignof__(data_block), STZFS_BLOCK_SIZE);
 }
@@ -0,0 +1,259 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/block.h"
+#include "../src/block_cache.h"
+#include "../src/blocks.h"
+#include "../src/dentry_cache.h"
+#include "../src/disk.h"
+#include "../src/inode.h"
+#include "../src/inode_cache.h"
+#include "../src/stzfs.h"
+#include "../src/super_block_cache.h"
+#include "test_fs.h"
+
+// small caches, the tests use more entries than they hold
+#define TEST_CACHE_BLOCKS (16)
+#define TEST_CACHE_ENTRIES (16)
+#define TEST_BLOCKS (64)
+
+int setup(void** state);
+int teardown(void** state);
+void test_block_cache_writes_back(void** state);
+void test_block_cache_evicts_dirty_blocks(void** state);
+void test_dentry_cache_follows_changes(void** state);
+void test_dentry_cache_evicts_names(void** state);
+void test_inode_cache_writes_back_on_sync(void** state);
+void test_inode_cache_writes_through_when_full(void** state);
+
+static void read_table_inode(int64_t inodeptr, inode_t* inode);
+static void set_permissions(int64_t inodeptr, mode_t permissions);
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_block_cache_writes_back, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_block_cache_evicts_dirty_blocks, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_dentry_cache_follows_changes, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_dentry_cache_evicts_names, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_inode_cache_writes_back_on_sync, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_inode_cache_writes_through_when_full, setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+int setup(void** state) {
+    block_cache_set_size(TEST_CACHE_BLOCKS * STZFS_BLOCK_SIZE);
+    dentry_cache_set_size(TEST_CACHE_ENTRIES);
+    inode_cache_set_size(TEST_CACHE_ENTRIES);
+    return test_fs_create(64 * 1024 * 1024, 1024, SUPER_BLOCK_FEATURE_COMPACT_DIRS);
+}
+
+int teardown(void** state) {
+    test_fs_dispose();
+    return 0;
+}
+
+void test_block_cache_writes_back(void** state) {
+    int64_t blockptr;
+    assert_int_equal(block_allocptr(&blockptr), SUCCESS);
+
+    data_block written;
+    data_block read;
+    memset(&written, 'a', STZFS_BLOCK_SIZE);
+    assert_int_equal(block_write(blockptr, &written), SUCCESS);
+
+    // the block only reaches the disk once it is flushed
+    assert_int_equal(disk_read((off_t)blockptr * STZFS_BLOCK_SIZE, &read, STZFS_BLOCK_SIZE), SUCCESS);
+    assert_int_not_equal(memcmp(&read, &written, STZFS_BLOCK_SIZE), 0);
+    assert_int_equal(block_read(blockptr, &read), SUCCESS);
+    assert_memory_equal(&read, &written, STZFS_BLOCK_SIZE);
+
+    block_cache_stats_t stats;
+    block_cache_get_stats(&stats);
+    assert_true(stats.dirty > 0);
+
+    assert_int_equal(block_cache_flush(), 0);
+    block_cache_get_stats(&stats);
+    assert_int_equal(stats.dirty, 0);
+    assert_int_equal(disk_read((off_t)blockptr * STZFS_BLOCK_SIZE, &read, STZFS_BLOCK_SIZE), SUCCESS);
+    assert_memory_equal(&read, &written, STZFS_BLOCK_SIZE);
+
+    assert_int_equal(block_free(&blockptr, 1), SUCCESS);
+}
+
+void test_block_cache_evicts_dirty_blocks(void** state) {
+    int64_t blockptrs[TEST_BLOCKS];
+    for (int i = 0; i < TEST_BLOCKS; i++) {
+        data_block block;
+        memset(&block, 'a' + i % 26, STZFS_BLOCK_SIZE);
+        assert_int_equal(block_alloc(&blockptrs[i], &block), SUCCESS);
+    }
+
+    // evicted blocks were written back before, the others come from the cache
+    block_cache_stats_t stats;
+    block_cache_get_stats(&stats);
+    assert_int_equal(stats.capacity, TEST_CACHE_BLOCKS);
+    assert_true(stats.used <= TEST_CACHE_BLOCKS);
+    assert_true(stats.evictions >= TEST_BLOCKS - TEST_CACHE_BLOCKS);
+    assert_true(stats.writebacks >= TEST_BLOCKS - TEST_CACHE_BLOCKS);
+
+    for (int i = 0; i < TEST_BLOCKS; i++) {
+        data_block expected;
+        data_block read;
+        memset(&expected, 'a' + i % 26, STZFS_BLOCK_SIZE);
+        assert_int_equal(block_read(blockptrs[i], &read), SUCCESS);
+        assert_memory_equal(&read, &expected, STZFS_BLOCK_SIZE);
+    }
+
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    for (int i = 0; i < TEST_BLOCKS; i++) {
+        data_block expected;
+        data_block read;
+        memset(&expected, 'a' + i % 26, STZFS_BLOCK_SIZE);
+        assert_int_equal(disk_read((off_t)blockptrs[i] * STZFS_BLOCK_SIZE, &read, STZFS_BLOCK_SIZE), SUCCESS);
+        assert_memory_equal(&read, &expected, STZFS_BLOCK_SIZE);
+    }
+
+    assert_int_equal(block_free(blockptrs, TEST_BLOCKS), SUCCESS);
+}
+
+void test_dentry_cache_follows_changes(void** state) {
+    // a missing name is cached as well
+    dentry_cache_stats_t stats;
+    dentry_cache_get_stats(&stats);
+    const uint64_t hits = stats.hits;
+    assert_int_equal(test_fs_lookup(ROOT_INODEPTR, "name"), 0);
+    assert_int_equal(test_fs_lookup(ROOT_INODEPTR, "name"), 0);
+    dentry_cache_get_stats(&stats);
+    assert_true(stats.hits > hits);
+
+    // creating, renaming and unlinking replace cached names
+    const int64_t inodeptr = test_fs_create_file(ROOT_INODEPTR, "name", 0);
+    assert_int_not_equal(inodeptr, 0);
+    assert_int_equal(test_fs_lookup(ROOT_INODEPTR, "name"), inodeptr);
+    assert_int_equal(test_fs_lookup(ROOT_INODEPTR, "other"), 0);
+
+    assert_int_equal(stzfs_rename_inode(ROOT_INODEPTR, "name", ROOT_INODEPTR, "other", 0), 0);
+    assert_int_equal(test_fs_lookup(ROOT_INODEPTR, "name"), 0);
+    assert_int_equal(test_fs_lookup(ROOT_INODEPTR, "other"), inodeptr);
+
+    assert_int_equal(stzfs_unlink_inode(ROOT_INODEPTR, "other", false), 0);
+    assert_int_equal(test_fs_lookup(ROOT_INODEPTR, "other"), 0);
+    stzfs_forget_inode(inodeptr, 1);
+}
+
+void test_dentry_cache_evicts_names(void** state) {
+    int64_t inodeptrs[4 * TEST_CACHE_ENTRIES];
+    for (int i = 0; i < 4 * TEST_CACHE_ENTRIES; i++) {
+        char name[16];
+        sprintf(name, "file%i", i);
+        inodeptrs[i] = test_fs_create_file(ROOT_INODEPTR, name, 0);
+        assert_int_not_equal(inodeptrs[i], 0);
+    }
+
+    for (int i = 0; i < 4 * TEST_CACHE_ENTRIES; i++) {
+        char name[16];
+        sprintf(name, "file%i", i);
+        assert_int_equal(test_fs_lookup(ROOT_INODEPTR, name), inodeptrs[i]);
+    }
+
+    dentry_cache_stats_t stats;
+    dentry_cache_get_stats(&stats);
+    assert_int_equal(stats.capacity, TEST_CACHE_ENTRIES);
+    assert_true(stats.used <= TEST_CACHE_ENTRIES);
+    assert_true(stats.evictions > 0);
+}
+
+void test_inode_cache_writes_back_on_sync(void** state) {
+    const int64_t inodeptr = test_fs_create_file(ROOT_INODEPTR, "file", 0);
+    assert_int_not_equal(inodeptr, 0);
+    stzfs_forget_inode(inodeptr, 1);
+    assert_int_equal(stzfs_fsync(NULL, 0, NULL), 0);
+
+    inode_t cached;
+    inode_t table;
+    assert_int_equal(inode_read(inodeptr, &cached), SUCCESS);
+    read_table_inode(inodeptr, &table);
+    assert_int_equal(table.mode, cached.mode);
+
+    // a changed inode stays in the cache until the table is synced
+    set_permissions(inodeptr, 0600);
+    inode_cache_stats_t stats;
+    inode_cache_get_stats(&stats);
+    assert_true(stats.dirty > 0);
+    assert_int_equal(inode_read(inodeptr, &cached), SUCCESS);
+    read_table_inode(inodeptr, &table);
+    assert_int_not_equal(table.mode, cached.mode);
+
+    assert_int_equal(stzfs_fsync(NULL, 0, NULL), 0);
+    inode_cache_get_stats(&stats);
+    assert_int_equal(stats.dirty, 0);
+    read_table_inode(inodeptr, &table);
+    assert_int_equal(table.mode, cached.mode);
+}
+
+void test_inode_cache_writes_through_when_full(void** state) {
+    int64_t inodeptrs[4 * TEST_CACHE_ENTRIES];
+    for (int i = 0; i < 4 * TEST_CACHE_ENTRIES; i++) {
+        char name[16];
+        sprintf(name, "file%i", i);
+        inodeptrs[i] = test_fs_create_file(ROOT_INODEPTR, name, 0);
+        assert_int_not_equal(inodeptrs[i], 0);
+        stzfs_forget_inode(inodeptrs[i], 1);
+        set_permissions(inodeptrs[i], 0600);
+    }
+
+    // dirty inodes are never evicted, changes beyond the capacity went to the table directly
+    inode_cache_stats_t stats;
+    inode_cache_get_stats(&stats);
+    assert_int_equal(stats.capacity, TEST_CACHE_ENTRIES);
+    assert_true(stats.used <= TEST_CACHE_ENTRIES);
+    assert_true(stats.dirty <= TEST_CACHE_ENTRIES);
+    int written_through = 0;
+    for (int i = 0; i < 4 * TEST_CACHE_ENTRIES; i++) {
+        inode_t cached;
+        inode_t table;
+        assert_int_equal(inode_read(inodeptrs[i], &cached), SUCCESS);
+        read_table_inode(inodeptrs[i], &table);
+        if (table.mode == cached.mode) written_through++;
+    }
+    assert_true(written_through >= 3 * TEST_CACHE_ENTRIES);
+
+    // clean inodes make room for the ones read next
+    assert_int_equal(stzfs_fsync(NULL, 0, NULL), 0);
+    const uint64_t evictions = stats.evictions;
+    for (int i = 0; i < 4 * TEST_CACHE_ENTRIES; i++) {
+        struct stat st;
+        assert_int_equal(stzfs_getattr_inode(inodeptrs[i], &st, NULL), 0);
+        assert_int_equal(st.st_mode & 0777, 0600);
+    }
+    inode_cache_get_stats(&stats);
+    assert_true(stats.evictions > evictions);
+
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    for (int i = 0; i < 4 * TEST_CACHE_ENTRIES; i++) {
+        struct stat st;
+        assert_int_equal(stzfs_getattr_inode(inodeptrs[i], &st, NULL), 0);
+        assert_int_equal(st.st_mode & 0777, 0600);
+    }
+}
+
+// read an inode from its inode table block, past the inode cache
+static void read_table_inode(int64_t inodeptr, inode_t* inode) {
+    inode_block block;
+    block_read(super_block_cache->inode_table + inodeptr / INODE_BLOCK_ENTRIES, &block);
+    *inode = block.inodes[inodeptr % INODE_BLOCK_ENTRIES];
+}
+
+static void set_permissions(int64_t inodeptr, mode_t permissions) {
+    struct stat attr = {.st_mode = S_IFREG | permissions};
+    struct stat st;
+    assert_int_equal(stzfs_setattr_inode(inodeptr, &attr, FUSE_SET_ATTR_MODE, &st, NULL), 0);
+    assert_int_equal(st.st_mode & 0777, permissions);
+}
@@ -0,0 +1,471 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/blocks.h"
+#include "../src/inode.h"
+#include "../src/super_block_cache.h"
+#include "../src/stzfs.h"
+#include "test_fs.h"
+
+// enough names for a hash index with a few dozen leaves in either format
+#define TEST_INDEXED_NAMES (3000)
+
+// longest name, fixed size entries keep the terminating null
+#define TEST_MAX_NAME_LENGTH (MAX_FILENAME_LENGTH - 1)
+
+// names of a directory listing, it stops after limit names if that is not 0
+typedef struct listing_t {
+    char (*names)[MAX_FILENAME_LENGTH + 1];
+    size_t count;
+    size_t capacity;
+    size_t limit;
+    off_t next; // position to continue behind the last name
+} listing_t;
+
+int setup_compact(void** state);
+int setup_fixed(void** state);
+int teardown(void** state);
+void test_index_created_when_directory_grows(void** state);
+void test_index_survives_remount(void** state);
+void test_index_after_unlink(void** state);
+void test_records_layout(void** state);
+void test_records_name_lengths(void** state);
+void test_records_space_reused(void** state);
+void test_cookie_resume_linear(void** state);
+void test_cookie_resume_indexed(void** state);
+void test_cookie_resume_after_remount(void** state);
+
+static int64_t create_names(int64_t parent_inodeptr, const char* format, size_t count);
+static void assert_names(int64_t dir_inodeptr, const char* format, size_t count, size_t skip);
+static void assert_index(int64_t dir_inodeptr);
+static void assert_name_lengths(int64_t dir_inodeptr);
+static void assert_resume(size_t count);
+static void name_of_length(char* name, size_t length);
+static void list_dir(int64_t dir_inodeptr, listing_t* listing);
+static void list_dir_from(int64_t dir_inodeptr, off_t offset, listing_t* listing);
+static size_t listed(const listing_t* listing, const char* name);
+static uint32_t fnv1a(const char* name);
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_index_created_when_directory_grows, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_index_created_when_directory_grows, setup_fixed, teardown),
+        cmocka_unit_test_setup_teardown(test_index_survives_remount, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_index_survives_remount, setup_fixed, teardown),
+        cmocka_unit_test_setup_teardown(test_index_after_unlink, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_index_after_unlink, setup_fixed, teardown),
+        cmocka_unit_test_setup_teardown(test_records_layout, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_records_name_lengths, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_records_space_reused, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_cookie_resume_linear, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_cookie_resume_linear, setup_fixed, teardown),
+        cmocka_unit_test_setup_teardown(test_cookie_resume_indexed, setup_compact, teardown),
+        cmocka_unit_test_setup_teardown(test_cookie_resume_indexed, setup_fixed, teardown),
+        cmocka_unit_test_setup_teardown(test_cookie_resume_after_remount, setup_compact, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+int setup_compact(void** state) {
+    return test_fs_create(64 * 1024 * 1024, 8192, SUPER_BLOCK_FEATURE_COMPACT_DIRS);
+}
+
+int setup_fixed(void** state) {
+    return test_fs_create(64 * 1024 * 1024, 8192, 0);
+}
+
+int teardown(void** state) {
+    test_fs_dispose();
+    return 0;
+}
+
+void test_index_created_when_directory_grows(void** state) {
+    const int64_t dir_inodeptr = create_names(ROOT_INODEPTR, "file-%04zu", TEST_INDEXED_NAMES);
+    assert_index(dir_inodeptr);
+    assert_names(dir_inodeptr, "file-%04zu", TEST_INDEXED_NAMES, 0);
+}
+
+void test_index_survives_remount(void** state) {
+    const int64_t dir_inodeptr = create_names(ROOT_INODEPTR, "file-%04zu", TEST_INDEXED_NAMES);
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    assert_index(dir_inodeptr);
+    assert_names(dir_inodeptr, "file-%04zu", TEST_INDEXED_NAMES, 0);
+}
+
+void test_index_after_unlink(void** state) {
+    const int64_t dir_inodeptr = create_names(ROOT_INODEPTR, "file-%04zu", TEST_INDEXED_NAMES);
+    for (size_t i = 0; i < TEST_INDEXED_NAMES; i += 3) {
+        char name[32];
+        sprintf(name, "file-%04zu", i);
+        assert_int_equal(stzfs_unlink_inode(dir_inodeptr, name, false), 0);
+    }
+
+    assert_index(dir_inodeptr);
+    assert_names(dir_inodeptr, "file-%04zu", TEST_INDEXED_NAMES, 3);
+
+    // the freed space is used again
+    inode_t inode;
+    assert_int_equal(inode_read(dir_inodeptr, &inode), SUCCESS);
+    const int64_t block_count = inode.block_count;
+    for (size_t i = 0; i < TEST_INDEXED_NAMES; i += 3) {
+        char name[32];
+        sprintf(name, "file-%04zu", i);
+        const int64_t inodeptr = test_fs_create_file(dir_inodeptr, name, 0);
+        assert_int_not_equal(inodeptr, 0);
+        stzfs_forget_inode(inodeptr, 1);
+    }
+
+    assert_int_equal(inode_read(dir_inodeptr, &inode), SUCCESS);
+    assert_true(inode.block_count <= block_count + 2);
+    assert_index(dir_inodeptr);
+    assert_names(dir_inodeptr, "file-%04zu", TEST_INDEXED_NAMES, 0);
+}
+
+void test_records_layout(void** state) {
+    const int64_t dir_inodeptr = test_fs_mkdir(ROOT_INODEPTR, "dir");
+    struct stat st;
+    assert_int_not_equal(test_fs_mkdir(dir_inodeptr, "sub"), 0);
+    assert_int_equal(stzfs_symlink_inode("sub", dir_inodeptr, "link", getuid(), getgid(), &st), 0);
+    for (size_t length = 1; length <= 40; length++) {
+        char name[MAX_FILENAME_LENGTH + 1];
+        name_of_length(name, length);
+        assert_int_not_equal(test_fs_create_file(dir_inodeptr, name, 0), 0);
+    }
+
+    // variable length records cover the block without gaps, they are packed into a single one
+    inode_t inode;
+    assert_int_equal(inode_read(dir_inodeptr, &inode), SUCCESS);
+    assert_int_equal(inode.block_count, 1);
+    assert_int_equal(inode.atom_count, 44);
+
+    dir_block block;
+    assert_int_equal(inode_read_data_block(&inode, NULL, 0, &block, NULL), SUCCESS);
+    size_t records = 0;
+    size_t position = 0;
+    while (position < STZFS_BLOCK_SIZE) {
+        const dir_record* record = (const dir_record*)((const uint8_t*)&block + position);
+        assert_int_equal(record->length % 4, 0);
+        assert_true(record->length >= DIR_RECORD_LENGTH(record->name_length));
+        assert_int_not_equal(record->inode, 0);
+
+        char name[MAX_FILENAME_LENGTH + 1] = {0};
+        memcpy(name, record->name, record->name_length);
+        if (records == 0) {
+            assert_string_equal(name, ".");
+            assert_int_equal(record->inode, dir_inodeptr);
+            assert_int_equal(record->type, DIR_TYPE_DIR);
+        } else if (records == 1) {
+            assert_string_equal(name, "..");
+            assert_int_equal(record->inode, ROOT_INODEPTR);
+            assert_int_equal(record->type, DIR_TYPE_DIR);
+        } else if (strcmp(name, "sub") == 0) {
+            assert_int_equal(record->type, DIR_TYPE_DIR);
+        } else if (strcmp(name, "link") == 0) {
+            assert_int_equal(record->type, DIR_TYPE_LNK);
+        } else {
+            char expected[MAX_FILENAME_LENGTH + 1];
+            name_of_length(expected, record->name_length);
+            assert_string_equal(name, expected);
+            assert_int_equal(record->type, DIR_TYPE_REG);
+        }
+
+        position += record->length;
+        records++;
+    }
+
+    // the last record gets the space up to the end of the block
+    assert_int_equal(position, STZFS_BLOCK_SIZE);
+    assert_int_equal(records, inode.atom_count);
+}
+
+void test_records_name_lengths(void** state) {
+    const int64_t dir_inodeptr = test_fs_mkdir(ROOT_INODEPTR, "dir");
+    for (size_t length = 1; length <= TEST_MAX_NAME_LENGTH; length++) {
+        char name[MAX_FILENAME_LENGTH + 1];
+        name_of_length(name, length);
+        const int64_t inodeptr = test_fs_create_file(dir_inodeptr, name, 0);
+        assert_int_not_equal(inodeptr, 0);
+        stzfs_forget_inode(inodeptr, 1);
+    }
+
+    char too_long[TEST_MAX_NAME_LENGTH + 2];
+    name_of_length(too_long, TEST_MAX_NAME_LENGTH + 1);
+    struct stat st;
+    struct fuse_file_info fi = {0};
+    assert_int_equal(stzfs_create_inode(dir_inodeptr, too_long, S_IFREG | 0644, getuid(), getgid(), &st, &fi),
+                     -ENAMETOOLONG);
+
+    assert_name_lengths(dir_inodeptr);
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    assert_name_lengths(dir_inodeptr);
+}
+
+void test_records_space_reused(void** state) {
+    // short names fill a single block
+    const int64_t dir_inodeptr = create_names(ROOT_INODEPTR, "first-%03zu", 200);
+    inode_t inode;
+    assert_int_equal(inode_read(dir_inodeptr, &inode), SUCCESS);
+    assert_int_equal(inode.block_count, 1);
+
+    // removed records are merged with their neighbours, twice as long names fit in again
+    for (size_t i = 0; i < 200; i++) {
+        char name[32];
+        sprintf(name, "first-%03zu", i);
+        assert_int_equal(stzfs_unlink_inode(dir_inodeptr, name, false), 0);
+    }
+    for (size_t i = 0; i < 100; i++) {
+        char name[32];
+        sprintf(name, "other-name-%019zu", i);
+        const int64_t inodeptr = test_fs_create_file(dir_inodeptr, name, 0);
+        assert_int_not_equal(inodeptr, 0);
+        stzfs_forget_inode(inodeptr, 1);
+    }
+
+    assert_int_equal(inode_read(dir_inodeptr, &inode), SUCCESS);
+    assert_int_equal(inode.block_count, 1);
+    assert_names(dir_inodeptr, "other-name-%019zu", 100, 0);
+    assert_int_equal(test_fs_lookup(dir_inodeptr, "first-000"), 0);
+}
+
+void test_cookie_resume_linear(void** state) {
+    assert_resume(60);
+}
+
+void test_cookie_resume_indexed(void** state) {
+    assert_resume(TEST_INDEXED_NAMES);
+}
+
+void test_cookie_resume_after_remount(void** state) {
+    const int64_t dir_inodeptr = create_names(ROOT_INODEPTR, "file-%04zu", TEST_INDEXED_NAMES);
+
+    listing_t first = {.limit = TEST_INDEXED_NAMES / 2};
+    list_dir_from(dir_inodeptr, 0, &first);
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    listing_t second = {0};
+    list_dir_from(dir_inodeptr, first.next, &second);
+
+    assert_int_equal(first.count + second.count, TEST_INDEXED_NAMES + 2);
+    for (size_t i = 0; i < TEST_INDEXED_NAMES; i++) {
+        char name[32];
+        sprintf(name, "file-%04zu", i);
+        assert_int_equal(listed(&first, name) + listed(&second, name), 1);
+    }
+
+    free(first.names);
+    free(second.names);
+}
+
+// a listing continued from a cookie after names were added and removed lists every remaining name that
+// was not listed before exactly once, even if the name behind the cookie is gone and leaves were split
+static void assert_resume(size_t count) {
+    const int64_t dir_inodeptr = create_names(ROOT_INODEPTR, "file-%04zu", count);
+
+    listing_t first = {.limit = count / 3};
+    list_dir_from(dir_inodeptr, 0, &first);
+    assert_int_equal(first.count, count / 3);
+
+    const char* last = first.names[first.count - 1];
+    assert_int_equal(strncmp(last, "file-", 5), 0);
+    assert_int_equal(stzfs_unlink_inode(dir_inodeptr, last, false), 0);
+
+    bool* removed = calloc(count, sizeof(bool));
+    assert_non_null(removed);
+    removed[strtoul(last + 5, NULL, 10)] = true;
+    for (size_t i = 0; i < count; i += 7) {
+        char name[32];
+        sprintf(name, "file-%04zu", i);
+        if (!removed[i]) {
+            assert_int_equal(stzfs_unlink_inode(dir_inodeptr, name, false), 0);
+            removed[i] = true;
+        }
+    }
+    for (size_t i = 0; i < count / 2; i++) {
+        char name[32];
+        sprintf(name, "new-%04zu", i);
+        const int64_t inodeptr = test_fs_create_file(dir_inodeptr, name, 0);
+        assert_int_not_equal(inodeptr, 0);
+        stzfs_forget_inode(inodeptr, 1);
+    }
+
+    listing_t second = {0};
+    list_dir_from(dir_inodeptr, first.next, &second);
+    for (size_t i = 0; i < count; i++) {
+        char name[32];
+        sprintf(name, "file-%04zu", i);
+        assert_int_equal(listed(&second, name), removed[i] ? 0 : 1 - listed(&first, name));
+    }
+    for (size_t i = 0; i < count / 2; i++) {
+        char name[32];
+        sprintf(name, "new-%04zu", i);
+        assert_true(listed(&second, name) <= 1);
+    }
+    assert_int_equal(listed(&first, ".") + listed(&second, "."), 1);
+    assert_int_equal(listed(&first, "..") + listed(&second, ".."), 1);
+
+    free(removed);
+    free(first.names);
+    free(second.names);
+}
+
+// create a directory with count empty files named after format and the number of each
+static int64_t create_names(int64_t parent_inodeptr, const char* format, size_t count) {
+    const int64_t dir_inodeptr = test_fs_mkdir(parent_inodeptr, "dir");
+    assert_int_not_equal(dir_inodeptr, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        char name[MAX_FILENAME_LENGTH + 1];
+        sprintf(name, format, i);
+        const int64_t inodeptr = test_fs_create_file(dir_inodeptr, name, 0);
+        assert_int_not_equal(inodeptr, 0);
+
+        // unlinked files are freed right away
+        stzfs_forget_inode(inodeptr, 1);
+    }
+
+    return dir_inodeptr;
+}
+
+// every name of create_names is found and listed exactly once, except every skip-th one which is gone
+static void assert_names(int64_t dir_inodeptr, const char* format, size_t count, size_t skip) {
+    listing_t listing = {0};
+    list_dir(dir_inodeptr, &listing);
+
+    size_t expected = 2;
+    for (size_t i = 0; i < count; i++) {
+        char name[MAX_FILENAME_LENGTH + 1];
+        sprintf(name, format, i);
+        const bool removed = skip > 0 && i % skip == 0;
+        assert_int_equal(test_fs_lookup(dir_inodeptr, name) != 0, !removed);
+        assert_int_equal(listed(&listing, name), !removed);
+        expected += !removed;
+    }
+
+    assert_int_equal(listed(&listing, "."), 1);
+    assert_int_equal(listed(&listing, ".."), 1);
+    assert_int_equal(listing.count, expected);
+    free(listing.names);
+}
+
+// the root of the index points to leaves of ascending hash ranges, every name is in the leaf of its hash
+static void assert_index(int64_t dir_inodeptr) {
+    inode_t inode;
+    assert_int_equal(inode_read(dir_inodeptr, &inode), SUCCESS);
+    assert_true(inode.mode & M_INDEXED);
+
+    dir_index_block root;
+    assert_int_equal(inode_read_data_block(&inode, NULL, 0, &root, NULL), SUCCESS);
+    assert_int_equal(root.levels, 0);
+    assert_true(root.count > 1);
+    assert_int_equal(root.entries[0].hash, 0);
+
+    const bool compact = super_block_cache->features & SUPER_BLOCK_FEATURE_COMPACT_DIRS;
+    size_t names = 0;
+    for (uint32_t i = 0; i < root.count; i++) {
+        const uint32_t first = root.entries[i].hash;
+        const uint64_t end = i + 1 < root.count ? root.entries[i + 1].hash : (uint64_t)UINT32_MAX + 1;
+        assert_true(first < end);
+        assert_in_range(root.entries[i].offset, 1, inode.block_count - 1);
+
+        dir_block leaf;
+        assert_int_equal(inode_read_data_block(&inode, NULL, root.entries[i].offset, &leaf, NULL), SUCCESS);
+        for (size_t position = 0; position < STZFS_BLOCK_SIZE; ) {
+            char name[MAX_FILENAME_LENGTH + 1] = {0};
+            if (compact) {
+                const dir_record* record = (const dir_record*)((const uint8_t*)&leaf + position);
+                assert_true(record->length >= DIR_RECORD_LENGTH(0));
+                if (record->inode != 0) {
+                    memcpy(name, record->name, record->name_length);
+                }
+                position += record->length;
+            } else {
+                strncpy(name, (const char*)((const dir_block_entry*)((const uint8_t*)&leaf + position))->name,
+                        MAX_FILENAME_LENGTH);
+                position += sizeof(dir_block_entry);
+            }
+
+            if (name[0] != 0) {
+                assert_in_range(fnv1a(name), first, end - 1);
+                names++;
+            }
+        }
+    }
+
+    // the leaves hold . and .. as well
+    assert_int_equal(names, inode.atom_count);
+}
+
+// every name of test_records_name_lengths is found and listed exactly once
+static void assert_name_lengths(int64_t dir_inodeptr) {
+    listing_t listing = {0};
+    list_dir(dir_inodeptr, &listing);
+    assert_int_equal(listing.count, TEST_MAX_NAME_LENGTH + 2);
+
+    for (size_t length = 1; length <= TEST_MAX_NAME_LENGTH; length++) {
+        char name[MAX_FILENAME_LENGTH + 1];
+        name_of_length(name, length);
+        assert_int_not_equal(test_fs_lookup(dir_inodeptr, name), 0);
+        assert_int_equal(listed(&listing, name), 1);
+    }
+
+    free(listing.names);
+}
+
+// a name of the given length that differs from those of other lengths in every character
+static void name_of_length(char* name, size_t length) {
+    memset(name, 'a' + length % 26, length);
+    name[length] = 0;
+}
+
+static int fill_listing(void* context, const char* name, const struct stat* st, off_t next) {
+    listing_t* listing = context;
+    if (listing->limit > 0 && listing->count == listing->limit) {
+        return 1;
+    }
+
+    if (listing->count == listing->capacity) {
+        listing->capacity = listing->capacity > 0 ? 2 * listing->capacity : 64;
+        listing->names = realloc(listing->names, listing->capacity * sizeof(*listing->names));
+        assert_non_null(listing->names);
+    }
+
+    strcpy(listing->names[listing->count++], name);
+    listing->next = next;
+    return 0;
+}
+
+static void list_dir(int64_t dir_inodeptr, listing_t* listing) {
+    list_dir_from(dir_inodeptr, 0, listing);
+}
+
+static void list_dir_from(int64_t dir_inodeptr, off_t offset, listing_t* listing) {
+    assert_int_equal(stzfs_readdir_inode(dir_inodeptr, offset, false, fill_listing, listing), 0);
+}
+
+// how often a name was listed
+static size_t listed(const listing_t* listing, const char* name) {
+    size_t count = 0;
+    for (size_t i = 0; i < listing->count; i++) {
+        count += strcmp(listing->names[i], name) == 0;
+    }
+
+    return count;
+}
+
+// hash of names in the index, 32 bit fnv-1a
+static uint32_t fnv1a(const char* name) {
+    uint32_t hash = 0x811c9dc5;
+    for (const char* c = name; *c != 0; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x01000193;
+    }
+
+    return hash;
+}
@@ -0,0 +1,337 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/bitmap_cache.h"
+#include "../src/block.h"
+#include "../src/blocks.h"
+#include "../src/handle.h"
+#include "../src/stzfs.h"
+#include "test_fs.h"
+
+// blocks written by the tests
+#define TEST_BLOCKS (64)
+
+int setup_indirect(void** state);
+int setup_extents(void** state);
+int teardown(void** state);
+void test_delayed_blocks_allocated_on_flush(void** state);
+void test_delayed_blocks_dropped_on_truncate(void** state);
+void test_delayed_blocks_fill_disk(void** state);
+void test_fallocate_preallocates_zeroed_blocks(void** state);
+void test_fallocate_punches_and_zeroes(void** state);
+void test_fallocate_zeroes_old_end(void** state);
+void test_seek_data_and_holes(void** state);
+
+static int64_t create_open(const char* name, struct fuse_file_info* fi);
+static void fill(char* buffer, size_t length, char seed);
+static off_t file_size(int64_t inodeptr, struct fuse_file_info* fi);
+static void assert_zero(const char* buffer, size_t length);
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_delayed_blocks_allocated_on_flush, setup_indirect, teardown),
+        cmocka_unit_test_setup_teardown(test_delayed_blocks_allocated_on_flush, setup_extents, teardown),
+        cmocka_unit_test_setup_teardown(test_delayed_blocks_dropped_on_truncate, setup_indirect, teardown),
+        cmocka_unit_test_setup_teardown(test_delayed_blocks_dropped_on_truncate, setup_extents, teardown),
+        cmocka_unit_test_setup_teardown(test_delayed_blocks_fill_disk, setup_indirect, teardown),
+        cmocka_unit_test_setup_teardown(test_delayed_blocks_fill_disk, setup_extents, teardown),
+        cmocka_unit_test_setup_teardown(test_fallocate_preallocates_zeroed_blocks, setup_indirect, teardown),
+        cmocka_unit_test_setup_teardown(test_fallocate_preallocates_zeroed_blocks, setup_extents, teardown),
+        cmocka_unit_test_setup_teardown(test_fallocate_punches_and_zeroes, setup_indirect, teardown),
+        cmocka_unit_test_setup_teardown(test_fallocate_punches_and_zeroes, setup_extents, teardown),
+        cmocka_unit_test_setup_teardown(test_fallocate_zeroes_old_end, setup_indirect, teardown),
+        cmocka_unit_test_setup_teardown(test_fallocate_zeroes_old_end, setup_extents, teardown),
+        cmocka_unit_test_setup_teardown(test_seek_data_and_holes, setup_indirect, teardown),
+        cmocka_unit_test_setup_teardown(test_seek_data_and_holes, setup_extents, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+int setup_indirect(void** state) {
+    return test_fs_create(64 * 1024 * 1024, 1024, SUPER_BLOCK_FEATURE_COMPACT_DIRS);
+}
+
+int setup_extents(void** state) {
+    return test_fs_create(64 * 1024 * 1024, 1024, SUPER_BLOCK_FEATURE_COMPACT_DIRS | SUPER_BLOCK_FEATURE_EXTENTS);
+}
+
+int teardown(void** state) {
+    test_fs_dispose();
+    return 0;
+}
+
+void test_delayed_blocks_allocated_on_flush(void** state) {
+    struct fuse_file_info fi = {0};
+    const int64_t inodeptr = create_open("file", &fi);
+    const int64_t free_blocks = bitmap_cache_get_free(&block_bitmap_cache);
+
+    char* data = malloc(TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    char* read = malloc(TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    fill(data, TEST_BLOCKS * STZFS_BLOCK_SIZE, 'a');
+    assert_int_equal(stzfs_write(NULL, data, TEST_BLOCKS * STZFS_BLOCK_SIZE, 0, &fi), TEST_BLOCKS * STZFS_BLOCK_SIZE);
+
+    // the data only has blocks set aside, it is read from the handle, an indirect block map gets its
+    // indirect block for the null blocks at the new end right away
+    assert_true(bitmap_cache_get_free(&block_bitmap_cache) >= free_blocks - 1);
+    assert_true(block_get_free() <= free_blocks - TEST_BLOCKS);
+    assert_int_equal(stzfs_read(NULL, read, TEST_BLOCKS * STZFS_BLOCK_SIZE, 0, &fi), TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    assert_memory_equal(read, data, TEST_BLOCKS * STZFS_BLOCK_SIZE);
+
+    // a flush allocates the blocks and hands back what was set aside for mapping them but not needed
+    assert_int_equal(stzfs_flush(NULL, &fi), 0);
+    assert_true(bitmap_cache_get_free(&block_bitmap_cache) <= free_blocks - TEST_BLOCKS);
+    assert_int_equal(block_get_free(), bitmap_cache_get_free(&block_bitmap_cache));
+    assert_int_equal(stzfs_release(NULL, &fi), 0);
+
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    memset(read, 0, TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_open_inode(inodeptr, &fi), 0);
+    assert_int_equal(stzfs_read(NULL, read, TEST_BLOCKS * STZFS_BLOCK_SIZE, 0, &fi), TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    assert_memory_equal(read, data, TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_release(NULL, &fi), 0);
+
+    free(data);
+    free(read);
+}
+
+void test_delayed_blocks_dropped_on_truncate(void** state) {
+    struct fuse_file_info fi = {0};
+    const int64_t inodeptr = create_open("file", &fi);
+    const int64_t free_blocks = block_get_free();
+
+    char* data = malloc(TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    fill(data, TEST_BLOCKS * STZFS_BLOCK_SIZE, 'a');
+    assert_int_equal(stzfs_write(NULL, data, TEST_BLOCKS * STZFS_BLOCK_SIZE, 0, &fi), TEST_BLOCKS * STZFS_BLOCK_SIZE);
+    assert_true(block_get_free() <= free_blocks - TEST_BLOCKS);
+
+    // cut off data never gets blocks, its reservation is returned
+    struct stat attr = {.st_size = STZFS_BLOCK_SIZE};
+    struct stat st;
+    assert_int_equal(stzfs_setattr_inode(inodeptr, &attr, FUSE_SET_ATTR_SIZE, &st, &fi), 0);
+    assert_int_equal(st.st_size, STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_release(NULL, &fi), 0);
+
+    assert_int_equal(block_get_free(), free_blocks - 1);
+    assert_int_equal(bitmap_cache_get_free(&block_bitmap_cache), free_blocks - 1);
+    free(data);
+}
+
+void test_delayed_blocks_fill_disk(void** state) {
+    const size_t length = 3 * STZFS_BLOCK_SIZE;
+    char data[3 * STZFS_BLOCK_SIZE];
+    fill(data, length, 'a');
+
+    // every write starts a new run that reserves metadata it hardly needs
+    struct fuse_file_info fi[3] = {{0}};
+    create_open("a", &fi[0]);
+    create_open("b", &fi[1]);
+    create_open("c", &fi[2]);
+    int failures = 0;
+    for (int write = 0; failures < 3; write++) {
+        const off_t offset = (off_t)(write / 3) * 2 * length;
+        const int written = stzfs_write(NULL, data, length, offset, &fi[write % 3]);
+        if (written == -ENOSPC) {
+            failures++;
+            continue;
+        }
+
+        // a write running out of space part way reports the blocks it got
+        assert_true(written > 0 && written <= (int)length);
+        assert_int_equal(written % STZFS_BLOCK_SIZE, 0);
+        failures = 0;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        assert_int_equal(stzfs_release(NULL, &fi[i]), 0);
+    }
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    assert_true(block_get_free() <= 3 * (1 + HANDLE_RUN_METADATA_BLOCKS));
+}
+
+void test_fallocate_preallocates_zeroed_blocks(void** state) {
+    const size_t length = TEST_BLOCKS * STZFS_BLOCK_SIZE;
+    char* data = malloc(length);
+    char* read = malloc(length);
+    fill(data, length, 'a');
+
+    // leave old data in the free blocks
+    const int64_t old_inodeptr = test_fs_create_file(ROOT_INODEPTR, "old", length);
+    assert_int_not_equal(old_inodeptr, 0);
+    assert_int_equal(stzfs_unlink_inode(ROOT_INODEPTR, "old", false), 0);
+    stzfs_forget_inode(old_inodeptr, 1);
+
+    struct fuse_file_info fi = {0};
+    const int64_t inodeptr = create_open("file", &fi);
+    const int64_t free_blocks = bitmap_cache_get_free(&block_bitmap_cache);
+    assert_int_equal(stzfs_fallocate(NULL, 0, 0, length, &fi), 0);
+    assert_int_equal(file_size(inodeptr, &fi), length);
+    assert_true(bitmap_cache_get_free(&block_bitmap_cache) <= free_blocks - TEST_BLOCKS);
+
+    // preallocated blocks read as zeroes until they are written, writes need no new blocks
+    assert_int_equal(stzfs_read(NULL, read, length, 0, &fi), length);
+    assert_zero(read, length);
+    const int64_t preallocated_free_blocks = bitmap_cache_get_free(&block_bitmap_cache);
+    assert_int_equal(stzfs_write(NULL, data, STZFS_BLOCK_SIZE, 5 * STZFS_BLOCK_SIZE, &fi), STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_flush(NULL, &fi), 0);
+    assert_int_equal(bitmap_cache_get_free(&block_bitmap_cache), preallocated_free_blocks);
+
+    // space behind the end
+    assert_int_equal(stzfs_fallocate(NULL, FALLOC_FL_KEEP_SIZE, length, 16 * STZFS_BLOCK_SIZE, &fi), 0);
+    assert_int_equal(file_size(inodeptr, &fi), length);
+    assert_true(bitmap_cache_get_free(&block_bitmap_cache) <= preallocated_free_blocks - 16);
+    assert_int_equal(stzfs_release(NULL, &fi), 0);
+
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    assert_int_equal(stzfs_open_inode(inodeptr, &fi), 0);
+    assert_int_equal(stzfs_read(NULL, read, length, 0, &fi), length);
+    assert_zero(read, 5 * STZFS_BLOCK_SIZE);
+    assert_memory_equal(&read[5 * STZFS_BLOCK_SIZE], data, STZFS_BLOCK_SIZE);
+    assert_zero(&read[6 * STZFS_BLOCK_SIZE], length - 6 * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_release(NULL, &fi), 0);
+
+    free(data);
+    free(read);
+}
+
+void test_fallocate_punches_and_zeroes(void** state) {
+    const size_t length = TEST_BLOCKS * STZFS_BLOCK_SIZE;
+    char* data = malloc(length);
+    char* read = malloc(length);
+    fill(data, length, 'a');
+
+    struct fuse_file_info fi = {0};
+    const int64_t inodeptr = create_open("file", &fi);
+    assert_int_equal(stzfs_write(NULL, data, length, 0, &fi), length);
+    assert_int_equal(stzfs_flush(NULL, &fi), 0);
+
+    // the blocks fully inside of the hole are freed, the partial ones at its edges zeroed
+    int64_t free_blocks = bitmap_cache_get_free(&block_bitmap_cache);
+    const off_t hole = 16 * STZFS_BLOCK_SIZE + 100;
+    assert_int_equal(stzfs_fallocate(NULL, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole, 16 * STZFS_BLOCK_SIZE,
+                                     &fi), 0);
+    assert_true(bitmap_cache_get_free(&block_bitmap_cache) >= free_blocks + 15);
+    assert_int_equal(file_size(inodeptr, &fi), length);
+
+    // zeroed blocks stay allocated
+    free_blocks = bitmap_cache_get_free(&block_bitmap_cache);
+    const off_t zeroed = 40 * STZFS_BLOCK_SIZE;
+    assert_int_equal(stzfs_fallocate(NULL, FALLOC_FL_ZERO_RANGE, zeroed, 8 * STZFS_BLOCK_SIZE, &fi), 0);
+    assert_true(bitmap_cache_get_free(&block_bitmap_cache) <= free_blocks);
+    assert_int_equal(file_size(inodeptr, &fi), length);
+
+    assert_int_equal(stzfs_read(NULL, read, length, 0, &fi), length);
+    assert_memory_equal(read, data, hole);
+    assert_zero(&read[hole], 16 * STZFS_BLOCK_SIZE);
+    assert_memory_equal(&read[hole + 16 * STZFS_BLOCK_SIZE], &data[hole + 16 * STZFS_BLOCK_SIZE],
+                        zeroed - hole - 16 * STZFS_BLOCK_SIZE);
+    assert_zero(&read[zeroed], 8 * STZFS_BLOCK_SIZE);
+    assert_memory_equal(&read[zeroed + 8 * STZFS_BLOCK_SIZE], &data[zeroed + 8 * STZFS_BLOCK_SIZE],
+                        length - zeroed - 8 * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_release(NULL, &fi), 0);
+
+    free(data);
+    free(read);
+}
+
+void test_fallocate_zeroes_old_end(void** state) {
+    const size_t length = 2 * STZFS_BLOCK_SIZE;
+    const off_t old_end = STZFS_BLOCK_SIZE + 904;
+    char data[2 * STZFS_BLOCK_SIZE];
+    char read[2 * STZFS_BLOCK_SIZE];
+    fill(data, length, 'a');
+
+    // truncating leaves the old bytes behind the end in the last block, growing the file must not expose them
+    const int modes[] = {0, FALLOC_FL_ZERO_RANGE};
+    const off_t offsets[] = {0, old_end + 1000};
+    const off_t ends[] = {length, old_end + 1100};
+    for (int i = 0; i < 2; i++) {
+        struct fuse_file_info fi = {0};
+        const int64_t inodeptr = create_open(i == 0 ? "default" : "zero", &fi);
+        assert_int_equal(stzfs_write(NULL, data, length, 0, &fi), length);
+        assert_int_equal(stzfs_flush(NULL, &fi), 0);
+
+        struct stat attr = {.st_size = old_end};
+        struct stat st;
+        assert_int_equal(stzfs_setattr_inode(inodeptr, &attr, FUSE_SET_ATTR_SIZE, &st, &fi), 0);
+        assert_int_equal(stzfs_fallocate(NULL, modes[i], offsets[i], ends[i] - offsets[i], &fi), 0);
+        assert_int_equal(file_size(inodeptr, &fi), ends[i]);
+
+        assert_int_equal(stzfs_read(NULL, read, ends[i], 0, &fi), ends[i]);
+        assert_memory_equal(read, data, old_end);
+        assert_zero(&read[old_end], ends[i] - old_end);
+        assert_int_equal(stzfs_release(NULL, &fi), 0);
+    }
+}
+
+void test_seek_data_and_holes(void** state) {
+    char data[STZFS_BLOCK_SIZE];
+    fill(data, STZFS_BLOCK_SIZE, 'a');
+
+    // data at blocks 0 and 100, preallocated blocks 50 to 59, a hole from 101 on up to the end
+    struct fuse_file_info fi = {0};
+    create_open("file", &fi);
+    const off_t size = 120 * STZFS_BLOCK_SIZE;
+    assert_int_equal(stzfs_write(NULL, data, STZFS_BLOCK_SIZE, 0, &fi), STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_write(NULL, data, 100, size - 100, &fi), 100);
+    assert_int_equal(stzfs_fallocate(NULL, 0, 50 * STZFS_BLOCK_SIZE, 10 * STZFS_BLOCK_SIZE, &fi), 0);
+
+    // data still held back by the handle is found as well
+    assert_int_equal(stzfs_write(NULL, data, STZFS_BLOCK_SIZE, 100 * STZFS_BLOCK_SIZE, &fi), STZFS_BLOCK_SIZE);
+
+    assert_int_equal(stzfs_lseek(NULL, 0, SEEK_DATA, &fi), 0);
+    assert_int_equal(stzfs_lseek(NULL, 10, SEEK_DATA, &fi), 10);
+    assert_int_equal(stzfs_lseek(NULL, 0, SEEK_HOLE, &fi), STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_lseek(NULL, STZFS_BLOCK_SIZE, SEEK_DATA, &fi), 50 * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_lseek(NULL, 50 * STZFS_BLOCK_SIZE, SEEK_HOLE, &fi), 60 * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_lseek(NULL, 60 * STZFS_BLOCK_SIZE, SEEK_DATA, &fi), 100 * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_lseek(NULL, 100 * STZFS_BLOCK_SIZE, SEEK_HOLE, &fi), 101 * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_lseek(NULL, 101 * STZFS_BLOCK_SIZE, SEEK_DATA, &fi), size - STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_lseek(NULL, size - STZFS_BLOCK_SIZE, SEEK_HOLE, &fi), size);
+
+    // the end of the file is an implicit hole, there is nothing behind it
+    assert_int_equal(stzfs_lseek(NULL, size - 1, SEEK_DATA, &fi), size - 1);
+    assert_int_equal(stzfs_lseek(NULL, size, SEEK_DATA, &fi), -ENXIO);
+    assert_int_equal(stzfs_lseek(NULL, size, SEEK_HOLE, &fi), -ENXIO);
+
+    // a punched hole
+    assert_int_equal(stzfs_fallocate(NULL, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, STZFS_BLOCK_SIZE, &fi), 0);
+    assert_int_equal(stzfs_lseek(NULL, 0, SEEK_HOLE, &fi), 0);
+    assert_int_equal(stzfs_lseek(NULL, 0, SEEK_DATA, &fi), 50 * STZFS_BLOCK_SIZE);
+    assert_int_equal(stzfs_release(NULL, &fi), 0);
+}
+
+// create a file and keep it open
+static int64_t create_open(const char* name, struct fuse_file_info* fi) {
+    struct stat st;
+    assert_int_equal(stzfs_create_inode(ROOT_INODEPTR, name, S_IFREG | 0644, getuid(), getgid(), &st, fi), 0);
+    return (int64_t)st.st_ino;
+}
+
+static off_t file_size(int64_t inodeptr, struct fuse_file_info* fi) {
+    struct stat st;
+    assert_int_equal(stzfs_getattr_inode(inodeptr, &st, fi), 0);
+    return st.st_size;
+}
+
+static void assert_zero(const char* buffer, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        assert_int_equal(buffer[i], 0);
+    }
+}
+
+// data that differs between blocks
+static void fill(char* buffer, size_t length, char seed) {
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = (char)(seed + i / STZFS_BLOCK_SIZE + i % 251);
+    }
+}
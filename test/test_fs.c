@@ -0,0 +1,151 @@
+#include "test_fs.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/disk.h"
+#include "../src/stzfs.h"
+
+static stzfs_error_t copy_image(const char* src, const char* dst);
+
+static char image_path[] = "/tmp/stzfs_test_XXXXXX";
+
+// create and mount a new file system
+stzfs_error_t test_fs_create(off_t size, int64_t inode_count, uint32_t features) {
+    strcpy(image_path, "/tmp/stzfs_test_XXXXXX");
+    const int fd = mkstemp(image_path);
+    if (fd == -1) {
+        return ERROR;
+    }
+    close(fd);
+
+    if (disk_create_file(image_path, size) || disk_set_file(image_path)) {
+        unlink(image_path);
+        return ERROR;
+    }
+
+    stzfs_makefs(inode_count, features);
+    return SUCCESS;
+}
+
+// unmount cleanly and mount again
+stzfs_error_t test_fs_remount(void) {
+    stzfs_destroy();
+    if (disk_set_file(image_path)) {
+        return ERROR;
+    }
+
+    stzfs_init();
+    return SUCCESS;
+}
+
+// mount the image as it was after a sync, like after losing power right after it
+stzfs_error_t test_fs_crash(void) {
+    if (stzfs_fsync(NULL, 0, NULL)) {
+        return ERROR;
+    }
+
+    char crashed_path[] = "/tmp/stzfs_test_XXXXXX";
+    const int fd = mkstemp(crashed_path);
+    if (fd == -1) {
+        return ERROR;
+    }
+    close(fd);
+
+    if (copy_image(image_path, crashed_path)) {
+        unlink(crashed_path);
+        return ERROR;
+    }
+
+    // the mounted file system goes away with its image
+    stzfs_destroy();
+    unlink(image_path);
+    strcpy(image_path, crashed_path);
+    if (disk_set_file(image_path)) {
+        return ERROR;
+    }
+
+    stzfs_init();
+    return SUCCESS;
+}
+
+// unmount and remove the image
+void test_fs_dispose(void) {
+    stzfs_destroy();
+    unlink(image_path);
+}
+
+// create a file and fill it with size bytes
+int64_t test_fs_create_file(int64_t parent_inodeptr, const char* name, size_t size) {
+    struct stat st;
+    struct fuse_file_info fi = {0};
+    if (stzfs_create_inode(parent_inodeptr, name, S_IFREG | 0644, getuid(), getgid(), &st, &fi)) {
+        return 0;
+    }
+
+    char buffer[65536];
+    memset(buffer, 'x', sizeof(buffer));
+    for (size_t written = 0; written < size; ) {
+        const size_t length = size - written < sizeof(buffer) ? size - written : sizeof(buffer);
+        const int result = stzfs_write(NULL, buffer, length, (off_t)written, &fi);
+        if (result <= 0) {
+            stzfs_release(NULL, &fi);
+            return 0;
+        }
+        written += result;
+    }
+
+    return stzfs_release(NULL, &fi) ? 0 : (int64_t)st.st_ino;
+}
+
+int64_t test_fs_mkdir(int64_t parent_inodeptr, const char* name) {
+    struct stat st;
+    if (stzfs_mkdir_inode(parent_inodeptr, name, S_IFDIR | 0755, getuid(), getgid(), &st)) {
+        return 0;
+    }
+
+    return (int64_t)st.st_ino;
+}
+
+// inodeptr of a name, 0 if it is missing
+int64_t test_fs_lookup(int64_t parent_inodeptr, const char* name) {
+    struct stat st;
+    if (stzfs_lookup_inode(parent_inodeptr, name, &st)) {
+        return 0;
+    }
+
+    // drop the reference again, the tests only look
+    stzfs_forget_inode((int64_t)st.st_ino, 1);
+    return (int64_t)st.st_ino;
+}
+
+static stzfs_error_t copy_image(const char* src, const char* dst) {
+    const int in = open(src, O_RDONLY);
+    const int out = open(dst, O_WRONLY);
+    stzfs_error_t error = in == -1 || out == -1 ? ERROR : SUCCESS;
+
+    struct stat st;
+    if (!error && (fstat(in, &st) || ftruncate(out, st.st_size))) {
+        error = ERROR;
+    }
+
+    // holes stay holes
+    char buffer[65536];
+    ssize_t length;
+    for (off_t offset = 0; !error && (length = pread(in, buffer, sizeof(buffer), offset)) > 0; offset += length) {
+        bool zero = true;
+        for (ssize_t i = 0; i < length && zero; i++) {
+            zero = buffer[i] == 0;
+        }
+        if (!zero && pwrite(out, buffer, length, offset) != length) {
+            error = ERROR;
+        }
+    }
+
+    if (in != -1) close(in);
+    if (out != -1) close(out);
+    return error;
+}
@@ -0,0 +1,21 @@
+#ifndef STZFS_TEST_FS_H
+#define STZFS_TEST_FS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../src/error.h"
+
+// file system on a temporary image file, mounted without fuse
+stzfs_error_t test_fs_create(off_t size, int64_t inode_count, uint32_t features);
+stzfs_error_t test_fs_remount(void);
+stzfs_error_t test_fs_crash(void);
+void test_fs_dispose(void);
+
+// files for the tests, created with a kernel reference held like after a lookup
+int64_t test_fs_create_file(int64_t parent_inodeptr, const char* name, size_t size);
+int64_t test_fs_mkdir(int64_t parent_inodeptr, const char* name);
+int64_t test_fs_lookup(int64_t parent_inodeptr, const char* name);
+
+#endif // STZFS_TEST_FS_H
@@ -0,0 +1,158 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/bitmap_cache.h"
+#include "../src/blocks.h"
+#include "../src/group.h"
+#include "../src/group_cache.h"
+#include "../src/inode.h"
+#include "../src/super_block_cache.h"
+#include "test_fs.h"
+
+// two and a half groups, the last one is cut short by the end of the disk
+#define TEST_BLOCKS (GROUP_BLOCKS * 5 / 2)
+#define TEST_INODES (3 * 1024)
+
+int setup(void** state);
+int teardown(void** state);
+void test_makefs_group_counts(void** state);
+void test_directories_spread_over_groups(void** state);
+void test_files_stay_in_directory_group(void** state);
+void test_group_counts_survive_remount(void** state);
+void test_group_counts_rebuilt_after_crash(void** state);
+
+static void assert_counts_match_bitmaps(void);
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_makefs_group_counts, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_directories_spread_over_groups, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_files_stay_in_directory_group, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_group_counts_survive_remount, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_group_counts_rebuilt_after_crash, setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+int setup(void** state) {
+    return test_fs_create((off_t)TEST_BLOCKS * STZFS_BLOCK_SIZE, TEST_INODES, SUPER_BLOCK_FEATURE_COMPACT_DIRS);
+}
+
+int teardown(void** state) {
+    test_fs_dispose();
+    return 0;
+}
+
+void test_makefs_group_counts(void** state) {
+    const super_block* sb = super_block_cache;
+    assert_int_equal(sb->group_count, 3);
+    assert_int_equal(group_cache.count, 3);
+    assert_int_equal(sb->inodes_per_group, 1024);
+
+    // the metadata and the root directory live in the first group
+    const int64_t metadata_blocks = sb->inode_table + sb->inode_table_length;
+    assert_int_equal(group_cache.groups[0].free_blocks, GROUP_BLOCKS - metadata_blocks - 1);
+    assert_int_equal(group_cache.groups[1].free_blocks, GROUP_BLOCKS);
+    assert_int_equal(group_cache.groups[2].free_blocks, GROUP_BLOCKS / 2);
+
+    // inode 0 is reserved, inode 1 is the root directory
+    assert_int_equal(group_cache.groups[0].free_inodes, 1024 - 2);
+    assert_int_equal(group_cache.groups[1].free_inodes, 1024);
+    assert_int_equal(group_cache.groups[2].free_inodes, 1024);
+
+    assert_counts_match_bitmaps();
+}
+
+void test_directories_spread_over_groups(void** state) {
+    bool used[3] = {false};
+    for (int i = 0; i < 6; i++) {
+        char name[16];
+        sprintf(name, "dir%i", i);
+        const int64_t inodeptr = test_fs_mkdir(ROOT_INODEPTR, name);
+        assert_int_not_equal(inodeptr, 0);
+        used[group_of_inode(inodeptr)] = true;
+    }
+
+    assert_true(used[0] && used[1] && used[2]);
+    assert_counts_match_bitmaps();
+}
+
+void test_files_stay_in_directory_group(void** state) {
+    // the first directory goes to an empty group
+    const int64_t dir_inodeptr = test_fs_mkdir(ROOT_INODEPTR, "dir");
+    const int64_t group = group_of_inode(dir_inodeptr);
+    assert_int_not_equal(group, 0);
+
+    const int64_t inodeptr = test_fs_create_file(dir_inodeptr, "file", 64 * STZFS_BLOCK_SIZE);
+    assert_int_not_equal(inodeptr, 0);
+    assert_int_equal(group_of_inode(inodeptr), group);
+
+    // the data follows its inode
+    inode_t inode;
+    assert_int_equal(inode_read(inodeptr, &inode), SUCCESS);
+    assert_int_equal(inode.block_count, 64);
+    for (int64_t offset = 0; offset < inode.block_count; offset++) {
+        int64_t blockptr;
+        assert_int_equal(inode_find_data_blockptr(&inode, offset, ALLOC_SPARSE_NO, &blockptr), SUCCESS);
+        assert_int_equal(group_of_block(blockptr), group);
+    }
+
+    assert_counts_match_bitmaps();
+}
+
+void test_group_counts_survive_remount(void** state) {
+    const int64_t dir_inodeptr = test_fs_mkdir(ROOT_INODEPTR, "dir");
+    assert_int_not_equal(test_fs_create_file(dir_inodeptr, "a", 100 * STZFS_BLOCK_SIZE), 0);
+    assert_int_not_equal(test_fs_create_file(ROOT_INODEPTR, "b", 10 * STZFS_BLOCK_SIZE), 0);
+
+    group_descriptor groups[3];
+    memcpy(groups, group_cache.groups, sizeof(groups));
+
+    assert_int_equal(test_fs_remount(), SUCCESS);
+    assert_int_equal(group_cache.count, 3);
+    assert_memory_equal(group_cache.groups, groups, sizeof(groups));
+    assert_counts_match_bitmaps();
+}
+
+void test_group_counts_rebuilt_after_crash(void** state) {
+    const int64_t dir_inodeptr = test_fs_mkdir(ROOT_INODEPTR, "dir");
+    assert_int_not_equal(test_fs_create_file(dir_inodeptr, "a", 100 * STZFS_BLOCK_SIZE), 0);
+
+    // counts that were not written back before the crash
+    group_cache.groups[group_of_inode(dir_inodeptr)].free_blocks += 100;
+    group_cache.groups[group_of_inode(dir_inodeptr)].free_inodes += 2;
+
+    assert_int_equal(test_fs_crash(), SUCCESS);
+    assert_counts_match_bitmaps();
+}
+
+// every group counts what its part of the bitmaps holds, the super block their sums
+static void assert_counts_match_bitmaps(void) {
+    assert_int_equal(group_cache_sync(), 0);
+
+    int64_t free_blocks = 0;
+    int64_t free_inodes = 0;
+    for (size_t group = 0; group < group_cache.count; group++) {
+        const int64_t first_block = (int64_t)group * group_cache.blocks_per_group;
+        const int64_t first_inode = (int64_t)group * group_cache.inodes_per_group;
+        assert_int_equal(group_cache.groups[group].free_blocks,
+                         bitmap_cache_count_free(&block_bitmap_cache, first_block,
+                                                 first_block + group_cache.blocks_per_group));
+        assert_int_equal(group_cache.groups[group].free_inodes,
+                         bitmap_cache_count_free(&inode_bitmap_cache, first_inode,
+                                                 first_inode + group_cache.inodes_per_group));
+
+        free_blocks += group_cache.groups[group].free_blocks;
+        free_inodes += group_cache.groups[group].free_inodes;
+    }
+
+    assert_int_equal(super_block_cache->free_blocks, free_blocks);
+    assert_int_equal(super_block_cache->free_inodes, free_inodes);
+    assert_int_equal(bitmap_cache_get_free(&block_bitmap_cache), free_blocks);
+}
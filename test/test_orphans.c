@@ -0,0 +1,114 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <time.h>
+
+#include "../src/bitmap.h"
+#include "../src/block.h"
+#include "../src/blocks.h"
+#include "../src/orphan.h"
+#include "../src/stzfs.h"
+#include "../src/super_block_cache.h"
+#include "test_fs.h"
+
+// large enough to go through the orphan list
+#define TEST_FILE_SIZE (4 * ORPHAN_MIN_BLOCKS * STZFS_BLOCK_SIZE)
+
+int setup(void** state);
+int teardown(void** state);
+void test_unlinked_file_held_until_forgotten(void** state);
+void test_held_orphans_freed_after_crash(void** state);
+void test_reclaimer_frees_in_background(void** state);
+
+static bool is_held(int64_t inodeptr);
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_unlinked_file_held_until_forgotten, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_held_orphans_freed_after_crash, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_reclaimer_frees_in_background, setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
+
+int setup(void** state) {
+    return test_fs_create(64 * 1024 * 1024, 1024, SUPER_BLOCK_FEATURE_COMPACT_DIRS);
+}
+
+int teardown(void** state) {
+    test_fs_dispose();
+    return 0;
+}
+
+void test_unlinked_file_held_until_forgotten(void** state) {
+    const int64_t free_blocks = block_get_free();
+    const int64_t inodeptr = test_fs_create_file(ROOT_INODEPTR, "file", TEST_FILE_SIZE);
+    assert_int_not_equal(inodeptr, 0);
+
+    // the kernel still refers to the file, it keeps its inode and blocks and is remembered on disk
+    assert_int_equal(stzfs_unlink_inode(ROOT_INODEPTR, "file", false), 0);
+    assert_true(is_held(inodeptr));
+    assert_true(bitmap_is_inode_allocated(inodeptr));
+    assert_true(block_get_free() < free_blocks);
+
+    stzfs_forget_inode(inodeptr, 1);
+    assert_false(is_held(inodeptr));
+    assert_int_equal(super_block_cache->orphan_head, 0);
+    assert_false(bitmap_is_inode_allocated(inodeptr));
+    assert_int_equal(block_get_free(), free_blocks);
+}
+
+void test_held_orphans_freed_after_crash(void** state) {
+    const int64_t free_blocks = block_get_free();
+    const int64_t large_inodeptr = test_fs_create_file(ROOT_INODEPTR, "large", TEST_FILE_SIZE);
+    const int64_t small_inodeptr = test_fs_create_file(ROOT_INODEPTR, "small", STZFS_BLOCK_SIZE);
+    assert_int_not_equal(large_inodeptr, 0);
+    assert_int_not_equal(small_inodeptr, 0);
+
+    assert_int_equal(stzfs_unlink_inode(ROOT_INODEPTR, "large", false), 0);
+    assert_int_equal(stzfs_unlink_inode(ROOT_INODEPTR, "small", false), 0);
+    assert_true(is_held(large_inodeptr));
+    assert_true(is_held(small_inodeptr));
+
+    // the next mount frees both, nothing refers to them anymore
+    assert_int_equal(test_fs_crash(), SUCCESS);
+    assert_false(is_held(large_inodeptr));
+    assert_false(is_held(small_inodeptr));
+    assert_int_equal(super_block_cache->orphan_head, 0);
+    assert_false(bitmap_is_inode_allocated(large_inodeptr));
+    assert_false(bitmap_is_inode_allocated(small_inodeptr));
+    assert_int_equal(block_get_free(), free_blocks);
+}
+
+void test_reclaimer_frees_in_background(void** state) {
+    assert_int_equal(orphan_start_reclaimer(), 0);
+
+    const int64_t free_blocks = block_get_free();
+    const int64_t inodeptr = test_fs_create_file(ROOT_INODEPTR, "file", TEST_FILE_SIZE);
+    assert_int_not_equal(inodeptr, 0);
+    stzfs_forget_inode(inodeptr, 1);
+    assert_int_equal(stzfs_unlink_inode(ROOT_INODEPTR, "file", false), 0);
+
+    // one step every ORPHAN_STEP_DELAY_NS
+    const struct timespec delay = {.tv_sec = 0, .tv_nsec = ORPHAN_STEP_DELAY_NS};
+    for (int i = 0; i < 100 && bitmap_is_inode_allocated(inodeptr); i++) {
+        nanosleep(&delay, NULL);
+    }
+
+    assert_false(bitmap_is_inode_allocated(inodeptr));
+    assert_int_equal(super_block_cache->orphan_head, 0);
+    assert_int_equal(block_get_free(), free_blocks);
+}
+
+static bool is_held(int64_t inodeptr) {
+    for (size_t slot = 0; slot < SUPER_BLOCK_HELD_ORPHANS; slot++) {
+        if (super_block_cache->held_orphans[slot] == inodeptr) {
+            return true;
+        }
+    }
+
+    return false;
+}